@@ -0,0 +1,1091 @@
+/*
+	Copyright (C) 2015 Peter J. B. Lewis
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+    and associated documentation files (the "Software"), to deal in the Software without restriction,
+    including without limitation the rights to use, copy, modify, merge, publish, distribute,
+    sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+    BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Throughput and round-trip latency of message streams, swept over message
+// size, ring size, producer and consumer counts, thread pinning, and whether
+// the producers are threads or separate processes. Results go to stdout as a
+// table, or as CSV with -csv for tracking between releases. With -copy it
+// times each of the copy kernels instead, to show where streaming past the
+// cache starts to pay.
+
+#ifdef _WIN32
+#	include <Windows.h>
+#else
+#	include "TestPosix.h"
+#	include <sys/types.h>
+#	include <sys/wait.h>
+#	include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "IPCLib.h"
+
+#define BENCH_APP_NAME L"BENCHIPC"
+#define BENCH_PING_NAME L"BENCHPING"
+#define BENCH_PONG_NAME L"BENCHPONG"
+#define BENCH_CHANNEL_NAME L"BENCHRPC"
+#define BENCH_MEGABYTES 16
+#define BENCH_ITERATIONS 100000
+#define BENCH_WARMUP 1000
+#define BENCH_CONNECT_MS 5000
+#define BENCH_MAX_SWEEP 16
+#define BENCH_MAX_THREADS 16
+
+#ifdef _WIN32
+typedef HANDLE BENCH_PEER;
+#else
+typedef pid_t BENCH_PEER;
+#endif
+
+// One comma-separated sweep from the command line
+typedef struct _BENCH_LIST
+{
+	UINT	values[BENCH_MAX_SWEEP];
+	UINT	count;
+} BENCH_LIST;
+
+typedef struct _BENCH_CASE
+{
+	IPC_STREAM_DESC	desc;
+	UINT			messageSize;
+	UINT			producers;
+	UINT			consumers;
+	BOOL			bPinned;
+	BOOL			bProcesses;		// Producers, or the echo peer, run in processes of their own
+	UINT64			totalBytes;
+	UINT			iterations;
+} BENCH_CASE;
+
+typedef struct _BENCH_RESULT
+{
+	double	bytesPerSecond;
+	double	messagesPerSecond;
+	double	p50;				// Round trips, in microseconds
+	double	p99;
+	double	p999;
+} BENCH_RESULT;
+
+typedef struct _BENCH_THREAD
+{
+	IPC_STREAM*	pIPC;
+	BYTE*		pBuffer;
+	UINT		messageSize;
+	UINT		messageCount;
+	int			cpu;			// -1 leaves the thread wherever the scheduler likes
+	LONG64		firstTick;		// When a consumer got its first message
+} BENCH_THREAD;
+
+static BOOL g_bCsv = FALSE;
+
+static UINT GetProcessorCount( void )
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+
+	GetSystemInfo( &info );
+	return info.dwNumberOfProcessors;
+#else
+	long count = sysconf( _SC_NPROCESSORS_ONLN );
+	return count > 0 ? (UINT) count : 1;
+#endif
+}
+
+// Spreads pinned threads over the CPUs in order, or leaves them be
+static int ChooseCpu(
+	const BENCH_CASE* pCase,
+	UINT index )
+{
+	UINT cpus = min( GetProcessorCount(), (UINT) ( sizeof(DWORD_PTR) * 8 ) );
+
+	return pCase->bPinned ? (int) ( index % cpus ) : -1;
+}
+
+static void PinThread( int cpu )
+{
+	if ( cpu >= 0 )
+		SetThreadAffinityMask( GetCurrentThread(), (DWORD_PTR) 1 << cpu );
+}
+
+static LONG64 QueryTicks( void )
+{
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter( &now );
+	return now.QuadPart;
+}
+
+static DWORD ProducerThread( LPVOID pParam )
+{
+	BENCH_THREAD* pThread = (BENCH_THREAD*) pParam;
+	UINT i;
+
+	PinThread( pThread->cpu );
+
+	for ( i = 0; i < pThread->messageCount; ++i )
+		WriteInterprocessMessage( pThread->pIPC, pThread->pBuffer, pThread->messageSize );
+
+	return 0;
+}
+
+static DWORD ConsumerThread( LPVOID pParam )
+{
+	BENCH_THREAD* pThread = (BENCH_THREAD*) pParam;
+	UINT messageSize;
+	UINT i;
+
+	PinThread( pThread->cpu );
+
+	for ( i = 0; i < pThread->messageCount; ++i )
+	{
+		ReadInterprocessMessage( pThread->pIPC, pThread->pBuffer, pThread->messageSize, &messageSize );
+		if ( i == 0 )
+			pThread->firstTick = QueryTicks();
+	}
+
+	return 0;
+}
+
+// Bounces messageCount messages from the ping stream back down the pong one
+static int EchoLoop(
+	UINT messageSize,
+	UINT messageCount,
+	int cpu )
+{
+	IPC_STREAM* pPing = NULL;
+	IPC_STREAM* pPong = NULL;
+	BYTE* pBuffer = (BYTE*) malloc( messageSize );
+	UINT size;
+	UINT i;
+
+	if ( pBuffer == NULL ||
+		 FAILED( OpenInterprocessStreamEx( BENCH_PING_NAME, IPCLIB_VERSION, IPC_ACCESS_READ, &pPing ) ) ||
+		 FAILED( OpenInterprocessStreamEx( BENCH_PONG_NAME, IPCLIB_VERSION, IPC_ACCESS_WRITE, &pPong ) ) )
+	{
+		if ( pPing != NULL )
+			CloseInterprocessStream( pPing );
+		free( pBuffer );
+		return 1;
+	}
+
+	PinThread( cpu );
+
+	for ( i = 0; i < messageCount; ++i )
+	{
+		ReadInterprocessMessage( pPing, pBuffer, messageSize, &size );
+		WriteInterprocessMessage( pPong, pBuffer, size );
+	}
+
+	CloseInterprocessStream( pPong );
+	CloseInterprocessStream( pPing );
+	free( pBuffer );
+	return 0;
+}
+
+// Answers messageCount requests on a channel of its own with the request itself.
+// Closing the channel clears it, so it then waits for one more request, which
+// the client sends once it has every response.
+static int ServeLoop(
+	const IPC_STREAM_DESC* pDesc,
+	UINT messageSize,
+	UINT messageCount,
+	int cpu )
+{
+	IPC_CHANNEL* pChannel = NULL;
+	BYTE* pBuffer = (BYTE*) malloc( messageSize );
+	UINT64 callId;
+	UINT size;
+	UINT i;
+
+	if ( pBuffer == NULL ||
+		 FAILED( CreateInterprocessChannel( BENCH_CHANNEL_NAME, IPCLIB_VERSION, pDesc, &pChannel ) ) )
+	{
+		free( pBuffer );
+		return 1;
+	}
+
+	PinThread( cpu );
+
+	for ( i = 0; i < messageCount; ++i )
+	{
+		ReceiveInterprocessRequest( pChannel, &callId, pBuffer, messageSize, &size );
+		SendInterprocessResponse( pChannel, callId, pBuffer, size );
+	}
+	ReceiveInterprocessRequest( pChannel, &callId, pBuffer, messageSize, &size );
+
+	CloseInterprocessChannel( pChannel );
+	free( pBuffer );
+	return 0;
+}
+
+typedef struct _BENCH_ECHO
+{
+	IPC_STREAM_DESC	desc;			// Of the channel, for a server
+	UINT	messageSize;
+	UINT	messageCount;
+	int		cpu;
+} BENCH_ECHO;
+
+static DWORD EchoThread( LPVOID pParam )
+{
+	BENCH_ECHO* pEcho = (BENCH_ECHO*) pParam;
+
+	return (DWORD) EchoLoop( pEcho->messageSize, pEcho->messageCount, pEcho->cpu );
+}
+
+static DWORD ServeThread( LPVOID pParam )
+{
+	BENCH_ECHO* pEcho = (BENCH_ECHO*) pParam;
+
+	return (DWORD) ServeLoop( &pEcho->desc, pEcho->messageSize, pEcho->messageCount, pEcho->cpu );
+}
+
+// The body of a peer process: "produce" writes into the benchmark stream,
+// "echo" answers pings and "serve" creates a channel and answers requests
+static int RunPeer(
+	const char* szRole,
+	const IPC_STREAM_DESC* pDesc,
+	UINT messageSize,
+	UINT messageCount,
+	int cpu )
+{
+	BENCH_THREAD thread;
+	int result = 0;
+
+	if ( strcmp( szRole, "echo" ) == 0 )
+		return EchoLoop( messageSize, messageCount, cpu );
+	if ( strcmp( szRole, "serve" ) == 0 )
+		return ServeLoop( pDesc, messageSize, messageCount, cpu );
+	if ( strcmp( szRole, "produce" ) != 0 )
+		return 1;
+
+	ZeroMemory( &thread, sizeof(thread) );
+	thread.pBuffer = (BYTE*) malloc( messageSize );
+	thread.messageSize = messageSize;
+	thread.messageCount = messageCount;
+	thread.cpu = cpu;
+	if ( thread.pBuffer == NULL )
+		return 1;
+	memset( thread.pBuffer, 0xA5, messageSize );
+
+	if ( SUCCEEDED( OpenInterprocessStreamEx( BENCH_APP_NAME, IPCLIB_VERSION, IPC_ACCESS_WRITE, &thread.pIPC ) ) )
+	{
+		ProducerThread( &thread );
+		CloseInterprocessStream( thread.pIPC );
+	}
+	else
+	{
+		result = 1;
+	}
+
+	free( thread.pBuffer );
+	return result;
+}
+
+// Runs RunPeer in a new process
+static BOOL StartPeer(
+	const char* szRole,
+	const IPC_STREAM_DESC* pDesc,
+	UINT messageSize,
+	UINT messageCount,
+	int cpu,
+	BENCH_PEER* pPeer )
+{
+#ifdef _WIN32
+	char szPath[MAX_PATH];
+	char szCommand[MAX_PATH + 96];
+	STARTUPINFOA startup;
+	PROCESS_INFORMATION process;
+
+	GetModuleFileNameA( NULL, szPath, MAX_PATH );
+	sprintf_s( szCommand, sizeof(szCommand), "\"%s\" -peer %s %u %u %d %u %u %u %u", szPath, szRole,
+		messageSize, messageCount, cpu, pDesc->RingBufferSize, (UINT) pDesc->dwFlags, pDesc->IOGranularity,
+		(UINT) pDesc->WaitStrategy );
+
+	ZeroMemory( &startup, sizeof(startup) );
+	startup.cb = sizeof(startup);
+	if ( !CreateProcessA( NULL, szCommand, NULL, NULL, FALSE, 0, NULL, NULL, &startup, &process ) )
+		return FALSE;
+
+	CloseHandle( process.hThread );
+	*pPeer = process.hProcess;
+	return TRUE;
+#else
+	pid_t pid;
+
+	// Don't let the child flush our buffered output a second time
+	fflush( stdout );
+	pid = fork();
+	if ( pid == 0 )
+		_exit( RunPeer( szRole, pDesc, messageSize, messageCount, cpu ) );
+
+	*pPeer = pid;
+	return pid > 0;
+#endif
+}
+
+static void WaitPeer( BENCH_PEER peer )
+{
+#ifdef _WIN32
+	WaitForSingleObject( peer, INFINITE );
+	CloseHandle( peer );
+#else
+	int status;
+	waitpid( peer, &status, 0 );
+#endif
+}
+
+// Streams about totalBytes through a fresh stream from every producer to the
+// consumers. Timing starts at the first message a consumer sees, so starting
+// threads or processes isn't counted.
+static BOOL RunThroughput(
+	const BENCH_CASE* pCase,
+	BENCH_RESULT* pResult )
+{
+	IPC_STREAM_DESC desc = pCase->desc;
+	IPC_STREAM* pIPC = NULL;
+	BENCH_THREAD threads[BENCH_MAX_THREADS];
+	HANDLE hThreads[BENCH_MAX_THREADS];
+	BENCH_PEER peers[BENCH_MAX_THREADS];
+	UINT numThreads = pCase->producers + pCase->consumers;
+	UINT perProducer, perConsumer;
+	LONG64 start, end;
+	LARGE_INTEGER frequency;
+	BYTE* pBuffers;
+	BOOL bSuccess = TRUE;
+	UINT i;
+
+	if ( numThreads > BENCH_MAX_THREADS || pCase->producers == 0 || pCase->consumers == 0 )
+		return FALSE;
+
+	// Every consumer takes the same share, or all of it from a broadcast stream
+	perProducer = (UINT) max( pCase->totalBytes / pCase->messageSize / pCase->producers, 1 );
+	if ( desc.dwFlags & IPC_STREAM_BROADCAST )
+	{
+		perConsumer = perProducer * pCase->producers;
+	}
+	else
+	{
+		perProducer = ( perProducer + pCase->consumers - 1 ) / pCase->consumers * pCase->consumers;
+		perConsumer = perProducer * pCase->producers / pCase->consumers;
+	}
+
+	desc.dwFlags |= IPC_STREAM_MESSAGES;
+	desc.MaxReaders = pCase->consumers;
+	desc.MaxWriters = pCase->producers;
+	if ( FAILED( CreateInterprocessStreamEx( BENCH_APP_NAME, IPCLIB_VERSION, &desc, &pIPC ) ) )
+		return FALSE;
+
+	pBuffers = (BYTE*) malloc( (size_t) pCase->messageSize * numThreads );
+	if ( pBuffers == NULL )
+	{
+		CloseInterprocessStream( pIPC );
+		return FALSE;
+	}
+	memset( pBuffers, 0xA5, (size_t) pCase->messageSize * numThreads );
+
+	ZeroMemory( threads, sizeof(threads) );
+	ZeroMemory( hThreads, sizeof(hThreads) );
+	for ( i = 0; i < numThreads; ++i )
+	{
+		BOOL bProducer = i < pCase->producers;
+
+		threads[i].pBuffer = pBuffers + (size_t) pCase->messageSize * i;
+		threads[i].messageSize = pCase->messageSize;
+		threads[i].messageCount = bProducer ? perProducer : perConsumer;
+		threads[i].cpu = ChooseCpu( pCase, i );
+
+		// Consumers are registered before anything is written
+		if ( !bProducer || !pCase->bProcesses )
+		{
+			if ( FAILED( OpenInterprocessStreamEx( BENCH_APP_NAME, IPCLIB_VERSION,
+					bProducer ? IPC_ACCESS_WRITE : IPC_ACCESS_READ, &threads[i].pIPC ) ) )
+				bSuccess = FALSE;
+		}
+	}
+
+	// Start processes before threads, so nothing is forked with threads running
+	for ( i = 0; bSuccess && i < pCase->producers; ++i )
+	{
+		if ( pCase->bProcesses )
+		{
+			if ( !StartPeer( "produce", &pCase->desc, pCase->messageSize, perProducer, threads[i].cpu, &peers[i] ) )
+			{
+				bSuccess = FALSE;
+				peers[i] = 0;
+			}
+		}
+	}
+
+	QueryPerformanceFrequency( &frequency );
+	for ( i = 0; bSuccess && i < numThreads; ++i )
+	{
+		if ( i < pCase->producers && pCase->bProcesses )
+			continue;
+
+		hThreads[i] = CreateThread( NULL, 0,
+			(LPTHREAD_START_ROUTINE) ( i < pCase->producers ? ProducerThread : ConsumerThread ),
+			&threads[i], 0, NULL );
+	}
+
+	if ( bSuccess )
+	{
+		WaitForMultipleObjects( numThreads - pCase->producers, hThreads + pCase->producers, TRUE, INFINITE );
+		end = QueryTicks();
+		if ( !pCase->bProcesses )
+			WaitForMultipleObjects( pCase->producers, hThreads, TRUE, INFINITE );
+	}
+	for ( i = 0; pCase->bProcesses && i < pCase->producers; ++i )
+	{
+		if ( peers[i] )
+			WaitPeer( peers[i] );
+	}
+
+	for ( i = 0; i < numThreads; ++i )
+	{
+		if ( threads[i].pIPC != NULL )
+			CloseInterprocessStream( threads[i].pIPC );
+	}
+	CloseInterprocessStream( pIPC );
+	free( pBuffers );
+
+	if ( !bSuccess )
+		return FALSE;
+
+	start = threads[pCase->producers].firstTick;
+	for ( i = pCase->producers; i < numThreads; ++i )
+		start = min( start, threads[i].firstTick );
+
+	pResult->messagesPerSecond = (double) perProducer * pCase->producers * frequency.QuadPart /
+		(double) max( end - start, 1 );
+	pResult->bytesPerSecond = pResult->messagesPerSecond * pCase->messageSize;
+	return TRUE;
+}
+
+// The kernels -copy sweeps, and what they're called in the results
+static const DWORD g_CopyKernels[] = { IPC_COPY_MEMCPY, IPC_COPY_SSE2, IPC_COPY_AVX2, IPC_COPY_AVX512 };
+static const char* const g_szCopyKernels[] = { "copy-memcpy", "copy-sse2", "copy-avx2", "copy-avx512" };
+
+// Whether this CPU can run a kernel, rather than falling back to another
+static BOOL QueryCopyKernel( DWORD dwKernel )
+{
+	IPC_STREAM_DESC desc;
+	IPC_STREAM_INFO info;
+	IPC_STREAM* pIPC = NULL;
+
+	ZeroMemory( &desc, sizeof(desc) );
+	desc.RingBufferSize = 4096;
+	desc.CopyKernel = dwKernel;
+	if ( FAILED( CreateInterprocessStreamEx( BENCH_APP_NAME, IPCLIB_VERSION, &desc, &pIPC ) ) )
+		return FALSE;
+
+	QueryInterprocessStreamInfo( pIPC, &info );
+	CloseInterprocessStream( pIPC );
+	return info.CopyKernel == dwKernel;
+}
+
+// Writes each message into a ring twice its size and reads it straight back
+// on the same thread, so the two copies are all that is timed. Every copy
+// streams past the cache unless the kernel is memcpy.
+static BOOL RunCopy(
+	const BENCH_CASE* pCase,
+	BENCH_RESULT* pResult )
+{
+	IPC_STREAM_DESC desc = pCase->desc;
+	IPC_STREAM* pIPC = NULL;
+	LARGE_INTEGER frequency;
+	LONG64 start, end;
+	BYTE* pBuffer;
+	UINT count = (UINT) max( pCase->totalBytes / pCase->messageSize, 1 );
+	BOOL bSuccess = TRUE;
+	UINT i;
+
+	desc.dwFlags &= IPC_STREAM_LARGE_PAGES;
+	desc.RingBufferSize = pCase->messageSize * 2;
+	desc.IOGranularity = pCase->messageSize;
+	desc.NonTemporalThreshold = 1;
+	if ( FAILED( CreateInterprocessStreamEx( BENCH_APP_NAME, IPCLIB_VERSION, &desc, &pIPC ) ) )
+		return FALSE;
+
+	pBuffer = (BYTE*) malloc( pCase->messageSize );
+	if ( pBuffer == NULL )
+	{
+		CloseInterprocessStream( pIPC );
+		return FALSE;
+	}
+	memset( pBuffer, 0xA5, pCase->messageSize );
+	PinThread( ChooseCpu( pCase, 0 ) );
+
+	// The first pass faults the ring in
+	for ( i = 0; bSuccess && i < 2; ++i )
+	{
+		bSuccess = SUCCEEDED( WriteInterprocessStream( pIPC, pBuffer, pCase->messageSize ) ) &&
+			SUCCEEDED( ReadInterprocessStream( pIPC, pBuffer, pCase->messageSize ) );
+	}
+
+	QueryPerformanceFrequency( &frequency );
+	start = QueryTicks();
+	for ( i = 0; bSuccess && i < count; ++i )
+	{
+		bSuccess = SUCCEEDED( WriteInterprocessStream( pIPC, pBuffer, pCase->messageSize ) ) &&
+			SUCCEEDED( ReadInterprocessStream( pIPC, pBuffer, pCase->messageSize ) );
+	}
+	end = QueryTicks();
+
+	CloseInterprocessStream( pIPC );
+	free( pBuffer );
+
+	pResult->messagesPerSecond = (double) count * frequency.QuadPart / (double) max( end - start, 1 );
+	pResult->bytesPerSecond = pResult->messagesPerSecond * pCase->messageSize;
+	return bSuccess;
+}
+
+static int CompareTicks( const void* pA, const void* pB )
+{
+	LONG64 a = *(const LONG64*) pA;
+	LONG64 b = *(const LONG64*) pB;
+
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+static double Percentile(
+	const LONG64* pSorted,
+	UINT count,
+	double fraction,
+	LONG64 frequency )
+{
+	UINT index = min( (UINT) ( fraction * count ), count - 1 );
+
+	return (double) pSorted[index] * 1000000.0 / (double) frequency;
+}
+
+// Reduces round-trip times to the percentiles reported
+static void SummarizeSamples(
+	LONG64* pSamples,
+	UINT count,
+	BENCH_RESULT* pResult )
+{
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceFrequency( &frequency );
+	qsort( pSamples, count, sizeof(LONG64), CompareTicks );
+	pResult->p50 = Percentile( pSamples, count, 0.5, frequency.QuadPart );
+	pResult->p99 = Percentile( pSamples, count, 0.99, frequency.QuadPart );
+	pResult->p999 = Percentile( pSamples, count, 0.999, frequency.QuadPart );
+}
+
+// Times round trips of one message at a time to an echo peer and back
+static BOOL RunLatency(
+	const BENCH_CASE* pCase,
+	BENCH_RESULT* pResult )
+{
+	IPC_STREAM_DESC desc = pCase->desc;
+	IPC_STREAM* pPing = NULL;
+	IPC_STREAM* pPong = NULL;
+	BENCH_ECHO echo;
+	BENCH_PEER peer = 0;
+	HANDLE hEcho = NULL;
+	LONG64* pSamples;
+	BYTE* pBuffer;
+	UINT count = pCase->iterations + BENCH_WARMUP;
+	UINT size;
+	UINT i;
+
+	if ( pCase->iterations == 0 )
+		return FALSE;
+
+	// A plain point-to-point stream in each direction
+	desc.dwFlags &= ~( IPC_STREAM_SHARDED | IPC_STREAM_BROADCAST );
+	desc.dwFlags |= IPC_STREAM_MESSAGES;
+	if ( FAILED( CreateInterprocessStreamEx( BENCH_PING_NAME, IPCLIB_VERSION, &desc, &pPing ) ) )
+		return FALSE;
+	if ( FAILED( CreateInterprocessStreamEx( BENCH_PONG_NAME, IPCLIB_VERSION, &desc, &pPong ) ) )
+	{
+		CloseInterprocessStream( pPing );
+		return FALSE;
+	}
+
+	pSamples = (LONG64*) malloc( sizeof(LONG64) * pCase->iterations );
+	pBuffer = (BYTE*) malloc( pCase->messageSize );
+	if ( pSamples == NULL || pBuffer == NULL )
+	{
+		free( pSamples );
+		free( pBuffer );
+		CloseInterprocessStream( pPong );
+		CloseInterprocessStream( pPing );
+		return FALSE;
+	}
+	memset( pBuffer, 0xA5, pCase->messageSize );
+
+	echo.messageSize = pCase->messageSize;
+	echo.messageCount = count;
+	echo.cpu = ChooseCpu( pCase, 1 );
+	if ( pCase->bProcesses )
+	{
+		if ( !StartPeer( "echo", &pCase->desc, echo.messageSize, echo.messageCount, echo.cpu, &peer ) )
+			count = 0;
+	}
+	else
+	{
+		hEcho = CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE) EchoThread, &echo, 0, NULL );
+	}
+
+	PinThread( ChooseCpu( pCase, 0 ) );
+
+	for ( i = 0; i < count; ++i )
+	{
+		LONG64 start = QueryTicks();
+
+		WriteInterprocessMessage( pPing, pBuffer, pCase->messageSize );
+		ReadInterprocessMessage( pPong, pBuffer, pCase->messageSize, &size );
+
+		if ( i >= BENCH_WARMUP )
+			pSamples[i - BENCH_WARMUP] = QueryTicks() - start;
+	}
+
+	if ( hEcho != NULL )
+		WaitForMultipleObjects( 1, &hEcho, TRUE, INFINITE );
+	if ( peer )
+		WaitPeer( peer );
+
+	// Let the next case pick its own CPU
+	if ( pCase->bPinned )
+		SetThreadAffinityMask( GetCurrentThread(), ~(DWORD_PTR) 0 );
+
+	CloseInterprocessStream( pPong );
+	CloseInterprocessStream( pPing );
+	free( pBuffer );
+
+	if ( count == 0 )
+	{
+		free( pSamples );
+		return FALSE;
+	}
+
+	SummarizeSamples( pSamples, pCase->iterations, pResult );
+	free( pSamples );
+	return TRUE;
+}
+
+// Times calls through a request/response channel, one at a time, to a server
+// that answers each with the request. The server creates the channel, so the
+// client polls until it can open it.
+static BOOL RunRoundTrip(
+	const BENCH_CASE* pCase,
+	BENCH_RESULT* pResult )
+{
+	IPC_CHANNEL* pChannel = NULL;
+	BENCH_ECHO serve;
+	BENCH_PEER peer = 0;
+	HANDLE hServe = NULL;
+	LONG64* pSamples;
+	BYTE* pBuffer;
+	UINT count = pCase->iterations + BENCH_WARMUP;
+	UINT64 callId;
+	UINT size;
+	UINT i;
+
+	if ( pCase->iterations == 0 )
+		return FALSE;
+
+	pSamples = (LONG64*) malloc( sizeof(LONG64) * pCase->iterations );
+	pBuffer = (BYTE*) malloc( pCase->messageSize );
+	if ( pSamples == NULL || pBuffer == NULL )
+	{
+		free( pSamples );
+		free( pBuffer );
+		return FALSE;
+	}
+	memset( pBuffer, 0xA5, pCase->messageSize );
+
+	// Channels only take the flags that shape the memory
+	serve.desc = pCase->desc;
+	serve.desc.dwFlags &= IPC_STREAM_MIRRORED | IPC_STREAM_ADAPTIVE_GRANULARITY |
+		IPC_STREAM_LARGE_PAGES | IPC_STREAM_PREFAULT;
+	serve.messageSize = pCase->messageSize;
+	serve.messageCount = count;
+	serve.cpu = ChooseCpu( pCase, 1 );
+	if ( pCase->bProcesses )
+	{
+		if ( !StartPeer( "serve", &serve.desc, serve.messageSize, serve.messageCount, serve.cpu, &peer ) )
+			count = 0;
+	}
+	else
+	{
+		hServe = CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE) ServeThread, &serve, 0, NULL );
+	}
+
+	for ( i = 0; count > 0 && FAILED( OpenInterprocessChannel( BENCH_CHANNEL_NAME, IPCLIB_VERSION, &pChannel ) ); ++i )
+	{
+		if ( i == BENCH_CONNECT_MS )
+			count = 0;
+		Sleep( 1 );
+	}
+
+	PinThread( ChooseCpu( pCase, 0 ) );
+
+	for ( i = 0; i < count; ++i )
+	{
+		LONG64 start = QueryTicks();
+
+		SendInterprocessRequest( pChannel, pBuffer, pCase->messageSize, &callId );
+		AwaitInterprocessResponse( pChannel, callId, pBuffer, pCase->messageSize, &size );
+
+		if ( i >= BENCH_WARMUP )
+			pSamples[i - BENCH_WARMUP] = QueryTicks() - start;
+	}
+
+	if ( pChannel != NULL )
+	{
+		SendInterprocessRequest( pChannel, NULL, 0, &callId );
+		CloseInterprocessChannel( pChannel );
+	}
+	if ( hServe != NULL )
+		WaitForMultipleObjects( 1, &hServe, TRUE, INFINITE );
+	if ( peer )
+		WaitPeer( peer );
+
+	if ( pCase->bPinned )
+		SetThreadAffinityMask( GetCurrentThread(), ~(DWORD_PTR) 0 );
+
+	free( pBuffer );
+
+	if ( count == 0 )
+	{
+		free( pSamples );
+		return FALSE;
+	}
+
+	SummarizeSamples( pSamples, pCase->iterations, pResult );
+	free( pSamples );
+	return TRUE;
+}
+
+static void PrintHeader( void )
+{
+	if ( g_bCsv )
+	{
+		printf( "test,transport,message_size,ring_size,producers,consumers,pinned,"
+			"mb_per_s,msgs_per_s,p50_us,p99_us,p999_us\n" );
+	}
+	else
+	{
+		printf( "%-10s %-9s %8s %8s %4s %4s %3s %10s %12s %9s %9s %9s\n",
+			"test", "transport", "size", "ring", "prod", "cons", "pin",
+			"MB/s", "msgs/s", "p50 us", "p99 us", "p99.9 us" );
+	}
+}
+
+static void PrintThroughput(
+	const BENCH_CASE* pCase,
+	const BENCH_RESULT* pResult )
+{
+	const char* szTransport = pCase->bProcesses ? "process" : "thread";
+	double megabytes = pResult->bytesPerSecond / ( 1024.0 * 1024.0 );
+
+	if ( g_bCsv )
+	{
+		printf( "throughput,%s,%u,%u,%u,%u,%d,%.1f,%.0f,,,\n", szTransport, pCase->messageSize,
+			pCase->desc.RingBufferSize, pCase->producers, pCase->consumers, pCase->bPinned,
+			megabytes, pResult->messagesPerSecond );
+	}
+	else
+	{
+		printf( "%-10s %-9s %8u %8u %4u %4u %3s %10.1f %12.0f\n", "throughput", szTransport,
+			pCase->messageSize, pCase->desc.RingBufferSize, pCase->producers, pCase->consumers,
+			pCase->bPinned ? "yes" : "no", megabytes, pResult->messagesPerSecond );
+	}
+	fflush( stdout );
+}
+
+static void PrintCopy(
+	const char* szTest,
+	const BENCH_CASE* pCase,
+	const BENCH_RESULT* pResult )
+{
+	double megabytes = pResult->bytesPerSecond / ( 1024.0 * 1024.0 );
+
+	if ( g_bCsv )
+	{
+		printf( "%s,thread,%u,%u,1,1,%d,%.1f,%.0f,,,\n", szTest, pCase->messageSize,
+			pCase->messageSize * 2, pCase->bPinned, megabytes, pResult->messagesPerSecond );
+	}
+	else
+	{
+		printf( "%-10s %-9s %8u %8u %4u %4u %3s %10.1f %12.0f\n", szTest, "thread",
+			pCase->messageSize, pCase->messageSize * 2, 1, 1,
+			pCase->bPinned ? "yes" : "no", megabytes, pResult->messagesPerSecond );
+	}
+	fflush( stdout );
+}
+
+static void PrintLatency(
+	const char* szTest,
+	const BENCH_CASE* pCase,
+	const BENCH_RESULT* pResult )
+{
+	const char* szTransport = pCase->bProcesses ? "process" : "thread";
+
+	if ( g_bCsv )
+	{
+		printf( "%s,%s,%u,%u,1,1,%d,,,%.2f,%.2f,%.2f\n", szTest, szTransport, pCase->messageSize,
+			pCase->desc.RingBufferSize, pCase->bPinned, pResult->p50, pResult->p99, pResult->p999 );
+	}
+	else
+	{
+		printf( "%-10s %-9s %8u %8u %4u %4u %3s %10s %12s %9.2f %9.2f %9.2f\n", szTest, szTransport,
+			pCase->messageSize, pCase->desc.RingBufferSize, 1, 1, pCase->bPinned ? "yes" : "no",
+			"", "", pResult->p50, pResult->p99, pResult->p999 );
+	}
+	fflush( stdout );
+}
+
+static void PrintFailure(
+	const char* szTest,
+	const BENCH_CASE* pCase )
+{
+	fprintf( stderr, "%s failed: size %u, ring %u, %u producers, %u consumers\n", szTest,
+		pCase->messageSize, pCase->desc.RingBufferSize, pCase->producers, pCase->consumers );
+}
+
+// Parses "a,b,c" into a sweep
+static BOOL ParseList(
+	const char* szList,
+	BENCH_LIST* pList )
+{
+	pList->count = 0;
+	while ( *szList != 0 && pList->count < BENCH_MAX_SWEEP )
+	{
+		char* pEnd;
+		unsigned long value = strtoul( szList, &pEnd, 10 );
+
+		if ( pEnd == szList || value == 0 )
+			return FALSE;
+		pList->values[pList->count++] = (UINT) value;
+
+		szList = *pEnd == ',' ? pEnd + 1 : pEnd;
+	}
+
+	return pList->count > 0;
+}
+
+// Parses "off", "on" or "both" into the range of a BOOL sweep
+static BOOL ParseChoice(
+	const char* szChoice,
+	const char* szOn,
+	BOOL* pFirst,
+	BOOL* pLast )
+{
+	BOOL bBoth = strcmp( szChoice, "both" ) == 0;
+	BOOL bOn = strcmp( szChoice, szOn ) == 0;
+
+	*pFirst = bOn;
+	*pLast = bOn || bBoth;
+	return bBoth || bOn || strcmp( szChoice, "off" ) == 0 || strcmp( szChoice, "thread" ) == 0;
+}
+
+static const char g_szUsage[] =
+	"Usage: Benchmark [-csv] [-throughput | -latency] [-megabytes n] [-iterations n]\n"
+	"                 [-sizes a,b,...] [-rings a,b,...] [-producers a,b,...] [-consumers a,b,...]\n"
+	"                 [-pin off|on|both] [-transport thread|process|both]\n"
+	"                 [-mpsc | -sharded] [-broadcast] [-adaptive] [-granularity bytes]\n"
+	"                 [-wait yield|spin|backoff|block]\n"
+	"       Benchmark [-csv] -copy [-megabytes n] [-sizes a,b,...] [-pin off|on] [-largepages]\n";
+
+int main(int argc, char** argv)
+{
+	static const UINT defaultSizes[] = { 64, 1024, 16384 };
+	static const UINT defaultRings[] = { 4096, 65536, 1048576 };
+	static const UINT defaultProducers[] = { 1, 4 };
+	static const UINT defaultConsumers[] = { 1, 2 };
+	static const UINT defaultCopySizes[] = { 4096, 65536, 1048576, 16777216 };
+	BENCH_LIST sizes, rings, producers, consumers;
+	IPC_STREAM_DESC peerDesc;
+	BENCH_CASE benchCase;
+	BENCH_RESULT result;
+	BOOL bThroughput = TRUE, bLatency = TRUE, bCopy = FALSE;
+	BOOL bSizes = FALSE;
+	BOOL bPinFirst = FALSE, bPinLast = FALSE;
+	BOOL bProcessFirst = FALSE, bProcessLast = TRUE;
+	BOOL bPinned, bProcesses;
+	UINT s, r, p, c, k;
+	int i;
+
+	// Peer processes are this executable run with
+	// -peer role size count cpu ring flags granularity wait
+	if ( argc == 10 && strcmp( argv[1], "-peer" ) == 0 )
+	{
+		ZeroMemory( &peerDesc, sizeof(peerDesc) );
+		peerDesc.RingBufferSize = (UINT) atoi( argv[6] );
+		peerDesc.dwFlags = (DWORD) atoi( argv[7] );
+		peerDesc.IOGranularity = (UINT) atoi( argv[8] );
+		peerDesc.WaitStrategy = (DWORD) atoi( argv[9] );
+		return RunPeer( argv[2], &peerDesc, (UINT) atoi( argv[3] ), (UINT) atoi( argv[4] ), atoi( argv[5] ) );
+	}
+
+	ZeroMemory( &benchCase, sizeof(benchCase) );
+	benchCase.totalBytes = (UINT64) BENCH_MEGABYTES * 1024 * 1024;
+	benchCase.iterations = BENCH_ITERATIONS;
+
+	sizes.count = _countof(defaultSizes);
+	memcpy( sizes.values, defaultSizes, sizeof(defaultSizes) );
+	rings.count = _countof(defaultRings);
+	memcpy( rings.values, defaultRings, sizeof(defaultRings) );
+	producers.count = _countof(defaultProducers);
+	memcpy( producers.values, defaultProducers, sizeof(defaultProducers) );
+	consumers.count = _countof(defaultConsumers);
+	memcpy( consumers.values, defaultConsumers, sizeof(defaultConsumers) );
+
+	for ( i = 1; i < argc; ++i )
+	{
+		BOOL bValid = TRUE;
+
+		if ( strcmp( argv[i], "-csv" ) == 0 )
+			g_bCsv = TRUE;
+		else if ( strcmp( argv[i], "-throughput" ) == 0 )
+			bLatency = FALSE;
+		else if ( strcmp( argv[i], "-latency" ) == 0 )
+			bThroughput = FALSE;
+		else if ( strcmp( argv[i], "-mpsc" ) == 0 )
+			benchCase.desc.dwFlags |= IPC_STREAM_MULTI_PRODUCER;
+		else if ( strcmp( argv[i], "-sharded" ) == 0 )
+			benchCase.desc.dwFlags |= IPC_STREAM_SHARDED;
+		else if ( strcmp( argv[i], "-broadcast" ) == 0 )
+			benchCase.desc.dwFlags |= IPC_STREAM_BROADCAST;
+		else if ( strcmp( argv[i], "-adaptive" ) == 0 )
+			benchCase.desc.dwFlags |= IPC_STREAM_ADAPTIVE_GRANULARITY;
+		else if ( strcmp( argv[i], "-largepages" ) == 0 )
+			benchCase.desc.dwFlags |= IPC_STREAM_LARGE_PAGES;
+		else if ( strcmp( argv[i], "-copy" ) == 0 )
+			bCopy = TRUE;
+		else if ( i + 1 >= argc )
+			bValid = FALSE;
+		else if ( strcmp( argv[i], "-megabytes" ) == 0 )
+			benchCase.totalBytes = (UINT64) atoi( argv[++i] ) * 1024 * 1024;
+		else if ( strcmp( argv[i], "-iterations" ) == 0 )
+			benchCase.iterations = (UINT) atoi( argv[++i] );
+		else if ( strcmp( argv[i], "-granularity" ) == 0 )
+			benchCase.desc.IOGranularity = (UINT) atoi( argv[++i] );
+		else if ( strcmp( argv[i], "-sizes" ) == 0 )
+			bValid = bSizes = ParseList( argv[++i], &sizes );
+		else if ( strcmp( argv[i], "-rings" ) == 0 )
+			bValid = ParseList( argv[++i], &rings );
+		else if ( strcmp( argv[i], "-producers" ) == 0 )
+			bValid = ParseList( argv[++i], &producers );
+		else if ( strcmp( argv[i], "-consumers" ) == 0 )
+			bValid = ParseList( argv[++i], &consumers );
+		else if ( strcmp( argv[i], "-pin" ) == 0 )
+			bValid = ParseChoice( argv[++i], "on", &bPinFirst, &bPinLast );
+		else if ( strcmp( argv[i], "-transport" ) == 0 )
+			bValid = ParseChoice( argv[++i], "process", &bProcessFirst, &bProcessLast );
+		else if ( strcmp( argv[i], "-wait" ) == 0 )
+		{
+			++i;
+			if ( strcmp( argv[i], "spin" ) == 0 )
+				benchCase.desc.WaitStrategy = IPC_WAIT_SPIN;
+			else if ( strcmp( argv[i], "backoff" ) == 0 )
+				benchCase.desc.WaitStrategy = IPC_WAIT_BACKOFF;
+			else if ( strcmp( argv[i], "block" ) == 0 )
+				benchCase.desc.WaitStrategy = IPC_WAIT_BLOCK;
+			else
+				benchCase.desc.WaitStrategy = IPC_WAIT_YIELD;
+		}
+		else
+			bValid = FALSE;
+
+		if ( !bValid )
+		{
+			fprintf( stderr, "%s", g_szUsage );
+			return 1;
+		}
+	}
+
+	PrintHeader();
+
+	// The copy sweep has sizes of its own, well past the caches, and each
+	// message gets a ring of its own size
+	if ( bCopy )
+	{
+		if ( !bSizes )
+		{
+			sizes.count = _countof(defaultCopySizes);
+			memcpy( sizes.values, defaultCopySizes, sizeof(defaultCopySizes) );
+		}
+		benchCase.bPinned = bPinLast;
+
+		for ( k = 0; k < _countof(g_CopyKernels); ++k )
+		{
+			if ( !QueryCopyKernel( g_CopyKernels[k] ) )
+				continue;
+
+			benchCase.desc.CopyKernel = g_CopyKernels[k];
+			for ( s = 0; s < sizes.count; ++s )
+			{
+				benchCase.messageSize = sizes.values[s];
+				if ( RunCopy( &benchCase, &result ) )
+					PrintCopy( g_szCopyKernels[k], &benchCase, &result );
+				else
+					PrintFailure( g_szCopyKernels[k], &benchCase );
+			}
+		}
+		return 0;
+	}
+
+	for ( bProcesses = bProcessFirst; bProcesses <= bProcessLast; ++bProcesses )
+	for ( bPinned = bPinFirst; bPinned <= bPinLast; ++bPinned )
+	for ( r = 0; r < rings.count; ++r )
+	for ( s = 0; s < sizes.count; ++s )
+	{
+		benchCase.bProcesses = bProcesses;
+		benchCase.bPinned = bPinned;
+		benchCase.desc.RingBufferSize = rings.values[r];
+		benchCase.messageSize = sizes.values[s];
+
+		for ( p = 0; bThroughput && p < producers.count; ++p )
+		for ( c = 0; c < consumers.count; ++c )
+		{
+			benchCase.producers = producers.values[p];
+			benchCase.consumers = consumers.values[c];
+
+			if ( RunThroughput( &benchCase, &result ) )
+				PrintThroughput( &benchCase, &result );
+			else
+				PrintFailure( "throughput", &benchCase );
+		}
+
+		if ( bLatency )
+		{
+			benchCase.producers = 1;
+			benchCase.consumers = 1;
+
+			if ( RunLatency( &benchCase, &result ) )
+				PrintLatency( "latency", &benchCase, &result );
+			else
+				PrintFailure( "latency", &benchCase );
+
+			if ( RunRoundTrip( &benchCase, &result ) )
+				PrintLatency( "rpc", &benchCase, &result );
+			else
+				PrintFailure( "rpc", &benchCase );
+		}
+	}
+
+	return 0;
+}
@@ -17,7 +17,29 @@
     OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
-#include <Windows.h>
+#ifdef _WIN32
+#	include <Windows.h>
+#else
+#	include <dirent.h>
+#	include <errno.h>
+#	include <fcntl.h>
+#	include <limits.h>
+#	include <pthread.h>
+#	include <sched.h>
+#	include <signal.h>
+#	include <stdlib.h>
+#	include <string.h>
+#	include <unistd.h>
+#	include <linux/futex.h>
+#	include <linux/magic.h>
+#	include <linux/mempolicy.h>
+#	include <sys/eventfd.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <sys/statfs.h>
+#	include <sys/syscall.h>
+#	include <time.h>
+#endif
 #include <memory.h>
 #include <stdio.h>
 
@@ -25,19 +47,319 @@
 #	include <assert.h>
 #endif
 
+// The streaming copy kernels are x86 only; anywhere else everything is memcpy
+#if defined( _M_X64 ) || defined( _M_IX86 ) || defined( __x86_64__ ) || defined( __i386__ )
+#	define IPC_X86
+#	include <immintrin.h>
+#	ifdef _WIN32
+#		include <intrin.h>
+#		define IPC_TARGET( isa )
+#	else
+#		include <cpuid.h>
+#		define IPC_TARGET( isa )	__attribute__(( target( isa ) ))
+#	endif
+	// Visual C++ only has AVX-512 intrinsics from 2017 on
+#	if !defined( _MSC_VER ) || _MSC_VER >= 1910
+#		define IPC_AVX512
+#	endif
+#endif
+
 #include "IPCLib.h"
 
 #define IPC_IO_GRANULARITY 256
-#define IPC_SPINLOCK_COUNT 10000
+#define IPC_SPIN_MICROSECONDS 1000
+#define IPC_SPIN_CLOCK_INTERVAL 64
+#define IPC_BACKOFF_LIMIT 10
+#define IPC_EVENT_POLL_MS 1
+#define IPC_MIRROR_MAP_ATTEMPTS 16
+#define IPC_MAX_MESSAGE_BUFFERS 16
+#define IPC_MAX_NUMA_NODE 63
+#define IPC_DEFAULT_MAX_READERS 16
+#define IPC_MAX_READERS 1024
+#define IPC_DEFAULT_MAX_WRITERS 8
+#define IPC_MAX_WRITERS 64
+#define IPC_DEFAULT_LANES 2
+#define IPC_MAX_LANES 16
+#define IPC_DEFAULT_ARENA_BLOCK_SIZE 65536
+#define IPC_DEFAULT_ARENA_BLOCKS 16
+#define IPC_CHANNEL_MAX_WAITERS 64
+#define IPC_CHANNEL_DISCARD_SIZE 256
+#define IPC_GROW_MICROSECONDS 100000
+#define IPC_MAX_JOURNAL_PATH 1024
+#define IPC_NON_TEMPORAL_THRESHOLD 1048576
+#define IPC_SELECTOR_POLL_MS 10
+#define IPC_REGISTRY_ENTRIES 8192
+#define IPC_REGISTRY_REPAIR_SPINS 65536	// Spins on an entry mid-rewrite before seeing to it
+
+#ifdef _WIN32
+
+typedef HANDLE IPC_LOCK;
+typedef HANDLE IPC_EVENT;
+typedef HANDLE IPC_THREAD;
+
+#define IPC_REGISTRY_NAME	L"IPCLib_Registry"
+#define IPC_REGISTRY_LOCK_NAME	L"%ls_Lock"
+#define IPC_REGISTRY_VARIABLE	L"IPCLIB_REGISTRY"
+#define IPC_MAX_REGISTRY_NAME	260
+
+#define IPC_TRY		__try
+#define IPC_EXCEPT	__except( GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? \
+	EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH )
+
+#define AtomicFetchAdd64( p, v ) \
+	( (UINT64) InterlockedExchangeAdd64( (volatile LONG64*) (p), (LONG64) (v) ) )
+#define AtomicIncrement( p )	InterlockedIncrement( (p) )
+#define AtomicDecrement( p )	InterlockedDecrement( (p) )
+#define AtomicCompareExchange( p, v, c )	InterlockedCompareExchange( (p), (v), (c) )
+#define AtomicCompareExchange64( p, v, c ) \
+	( (UINT64) InterlockedCompareExchange64( (volatile LONG64*) (p), (LONG64) (v), (LONG64) (c) ) )
+
+#else
+
+// Locks and events are futex words stored inside the mapping itself
+typedef volatile LONG* IPC_LOCK;
+typedef volatile LONG* IPC_EVENT;
+typedef pthread_t IPC_THREAD;
+
+// There are no structured exceptions here; a failed page-in raises SIGBUS
+// Large-page segments are files on hugetlbfs rather than POSIX shared memory
+#define IPC_HUGETLBFS_PATH	"/dev/hugepages"
+#define IPC_REGISTRY_NAME	"/IPCLib_Registry"
+#define IPC_REGISTRY_VARIABLE	"IPCLIB_REGISTRY"
+
+#define IPC_TRY		if ( 1 )
+#define IPC_EXCEPT	else
+
+#define ZeroMemory( p, n )	memset( (p), 0, (n) )
+#define AtomicFetchAdd64( p, v )	__atomic_fetch_add( (p), (v), __ATOMIC_ACQ_REL )
+#define AtomicIncrement( p )		__atomic_add_fetch( (p), 1, __ATOMIC_SEQ_CST )
+#define AtomicDecrement( p )		__atomic_sub_fetch( (p), 1, __ATOMIC_SEQ_CST )
+#define AtomicCompareExchange( p, v, c )	__sync_val_compare_and_swap( (p), (c), (v) )
+#define AtomicCompareExchange64( p, v, c )	__sync_val_compare_and_swap( (p), (c), (v) )
+#define MemoryBarrier()		__sync_synchronize()
+
+#if defined( __i386__ ) || defined( __x86_64__ )
+#	define YieldProcessor()	__builtin_ia32_pause()
+#elif defined( __aarch64__ ) || defined( __arm__ )
+#	define YieldProcessor()	__asm__ __volatile__( "yield" ::: "memory" )
+#else
+#	define YieldProcessor()	__asm__ __volatile__( "" ::: "memory" )
+#endif
+#define SwitchToThread()	sched_yield()
+#define GetCurrentProcessId()	( (DWORD) getpid() )
+#define Sleep( ms )			usleep( (ms) * 1000 )
+#define IPC_LOCK_WAITERS	0x40000000	// Set in a lock word above its owner's process ID
+#define IPC_LOCK_OWNER_POLL_MS	10
+#define swprintf_s			swprintf
+
+#ifndef min
+#	define min( a, b )		( ( (a) < (b) ) ? (a) : (b) )
+#endif
+#ifndef max
+#	define max( a, b )		( ( (a) > (b) ) ? (a) : (b) )
+#endif
+
+#endif
+
+// Each side's hot fields get a line to themselves so that publishing one
+// cursor doesn't evict the line the other side is polling. Two lines' worth
+// keeps them apart from the adjacent-line prefetcher too.
+#define IPC_CACHE_LINE 128
+
+// Counters for one side of the stream. Each side keeps to its own line, so
+// counting costs a writer nothing the reader can see.
+typedef struct _IPC_RING_STATS
+{
+    volatile UINT64 Bytes;
+    volatile UINT64 Messages;
+    volatile UINT64 Spins;
+    volatile UINT64 Waits;
+    volatile UINT64 WaitMicroseconds;
+    volatile UINT64 LockContention;
+    volatile UINT64 HighWater;		// Readers only
+    BYTE            Reserved[IPC_CACHE_LINE - 7 * sizeof(UINT64)];
+} IPC_RING_STATS;
 
 typedef struct _IPC_RING
 {
+    // Fixed at creation
+	volatile DWORD  dwVersion;
+    volatile UINT   HeaderSize;
+    volatile UINT   RingBufferSize;
+    volatile UINT   BufferOffset;
+	volatile DWORD  dwFlags;
+    volatile UINT   IOGranularity;
+	volatile DWORD  WaitStrategy;
+    volatile UINT   SpinMicroseconds;
+    volatile UINT   PageSize;
+	volatile DWORD  NumaPolicy;
+	volatile DWORD  NumaNode;
+    volatile UINT   MaxReaders;
+    volatile UINT   MaxWriters;
+    volatile UINT   MaxRingBufferSize;
+    volatile UINT   GrowMicroseconds;
+    volatile UINT   JournalSegments;
+	volatile DWORD  CopyKernel;		// As asked for; each handle gets what its CPU has
+    volatile UINT   NonTemporalThreshold;
+    volatile UINT   Lanes;
+    volatile UINT   ArenaOffset;
+    volatile UINT   ArenaBlockSize;
+    volatile UINT   ArenaBlocks;
+    volatile DWORD  ProcessId;		// The creator's
+    BYTE            Reserved0[IPC_CACHE_LINE - 23 * sizeof(DWORD)];
+
+    // Written by the writer, polled by the reader. In an overwrite stream the
+    // tail is the oldest byte not yet overwritten, and the tail and its record
+    // count are updated together under the generation count. Once a growable
+    // stream's writers have moved on to a later ring, the write cursor of the
+    // one they left is final. A journal's segments from tail to head are the
+    // ones still on disk.
     volatile UINT64 WriteCursor;
+    volatile UINT64 TailCursor;
+    volatile UINT64 TailSequence;	// Records overwritten so far
+    volatile UINT64 WriteSequence;	// Records written so far
+    volatile UINT64 HeadSegment;	// The journal segment being written
+    volatile UINT64 TailSegment;	// The oldest journal segment retained
+    volatile LONG   Generation;		// Odd while the tail is being moved
+    volatile LONG   Successor;		// The ring writers moved on to, if any
+    volatile LONG   LatestRing;		// The newest ring; kept in the first one only
+    BYTE            Reserved1[IPC_CACHE_LINE - 6 * sizeof(UINT64) - 3 * sizeof(LONG)];
+
+    // Contended between multiple producers only
+    volatile UINT64 ReserveCursor;
+    BYTE            Reserved2[IPC_CACHE_LINE - sizeof(UINT64)];
+
+    // Written by the reader, polled by the writer
     volatile UINT64 ReadCursor;
-    volatile UINT   RingBufferSize;
-	volatile DWORD  dwVersion;
+    volatile UINT64 ReadSequence;	// Records consumed or skipped so far
+    BYTE            Reserved3[IPC_CACHE_LINE - 2 * sizeof(UINT64)];
+
+    // Only written when somebody has to block
+    volatile LONG   ReadWaiters;	// Readers asleep on the write event
+    volatile LONG   WriteWaiters;	// Writers asleep on the read event
+    volatile LONG   ReadSelectors;	// Selectors among the readers asleep
+    volatile LONG   WriteSelectors;	// Selectors among the writers asleep
+    volatile LONG   ReadSelectSequence;	// Counts signals to the read selectors
+    volatile LONG   WriteSelectSequence;	// Counts signals to the write selectors
+#ifndef _WIN32
+    volatile LONG   WriteLock;
+    volatile LONG   WriteEvent;
+    volatile LONG   ReadLock;
+    volatile LONG   ReadEvent;
+    BYTE            Reserved4[IPC_CACHE_LINE - 10 * sizeof(LONG)];
+#else
+    BYTE            Reserved4[IPC_CACHE_LINE - 6 * sizeof(LONG)];
+#endif
+
+    IPC_RING_STATS  WriterStats;
+    IPC_RING_STATS  ReaderStats;
 } IPC_RING;
 
+// Broadcast streams follow the header with a table of these, one per reader,
+// each on its own line
+typedef struct _IPC_READER_SLOT
+{
+    volatile UINT64 ReadCursor;
+    volatile UINT64 ReadSequence;
+    volatile LONG   InUse;
+    BYTE            Reserved[IPC_CACHE_LINE - 2 * sizeof(UINT64) - sizeof(LONG)];
+} IPC_READER_SLOT;
+
+#define IPC_READER_SLOTS_OFFSET \
+	( ( sizeof(IPC_RING) + IPC_CACHE_LINE - 1 ) / IPC_CACHE_LINE * IPC_CACHE_LINE )
+
+// Sharded streams have one of these per producer instead, each with a ring of
+// its own, so producers share nothing but the header. Priority streams have
+// one per lane, whose InUse is held by whichever writer is writing the lane.
+typedef struct _IPC_SHARD
+{
+    volatile UINT64 WriteCursor;
+    volatile LONG   InUse;
+    BYTE            Reserved0[IPC_CACHE_LINE - sizeof(UINT64) - sizeof(LONG)];
+    volatile UINT64 ReadCursor;
+    BYTE            Reserved1[IPC_CACHE_LINE - sizeof(UINT64)];
+} IPC_SHARD;
+
+#define IPC_SHARDS_OFFSET	IPC_READER_SLOTS_OFFSET
+
+// An arena comes after the slots or shards: this line, then one IPC_ARENA_BLOCK
+// per block, then the blocks themselves on a line boundary. The free list is
+// a stack of block numbers, plus one so that zero means empty, with a count
+// of changes in the high half so that a stale head never compares equal.
+typedef struct _IPC_ARENA
+{
+    volatile UINT64 FreeList;
+    volatile LONG   ReaderLock;		// Keeps broadcast readers still while a block is counted out to them
+    BYTE            Reserved[IPC_CACHE_LINE - sizeof(UINT64) - sizeof(LONG)];
+} IPC_ARENA;
+
+typedef struct _IPC_ARENA_BLOCK
+{
+    volatile LONG   RefCount;		// Handles yet to release it
+    volatile UINT   Next;			// The free block under this one, while it is free
+} IPC_ARENA_BLOCK;
+
+// What goes through the ring in place of the payload
+typedef struct _IPC_BLOCK_REFERENCE
+{
+    UINT    Block;
+    UINT    DataSize;
+} IPC_BLOCK_REFERENCE;
+
+// A journal has neither, and keeps the path its segment files are named from
+// there instead. Its data is in the segment files, each of which starts with
+// one of these. Each segment carries on from where the one before it ended.
+#define IPC_JOURNAL_PREFIX_OFFSET	IPC_READER_SLOTS_OFFSET
+
+typedef struct _IPC_SEGMENT
+{
+    volatile DWORD  dwVersion;		// Written last, once the rest is valid
+    volatile UINT   HeaderSize;
+    volatile UINT   SegmentSize;
+    volatile LONG   Sealed;			// Nothing more will be written to it
+    volatile UINT64 BaseCursor;
+    volatile UINT64 BaseSequence;
+    volatile UINT64 EndCursor;
+    volatile UINT64 EndSequence;
+    BYTE            Reserved[IPC_CACHE_LINE - 4 * sizeof(UINT64) - 4 * sizeof(DWORD)];
+} IPC_SEGMENT;
+
+// The registry is a hash table of every stream's name and layout, probed
+// linearly. It is only written under its lock, and each entry's sequence is
+// odd while it's being written, so lookups need no lock. A new segment is all
+// zeros, which is an empty table, so nobody has to initialize it.
+#define IPC_REGISTRY_FREE	0	// Never used, so a probe stops here
+#define IPC_REGISTRY_OPEN	1
+#define IPC_REGISTRY_CLOSED	2	// Used once, so a probe carries on past it
+
+typedef struct _IPC_REGISTRY_ENTRY
+{
+    volatile LONG   Sequence;
+    volatile LONG   State;
+    UINT            Hash;
+    DWORD           dwVersion;
+    DWORD           dwFlags;
+    UINT            RingBufferSize;
+    UINT            BufferOffset;
+    UINT            MappedFileSize;
+    UINT            PageSize;
+    DWORD           ProcessId;
+    WCHAR           Name[IPC_MAX_STREAM_NAME];
+} IPC_REGISTRY_ENTRY;
+
+typedef struct _IPC_REGISTRY
+{
+    volatile LONG   Lock;			// On POSIX; Win32 has a named mutex instead
+    volatile LONG   Overflow;		// Streams open but left out, so a name not found may still be open
+    volatile LONG   EntrySize;		// Claimed by the first to map it, so other layouts keep out
+    volatile LONG   Entries;
+    BYTE            Reserved[IPC_CACHE_LINE - 4 * sizeof(LONG)];
+    IPC_REGISTRY_ENTRY Table[IPC_REGISTRY_ENTRIES];
+} IPC_REGISTRY;
+
+// Copies size bytes; the streaming kernels bypass the cache
+typedef void (*IPC_COPY_ROUTINE)( BYTE* pDest, const BYTE* pSrc, SIZE_T size );
+
 struct _IPC_STREAM
 {
     LPWSTR			MappedFileName;
@@ -46,18 +368,155 @@ struct _IPC_STREAM
     LPWSTR			ReadLockName;
     LPWSTR			ReadEventName;
     IPC_RING*		pRing;
+    IPC_READER_SLOT*	pSlot;			// Our reader slot in a broadcast stream
+    volatile UINT64*	pReadCursor;	// The cursor this handle reads from
+    volatile UINT64*	pReadSequence;	// ...and the record count that goes with it
+    volatile UINT64*	pWriteCursor;	// The cursor this handle writes to, or waits on
+    IPC_SHARD*		pShard;			// Our shard in a sharded stream
+    IPC_SHARD*		pLane;			// The lane we last wrote in a priority stream
     BYTE*			pBuffer;
-    HANDLE			hWriteLock;
-    HANDLE			hWriteEvent;
-    HANDLE			hReadLock;
-    HANDLE			hReadEvent;
+    BYTE*			pMirror;
+    IPC_LOCK		hWriteLock;
+    IPC_EVENT		hWriteEvent;
+    IPC_LOCK		hReadLock;
+    IPC_EVENT		hReadEvent;
+#ifdef _WIN32
     HANDLE			hMappedFile;
+#else
+    char*			szSharedMemoryName;
+    BOOL			bHugeTlbFs;
+#endif
     UINT			MappedFileSize;
+    UINT			BufferOffset;
     UINT			RingBufferSize;
     UINT			IOGranularity;
+	DWORD			dwFlags;
+	DWORD			WaitStrategy;
+    UINT			SpinMicroseconds;
+    UINT			PageSize;
+	DWORD			NumaPolicy;
+	DWORD			NumaNode;
+    UINT			MaxReaders;
+    UINT			MaxWriters;
+    UINT			NextShard;		// Where a sharded reader looks first
+    UINT			Lanes;
+	DWORD			dwAccess;
+    UINT64			CachedReadCursor;	// Last ReadCursor we saw as a writer
+    UINT64			CachedWriteCursor;	// Last WriteCursor we saw as a reader
+    UINT64			PendingWriteCursor;
+    UINT			PendingWriteSize;
+    UINT			PendingReadSize;
+    UINT64			DroppedBytes;		// Lost to the writer lapping us
+    UINT64			DroppedMessages;
+    void			(*pfnWriteWait)( void* );	// Polled while a multi-producer write waits
+    void*			pWriteWaitContext;
+    LPWSTR			StreamName;		// A growable stream's, which its later rings are named after
+    IPC_STREAM*		pFirst;			// Its first ring, kept open while we're on a later one
+    UINT			Generation;		// Which of its rings we're on
+    UINT			MaxRingBufferSize;
+    UINT			GrowMicroseconds;
+    UINT64			BlockedMicroseconds;	// Writing to this ring; enough and it grows
+    LPWSTR			JournalPrefix;	// Directory and name a journal's segments are named from
+    UINT			JournalSegments;
+    IPC_SEGMENT*	pWriteSegment;	// The journal segment we last wrote to
+    UINT64			WriteSegment;
+    IPC_SEGMENT*	pReadSegment;	// ...and the one we're reading
+    UINT64			ReadSegment;
+    UINT64			JournalCursor;	// Where in the journal this handle reads from
+    UINT64			JournalSequence;
+	DWORD			CopyKernel;
+    UINT			NonTemporalThreshold;	// Transfers this large use the streaming copy
+    IPC_COPY_ROUTINE	pfnStreamingCopy;
+    IPC_ARENA*		pArena;
+    IPC_ARENA_BLOCK*	pArenaBlocks;
+    BYTE*			pArenaData;
+    UINT			ArenaBlockSize;
+    UINT			ArenaBlocks;
+    IPC_REGISTRY_ENTRY*	pEntry;		// Where its creator listed the stream
+    LONG			EntrySequence;	// ...and the entry's sequence once it had
+    BOOL			bUnlisted;		// Counted in the registry's overflow instead
     BOOL			bIsServer;
 };
 
+// Shards and lanes each have a ring of their own after the header; any other
+// stream has just the one
+static UINT CountSubRings( IPC_STREAM* pIPC )
+{
+    return max( pIPC->MaxWriters + pIPC->Lanes, 1 );
+}
+
+// Runs on a thread of its own once a selector's pollable handle is asked for
+static void WatchSelector( IPC_SELECTOR* pSelector );
+
+// Takes what an opener needs to know from the stream's header, and checks
+// that it's a layout we understand
+static HRESULT CacheStreamHeader(
+    IPC_STREAM* pIPC,
+    const IPC_RING* pRing,
+	DWORD dwVersion )
+{
+    pIPC->RingBufferSize = pRing->RingBufferSize;
+    pIPC->BufferOffset = pRing->BufferOffset;
+    pIPC->dwFlags = pRing->dwFlags;
+    pIPC->IOGranularity = pRing->IOGranularity;
+    pIPC->WaitStrategy = pRing->WaitStrategy;
+    pIPC->SpinMicroseconds = pRing->SpinMicroseconds;
+    pIPC->PageSize = pRing->PageSize;
+    pIPC->NumaPolicy = pRing->NumaPolicy;
+    pIPC->NumaNode = pRing->NumaNode;
+    pIPC->MaxReaders = pRing->MaxReaders;
+    pIPC->MaxWriters = pRing->MaxWriters;
+    pIPC->Lanes = pRing->Lanes;
+    pIPC->MaxRingBufferSize = pRing->MaxRingBufferSize;
+    pIPC->GrowMicroseconds = pRing->GrowMicroseconds;
+    pIPC->JournalSegments = pRing->JournalSegments;
+    pIPC->MappedFileSize = pIPC->BufferOffset;
+    if ( !( pIPC->dwFlags & IPC_STREAM_JOURNAL ) )
+        pIPC->MappedFileSize += pIPC->RingBufferSize * CountSubRings( pIPC );
+
+    // Check the versions and header layouts match
+    if ( pRing->dwVersion != dwVersion ||
+         pRing->HeaderSize != sizeof(IPC_RING) ||
+         pRing->MaxReaders > IPC_MAX_READERS ||
+         pRing->MaxWriters > IPC_MAX_WRITERS ||
+         pRing->Lanes > IPC_MAX_LANES )
+        return E_INVALIDARG;
+
+    return S_OK;
+}
+
+// A listed stream is mapped by the layout it was listed with, without a look
+// at its header first
+static void AdoptRegistryEntry(
+    IPC_STREAM* pIPC,
+    const IPC_REGISTRY_ENTRY* pEntry )
+{
+    pIPC->RingBufferSize = pEntry->RingBufferSize;
+    pIPC->BufferOffset = pEntry->BufferOffset;
+    pIPC->dwFlags = pEntry->dwFlags;
+    pIPC->PageSize = pEntry->PageSize;
+    pIPC->MappedFileSize = pEntry->MappedFileSize;
+}
+
+// ...and if the header then disagrees, the listing is stale
+static BOOL MatchesRegistryEntry(
+    const IPC_RING* pRing,
+    const IPC_REGISTRY_ENTRY* pEntry )
+{
+    UINT64 mappedFileSize = pRing->BufferOffset;
+
+    if ( !( pRing->dwFlags & IPC_STREAM_JOURNAL ) )
+        mappedFileSize += (UINT64) pRing->RingBufferSize * max( pRing->MaxWriters + pRing->Lanes, 1 );
+
+    return pRing->dwVersion == pEntry->dwVersion &&
+           pRing->HeaderSize == sizeof(IPC_RING) &&
+           pRing->RingBufferSize == pEntry->RingBufferSize &&
+           pRing->BufferOffset == pEntry->BufferOffset &&
+           pRing->dwFlags == pEntry->dwFlags &&
+           pRing->PageSize == pEntry->PageSize &&
+           mappedFileSize == pEntry->MappedFileSize;
+}
+
 typedef enum _IPC_HANDLE_TYPE
 {
 	IPC_WRITE_LOCK,
@@ -98,7 +557,7 @@ LPWSTR CreateGlobalObjectName(
     if ( newStr == NULL )
         return NULL;
     
-	swprintf_s( newStr, totalLen, L"%s%s%08X", szPrefix, szSuffix, dwVersion );
+	swprintf_s( newStr, totalLen, L"%ls%ls%08X", szPrefix, szSuffix, dwVersion );
 
     return newStr;
 }
@@ -109,36 +568,298 @@ void FreeGlobalObjectName(
 	free( szName );
 }
 
-HRESULT CreateInterprocessStream(
+// The locks and events only have names of their own on Windows; elsewhere
+// they live in the mapping
+static HRESULT CreateStreamNames(
+    IPC_STREAM* pIPC,
     LPCWSTR szName,
-	DWORD dwVersion,
-    UINT uRingBufferSize,
-    IPC_STREAM** ppIPC )
+	DWORD dwVersion )
 {
-	SECURITY_ATTRIBUTES sa;
-	IPC_STREAM* pIPC;
-	UINT uTotalBufferSize;
-
-    if ( ppIPC == NULL ) 
-        return E_INVALIDARG;
-    if ( uRingBufferSize <= sizeof(IPC_RING) )
-        return E_INVALIDARG;
-    if ( szName == NULL || *szName == 0 )
-        return E_INVALIDARG;
-	if ( dwVersion != IPCLIB_VERSION )
-		return E_INVALIDARG;
-
-	// Make sure we can do at least two writes to the buffer
-	uRingBufferSize = max( uRingBufferSize, IPC_IO_GRANULARITY * 2 );
-
-    pIPC = (IPC_STREAM*) malloc( sizeof(IPC_STREAM) );
-    ZeroMemory( pIPC, sizeof(*pIPC) );
-
+#ifdef _WIN32
     pIPC->WriteLockName = CreateGlobalObjectName( szName, IPC_WRITE_LOCK, dwVersion );
     pIPC->WriteEventName = CreateGlobalObjectName( szName, IPC_WRITE_EVENT, dwVersion );
     pIPC->ReadLockName = CreateGlobalObjectName( szName, IPC_READ_LOCK, dwVersion );
     pIPC->ReadEventName = CreateGlobalObjectName( szName, IPC_READ_EVENT, dwVersion );
+    if ( pIPC->WriteLockName == NULL || pIPC->WriteEventName == NULL ||
+         pIPC->ReadLockName == NULL || pIPC->ReadEventName == NULL )
+        return E_OUTOFMEMORY;
+#endif
     pIPC->MappedFileName = CreateGlobalObjectName( szName, IPC_MAPPED_FILE, dwVersion );
+    if ( pIPC->MappedFileName == NULL )
+        return E_OUTOFMEMORY;
+
+    return S_OK;
+}
+
+// A journal's segment files are named <directory>/<name>_<index>.journal, with
+// the index as 16 hex digits so that they sort in order
+static LPWSTR CreateJournalPrefix(
+    LPCWSTR szDirectory,
+    LPCWSTR szName )
+{
+    SIZE_T totalLen = wcslen( szDirectory ) + wcslen( szName ) + 2;
+    WCHAR* newStr = (WCHAR*) malloc( sizeof(WCHAR) * totalLen );
+
+    if ( newStr != NULL )
+        swprintf_s( newStr, totalLen, L"%ls/%ls", szDirectory, szName );
+    return newStr;
+}
+
+static LPWSTR CreateSegmentPath(
+    LPCWSTR szPrefix,
+    UINT64 index )
+{
+    SIZE_T totalLen = wcslen( szPrefix ) + 26; // _ + 16 digits + .journal + nullterm
+    WCHAR* newStr = (WCHAR*) malloc( sizeof(WCHAR) * totalLen );
+
+    if ( newStr != NULL )
+        swprintf_s( newStr, totalLen, L"%ls_%016llX.journal", szPrefix, (unsigned long long) index );
+    return newStr;
+}
+
+static LPCWSTR GetJournalBaseName( LPCWSTR szPrefix )
+{
+    LPCWSTR szBase = szPrefix;
+    LPCWSTR p;
+
+    for ( p = szPrefix; *p; ++p )
+    {
+        if ( *p == L'/' || *p == L'\\' )
+            szBase = p + 1;
+    }
+    return szBase;
+}
+
+static BOOL ParseSegmentName(
+    LPCWSTR szFileName,
+    LPCWSTR szBase,
+    UINT64* pIndex )
+{
+    SIZE_T baseLen = wcslen( szBase );
+    UINT64 index = 0;
+    SIZE_T i;
+
+    if ( wcslen( szFileName ) != baseLen + 25 ||
+         wcsncmp( szFileName, szBase, baseLen ) != 0 ||
+         szFileName[baseLen] != L'_' ||
+         wcscmp( szFileName + baseLen + 17, L".journal" ) != 0 )
+        return FALSE;
+
+    for ( i = baseLen + 1; i < baseLen + 17; ++i )
+    {
+        WCHAR c = szFileName[i];
+
+        if ( c >= L'0' && c <= L'9' )
+            index = index * 16 + ( c - L'0' );
+        else if ( c >= L'A' && c <= L'F' )
+            index = index * 16 + ( c - L'A' + 10 );
+        else
+            return FALSE;
+    }
+
+    *pIndex = index;
+    return TRUE;
+}
+
+#ifdef _WIN32
+
+// Says whether the last owner exited without releasing it
+static BOOL AcquireStreamLock( IPC_LOCK hLock )
+{
+    return WaitForSingleObject( hLock, INFINITE ) == WAIT_ABANDONED;
+}
+
+static BOOL TryAcquireStreamLock( IPC_LOCK hLock )
+{
+    return WaitForSingleObject( hLock, 0 ) != WAIT_TIMEOUT;
+}
+
+static void ReleaseStreamLock( IPC_LOCK hLock )
+{
+    ReleaseMutex( hLock );
+}
+
+// One we aren't allowed to open is still there
+static BOOL ProcessAlive( DWORD dwProcessId )
+{
+    HANDLE hProcess = OpenProcess( SYNCHRONIZE, FALSE, dwProcessId );
+    DWORD dwResult;
+
+    if ( hProcess == NULL )
+        return GetLastError() == ERROR_ACCESS_DENIED;
+
+    dwResult = WaitForSingleObject( hProcess, 0 );
+    CloseHandle( hProcess );
+    return dwResult == WAIT_TIMEOUT;
+}
+
+static void SignalStreamEvent( IPC_EVENT hEvent )
+{
+    SetEvent( hEvent );
+}
+
+// A selector waits on the streams' events themselves
+static void SignalSelectors( volatile LONG* pSequence )
+{
+    UNREFERENCED_PARAMETER( pSequence );
+}
+
+static IPC_EVENT GetSelectorEvent(
+    IPC_EVENT hEvent,
+    volatile LONG* pSequence )
+{
+    UNREFERENCED_PARAMETER( pSequence );
+    return hEvent;
+}
+
+static void WaitStreamEvent( IPC_EVENT hEvent )
+{
+    WaitForSingleObject( hEvent, INFINITE );
+}
+
+static void WaitStreamEventTimeout(
+    IPC_EVENT hEvent,
+    DWORD dwMilliseconds )
+{
+    WaitForSingleObject( hEvent, dwMilliseconds );
+}
+
+// Unnamed objects for synchronising threads within one process. The POSIX
+// versions live in the word they are given, which Win32 has no use for.
+static IPC_LOCK CreateLocalLock( volatile LONG* pWord )
+{
+    UNREFERENCED_PARAMETER( pWord );
+    return CreateMutexW( NULL, FALSE, NULL );
+}
+
+static IPC_EVENT CreateLocalEvent( volatile LONG* pWord )
+{
+    UNREFERENCED_PARAMETER( pWord );
+    return CreateEventW( NULL, FALSE, FALSE, NULL );
+}
+
+static void CloseLocalObject( HANDLE hObject )
+{
+    if ( hObject != NULL )
+        CloseHandle( hObject );
+}
+
+static UINT64 QueryClockMicroseconds( void )
+{
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER count;
+
+    if ( frequency.QuadPart == 0 )
+        QueryPerformanceFrequency( &frequency );
+    QueryPerformanceCounter( &count );
+
+    return (UINT64) ( count.QuadPart / frequency.QuadPart ) * 1000000 +
+        (UINT64) ( count.QuadPart % frequency.QuadPart ) * 1000000 / frequency.QuadPart;
+}
+
+static UINT GetMappingGranularity( void )
+{
+    SYSTEM_INFO si;
+    GetSystemInfo( &si );
+    return si.dwAllocationGranularity;
+}
+
+static UINT GetPageSize( void )
+{
+    SYSTEM_INFO si;
+    GetSystemInfo( &si );
+    return si.dwPageSize;
+}
+
+static UINT GetLargePageSize( void )
+{
+    return (UINT) GetLargePageMinimum();
+}
+
+// Large-page sections need SeLockMemoryPrivilege enabled in our token
+static BOOL EnableLockMemoryPrivilege( void )
+{
+    TOKEN_PRIVILEGES tp;
+    HANDLE hToken;
+    BOOL bEnabled;
+
+    if ( !OpenProcessToken( GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken ) )
+        return FALSE;
+
+    tp.PrivilegeCount = 1;
+    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bEnabled = LookupPrivilegeValue( NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid ) &&
+               AdjustTokenPrivileges( hToken, FALSE, &tp, 0, NULL, NULL ) &&
+               GetLastError() == ERROR_SUCCESS;
+
+    CloseHandle( hToken );
+    return bEnabled;
+}
+
+// Maps the stream's file mapping, and for a mirrored stream maps the ring a
+// second time directly after the first so accesses never need to wrap
+static HRESULT MapStreamView( IPC_STREAM* pIPC )
+{
+    UINT alignment = max( pIPC->PageSize, GetMappingGranularity() );
+    int attempt;
+
+    if ( !( pIPC->dwFlags & IPC_STREAM_MIRRORED ) )
+    {
+        pIPC->pRing = (IPC_RING*) MapViewOfFile(
+            pIPC->hMappedFile,
+            FILE_MAP_WRITE | FILE_MAP_READ,
+            0, 0,
+            pIPC->MappedFileSize );
+        if ( pIPC->pRing == NULL )
+            return HRESULT_FROM_WIN32( GetLastError() );
+
+        return S_OK;
+    }
+
+    // Find a hole big enough for both views, then map into it. Another thread
+    // can grab the hole between us releasing and mapping it, so retry.
+    for ( attempt = 0; attempt < IPC_MIRROR_MAP_ATTEMPTS; ++attempt )
+    {
+        // Large-page views have to start on a large page
+        BYTE* pBase = (BYTE*) VirtualAlloc(
+            NULL,
+            pIPC->MappedFileSize + pIPC->RingBufferSize + alignment,
+            MEM_RESERVE,
+            PAGE_NOACCESS );
+        if ( pBase == NULL )
+            return HRESULT_FROM_WIN32( GetLastError() );
+
+        VirtualFree( pBase, 0, MEM_RELEASE );
+        pBase = (BYTE*) ( ( (DWORD_PTR) pBase + alignment - 1 ) / alignment * alignment );
+
+        pIPC->pRing = (IPC_RING*) MapViewOfFileEx(
+            pIPC->hMappedFile,
+            FILE_MAP_WRITE | FILE_MAP_READ,
+            0, 0,
+            pIPC->MappedFileSize,
+            pBase );
+        if ( pIPC->pRing == NULL )
+            continue;
+
+        pIPC->pMirror = (BYTE*) MapViewOfFileEx(
+            pIPC->hMappedFile,
+            FILE_MAP_WRITE | FILE_MAP_READ,
+            0, pIPC->BufferOffset,
+            pIPC->RingBufferSize,
+            pBase + pIPC->MappedFileSize );
+        if ( pIPC->pMirror != NULL )
+            return S_OK;
+
+        UnmapViewOfFile( pIPC->pRing );
+        pIPC->pRing = NULL;
+    }
+
+    return E_OUTOFMEMORY;
+}
+
+static HRESULT CreateStreamObjects( IPC_STREAM* pIPC )
+{
+	SECURITY_ATTRIBUTES sa;
 
 	sa.bInheritHandle = FALSE;
 	sa.lpSecurityDescriptor = NULL;
@@ -151,10 +872,7 @@ HRESULT CreateInterprocessStream(
 	if ( !pIPC->hWriteLock || 
          GetLastError() == ERROR_ALREADY_EXISTS || 
          GetLastError() == ERROR_ACCESS_DENIED )
-    {
-        CloseInterprocessStream( pIPC );
 		return HRESULT_FROM_WIN32( GetLastError() );
-    }
 
 	pIPC->hWriteEvent = CreateEvent(
 		&sa,
@@ -162,10 +880,7 @@ HRESULT CreateInterprocessStream(
         FALSE,
     	pIPC->WriteEventName );
 	if ( !pIPC->hWriteEvent )
-    {
-        CloseInterprocessStream( pIPC );
 		return HRESULT_FROM_WIN32( GetLastError() );
-    }
 
 	pIPC->hReadLock = CreateMutex(
 		&sa,
@@ -174,10 +889,7 @@ HRESULT CreateInterprocessStream(
 	if ( !pIPC->hReadLock || 
          GetLastError() == ERROR_ALREADY_EXISTS || 
          GetLastError() == ERROR_ACCESS_DENIED )
-    {
-        CloseInterprocessStream( pIPC );
 		return HRESULT_FROM_WIN32( GetLastError() );
-    }
 
 	pIPC->hReadEvent = CreateEvent(
 		&sa,
@@ -185,133 +897,125 @@ HRESULT CreateInterprocessStream(
         FALSE,
     	pIPC->ReadEventName );
 	if ( !pIPC->hReadEvent )
-    {
-        CloseInterprocessStream( pIPC );
 		return HRESULT_FROM_WIN32( GetLastError() );
-    }
 
-    uTotalBufferSize = uRingBufferSize + sizeof(IPC_RING);
+    // Sections can prefer a node but have no interleaved placement
+    if ( pIPC->NumaPolicy != IPC_NUMA_BIND )
+    {
+        pIPC->NumaPolicy = IPC_NUMA_DEFAULT;
+        pIPC->NumaNode = NUMA_NO_PREFERRED_NODE;
+    }
 
-    pIPC->hMappedFile = CreateFileMapping(
-		(HANDLE) -1,
-		NULL,
-		PAGE_READWRITE,
-		0,
-		uTotalBufferSize,
-		pIPC->MappedFileName );
-	if ( !pIPC->hMappedFile )
-	{
-        CloseInterprocessStream( pIPC );
-		return HRESULT_FROM_WIN32( GetLastError() );
-	}
+    if ( ( pIPC->dwFlags & IPC_STREAM_LARGE_PAGES ) && pIPC->PageSize != 0 && EnableLockMemoryPrivilege() )
+    {
+        pIPC->hMappedFile = CreateFileMappingNuma(
+            INVALID_HANDLE_VALUE,
+            NULL,
+            PAGE_READWRITE | SEC_COMMIT | SEC_LARGE_PAGES,
+            0,
+            pIPC->MappedFileSize,
+            pIPC->MappedFileName,
+            pIPC->NumaNode );
+    }
 
-	pIPC->pRing = (IPC_RING*) MapViewOfFile(
-		pIPC->hMappedFile,
-		FILE_MAP_WRITE | FILE_MAP_READ,
-		0, 0,
-		uTotalBufferSize );
-    if ( pIPC->pRing == NULL )
+    // Fall back to normal pages
+    if ( !pIPC->hMappedFile )
     {
-        CloseInterprocessStream( pIPC );
+        pIPC->PageSize = GetPageSize();
+        pIPC->hMappedFile = CreateFileMappingNuma(
+            INVALID_HANDLE_VALUE,
+            NULL,
+            PAGE_READWRITE,
+            0,
+            pIPC->MappedFileSize,
+            pIPC->MappedFileName,
+            pIPC->NumaNode );
+    }
+	if ( !pIPC->hMappedFile )
 		return HRESULT_FROM_WIN32( GetLastError() );
-	}
 
-	__try
-	{
-		ZeroMemory( pIPC->pRing, uTotalBufferSize );
-		pIPC->pRing->RingBufferSize = uRingBufferSize;
-		pIPC->pRing->dwVersion = dwVersion;
-	}
-	__except( GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ?
-		EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
-	{
-        CloseInterprocessStream( pIPC );
-		return E_FAIL;
-	}
+    if ( pIPC->NumaPolicy != IPC_NUMA_BIND )
+        pIPC->NumaNode = 0;
 
-    pIPC->pBuffer = ( (BYTE*) pIPC->pRing ) + sizeof(IPC_RING);
-    pIPC->IOGranularity = IPC_IO_GRANULARITY;
-    pIPC->MappedFileSize = uTotalBufferSize;
-    pIPC->RingBufferSize = uRingBufferSize;
-    pIPC->bIsServer = TRUE;
+    return MapStreamView( pIPC );
+}
 
-    *ppIPC = pIPC;
-    return S_OK;
+static void UnmapStreamView( IPC_STREAM* pIPC )
+{
+    if ( pIPC->pMirror )
+        UnmapViewOfFile( pIPC->pMirror );
+    if ( pIPC->pRing )
+        UnmapViewOfFile( pIPC->pRing );
+    pIPC->pMirror = NULL;
+    pIPC->pRing = NULL;
 }
 
-HRESULT OpenInterprocessStream(
-    LPCWSTR szName,
+static HRESULT OpenStreamObjects(
+    IPC_STREAM* pIPC,
 	DWORD dwVersion,
-    IPC_STREAM** ppIPC )
+    const IPC_REGISTRY_ENTRY* pEntry )
 {
-	IPC_STREAM* pIPC = NULL;
 	IPC_RING* pTmpRing = NULL;
-
-    if ( ppIPC == NULL ) 
-        return E_INVALIDARG;
-    if ( szName == NULL || *szName == 0 )
-        return E_INVALIDARG;
-	if ( dwVersion != IPCLIB_VERSION )
-		return E_INVALIDARG;
-
-    pIPC = (IPC_STREAM*) malloc( sizeof(IPC_STREAM) );
-    ZeroMemory( pIPC, sizeof(*pIPC) );
-
-    pIPC->WriteLockName = CreateGlobalObjectName( szName, IPC_WRITE_LOCK, dwVersion );
-    pIPC->WriteEventName = CreateGlobalObjectName( szName, IPC_WRITE_EVENT, dwVersion );
-    pIPC->ReadLockName = CreateGlobalObjectName( szName, IPC_READ_LOCK, dwVersion );
-    pIPC->ReadEventName = CreateGlobalObjectName( szName, IPC_READ_EVENT, dwVersion );
-    pIPC->MappedFileName = CreateGlobalObjectName( szName, IPC_MAPPED_FILE, dwVersion );
+    BOOL bMatches;
+    HRESULT hr;
 
 	pIPC->hWriteLock = OpenMutex(
 		SYNCHRONIZE,
 		FALSE,
     	pIPC->WriteLockName );
 	if ( !pIPC->hWriteLock )
-    {
-        CloseInterprocessStream( pIPC );
 		return HRESULT_FROM_WIN32( GetLastError() );
-    }
 
 	pIPC->hWriteEvent = OpenEvent(
 		SYNCHRONIZE | EVENT_MODIFY_STATE,
 		FALSE,
 		pIPC->WriteEventName );
 	if ( !pIPC->hWriteEvent )
-    {
-        CloseInterprocessStream( pIPC );
 		return HRESULT_FROM_WIN32( GetLastError() );
-    }
 
 	pIPC->hReadLock = OpenMutex(
 		SYNCHRONIZE,
 		FALSE,
     	pIPC->ReadLockName );
 	if ( !pIPC->hReadLock )
-    {
-        CloseInterprocessStream( pIPC );
 		return HRESULT_FROM_WIN32( GetLastError() );
-    }
 
 	pIPC->hReadEvent = OpenEvent(
 		SYNCHRONIZE | EVENT_MODIFY_STATE,
 		FALSE,
 		pIPC->ReadEventName );
 	if ( !pIPC->hReadEvent )
-    {
-        CloseInterprocessStream( pIPC );
 		return HRESULT_FROM_WIN32( GetLastError() );
-    }
 
     pIPC->hMappedFile = OpenFileMapping(
 		FILE_MAP_WRITE | FILE_MAP_READ,
 		FALSE,
 		pIPC->MappedFileName );
 	if ( !pIPC->hMappedFile )
-	{
-        CloseInterprocessStream( pIPC );
 		return HRESULT_FROM_WIN32( GetLastError() );
-	}
+
+    // A listed stream's layout is known up front, so it's mapped just the once
+    if ( pEntry != NULL )
+    {
+        AdoptRegistryEntry( pIPC, pEntry );
+        if ( SUCCEEDED( MapStreamView( pIPC ) ) )
+        {
+            IPC_TRY
+            {
+                bMatches = MatchesRegistryEntry( pIPC->pRing, pEntry );
+                hr = bMatches ? CacheStreamHeader( pIPC, pIPC->pRing, dwVersion ) : S_OK;
+            }
+            IPC_EXCEPT
+            {
+                bMatches = TRUE;
+                hr = E_FAIL;
+            }
+
+            if ( bMatches )
+                return hr;
+            UnmapStreamView( pIPC );
+        }
+    }
 
     pTmpRing = (IPC_RING*) MapViewOfFile(
 		pIPC->hMappedFile,
@@ -319,65 +1023,32 @@ HRESULT OpenInterprocessStream(
 		0, 0,
 		sizeof(IPC_RING) );
     if ( pTmpRing == NULL )
-    {
-        CloseInterprocessStream( pIPC );
 		return HRESULT_FROM_WIN32( GetLastError() );
-	}
 
     // Cache some of the ringbuffer properties
-	__try
+	IPC_TRY
 	{
-        pIPC->RingBufferSize = pTmpRing->RingBufferSize;
-
-		// Check the versions match
-		if ( pTmpRing->dwVersion != dwVersion )
-		{
-			CloseInterprocessStream( pIPC );
-			return E_INVALIDARG;
-		}
+        hr = CacheStreamHeader( pIPC, pTmpRing, dwVersion );
 	}
-	__except(GetExceptionCode()==EXCEPTION_IN_PAGE_ERROR ?
-	EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+	IPC_EXCEPT
 	{
-        CloseInterprocessStream( pIPC );
-		return E_FAIL;
+		hr = E_FAIL;
 	}
 
     UnmapViewOfFile( pTmpRing );
+    if ( FAILED( hr ) )
+        return hr;
 
-    pIPC->MappedFileSize = pIPC->RingBufferSize + sizeof(IPC_RING);
-
-    pIPC->pRing = (IPC_RING*) MapViewOfFile(
-        pIPC->hMappedFile,
-        FILE_MAP_WRITE | FILE_MAP_READ,
-        0, 0, 
-        pIPC->MappedFileSize );
-    if ( pIPC->pRing == NULL )
-    {
-        CloseInterprocessStream( pIPC );
-		return HRESULT_FROM_WIN32( GetLastError() );
-    }
-
-    pIPC->pBuffer = ( (BYTE*) pIPC->pRing ) + sizeof(IPC_RING);
-    pIPC->IOGranularity = IPC_IO_GRANULARITY;
-    pIPC->bIsServer = FALSE;
-
-    *ppIPC = pIPC;
-    return S_OK;
+    return MapStreamView( pIPC );
 }
 
-BOOL QueryInterprocessStreamIsOpen( 
-	LPCWSTR szName,
-	DWORD dwVersion )
+static BOOL QueryStreamObjectsExist(
+    LPCWSTR szMappedFileName )
 {
-    LPWSTR MappedFileName = CreateGlobalObjectName( szName, IPC_MAPPED_FILE, dwVersion );
-
 	HANDLE hMappedFile = OpenFileMapping(
 		FILE_MAP_WRITE | FILE_MAP_READ,
 		FALSE,
-		MappedFileName );
-
-    FreeGlobalObjectName( MappedFileName );
+		szMappedFileName );
 
 	if ( !hMappedFile )
 	{
@@ -388,40 +1059,14 @@ BOOL QueryInterprocessStreamIsOpen(
 	return TRUE;
 }
 
-HRESULT CloseInterprocessStream( IPC_STREAM* pIPC )
+static void ClearStreamRing( IPC_STREAM* pIPC )
 {
-    if ( pIPC == NULL )
-        return E_INVALIDARG;
-
-    if ( pIPC->bIsServer && 
-         pIPC->hWriteLock && 
-         pIPC->hWriteEvent &&
-         pIPC->hMappedFile )
-    {
-        // Wait for clients to release their write lock on the ringbuffer
-        WaitForSingleObject( pIPC->hWriteLock, INFINITE );
-
-        // Clear the mapping
-        ZeroMemory( pIPC->pRing, pIPC->MappedFileSize );
-        ReleaseMutex( pIPC->hWriteLock );
-
-        // Notify listeners there's data there
-        SetEvent( pIPC->hWriteEvent );
-    }
-
-    if ( pIPC->pRing )
-        UnmapViewOfFile( pIPC->pRing );
+    ZeroMemory( pIPC->pRing, pIPC->MappedFileSize );
+}
 
-    if ( pIPC->WriteLockName != NULL )
-        FreeGlobalObjectName( pIPC->WriteLockName );
-    if ( pIPC->WriteEventName != NULL )
-        FreeGlobalObjectName( pIPC->WriteEventName );
-    if ( pIPC->ReadLockName != NULL )
-        FreeGlobalObjectName( pIPC->ReadLockName );
-    if ( pIPC->ReadEventName != NULL )
-        FreeGlobalObjectName( pIPC->ReadEventName );
-    if ( pIPC->MappedFileName != NULL )
-        FreeGlobalObjectName( pIPC->MappedFileName );
+static void CloseStreamObjects( IPC_STREAM* pIPC )
+{
+    UnmapStreamView( pIPC );
 
     if ( pIPC->hWriteEvent != NULL )
         CloseHandle( pIPC->hWriteEvent );
@@ -433,194 +1078,6315 @@ HRESULT CloseInterprocessStream( IPC_STREAM* pIPC )
         CloseHandle( pIPC->hReadLock );
     if ( pIPC->hMappedFile != NULL )
         CloseHandle( pIPC->hMappedFile );
+}
 
-    free( pIPC );
+// Named objects go with the last handle to them, whoever created them
+static void DisownStreamObjects( IPC_STREAM* pIPC )
+{
+    UNREFERENCED_PARAMETER( pIPC );
+}
+
+// Maps a whole journal segment, creating the file at its full size if a
+// writer asks for one that isn't there. The view outlives the handles, and the
+// file can be deleted while views of it are still open.
+static HRESULT MapSegmentFile(
+    LPCWSTR szPath,
+    UINT mappedSize,
+    BOOL bWrite,
+    void** ppView )
+{
+    HANDLE hFile, hMapping;
+    void* pView;
+
+    hFile = CreateFileW( szPath, bWrite ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        bWrite ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+    if ( hFile == INVALID_HANDLE_VALUE )
+        return HRESULT_FROM_WIN32( GetLastError() );
+
+    hMapping = CreateFileMappingW( hFile, NULL, bWrite ? PAGE_READWRITE : PAGE_READONLY, 0, mappedSize, NULL );
+    CloseHandle( hFile );
+    if ( hMapping == NULL )
+        return HRESULT_FROM_WIN32( GetLastError() );
+
+    pView = MapViewOfFile( hMapping, bWrite ? FILE_MAP_READ | FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, mappedSize );
+    CloseHandle( hMapping );
+    if ( pView == NULL )
+        return HRESULT_FROM_WIN32( GetLastError() );
+
+    *ppView = pView;
     return S_OK;
 }
 
-static void WriteSpinlock( 
-    IPC_STREAM* pIPC,
-    UINT64 writeCursor )
+static void UnmapSegmentFile(
+    void* pView,
+    UINT mappedSize )
 {
-    UINT spin = IPC_SPINLOCK_COUNT;
-    UINT64 readCursor = pIPC->pRing->ReadCursor;
-    UINT ringBufferSize = pIPC->RingBufferSize;
+    UNREFERENCED_PARAMETER( mappedSize );
+    UnmapViewOfFile( pView );
+}
 
-    // Spin while in case the data is going to come in very soon
-    while ( writeCursor - readCursor > ringBufferSize && spin-- > 0 )
-    {
-        SwitchToThread(); // Give up our quantum
-        readCursor = pIPC->pRing->ReadCursor;
-    }
+// Starts writing a sealed segment back without waiting for it
+static void FlushSegmentFile(
+    void* pView,
+    UINT mappedSize )
+{
+    FlushViewOfFile( pView, mappedSize );
+}
 
-    // Switch to a very slow wait 
-    while ( writeCursor - pIPC->pRing->ReadCursor > ringBufferSize )
+static void DeleteSegmentFile( LPCWSTR szPath )
+{
+    DeleteFileW( szPath );
+}
+
+// The oldest and newest segments of a journal on disk, if it has any
+static BOOL FindSegmentFiles(
+    LPCWSTR szPrefix,
+    UINT64* pFirst,
+    UINT64* pLast )
+{
+    WIN32_FIND_DATAW find;
+    SIZE_T totalLen = wcslen( szPrefix ) + 11;
+    WCHAR* szPattern = (WCHAR*) malloc( sizeof(WCHAR) * totalLen );
+    LPCWSTR szBase = GetJournalBaseName( szPrefix );
+    HANDLE hFind;
+    UINT64 index;
+    BOOL bFound = FALSE;
+
+    if ( szPattern == NULL )
+        return FALSE;
+
+    swprintf_s( szPattern, totalLen, L"%ls_*.journal", szPrefix );
+    hFind = FindFirstFileW( szPattern, &find );
+    free( szPattern );
+    if ( hFind == INVALID_HANDLE_VALUE )
+        return FALSE;
+
+    do
     {
-        WaitForSingleObject( pIPC->hReadEvent, INFINITE );
+        if ( ParseSegmentName( find.cFileName, szBase, &index ) )
+        {
+            if ( !bFound || index < *pFirst )
+                *pFirst = index;
+            if ( !bFound || index > *pLast )
+                *pLast = index;
+            bFound = TRUE;
+        }
     }
+    while ( FindNextFileW( hFind, &find ) );
 
-#ifdef _DEBUG
-	assert( writeCursor - pIPC->pRing->ReadCursor <= ringBufferSize );
-#endif
+    FindClose( hFind );
+    return bFound;
 }
 
-HRESULT WriteInterprocessStream(
-    _In_ IPC_STREAM* pIPC,
-    _In_reads_(dataSize) LPCVOID pData,
-    _In_ UINT dataSize )
+static void UnlinkStreamObjects( LPCWSTR szMappedFileName )
 {
-	UINT ringBufferSize;
-	const BYTE* pSource = NULL;
-	const BYTE* pRingEnd = NULL;
+    UNREFERENCED_PARAMETER( szMappedFileName );
+}
 
-    if ( dataSize == 0 )
+// A wait here returns for an event that was set before it began, so there is
+// nothing to note
+static void ObserveStreamEvents(
+    IPC_EVENT* phEvents,
+    LONG* pValues,
+    UINT count )
+{
+    UNREFERENCED_PARAMETER( phEvents );
+    UNREFERENCED_PARAMETER( pValues );
+    UNREFERENCED_PARAMETER( count );
+}
+
+// Part of a wait on more handles than one wait can take: some of the events,
+// then the event that whichever group's wait ends first sets for the rest
+typedef struct _IPC_EVENT_GROUP
+{
+    HANDLE			hEvents[MAXIMUM_WAIT_OBJECTS];
+    DWORD			Count;
+    DWORD			dwMilliseconds;
+    HANDLE			hThread;
+} IPC_EVENT_GROUP;
+
+static DWORD WINAPI EventGroupMain( LPVOID pContext )
+{
+    IPC_EVENT_GROUP* pGroup = (IPC_EVENT_GROUP*) pContext;
+
+    WaitForMultipleObjects( pGroup->Count, pGroup->hEvents, FALSE, pGroup->dwMilliseconds );
+    SetEvent( pGroup->hEvents[pGroup->Count - 1] );
+    return 0;
+}
+
+// Sleeps until one of the events is signalled or the time runs out. Past the
+// limit on how many handles one wait can take, they are split into groups and
+// each group after the first is waited on by a thread of its own.
+static void WaitStreamEvents(
+    IPC_EVENT* phEvents,
+    const LONG* pValues,
+    UINT count,
+    DWORD dwMilliseconds )
+{
+    IPC_EVENT_GROUP* pGroups;
+    HANDLE hDone;
+    UINT size = MAXIMUM_WAIT_OBJECTS - 1;
+    UINT groups, first, i;
+
+    UNREFERENCED_PARAMETER( pValues );
+
+    if ( count == 0 )
     {
-        // Just release the semaphore and quit
-        SetEvent( pIPC->hWriteEvent );
-        return S_OK;
+        Sleep( min( dwMilliseconds, IPC_EVENT_POLL_MS ) );
+        return;
+    }
+    if ( count <= MAXIMUM_WAIT_OBJECTS )
+    {
+        WaitForMultipleObjects( count, phEvents, FALSE, dwMilliseconds );
+        return;
     }
 
-    ringBufferSize = pIPC->RingBufferSize;
-    pSource = (const BYTE*) pData;
-    pRingEnd = pIPC->pBuffer + ringBufferSize;
-    
-    // Lock the ring
-    WaitForSingleObject( pIPC->hWriteLock, INFINITE );
+    groups = ( count + size - 1 ) / size;
+    pGroups = (IPC_EVENT_GROUP*) malloc( groups * sizeof(IPC_EVENT_GROUP) );
+    hDone = CreateEventW( NULL, TRUE, FALSE, NULL );
+    if ( pGroups == NULL || hDone == NULL )
+    {
+        free( pGroups );
+        if ( hDone != NULL )
+            CloseHandle( hDone );
+        Sleep( min( dwMilliseconds, IPC_EVENT_POLL_MS ) );
+        return;
+    }
 
-    // Extract the current ring properties
-	__try
-	{
-		UINT64 writeCursor = pIPC->pRing->WriteCursor;
-        BYTE* pDest = pIPC->pBuffer + ( writeCursor % ringBufferSize );
+    for ( i = 0; i < groups; ++i )
+    {
+        first = i * size;
+        pGroups[i].Count = min( count - first, size ) + 1;
+        memcpy( pGroups[i].hEvents, phEvents + first, ( pGroups[i].Count - 1 ) * sizeof(HANDLE) );
+        pGroups[i].hEvents[pGroups[i].Count - 1] = hDone;
+        pGroups[i].dwMilliseconds = dwMilliseconds;
+        pGroups[i].hThread = NULL;
+    }
 
-        while ( dataSize > 0 )
+    // A group that couldn't get a thread is only polled
+    for ( i = 1; i < groups; ++i )
+    {
+        pGroups[i].hThread = CreateThread( NULL, 0, EventGroupMain, &pGroups[i], 0, NULL );
+        if ( pGroups[i].hThread == NULL )
+            pGroups[0].dwMilliseconds = min( dwMilliseconds, IPC_EVENT_POLL_MS );
+    }
+
+    EventGroupMain( &pGroups[0] );
+    for ( i = 1; i < groups; ++i )
+    {
+        if ( pGroups[i].hThread != NULL )
         {
-            UINT packetSize = min( dataSize, pIPC->IOGranularity );
+            WaitForSingleObject( pGroups[i].hThread, INFINITE );
+            CloseHandle( pGroups[i].hThread );
+        }
+    }
 
-            // Wait until the memory becomes available
-            WriteSpinlock( pIPC, writeCursor + packetSize );
+    CloseHandle( hDone );
+    free( pGroups );
+}
 
-            // Check for wrap: if we do, split the write
-            if ( pDest + packetSize > pRingEnd )
-            {
-                SIZE_T splitPoint = pRingEnd - pDest;
-				SIZE_T remainder = packetSize - splitPoint;
-                memcpy( pDest, pSource, splitPoint );
-                memcpy( pIPC->pBuffer, pSource + splitPoint, remainder );
-				pDest = pIPC->pBuffer + remainder;
-            }
-            else
-            {
-                memcpy( pDest, pSource, packetSize );
-				pDest += packetSize;
-            }
+// A selector's pollable handle is a manual-reset event
+static HRESULT CreateSelectorHandle( IPC_SELECT_HANDLE* phHandle )
+{
+    *phHandle = CreateEventW( NULL, TRUE, FALSE, NULL );
+    return *phHandle != NULL ? S_OK : HRESULT_FROM_WIN32( GetLastError() );
+}
 
-            pSource += packetSize;
-            writeCursor += packetSize;
-            dataSize -= packetSize;
+static void SignalSelectorHandle( IPC_SELECT_HANDLE hHandle )
+{
+    SetEvent( hHandle );
+}
 
-            // Update the write position so reads can consume the data
-            pIPC->pRing->WriteCursor = writeCursor;
-			MemoryBarrier();
-            SetEvent( pIPC->hWriteEvent );
-        }
-	}
-	__except(GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ?
-	    EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
-	{
-        ReleaseMutex( pIPC->hWriteLock );
-		return E_FAIL;
-	}
+static void ResetSelectorHandle( IPC_SELECT_HANDLE hHandle )
+{
+    ResetEvent( hHandle );
+}
 
-    // Release the lock
-    ReleaseMutex( pIPC->hWriteLock );
-    return S_OK;
+static void CloseSelectorHandle( IPC_SELECT_HANDLE hHandle )
+{
+    CloseHandle( hHandle );
 }
 
-static UINT64 ReadSpinlock( 
-    IPC_STREAM* pIPC,
-    UINT64 readCursor )
+static DWORD WINAPI SelectorThreadMain( LPVOID pContext )
 {
-    UINT spin = IPC_SPINLOCK_COUNT;
-    while ( readCursor >= pIPC->pRing->WriteCursor && spin-- > 0 )
-    {
-        SwitchToThread();
-    }
+    WatchSelector( (IPC_SELECTOR*) pContext );
+    return 0;
+}
+
+static HRESULT StartSelectorThread(
+    IPC_SELECTOR* pSelector,
+    IPC_THREAD* phThread )
+{
+    *phThread = CreateThread( NULL, 0, SelectorThreadMain, pSelector, 0, NULL );
+    return *phThread != NULL ? S_OK : HRESULT_FROM_WIN32( GetLastError() );
+}
+
+static void JoinSelectorThread( IPC_THREAD hThread )
+{
+    WaitForSingleObject( hThread, INFINITE );
+    CloseHandle( hThread );
+}
+
+// The mapping lasts as long as any process has it mapped, which is as long as
+// any stream it lists can be open. Its lock is a mutex of its own, which goes
+// to the next waiter if its owner exits holding it.
+static IPC_REGISTRY* MapRegistry( IPC_LOCK* phLock )
+{
+    IPC_REGISTRY* pRegistry;
+    HANDLE hMappedFile;
+    WCHAR szName[IPC_MAX_REGISTRY_NAME];
+    WCHAR szLockName[IPC_MAX_REGISTRY_NAME + 8];
+    DWORD len = GetEnvironmentVariableW( IPC_REGISTRY_VARIABLE, szName, IPC_MAX_REGISTRY_NAME );
+
+    if ( len == 0 || len >= IPC_MAX_REGISTRY_NAME )
+        swprintf_s( szName, IPC_MAX_REGISTRY_NAME, L"%ls", IPC_REGISTRY_NAME );
+    swprintf_s( szLockName, IPC_MAX_REGISTRY_NAME + 8, IPC_REGISTRY_LOCK_NAME, szName );
+
+    *phLock = CreateMutexW( NULL, FALSE, szLockName );
+    if ( *phLock == NULL )
+        return NULL;
 
-    if ( readCursor >= pIPC->pRing->WriteCursor )
+    hMappedFile = CreateFileMapping(
+        INVALID_HANDLE_VALUE,
+        NULL,
+        PAGE_READWRITE,
+        0,
+        sizeof(IPC_REGISTRY),
+        szName );
+
+    if ( !hMappedFile )
     {
-        WaitForSingleObject( pIPC->hWriteEvent, INFINITE );
+        CloseHandle( *phLock );
+        return NULL;
     }
 
-#ifdef _DEBUG
-	assert( pIPC->pRing->ReadCursor <= pIPC->pRing->WriteCursor );
-#endif
+    pRegistry = (IPC_REGISTRY*) MapViewOfFile(
+        hMappedFile,
+        FILE_MAP_WRITE | FILE_MAP_READ,
+        0, 0,
+        sizeof(IPC_REGISTRY) );
+    CloseHandle( hMappedFile );
+    if ( pRegistry == NULL )
+        CloseHandle( *phLock );
+    return pRegistry;
+}
 
-    return pIPC->pRing->WriteCursor;
+#else
+
+static long Futex(
+    volatile LONG* pWord,
+    int op,
+    LONG value )
+{
+    return syscall( SYS_futex, (LONG*) pWord, op, value, NULL, NULL, 0 );
 }
 
-HRESULT ReadInterprocessStream(
-    _In_ IPC_STREAM* pIPC,
-    _Out_writes_(*pDataSize) LPVOID pData,
-    _Out_ UINT dataSize )
+static long FutexWaitTimeout(
+    volatile LONG* pWord,
+    LONG value,
+    DWORD dwMilliseconds )
 {
-    UINT ioGranularity = pIPC->IOGranularity;
-    UINT ringBufferSize = pIPC->RingBufferSize;
-    BYTE* pBuffer = pIPC->pBuffer;
-    BYTE* pBufferEnd = pBuffer + ringBufferSize;
+    struct timespec timeout;
 
-    // Secure the read lock
-    WaitForSingleObject( pIPC->hReadLock, INFINITE );
+    timeout.tv_sec = dwMilliseconds / 1000;
+    timeout.tv_nsec = ( dwMilliseconds % 1000 ) * 1000000L;
+    return syscall( SYS_futex, (LONG*) pWord, FUTEX_WAIT, value, &timeout, NULL, 0 );
+}
 
-	__try
-	{
-        UINT64 readCursor = pIPC->pRing->ReadCursor;
+// One we aren't allowed to signal is still there
+static BOOL ProcessAlive( DWORD dwProcessId )
+{
+    return kill( (pid_t) dwProcessId, 0 ) == 0 || errno == EPERM;
+}
 
-        const BYTE* pSrc = pBuffer + ( readCursor % ringBufferSize );
-        BYTE* pDest = (BYTE*) pData;
-        BYTE* pEnd = pDest + dataSize;
+// getpid is a system call, so the lock takes it once and again after a fork
+static volatile LONG g_LockOwner = 0;
 
-        while ( pDest < pEnd )
-        {
-            // Wait until the memory becomes available
-            UINT64 writeCursor = ReadSpinlock( pIPC, readCursor );
+static void ForgetLockOwner( void )
+{
+    g_LockOwner = 0;
+}
 
-            // How much memory is available?
-            UINT available = min( dataSize, min( ioGranularity, (UINT) (writeCursor - readCursor) ) );
+static LONG GetLockOwner( void )
+{
+    LONG owner = g_LockOwner;
 
-            // If we're about to overrun the buffer, split the read
-            if ( pSrc + available > pBufferEnd )
-            {
-                SIZE_T splitPoint = pBufferEnd - pSrc;
-				SIZE_T remainder = available - splitPoint;
-                memcpy( pDest, pSrc, splitPoint );
-                memcpy( pDest + splitPoint, pBuffer, remainder );
-				pSrc = pBuffer + remainder;
-            }
-            else
+    if ( owner == 0 )
+    {
+        owner = (LONG) getpid();
+        if ( AtomicCompareExchange( &g_LockOwner, owner, 0 ) == 0 )
+            pthread_atfork( NULL, NULL, ForgetLockOwner );
+    }
+    return owner;
+}
+
+// Futex mutex holding its owner's process ID, with IPC_LOCK_WAITERS set once
+// anyone sleeps on it. A process can die holding it, and nothing would ever
+// release it then, so a waiter that times out checks the owner is still
+// running and takes the lock over if it isn't. Says whether it did.
+static BOOL AcquireStreamLock( IPC_LOCK hLock )
+{
+    LONG self = GetLockOwner();
+    LONG c = AtomicCompareExchange( hLock, self, 0 );
+    LONG prev;
+
+    while ( c != 0 )
+    {
+        if ( !( c & IPC_LOCK_WAITERS ) )
+        {
+            prev = AtomicCompareExchange( hLock, c | IPC_LOCK_WAITERS, c );
+            if ( prev != c )
             {
-                memcpy( pDest, pSrc, available );
-				pSrc += available;
+                c = prev;
+                continue;
             }
+            c |= IPC_LOCK_WAITERS;
+        }
 
-            readCursor += available;
-            dataSize -= available;
-            pDest += available;
+        if ( FutexWaitTimeout( hLock, c, IPC_LOCK_OWNER_POLL_MS ) != 0 && errno == ETIMEDOUT &&
+             !ProcessAlive( (DWORD) ( c & ~IPC_LOCK_WAITERS ) ) &&
+             AtomicCompareExchange( hLock, self | IPC_LOCK_WAITERS, c ) == c )
+            return TRUE;
 
-            // Free it up so writes can resume
-            pIPC->pRing->ReadCursor = readCursor;
-			MemoryBarrier();
-            SetEvent( pIPC->hReadEvent );
-        }
-	}
-	__except(GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ?
-	    EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
-	{
-        ReleaseMutex( pIPC->hReadLock );
-		return E_FAIL;
-	}
+        // Others may still be asleep, so whoever takes it now wakes them later
+        c = AtomicCompareExchange( hLock, self | IPC_LOCK_WAITERS, 0 );
+    }
+    return FALSE;
+}
 
-    ReleaseMutex( pIPC->hReadLock );
-    return S_OK;
+static BOOL TryAcquireStreamLock( IPC_LOCK hLock )
+{
+    return AtomicCompareExchange( hLock, GetLockOwner(), 0 ) == 0;
+}
+
+static void ReleaseStreamLock( IPC_LOCK hLock )
+{
+    if ( __atomic_exchange_n( hLock, 0, __ATOMIC_RELEASE ) & IPC_LOCK_WAITERS )
+        Futex( hLock, FUTEX_WAKE, 1 );
 }
 
+// Auto-reset event: 1 while signalled, consumed by exactly one waiter
+static void SignalStreamEvent( IPC_EVENT hEvent )
+{
+    __atomic_store_n( hEvent, 1, __ATOMIC_SEQ_CST );
+    Futex( hEvent, FUTEX_WAKE, 1 );
+}
+
+// A selector can't sleep on a stream's event, as it would have to consume it
+// and so take it from the waiter it was meant for. It sleeps on a count of
+// the signals instead, which every one of them changes.
+static void SignalSelectors( volatile LONG* pSequence )
+{
+    AtomicIncrement( pSequence );
+    Futex( pSequence, FUTEX_WAKE, INT_MAX );
+}
+
+static IPC_EVENT GetSelectorEvent(
+    IPC_EVENT hEvent,
+    volatile LONG* pSequence )
+{
+    (void) hEvent;
+    return pSequence;
+}
+
+static void WaitStreamEvent( IPC_EVENT hEvent )
+{
+    while ( __atomic_exchange_n( hEvent, 0, __ATOMIC_ACQUIRE ) == 0 )
+    {
+        Futex( hEvent, FUTEX_WAIT, 0 );
+    }
+}
+
+static void WaitStreamEventTimeout(
+    IPC_EVENT hEvent,
+    DWORD dwMilliseconds )
+{
+    if ( __atomic_exchange_n( hEvent, 0, __ATOMIC_ACQUIRE ) == 0 )
+    {
+        FutexWaitTimeout( hEvent, 0, dwMilliseconds );
+        __atomic_store_n( hEvent, 0, __ATOMIC_RELAXED );
+    }
+}
+
+static IPC_LOCK CreateLocalLock( volatile LONG* pWord )
+{
+    *pWord = 0;
+    return pWord;
+}
+
+static IPC_EVENT CreateLocalEvent( volatile LONG* pWord )
+{
+    *pWord = 0;
+    return pWord;
+}
+
+static void CloseLocalObject( volatile LONG* pWord )
+{
+    (void) pWord;
+}
+
+static HRESULT HResultFromErrno( int err )
+{
+    switch ( err )
+    {
+    case EEXIST:	return HRESULT_FROM_WIN32( ERROR_ALREADY_EXISTS );
+    case ENOENT:	return HRESULT_FROM_WIN32( ERROR_FILE_NOT_FOUND );
+    case EACCES:	return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+    case ENOMEM:	return E_OUTOFMEMORY;
+    case EINVAL:	return E_INVALIDARG;
+    default:		return E_FAIL;
+    }
+}
+
+// shm_open wants a narrow name with a single leading slash
+static char* CreateSharedMemoryName( LPCWSTR szName )
+{
+    SIZE_T len = wcstombs( NULL, szName, 0 );
+    char* newStr;
+
+    if ( len == (SIZE_T) -1 )
+        return NULL;
+
+    newStr = (char*) malloc( len + 2 );
+    if ( newStr == NULL )
+        return NULL;
+
+    newStr[0] = '/';
+    wcstombs( newStr + 1, szName, len + 1 );
+    return newStr;
+}
+
+static void BindStreamObjects( IPC_STREAM* pIPC )
+{
+    pIPC->hWriteLock = &pIPC->pRing->WriteLock;
+    pIPC->hWriteEvent = &pIPC->pRing->WriteEvent;
+    pIPC->hReadLock = &pIPC->pRing->ReadLock;
+    pIPC->hReadEvent = &pIPC->pRing->ReadEvent;
+}
+
+static UINT64 QueryClockMicroseconds( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (UINT64) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static UINT GetMappingGranularity( void )
+{
+    return (UINT) sysconf( _SC_PAGESIZE );
+}
+
+static UINT GetPageSize( void )
+{
+    return (UINT) sysconf( _SC_PAGESIZE );
+}
+
+// Zero unless a hugetlbfs is mounted where we expect it
+static UINT GetLargePageSize( void )
+{
+    struct statfs fs;
+
+    if ( statfs( IPC_HUGETLBFS_PATH, &fs ) != 0 || fs.f_type != HUGETLBFS_MAGIC )
+        return 0;
+
+    return (UINT) fs.f_bsize;
+}
+
+// Opens the stream's segment, which is either in POSIX shared memory or, for
+// large pages, a file on hugetlbfs
+static int OpenSegment(
+    const char* szSharedMemoryName,
+    int oflag,
+    BOOL bHugeTlbFs )
+{
+    char path[PATH_MAX];
+
+    if ( !bHugeTlbFs )
+        return shm_open( szSharedMemoryName, oflag, 0600 );
+
+    snprintf( path, sizeof(path), "%s%s", IPC_HUGETLBFS_PATH, szSharedMemoryName );
+    return open( path, oflag, 0600 );
+}
+
+static void UnlinkSegment(
+    const char* szSharedMemoryName,
+    BOOL bHugeTlbFs )
+{
+    char path[PATH_MAX];
+
+    if ( !bHugeTlbFs )
+    {
+        shm_unlink( szSharedMemoryName );
+        return;
+    }
+
+    snprintf( path, sizeof(path), "%s%s", IPC_HUGETLBFS_PATH, szSharedMemoryName );
+    unlink( path );
+}
+
+// Clients don't know which kind of segment the creator made
+static int OpenAnySegment(
+    const char* szSharedMemoryName,
+    int oflag )
+{
+    int fd = OpenSegment( szSharedMemoryName, oflag, FALSE );
+
+    if ( fd < 0 && errno == ENOENT && GetLargePageSize() != 0 )
+    {
+        fd = OpenSegment( szSharedMemoryName, oflag, TRUE );
+        if ( fd < 0 && errno != EACCES )
+            errno = ENOENT;
+    }
+
+    return fd;
+}
+
+// The policy is held by the shared segment itself, so pages follow it whoever
+// touches them first. Falls back to the default policy if the kernel refuses.
+static void ApplyNumaPolicy( IPC_STREAM* pIPC )
+{
+    unsigned long nodeMask;
+    int mode;
+
+    if ( pIPC->NumaPolicy == IPC_NUMA_BIND )
+    {
+        nodeMask = 1UL << pIPC->NumaNode;
+        mode = MPOL_BIND;
+    }
+    else if ( pIPC->NumaPolicy == IPC_NUMA_INTERLEAVE )
+    {
+        // The kernel trims this down to the nodes we're allowed to use
+        nodeMask = ~0UL;
+        mode = MPOL_INTERLEAVE;
+    }
+    else
+    {
+        return;
+    }
+
+    if ( syscall( SYS_mbind, pIPC->pRing, (unsigned long) pIPC->MappedFileSize, mode,
+                  &nodeMask, (unsigned long) ( sizeof(nodeMask) * 8 + 1 ), 0 ) != 0 )
+    {
+        pIPC->NumaPolicy = IPC_NUMA_DEFAULT;
+        pIPC->NumaNode = 0;
+    }
+}
+
+// Maps the stream's segment, and for a mirrored stream maps the ring a second
+// time directly after the first so accesses never need to wrap
+static HRESULT MapStreamView(
+    IPC_STREAM* pIPC,
+    int fd )
+{
+    SIZE_T viewSize = pIPC->MappedFileSize;
+    SIZE_T alignment = pIPC->PageSize > GetPageSize() ? pIPC->PageSize : 0;
+    BYTE* pReserved;
+    BYTE* pBase;
+
+    if ( pIPC->dwFlags & IPC_STREAM_MIRRORED )
+        viewSize += pIPC->RingBufferSize;
+
+    // Reserve the whole range first so nothing can land in the mirror's spot,
+    // and trim it so that huge-page views start on a huge page
+    pReserved = (BYTE*) mmap( NULL, viewSize + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( pReserved == MAP_FAILED )
+        return HResultFromErrno( errno );
+
+    pBase = pReserved;
+    if ( alignment != 0 )
+    {
+        pBase = (BYTE*) ( ( (DWORD_PTR) pReserved + alignment - 1 ) / alignment * alignment );
+        if ( pBase != pReserved )
+            munmap( pReserved, pBase - pReserved );
+        munmap( pBase + viewSize, pReserved + alignment - pBase );
+    }
+
+    if ( mmap( pBase, pIPC->MappedFileSize, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_FIXED, fd, 0 ) == MAP_FAILED )
+    {
+        HRESULT hr = HResultFromErrno( errno );
+        munmap( pBase, viewSize );
+        return hr;
+    }
+
+    if ( pIPC->dwFlags & IPC_STREAM_MIRRORED )
+    {
+        if ( mmap( pBase + pIPC->MappedFileSize, pIPC->RingBufferSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, fd, pIPC->BufferOffset ) == MAP_FAILED )
+        {
+            HRESULT hr = HResultFromErrno( errno );
+            munmap( pBase, viewSize );
+            return hr;
+        }
+
+        pIPC->pMirror = pBase + pIPC->MappedFileSize;
+    }
+
+    // Without hugetlbfs, ask for transparent huge pages instead
+    if ( ( pIPC->dwFlags & IPC_STREAM_LARGE_PAGES ) && alignment == 0 )
+        madvise( pBase, viewSize, MADV_HUGEPAGE );
+
+    pIPC->pRing = (IPC_RING*) pBase;
+    BindStreamObjects( pIPC );
+    return S_OK;
+}
+
+// A segment whose creator died without closing it is never unlinked, and its
+// name could never be used again. Unlinks the segment at the name if that is
+// what it is, and says whether the name may now be free.
+static BOOL ReclaimStaleSegment(
+    const char* szSharedMemoryName,
+    BOOL bHugeTlbFs )
+{
+    struct stat st, current;
+    IPC_RING* pTmpRing;
+    DWORD dwProcessId = 0;
+    int fd;
+
+    fd = OpenSegment( szSharedMemoryName, O_RDONLY, bHugeTlbFs );
+    if ( fd < 0 )
+        return errno == ENOENT;
+
+    // One that isn't sized or stamped yet may still be being created
+    if ( fstat( fd, &st ) == 0 && st.st_size >= (off_t) sizeof(IPC_RING) )
+    {
+        pTmpRing = (IPC_RING*) mmap( NULL, sizeof(IPC_RING), PROT_READ, MAP_SHARED, fd, 0 );
+        if ( pTmpRing != MAP_FAILED )
+        {
+            dwProcessId = pTmpRing->ProcessId;
+            munmap( pTmpRing, sizeof(IPC_RING) );
+        }
+    }
+    close( fd );
+
+    if ( dwProcessId == 0 || ProcessAlive( dwProcessId ) )
+        return FALSE;
+
+    // Somebody else may have reclaimed it and made a new one meanwhile
+    fd = OpenSegment( szSharedMemoryName, O_RDONLY, bHugeTlbFs );
+    if ( fd < 0 )
+        return errno == ENOENT;
+    if ( fstat( fd, &current ) == 0 && current.st_ino == st.st_ino )
+        UnlinkSegment( szSharedMemoryName, bHugeTlbFs );
+    close( fd );
+    return TRUE;
+}
+
+static HRESULT CreateStreamObjects( IPC_STREAM* pIPC )
+{
+    HRESULT hr;
+    int fd;
+
+    pIPC->szSharedMemoryName = CreateSharedMemoryName( pIPC->MappedFileName );
+    if ( pIPC->szSharedMemoryName == NULL )
+        return E_OUTOFMEMORY;
+
+    fd = -1;
+    if ( ( pIPC->dwFlags & IPC_STREAM_LARGE_PAGES ) && pIPC->PageSize != 0 )
+    {
+        pIPC->bHugeTlbFs = TRUE;
+        fd = OpenSegment( pIPC->szSharedMemoryName, O_RDWR | O_CREAT | O_EXCL, TRUE );
+        if ( fd < 0 && errno == EEXIST && ReclaimStaleSegment( pIPC->szSharedMemoryName, TRUE ) )
+            fd = OpenSegment( pIPC->szSharedMemoryName, O_RDWR | O_CREAT | O_EXCL, TRUE );
+        if ( fd < 0 && errno == EEXIST )
+        {
+            free( pIPC->szSharedMemoryName );
+            pIPC->szSharedMemoryName = NULL;
+            return HResultFromErrno( errno );
+        }
+
+        // Sizing fails when there aren't enough huge pages reserved
+        if ( fd >= 0 && ftruncate( fd, pIPC->MappedFileSize ) != 0 )
+        {
+            close( fd );
+            UnlinkSegment( pIPC->szSharedMemoryName, TRUE );
+            fd = -1;
+        }
+        else if ( fd >= 0 )
+        {
+            hr = MapStreamView( pIPC, fd );
+            if ( SUCCEEDED( hr ) )
+            {
+                close( fd );
+                ApplyNumaPolicy( pIPC );
+                return hr;
+            }
+
+            close( fd );
+            UnlinkSegment( pIPC->szSharedMemoryName, TRUE );
+            fd = -1;
+        }
+    }
+
+    // Fall back to normal pages
+    pIPC->bHugeTlbFs = FALSE;
+    pIPC->PageSize = GetPageSize();
+
+    fd = OpenSegment( pIPC->szSharedMemoryName, O_RDWR | O_CREAT | O_EXCL, FALSE );
+    if ( fd < 0 && errno == EEXIST && ReclaimStaleSegment( pIPC->szSharedMemoryName, FALSE ) )
+        fd = OpenSegment( pIPC->szSharedMemoryName, O_RDWR | O_CREAT | O_EXCL, FALSE );
+    if ( fd < 0 )
+    {
+        // Don't let CloseInterprocessStream unlink someone else's stream
+        free( pIPC->szSharedMemoryName );
+        pIPC->szSharedMemoryName = NULL;
+        return HResultFromErrno( errno );
+    }
+
+    if ( ftruncate( fd, pIPC->MappedFileSize ) != 0 )
+    {
+        hr = HResultFromErrno( errno );
+        close( fd );
+        return hr;
+    }
+
+    hr = MapStreamView( pIPC, fd );
+    close( fd );
+    if ( SUCCEEDED( hr ) )
+        ApplyNumaPolicy( pIPC );
+    return hr;
+}
+
+static void UnmapStreamView( IPC_STREAM* pIPC )
+{
+    if ( pIPC->pRing )
+        munmap( pIPC->pRing, pIPC->MappedFileSize + ( pIPC->pMirror ? pIPC->RingBufferSize : 0 ) );
+    pIPC->pMirror = NULL;
+    pIPC->pRing = NULL;
+}
+
+static HRESULT OpenStreamObjects(
+    IPC_STREAM* pIPC,
+	DWORD dwVersion,
+    const IPC_REGISTRY_ENTRY* pEntry )
+{
+    struct stat st;
+    IPC_RING* pTmpRing;
+    HRESULT hr;
+    int fd;
+    char* szSharedMemoryName = CreateSharedMemoryName( pIPC->MappedFileName );
+
+    if ( szSharedMemoryName == NULL )
+        return E_OUTOFMEMORY;
+
+    fd = OpenAnySegment( szSharedMemoryName, O_RDWR );
+    free( szSharedMemoryName );
+    if ( fd < 0 )
+        return HResultFromErrno( errno );
+
+    // The creator may not have sized the segment yet
+    if ( fstat( fd, &st ) != 0 || st.st_size < (off_t) sizeof(IPC_RING) )
+    {
+        close( fd );
+        return HRESULT_FROM_WIN32( ERROR_FILE_NOT_FOUND );
+    }
+
+    // A listed stream's layout is known up front, so it's mapped just the once
+    if ( pEntry != NULL && pEntry->MappedFileSize <= (UINT64) st.st_size )
+    {
+        AdoptRegistryEntry( pIPC, pEntry );
+        if ( SUCCEEDED( MapStreamView( pIPC, fd ) ) )
+        {
+            if ( MatchesRegistryEntry( pIPC->pRing, pEntry ) )
+            {
+                close( fd );
+                return CacheStreamHeader( pIPC, pIPC->pRing, dwVersion );
+            }
+            UnmapStreamView( pIPC );
+        }
+    }
+
+    pTmpRing = (IPC_RING*) mmap( NULL, sizeof(IPC_RING), PROT_READ, MAP_SHARED, fd, 0 );
+    if ( pTmpRing == MAP_FAILED )
+    {
+        hr = HResultFromErrno( errno );
+        close( fd );
+        return hr;
+    }
+
+    // Cache some of the ringbuffer properties
+    hr = CacheStreamHeader( pIPC, pTmpRing, dwVersion );
+    munmap( pTmpRing, sizeof(IPC_RING) );
+    if ( SUCCEEDED( hr ) && pIPC->MappedFileSize > (UINT64) st.st_size )
+        hr = E_INVALIDARG;
+    if ( FAILED( hr ) )
+    {
+        close( fd );
+        return hr;
+    }
+
+    hr = MapStreamView( pIPC, fd );
+    close( fd );
+    return hr;
+}
+
+static BOOL QueryStreamObjectsExist(
+    LPCWSTR szMappedFileName )
+{
+    char* szSharedMemoryName = CreateSharedMemoryName( szMappedFileName );
+    int fd;
+
+    if ( szSharedMemoryName == NULL )
+        return FALSE;
+
+    fd = OpenAnySegment( szSharedMemoryName, O_RDONLY );
+    free( szSharedMemoryName );
+
+    if ( fd < 0 )
+    {
+        return FALSE;
+    }
+
+    close( fd );
+    return TRUE;
+}
+
+static void ClearStreamRing( IPC_STREAM* pIPC )
+{
+    // The lock and event words live in the header, so only clear the ring itself
+    pIPC->pRing->WriteCursor = 0;
+    pIPC->pRing->ReadCursor = 0;
+    pIPC->pRing->RingBufferSize = 0;
+    pIPC->pRing->dwVersion = 0;
+    ZeroMemory( (BYTE*) pIPC->pRing + pIPC->BufferOffset, pIPC->MappedFileSize - pIPC->BufferOffset );
+}
+
+static void CloseStreamObjects( IPC_STREAM* pIPC )
+{
+    UnmapStreamView( pIPC );
+
+    // Unlinking the name mirrors the Win32 objects dying with their creator
+    if ( pIPC->szSharedMemoryName != NULL )
+    {
+        UnlinkSegment( pIPC->szSharedMemoryName, pIPC->bHugeTlbFs );
+        free( pIPC->szSharedMemoryName );
+    }
+}
+
+// Leaves the name for somebody else to unlink, as a grown stream's server
+// does for every ring its writers created
+static void DisownStreamObjects( IPC_STREAM* pIPC )
+{
+    free( pIPC->szSharedMemoryName );
+    pIPC->szSharedMemoryName = NULL;
+}
+
+static void UnlinkStreamObjects( LPCWSTR szMappedFileName )
+{
+    char* szSharedMemoryName = CreateSharedMemoryName( szMappedFileName );
+
+    if ( szSharedMemoryName == NULL )
+        return;
+
+    UnlinkSegment( szSharedMemoryName, FALSE );
+    if ( GetLargePageSize() != 0 )
+        UnlinkSegment( szSharedMemoryName, TRUE );
+    free( szSharedMemoryName );
+}
+
+static char* CreateNarrowPath( LPCWSTR szPath )
+{
+    SIZE_T len = wcstombs( NULL, szPath, 0 );
+    char* newStr;
+
+    if ( len == (SIZE_T) -1 )
+        return NULL;
+
+    newStr = (char*) malloc( len + 1 );
+    if ( newStr != NULL )
+        wcstombs( newStr, szPath, len + 1 );
+    return newStr;
+}
+
+// Maps a whole journal segment, creating the file at its full size if a
+// writer asks for one that isn't there. The view outlives the descriptor, and
+// the file can be unlinked while views of it are still open.
+static HRESULT MapSegmentFile(
+    LPCWSTR szPath,
+    UINT mappedSize,
+    BOOL bWrite,
+    void** ppView )
+{
+    char* szNarrowPath = CreateNarrowPath( szPath );
+    struct stat st;
+    void* pView;
+    int fd;
+
+    if ( szNarrowPath == NULL )
+        return E_OUTOFMEMORY;
+
+    fd = open( szNarrowPath, bWrite ? O_RDWR | O_CREAT : O_RDONLY, 0600 );
+    free( szNarrowPath );
+    if ( fd < 0 )
+        return HResultFromErrno( errno );
+
+    // A reader can't map past the end of a file without faulting later
+    if ( fstat( fd, &st ) != 0 ||
+         ( st.st_size < (off_t) mappedSize && ( !bWrite || ftruncate( fd, mappedSize ) != 0 ) ) )
+    {
+        close( fd );
+        return HRESULT_FROM_WIN32( ERROR_INVALID_DATA );
+    }
+
+    pView = mmap( NULL, mappedSize, bWrite ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( pView == MAP_FAILED )
+        return HResultFromErrno( errno );
+
+    *ppView = pView;
+    return S_OK;
+}
+
+static void UnmapSegmentFile(
+    void* pView,
+    UINT mappedSize )
+{
+    munmap( pView, mappedSize );
+}
+
+// Starts writing a sealed segment back without waiting for it
+static void FlushSegmentFile(
+    void* pView,
+    UINT mappedSize )
+{
+    msync( pView, mappedSize, MS_ASYNC );
+}
+
+static void DeleteSegmentFile( LPCWSTR szPath )
+{
+    char* szNarrowPath = CreateNarrowPath( szPath );
+
+    if ( szNarrowPath == NULL )
+        return;
+
+    unlink( szNarrowPath );
+    free( szNarrowPath );
+}
+
+// The oldest and newest segments of a journal on disk, if it has any
+static BOOL FindSegmentFiles(
+    LPCWSTR szPrefix,
+    UINT64* pFirst,
+    UINT64* pLast )
+{
+    char* szDirectory = CreateNarrowPath( szPrefix );
+    LPCWSTR szBase = GetJournalBaseName( szPrefix );
+    WCHAR szFileName[NAME_MAX + 1];
+    struct dirent* pEntry;
+    DIR* pDir;
+    UINT64 index;
+    BOOL bFound = FALSE;
+
+    if ( szDirectory == NULL )
+        return FALSE;
+
+    // The prefix always has a directory in front of the name
+    *strrchr( szDirectory, '/' ) = '\0';
+    pDir = opendir( szDirectory[0] ? szDirectory : "/" );
+    free( szDirectory );
+    if ( pDir == NULL )
+        return FALSE;
+
+    while ( ( pEntry = readdir( pDir ) ) != NULL )
+    {
+        if ( mbstowcs( szFileName, pEntry->d_name, NAME_MAX + 1 ) > NAME_MAX ||
+             !ParseSegmentName( szFileName, szBase, &index ) )
+            continue;
+
+        if ( !bFound || index < *pFirst )
+            *pFirst = index;
+        if ( !bFound || index > *pLast )
+            *pLast = index;
+        bFound = TRUE;
+    }
+
+    closedir( pDir );
+    return bFound;
+}
+
+// Older kernels and headers have no way to sleep on several futexes at once,
+// and there each event needs a thread of its own to sleep on it
+#ifdef SYS_futex_waitv
+#	define IPC_FUTEX_WAITV_MAX	128
+#	define IPC_FUTEX2_SIZE_U32	0x02
+
+typedef struct _IPC_FUTEX_WAITV
+{
+    UINT64  Value;
+    UINT64  Address;
+    DWORD   Flags;
+    DWORD   Reserved;
+} IPC_FUTEX_WAITV;
+#endif
+
+// Part of a wait on more events than one thread can sleep on, along with the
+// word that whichever group's wait ends first sets for the rest
+typedef struct _IPC_EVENT_GROUP
+{
+    IPC_EVENT*		phEvents;
+    const LONG*		pValues;
+    UINT			Count;
+    DWORD			dwMilliseconds;
+    volatile LONG*	pDone;
+    IPC_THREAD		hThread;
+    BOOL			bThread;
+} IPC_EVENT_GROUP;
+
+static volatile LONG g_EventGroupSize = 0;
+
+// How many events one thread can sleep on alongside its group's done word.
+// The kernel is only asked once whether it can do more than one.
+static UINT QueryEventGroupSize( void )
+{
+    if ( g_EventGroupSize == 0 )
+    {
+#ifdef SYS_futex_waitv
+        if ( syscall( SYS_futex_waitv, NULL, 0, 0, NULL, CLOCK_MONOTONIC ) < 0 && errno != ENOSYS )
+            g_EventGroupSize = IPC_FUTEX_WAITV_MAX - 1;
+        else
+#endif
+            g_EventGroupSize = 1;
+    }
+    return (UINT) g_EventGroupSize;
+}
+
+// Notes what each event is before the streams are polled, so a signal that
+// comes after that is seen by the wait below
+static void ObserveStreamEvents(
+    IPC_EVENT* phEvents,
+    LONG* pValues,
+    UINT count )
+{
+    UINT i;
+
+    for ( i = 0; i < count; ++i )
+        pValues[i] = __atomic_load_n( phEvents[i], __ATOMIC_ACQUIRE );
+}
+
+// Sleeps until one of the group's events is signalled after it was observed,
+// its done word is set, or the time runs out. A lone event is slept on by
+// itself, and the done word looked at between short sleeps; whoever sets it
+// wakes the event too, and the short sleeps only matter when that wake comes
+// before the sleep does.
+static void WaitEventGroup( IPC_EVENT_GROUP* pGroup )
+{
+    UINT64 deadline = QueryClockMicroseconds() + (UINT64) pGroup->dwMilliseconds * 1000;
+    UINT64 now;
+    DWORD slice;
+#ifdef SYS_futex_waitv
+    IPC_FUTEX_WAITV waiters[IPC_FUTEX_WAITV_MAX];
+    struct timespec timeout;
+    UINT i;
+
+    if ( QueryEventGroupSize() > 1 )
+    {
+        ZeroMemory( waiters, ( pGroup->Count + 1 ) * sizeof(IPC_FUTEX_WAITV) );
+        for ( i = 0; i < pGroup->Count; ++i )
+        {
+            waiters[i].Value = (UINT64) (DWORD) pGroup->pValues[i];
+            waiters[i].Address = (UINT64) (SIZE_T) pGroup->phEvents[i];
+            waiters[i].Flags = IPC_FUTEX2_SIZE_U32;
+        }
+        waiters[i].Address = (UINT64) (SIZE_T) pGroup->pDone;
+        waiters[i].Flags = IPC_FUTEX2_SIZE_U32;
+
+        // The timeout is absolute, on the clock given
+        clock_gettime( CLOCK_MONOTONIC, &timeout );
+        timeout.tv_sec += pGroup->dwMilliseconds / 1000;
+        timeout.tv_nsec += ( pGroup->dwMilliseconds % 1000 ) * 1000000L;
+        if ( timeout.tv_nsec >= 1000000000L )
+        {
+            timeout.tv_sec += 1;
+            timeout.tv_nsec -= 1000000000L;
+        }
+
+        syscall( SYS_futex_waitv, waiters, pGroup->Count + 1, 0,
+                 pGroup->dwMilliseconds == INFINITE ? NULL : &timeout, CLOCK_MONOTONIC );
+        return;
+    }
+#endif
+
+    while ( *pGroup->pDone == 0 && *pGroup->phEvents[0] == pGroup->pValues[0] )
+    {
+        slice = IPC_SELECTOR_POLL_MS;
+        if ( pGroup->dwMilliseconds != INFINITE )
+        {
+            now = QueryClockMicroseconds();
+            if ( now >= deadline )
+                return;
+            slice = (DWORD) min( ( deadline - now + 999 ) / 1000, IPC_SELECTOR_POLL_MS );
+        }
+        FutexWaitTimeout( pGroup->phEvents[0], pGroup->pValues[0], slice );
+    }
+}
+
+static void* EventGroupMain( void* pContext )
+{
+    IPC_EVENT_GROUP* pGroup = (IPC_EVENT_GROUP*) pContext;
+
+    WaitEventGroup( pGroup );
+    __atomic_store_n( pGroup->pDone, 1, __ATOMIC_SEQ_CST );
+    Futex( pGroup->pDone, FUTEX_WAKE, INT_MAX );
+    return NULL;
+}
+
+// Sleeps until one of the events is signalled after it was observed, or the
+// time runs out. Events past what one thread can sleep on are split into
+// groups, each after the first slept on by a thread of its own; with one
+// event to a group, this thread sleeps on the done word alone.
+static void WaitStreamEvents(
+    IPC_EVENT* phEvents,
+    const LONG* pValues,
+    UINT count,
+    DWORD dwMilliseconds )
+{
+    IPC_EVENT_GROUP* pGroups;
+    IPC_EVENT_GROUP group;
+    volatile LONG done = 0;
+    UINT size, groups, first, i;
+    BOOL bMissed = FALSE;
+
+    if ( count == 0 )
+    {
+        Sleep( min( dwMilliseconds, IPC_EVENT_POLL_MS ) );
+        return;
+    }
+
+    size = QueryEventGroupSize();
+    if ( count <= size )
+    {
+        group.phEvents = phEvents;
+        group.pValues = pValues;
+        group.Count = count;
+        group.dwMilliseconds = dwMilliseconds;
+        group.pDone = &done;
+        WaitEventGroup( &group );
+        return;
+    }
+
+    groups = ( count + size - 1 ) / size;
+    pGroups = (IPC_EVENT_GROUP*) malloc( groups * sizeof(IPC_EVENT_GROUP) );
+    if ( pGroups == NULL )
+    {
+        Sleep( min( dwMilliseconds, IPC_EVENT_POLL_MS ) );
+        return;
+    }
+
+    // A group that couldn't get a thread is only polled
+    for ( i = 0; i < groups; ++i )
+    {
+        first = i * size;
+        pGroups[i].phEvents = phEvents + first;
+        pGroups[i].pValues = pValues + first;
+        pGroups[i].Count = min( count - first, size );
+        pGroups[i].dwMilliseconds = dwMilliseconds;
+        pGroups[i].pDone = &done;
+        pGroups[i].bThread = ( i > 0 || size == 1 ) &&
+            pthread_create( &pGroups[i].hThread, NULL, EventGroupMain, &pGroups[i] ) == 0;
+        if ( !pGroups[i].bThread && ( i > 0 || size == 1 ) )
+            bMissed = TRUE;
+    }
+
+    if ( size > 1 )
+    {
+        if ( bMissed )
+            pGroups[0].dwMilliseconds = min( dwMilliseconds, IPC_EVENT_POLL_MS );
+        WaitEventGroup( &pGroups[0] );
+    }
+    else if ( done == 0 )
+        FutexWaitTimeout( &done, 0, bMissed ? min( dwMilliseconds, IPC_EVENT_POLL_MS ) : dwMilliseconds );
+
+    __atomic_store_n( &done, 1, __ATOMIC_SEQ_CST );
+    Futex( &done, FUTEX_WAKE, INT_MAX );
+    for ( i = 0; i < groups; ++i )
+    {
+        if ( !pGroups[i].bThread )
+            continue;
+        if ( size == 1 )
+            Futex( pGroups[i].phEvents[0], FUTEX_WAKE, INT_MAX );
+        pthread_join( pGroups[i].hThread, NULL );
+    }
+
+    free( pGroups );
+}
+
+// A selector's pollable handle is an eventfd, which reads as ready while its
+// count is non-zero
+static HRESULT CreateSelectorHandle( IPC_SELECT_HANDLE* phHandle )
+{
+    *phHandle = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    return *phHandle >= 0 ? S_OK : HResultFromErrno( errno );
+}
+
+static void SignalSelectorHandle( IPC_SELECT_HANDLE hHandle )
+{
+    uint64_t one = 1;
+
+    if ( write( hHandle, &one, sizeof(one) ) < 0 )
+        return; // Only fails if the count is already enormous
+}
+
+static void ResetSelectorHandle( IPC_SELECT_HANDLE hHandle )
+{
+    uint64_t count;
+
+    if ( read( hHandle, &count, sizeof(count) ) < 0 )
+        return; // Already reset
+}
+
+static void CloseSelectorHandle( IPC_SELECT_HANDLE hHandle )
+{
+    close( hHandle );
+}
+
+static void* SelectorThreadMain( void* pContext )
+{
+    WatchSelector( (IPC_SELECTOR*) pContext );
+    return NULL;
+}
+
+static HRESULT StartSelectorThread(
+    IPC_SELECTOR* pSelector,
+    IPC_THREAD* phThread )
+{
+    int err = pthread_create( phThread, NULL, SelectorThreadMain, pSelector );
+
+    return err == 0 ? S_OK : HResultFromErrno( err );
+}
+
+static void JoinSelectorThread( IPC_THREAD hThread )
+{
+    pthread_join( hThread, NULL );
+}
+
+// Whoever finds the segment empty sizes it; racing to do so is harmless, as
+// everyone asks for the same size and gets zeros either way. Its lock is the
+// first word in it.
+static IPC_REGISTRY* MapRegistry( IPC_LOCK* phLock )
+{
+    const char* szName = getenv( IPC_REGISTRY_VARIABLE );
+    struct stat st;
+    void* pView;
+    int fd;
+
+    if ( szName == NULL || *szName == 0 )
+        szName = IPC_REGISTRY_NAME;
+
+    fd = shm_open( szName, O_RDWR | O_CREAT, 0600 );
+    if ( fd < 0 )
+        return NULL;
+
+    if ( fstat( fd, &st ) != 0 ||
+         ( st.st_size == 0 && ftruncate( fd, sizeof(IPC_REGISTRY) ) != 0 ) ||
+         ( st.st_size != 0 && st.st_size != (off_t) sizeof(IPC_REGISTRY) ) )
+    {
+        close( fd );
+        return NULL;
+    }
+
+    pView = mmap( NULL, sizeof(IPC_REGISTRY), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( pView == MAP_FAILED )
+        return NULL;
+
+    *phLock = &( (IPC_REGISTRY*) pView )->Lock;
+    return (IPC_REGISTRY*) pView;
+}
+
+#endif
+
+// Wakes a reader or writer asleep on the stream, and any selectors asleep on
+// it for reading or writing
+static void WakeReaders( IPC_STREAM* pIPC )
+{
+    SignalStreamEvent( pIPC->hWriteEvent );
+    if ( pIPC->pRing->ReadSelectors != 0 )
+        SignalSelectors( &pIPC->pRing->ReadSelectSequence );
+}
+
+static void WakeWriters( IPC_STREAM* pIPC )
+{
+    SignalStreamEvent( pIPC->hReadEvent );
+    if ( pIPC->pRing->WriteSelectors != 0 )
+        SignalSelectors( &pIPC->pRing->WriteSelectSequence );
+}
+
+static void CopyCached(
+    BYTE* pDest,
+    const BYTE* pSrc,
+    SIZE_T size )
+{
+    memcpy( pDest, pSrc, size );
+}
+
+#ifdef IPC_X86
+
+// Each streaming kernel copies the aligned middle of the destination with
+// non-temporal stores, four vectors at a time, and leaves the ragged ends to
+// memcpy. The fence orders the streaming stores before the cursor update that
+// publishes them.
+IPC_TARGET( "sse2" )
+static void CopyStreamingSse2(
+    BYTE* pDest,
+    const BYTE* pSrc,
+    SIZE_T size )
+{
+    SIZE_T head = ( 16 - ( (SIZE_T) pDest & 15 ) ) & 15;
+    __m128i a, b, c, d;
+
+    if ( size < head + 64 )
+    {
+        memcpy( pDest, pSrc, size );
+        return;
+    }
+
+    memcpy( pDest, pSrc, head );
+    pDest += head;
+    pSrc += head;
+    size -= head;
+
+    for ( ; size >= 64; size -= 64, pDest += 64, pSrc += 64 )
+    {
+        a = _mm_loadu_si128( (const __m128i*) pSrc );
+        b = _mm_loadu_si128( (const __m128i*) ( pSrc + 16 ) );
+        c = _mm_loadu_si128( (const __m128i*) ( pSrc + 32 ) );
+        d = _mm_loadu_si128( (const __m128i*) ( pSrc + 48 ) );
+        _mm_stream_si128( (__m128i*) pDest, a );
+        _mm_stream_si128( (__m128i*) ( pDest + 16 ), b );
+        _mm_stream_si128( (__m128i*) ( pDest + 32 ), c );
+        _mm_stream_si128( (__m128i*) ( pDest + 48 ), d );
+    }
+    _mm_sfence();
+
+    memcpy( pDest, pSrc, size );
+}
+
+IPC_TARGET( "avx2" )
+static void CopyStreamingAvx2(
+    BYTE* pDest,
+    const BYTE* pSrc,
+    SIZE_T size )
+{
+    SIZE_T head = ( 32 - ( (SIZE_T) pDest & 31 ) ) & 31;
+    __m256i a, b, c, d;
+
+    if ( size < head + 128 )
+    {
+        memcpy( pDest, pSrc, size );
+        return;
+    }
+
+    memcpy( pDest, pSrc, head );
+    pDest += head;
+    pSrc += head;
+    size -= head;
+
+    for ( ; size >= 128; size -= 128, pDest += 128, pSrc += 128 )
+    {
+        a = _mm256_loadu_si256( (const __m256i*) pSrc );
+        b = _mm256_loadu_si256( (const __m256i*) ( pSrc + 32 ) );
+        c = _mm256_loadu_si256( (const __m256i*) ( pSrc + 64 ) );
+        d = _mm256_loadu_si256( (const __m256i*) ( pSrc + 96 ) );
+        _mm256_stream_si256( (__m256i*) pDest, a );
+        _mm256_stream_si256( (__m256i*) ( pDest + 32 ), b );
+        _mm256_stream_si256( (__m256i*) ( pDest + 64 ), c );
+        _mm256_stream_si256( (__m256i*) ( pDest + 96 ), d );
+    }
+    _mm_sfence();
+
+    memcpy( pDest, pSrc, size );
+}
+
+#ifdef IPC_AVX512
+
+IPC_TARGET( "avx512f" )
+static void CopyStreamingAvx512(
+    BYTE* pDest,
+    const BYTE* pSrc,
+    SIZE_T size )
+{
+    SIZE_T head = ( 64 - ( (SIZE_T) pDest & 63 ) ) & 63;
+    __m512i a, b, c, d;
+
+    if ( size < head + 256 )
+    {
+        memcpy( pDest, pSrc, size );
+        return;
+    }
+
+    memcpy( pDest, pSrc, head );
+    pDest += head;
+    pSrc += head;
+    size -= head;
+
+    for ( ; size >= 256; size -= 256, pDest += 256, pSrc += 256 )
+    {
+        a = _mm512_loadu_si512( (const void*) pSrc );
+        b = _mm512_loadu_si512( (const void*) ( pSrc + 64 ) );
+        c = _mm512_loadu_si512( (const void*) ( pSrc + 128 ) );
+        d = _mm512_loadu_si512( (const void*) ( pSrc + 192 ) );
+        _mm512_stream_si512( (void*) pDest, a );
+        _mm512_stream_si512( (void*) ( pDest + 64 ), b );
+        _mm512_stream_si512( (void*) ( pDest + 128 ), c );
+        _mm512_stream_si512( (void*) ( pDest + 192 ), d );
+    }
+    _mm_sfence();
+
+    memcpy( pDest, pSrc, size );
+}
+
+#endif
+
+static void QueryCpuid(
+    int leaf,
+    int subleaf,
+    int regs[4] )
+{
+#ifdef _WIN32
+    __cpuidex( regs, leaf, subleaf );
+#else
+    unsigned int a, b, c, d;
+
+    __cpuid_count( leaf, subleaf, a, b, c, d );
+    regs[0] = (int) a;
+    regs[1] = (int) b;
+    regs[2] = (int) c;
+    regs[3] = (int) d;
+#endif
+}
+
+// Which register state the OS saves on a context switch
+static UINT64 QueryEnabledXState( void )
+{
+#ifdef _WIN32
+    return _xgetbv( 0 );
+#else
+    unsigned int lo, hi;
+
+    __asm__ __volatile__( "xgetbv" : "=a" ( lo ), "=d" ( hi ) : "c" ( 0 ) );
+    return ( (UINT64) hi << 32 ) | lo;
+#endif
+}
+
+#endif
+
+// The widest kernel this CPU, and the OS, can run
+static DWORD QueryBestCopyKernel( void )
+{
+    static DWORD dwBest;
+#ifdef IPC_X86
+    UINT64 xstate = 0;
+    int regs[4];
+    int maxLeaf;
+#endif
+
+    if ( dwBest != 0 )
+        return dwBest;
+
+#ifdef IPC_X86
+    QueryCpuid( 0, 0, regs );
+    maxLeaf = regs[0];
+
+    QueryCpuid( 1, 0, regs );
+    dwBest = ( regs[3] & ( 1 << 26 ) ) ? IPC_COPY_SSE2 : IPC_COPY_MEMCPY;
+    if ( regs[2] & ( 1 << 27 ) )
+        xstate = QueryEnabledXState();
+
+    if ( maxLeaf >= 7 )
+    {
+        QueryCpuid( 7, 0, regs );
+
+        // AVX needs the YMM state saved, and AVX-512 the mask and ZMM state too
+        if ( ( regs[1] & ( 1 << 5 ) ) && ( xstate & 0x6 ) == 0x6 )
+            dwBest = IPC_COPY_AVX2;
+#ifdef IPC_AVX512
+        if ( ( regs[1] & ( 1 << 16 ) ) && ( xstate & 0xE6 ) == 0xE6 )
+            dwBest = IPC_COPY_AVX512;
+#endif
+    }
+#else
+    dwBest = IPC_COPY_MEMCPY;
+#endif
+
+    return dwBest;
+}
+
+// Settles on the widest kernel up to the one asked for that we can run. Every
+// handle chooses for itself, since they needn't share a CPU.
+static void BindCopyKernel(
+    IPC_STREAM* pIPC,
+    DWORD dwKernel )
+{
+    DWORD dwBest = QueryBestCopyKernel();
+
+    pIPC->CopyKernel = ( dwKernel == IPC_COPY_AUTO ) ? dwBest : min( dwKernel, dwBest );
+    switch ( pIPC->CopyKernel )
+    {
+#ifdef IPC_X86
+    case IPC_COPY_SSE2:		pIPC->pfnStreamingCopy = CopyStreamingSse2; break;
+    case IPC_COPY_AVX2:		pIPC->pfnStreamingCopy = CopyStreamingAvx2; break;
+#endif
+#ifdef IPC_AVX512
+    case IPC_COPY_AVX512:	pIPC->pfnStreamingCopy = CopyStreamingAvx512; break;
+#endif
+    default:				pIPC->pfnStreamingCopy = CopyCached; break;
+    }
+}
+
+// How to copy a transfer of the given size. Small ones are about to be read,
+// so are better off in the cache.
+static IPC_COPY_ROUTINE SelectCopy(
+    IPC_STREAM* pIPC,
+    UINT64 transferSize )
+{
+    return transferSize >= pIPC->NonTemporalThreshold ? pIPC->pfnStreamingCopy : CopyCached;
+}
+
+// Populates our page tables for the whole ring, mirror included, so the first
+// transfers don't fault
+static void PrefaultStreamView( IPC_STREAM* pIPC )
+{
+    volatile BYTE* pPage;
+    BYTE* pStart = (BYTE*) pIPC->pRing + pIPC->BufferOffset;
+    BYTE* pEnd = (BYTE*) pIPC->pRing + pIPC->MappedFileSize;
+
+	IPC_TRY
+	{
+        for ( pPage = pStart; pPage < pEnd; pPage += pIPC->PageSize )
+            (void) *pPage;
+        if ( pIPC->pMirror )
+        {
+            for ( pPage = pIPC->pMirror; pPage < pIPC->pMirror + pIPC->RingBufferSize; pPage += pIPC->PageSize )
+                (void) *pPage;
+        }
+	}
+	IPC_EXCEPT
+	{
+	}
+}
+
+static IPC_REGISTRY* volatile g_pRegistry = NULL;
+static IPC_LOCK g_hRegistryLock;
+static volatile LONG g_RegistryMapped = 0;	// 1 while being mapped, 2 once tried
+
+// Mapped by the first call that needs it, and kept for the life of the
+// process. A registry some other build laid out differently isn't used.
+static IPC_REGISTRY* GetRegistry( void )
+{
+    IPC_REGISTRY* pRegistry;
+    LONG entrySize, entries;
+
+    if ( g_RegistryMapped != 2 )
+    {
+        if ( AtomicCompareExchange( &g_RegistryMapped, 1, 0 ) == 0 )
+        {
+            pRegistry = MapRegistry( &g_hRegistryLock );
+            if ( pRegistry != NULL )
+            {
+                entrySize = AtomicCompareExchange( &pRegistry->EntrySize, (LONG) sizeof(IPC_REGISTRY_ENTRY), 0 );
+                entries = AtomicCompareExchange( &pRegistry->Entries, IPC_REGISTRY_ENTRIES, 0 );
+                if ( ( entrySize != 0 && entrySize != (LONG) sizeof(IPC_REGISTRY_ENTRY) ) ||
+                     ( entries != 0 && entries != IPC_REGISTRY_ENTRIES ) )
+                    pRegistry = NULL;
+            }
+
+            g_pRegistry = pRegistry;
+            MemoryBarrier();
+            g_RegistryMapped = 2;
+        }
+
+        while ( g_RegistryMapped != 2 )
+            SwitchToThread();
+    }
+
+    MemoryBarrier();
+    return g_pRegistry;
+}
+
+static UINT HashStreamName(
+    LPCWSTR szName,
+	DWORD dwVersion )
+{
+    UINT hash = 2166136261u ^ dwVersion;
+
+    for ( ; *szName != 0; ++szName )
+    {
+        hash ^= (UINT) *szName;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// An entry's sequence is odd only while it is being rewritten, so an owner
+// that died part way through leaves it odd. It's closed rather than freed, so
+// that no probe stops short at it.
+static void RepairRegistry( IPC_REGISTRY* pRegistry )
+{
+    UINT i;
+
+    for ( i = 0; i < IPC_REGISTRY_ENTRIES; ++i )
+    {
+        if ( pRegistry->Table[i].Sequence & 1 )
+        {
+            pRegistry->Table[i].State = IPC_REGISTRY_CLOSED;
+            AtomicIncrement( &pRegistry->Table[i].Sequence );
+        }
+    }
+}
+
+// The registry outlives any one process, and one killed holding the lock
+// would leave every later create and close waiting on it for good. It's a
+// stream lock, which passes to a waiter when its owner dies, and whoever it
+// passes to tidies up after the dead owner.
+static void LockRegistry( IPC_REGISTRY* pRegistry )
+{
+    if ( AcquireStreamLock( g_hRegistryLock ) )
+        RepairRegistry( pRegistry );
+}
+
+static void UnlockRegistry( void )
+{
+    ReleaseStreamLock( g_hRegistryLock );
+}
+
+// Entries are rewritten in place, so a lookup copies one out and checks that
+// nobody was rewriting it meanwhile. One that stays mid-rewrite may have been
+// left so by a process that died, which taking the lock puts right.
+static void ReadRegistryEntry(
+    const IPC_REGISTRY_ENTRY* pEntry,
+    IPC_REGISTRY_ENTRY* pCopy )
+{
+    LONG sequence;
+    UINT spins;
+
+    do
+    {
+        for ( spins = 1; ( sequence = pEntry->Sequence ) & 1; ++spins )
+        {
+            YieldProcessor();
+            if ( spins % IPC_REGISTRY_REPAIR_SPINS == 0 )
+            {
+                LockRegistry( g_pRegistry );
+                UnlockRegistry();
+            }
+        }
+        MemoryBarrier();
+        memcpy( pCopy, (const void*) pEntry, sizeof(*pCopy) );
+        MemoryBarrier();
+    }
+    while ( pEntry->Sequence != sequence );
+
+    pCopy->Name[IPC_MAX_STREAM_NAME - 1] = 0;
+}
+
+static BOOL MatchesStreamName(
+    const IPC_REGISTRY_ENTRY* pEntry,
+    UINT hash,
+    LPCWSTR szName,
+	DWORD dwVersion )
+{
+    return pEntry->State == IPC_REGISTRY_OPEN && pEntry->Hash == hash &&
+           pEntry->dwVersion == dwVersion && wcscmp( pEntry->Name, szName ) == 0;
+}
+
+// Takes an entry out, unless it has been rewritten since it was last seen. A
+// slot with nothing ever placed past it goes back to never having been used,
+// and so do the closed ones before it, so that probes stay short.
+static void CloseRegistryEntry(
+    IPC_REGISTRY_ENTRY* pEntry,
+    LONG sequence )
+{
+    IPC_REGISTRY* pRegistry = g_pRegistry;
+    UINT slot = (UINT) ( pEntry - pRegistry->Table );
+
+    LockRegistry( pRegistry );
+    if ( pEntry->Sequence == sequence )
+    {
+        AtomicIncrement( &pEntry->Sequence );
+        pEntry->State = IPC_REGISTRY_CLOSED;
+        AtomicIncrement( &pEntry->Sequence );
+
+        while ( pRegistry->Table[slot].State == IPC_REGISTRY_CLOSED &&
+                pRegistry->Table[( slot + 1 ) & ( IPC_REGISTRY_ENTRIES - 1 )].State == IPC_REGISTRY_FREE )
+        {
+            AtomicIncrement( &pRegistry->Table[slot].Sequence );
+            pRegistry->Table[slot].State = IPC_REGISTRY_FREE;
+            AtomicIncrement( &pRegistry->Table[slot].Sequence );
+            slot = ( slot - 1 ) & ( IPC_REGISTRY_ENTRIES - 1 );
+        }
+    }
+    UnlockRegistry();
+}
+
+// Probes from the name's hash until it finds the name or a slot that has
+// never been used
+static IPC_REGISTRY_ENTRY* LookupStream(
+    LPCWSTR szName,
+	DWORD dwVersion,
+    IPC_REGISTRY_ENTRY* pCopy )
+{
+    IPC_REGISTRY* pRegistry = GetRegistry();
+    IPC_REGISTRY_ENTRY* pEntry;
+    UINT hash, i;
+
+    if ( pRegistry == NULL || wcslen( szName ) >= IPC_MAX_STREAM_NAME )
+        return NULL;
+
+    hash = HashStreamName( szName, dwVersion );
+    for ( i = 0; i < IPC_REGISTRY_ENTRIES; ++i )
+    {
+        pEntry = &pRegistry->Table[( hash + i ) & ( IPC_REGISTRY_ENTRIES - 1 )];
+        ReadRegistryEntry( pEntry, pCopy );
+        if ( pCopy->State == IPC_REGISTRY_FREE )
+            return NULL;
+        if ( MatchesStreamName( pCopy, hash, szName, dwVersion ) )
+            return pEntry;
+    }
+
+    return NULL;
+}
+
+// Lists a stream its creator has just finished setting up. An entry its name
+// was left listed under by a creator that never closed it is taken over,
+// since the name could only be created again once that stream was gone.
+static void RegisterStream(
+    IPC_STREAM* pIPC,
+    LPCWSTR szName,
+	DWORD dwVersion )
+{
+    IPC_REGISTRY* pRegistry = GetRegistry();
+    IPC_REGISTRY_ENTRY* pEntry;
+    IPC_REGISTRY_ENTRY* pFree = NULL;
+    SIZE_T len = wcslen( szName );
+    UINT hash, i;
+
+    if ( pRegistry == NULL )
+        return;
+    if ( len >= IPC_MAX_STREAM_NAME )
+    {
+        AtomicIncrement( &pRegistry->Overflow );
+        pIPC->bUnlisted = TRUE;
+        return;
+    }
+
+    hash = HashStreamName( szName, dwVersion );
+    LockRegistry( pRegistry );
+    for ( i = 0; i < IPC_REGISTRY_ENTRIES; ++i )
+    {
+        pEntry = &pRegistry->Table[( hash + i ) & ( IPC_REGISTRY_ENTRIES - 1 )];
+        if ( MatchesStreamName( pEntry, hash, szName, dwVersion ) )
+        {
+            pFree = pEntry;
+            break;
+        }
+        if ( pEntry->State != IPC_REGISTRY_OPEN && pFree == NULL )
+            pFree = pEntry;
+        if ( pEntry->State == IPC_REGISTRY_FREE )
+            break;
+    }
+
+    if ( pFree == NULL )
+    {
+        AtomicIncrement( &pRegistry->Overflow );
+        pIPC->bUnlisted = TRUE;
+    }
+    else
+    {
+        AtomicIncrement( &pFree->Sequence );
+        pFree->State = IPC_REGISTRY_OPEN;
+        pFree->Hash = hash;
+        pFree->dwVersion = dwVersion;
+        pFree->dwFlags = pIPC->dwFlags;
+        pFree->RingBufferSize = pIPC->RingBufferSize;
+        pFree->BufferOffset = pIPC->BufferOffset;
+        pFree->MappedFileSize = pIPC->MappedFileSize;
+        pFree->PageSize = pIPC->PageSize;
+        pFree->ProcessId = GetCurrentProcessId();
+        memcpy( pFree->Name, szName, ( len + 1 ) * sizeof(WCHAR) );
+        pIPC->EntrySequence = AtomicIncrement( &pFree->Sequence );
+        pIPC->pEntry = pFree;
+    }
+    UnlockRegistry();
+}
+
+static void UnregisterStream( IPC_STREAM* pIPC )
+{
+    if ( pIPC->bUnlisted )
+    {
+        AtomicDecrement( &g_pRegistry->Overflow );
+        pIPC->bUnlisted = FALSE;
+    }
+
+    if ( pIPC->pEntry != NULL )
+        CloseRegistryEntry( pIPC->pEntry, pIPC->EntrySequence );
+    pIPC->pEntry = NULL;
+}
+
+// A growable stream keeps its name so its later rings can be found
+static LPWSTR CopyStreamName( LPCWSTR szName )
+{
+    SIZE_T size = ( wcslen( szName ) + 1 ) * sizeof(WCHAR);
+    LPWSTR newStr = (LPWSTR) malloc( size );
+
+    if ( newStr != NULL )
+        memcpy( newStr, szName, size );
+    return newStr;
+}
+
+static UINT SegmentMappedSize( IPC_STREAM* pIPC )
+{
+    return sizeof(IPC_SEGMENT) + pIPC->RingBufferSize;
+}
+
+static BYTE* SegmentData( IPC_SEGMENT* pSegment )
+{
+    return (BYTE*) pSegment + sizeof(IPC_SEGMENT);
+}
+
+// Readers only map segments a writer has finished making
+static HRESULT MapSegment(
+    IPC_STREAM* pIPC,
+    UINT64 index,
+    BOOL bWrite,
+    IPC_SEGMENT** ppSegment )
+{
+    LPWSTR szPath = CreateSegmentPath( pIPC->JournalPrefix, index );
+    IPC_SEGMENT* pSegment;
+    HRESULT hr;
+
+    if ( szPath == NULL )
+        return E_OUTOFMEMORY;
+
+    hr = MapSegmentFile( szPath, SegmentMappedSize( pIPC ), bWrite, (void**) &pSegment );
+    free( szPath );
+    if ( FAILED( hr ) )
+        return hr;
+
+    if ( !bWrite &&
+         ( pSegment->dwVersion != IPCLIB_VERSION || pSegment->HeaderSize != sizeof(IPC_SEGMENT) ||
+           pSegment->SegmentSize != pIPC->RingBufferSize ) )
+    {
+        UnmapSegmentFile( pSegment, SegmentMappedSize( pIPC ) );
+        return HRESULT_FROM_WIN32( ERROR_INVALID_DATA );
+    }
+
+    *ppSegment = pSegment;
+    return S_OK;
+}
+
+static void UnmapSegment(
+    IPC_STREAM* pIPC,
+    IPC_SEGMENT* pSegment )
+{
+    if ( pSegment != NULL )
+        UnmapSegmentFile( pSegment, SegmentMappedSize( pIPC ) );
+}
+
+static void DeleteSegment(
+    LPCWSTR szPrefix,
+    UINT64 index )
+{
+    LPWSTR szPath = CreateSegmentPath( szPrefix, index );
+
+    if ( szPath != NULL )
+    {
+        DeleteSegmentFile( szPath );
+        free( szPath );
+    }
+}
+
+static void InitSegment(
+    IPC_SEGMENT* pSegment,
+    UINT segmentSize,
+    UINT64 baseCursor,
+    UINT64 baseSequence )
+{
+    pSegment->HeaderSize = sizeof(IPC_SEGMENT);
+    pSegment->SegmentSize = segmentSize;
+    pSegment->Sealed = 0;
+    pSegment->BaseCursor = baseCursor;
+    pSegment->BaseSequence = baseSequence;
+    pSegment->EndCursor = baseCursor;
+    pSegment->EndSequence = baseSequence;
+    MemoryBarrier();
+    pSegment->dwVersion = IPCLIB_VERSION;
+}
+
+// Deletes the oldest segments beyond what the journal retains. The tail moves
+// first so that nobody goes looking for one that is about to go; readers that
+// already have it mapped carry on reading it.
+static void TrimJournal( IPC_STREAM* pIPC )
+{
+    IPC_RING* pRing = pIPC->pRing;
+    UINT64 tail = pRing->TailSegment;
+
+    if ( pIPC->JournalSegments == 0 )
+        return;
+
+    while ( pRing->HeadSegment - tail >= pIPC->JournalSegments )
+    {
+        pRing->TailSegment = ++tail;
+        DeleteSegment( pIPC->JournalPrefix, tail - 1 );
+    }
+}
+
+// Carries on from the end of whatever journal is on disk, or starts a new one.
+// A writer that died making a segment leaves it blank, and only the newest
+// one can be like that.
+static HRESULT RecoverJournal( IPC_STREAM* pIPC )
+{
+    IPC_SEGMENT* pSegment;
+    UINT64 first, last;
+    HRESULT hr;
+
+    if ( !FindSegmentFiles( pIPC->JournalPrefix, &first, &last ) )
+        first = last = 0;
+
+    hr = MapSegment( pIPC, last, TRUE, &pSegment );
+    while ( SUCCEEDED( hr ) && pSegment->dwVersion == 0 && last > first )
+    {
+        UnmapSegment( pIPC, pSegment );
+        DeleteSegment( pIPC->JournalPrefix, last-- );
+        hr = MapSegment( pIPC, last, TRUE, &pSegment );
+    }
+    if ( FAILED( hr ) )
+        return hr;
+
+    if ( pSegment->dwVersion == 0 )
+        InitSegment( pSegment, pIPC->RingBufferSize, 0, 0 );
+    if ( pSegment->dwVersion != IPCLIB_VERSION || pSegment->HeaderSize != sizeof(IPC_SEGMENT) ||
+         pSegment->SegmentSize != pIPC->RingBufferSize )
+    {
+        UnmapSegment( pIPC, pSegment );
+        return HRESULT_FROM_WIN32( ERROR_INVALID_DATA );
+    }
+
+    // A segment sealed just before a crash has no successor yet
+    pSegment->Sealed = 0;
+    pIPC->pRing->HeadSegment = last;
+    pIPC->pRing->TailSegment = first;
+    pIPC->pRing->WriteCursor = pSegment->EndCursor;
+    pIPC->pRing->WriteSequence = pSegment->EndSequence;
+    pIPC->pWriteSegment = pSegment;
+    pIPC->WriteSegment = last;
+
+    TrimJournal( pIPC );
+    return S_OK;
+}
+
+// Moves a reader to a position, clamped to what the journal still holds. Each
+// segment carries on from the last, so the one holding it can be found by a
+// binary search of their headers. If retention deletes one from under the
+// search, it starts again.
+static HRESULT SeekJournal(
+    IPC_STREAM* pIPC,
+    UINT64 position )
+{
+    IPC_SEGMENT* pSegment;
+    UINT64 tail, low, high, mid;
+    UINT64 cursor, endCursor, sequence;
+    UINT size;
+    HRESULT hr;
+
+    for ( ;; )
+    {
+        tail = pIPC->pRing->TailSegment;
+        low = tail;
+        high = pIPC->pRing->HeadSegment;
+        hr = S_OK;
+        while ( low < high && SUCCEEDED( hr ) )
+        {
+            mid = low + ( high - low + 1 ) / 2;
+            hr = MapSegment( pIPC, mid, FALSE, &pSegment );
+            if ( SUCCEEDED( hr ) )
+            {
+                if ( pSegment->BaseCursor <= position )
+                    low = mid;
+                else
+                    high = mid - 1;
+                UnmapSegment( pIPC, pSegment );
+            }
+        }
+        if ( SUCCEEDED( hr ) )
+            hr = MapSegment( pIPC, low, FALSE, &pSegment );
+        if ( SUCCEEDED( hr ) )
+            break;
+        if ( pIPC->pRing->TailSegment == tail )
+            return hr;
+    }
+
+    endCursor = pSegment->EndCursor;
+    cursor = min( max( position, pSegment->BaseCursor ), endCursor );
+    sequence = pSegment->BaseSequence;
+
+    // Messages can only be read from the start of one, so count our way there
+    if ( pIPC->dwFlags & IPC_STREAM_MESSAGES )
+    {
+        UINT64 walk = pSegment->BaseCursor;
+
+        while ( walk < cursor )
+        {
+            memcpy( &size, SegmentData( pSegment ) + ( walk - pSegment->BaseCursor ), sizeof(size) );
+            walk += sizeof(size) + size;
+            ++sequence;
+        }
+        if ( walk != cursor )
+        {
+            UnmapSegment( pIPC, pSegment );
+            return E_INVALIDARG;
+        }
+    }
+
+    UnmapSegment( pIPC, pIPC->pReadSegment );
+    pIPC->pReadSegment = pSegment;
+    pIPC->ReadSegment = low;
+    pIPC->JournalCursor = cursor;
+    pIPC->JournalSequence = sequence;
+    return S_OK;
+}
+
+// Takes the journal's path from the stream, and starts a reader at the live end
+static HRESULT OpenJournal( IPC_STREAM* pIPC )
+{
+    const WCHAR* szPrefix = (const WCHAR*) ( (BYTE*) pIPC->pRing + IPC_JOURNAL_PREFIX_OFFSET );
+    SIZE_T len = 0;
+
+    if ( pIPC->BufferOffset < IPC_JOURNAL_PREFIX_OFFSET + IPC_MAX_JOURNAL_PATH * sizeof(WCHAR) )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_DATA );
+    while ( len < IPC_MAX_JOURNAL_PATH && szPrefix[len] != 0 )
+        ++len;
+    if ( len == IPC_MAX_JOURNAL_PATH )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_DATA );
+
+    pIPC->JournalPrefix = CopyStreamName( szPrefix );
+    if ( pIPC->JournalPrefix == NULL )
+        return E_OUTOFMEMORY;
+
+    if ( pIPC->dwAccess & IPC_ACCESS_READ )
+        return SeekJournal( pIPC, IPC_JOURNAL_END );
+    return S_OK;
+}
+
+// Everything in an arena before its blocks
+static UINT64 GetArenaHeaderSize( UINT blocks )
+{
+    return ( sizeof(IPC_ARENA) + (UINT64) blocks * sizeof(IPC_ARENA_BLOCK) + IPC_CACHE_LINE - 1 ) /
+        IPC_CACHE_LINE * IPC_CACHE_LINE;
+}
+
+// Points the handle at the stream's arena, if it has one
+static HRESULT BindArena( IPC_STREAM* pIPC )
+{
+    IPC_RING* pRing = pIPC->pRing;
+    UINT64 arenaEnd;
+
+    if ( !( pIPC->dwFlags & IPC_STREAM_ARENA ) )
+        return S_OK;
+
+    arenaEnd = pRing->ArenaOffset + GetArenaHeaderSize( pRing->ArenaBlocks ) +
+        (UINT64) pRing->ArenaBlockSize * pRing->ArenaBlocks;
+    if ( pRing->ArenaOffset < IPC_READER_SLOTS_OFFSET || pRing->ArenaBlockSize == 0 ||
+         pRing->ArenaBlocks == 0 || arenaEnd > pIPC->BufferOffset )
+        return E_INVALIDARG;
+
+    pIPC->ArenaBlockSize = pRing->ArenaBlockSize;
+    pIPC->ArenaBlocks = pRing->ArenaBlocks;
+    pIPC->pArena = (IPC_ARENA*) ( (BYTE*) pRing + pRing->ArenaOffset );
+    pIPC->pArenaBlocks = (IPC_ARENA_BLOCK*) ( pIPC->pArena + 1 );
+    pIPC->pArenaData = (BYTE*) pIPC->pArena + GetArenaHeaderSize( pIPC->ArenaBlocks );
+    return S_OK;
+}
+
+// Stacks every block on the free list, the first on top
+static void InitArena( IPC_STREAM* pIPC )
+{
+    UINT i;
+
+    for ( i = 0; i < pIPC->ArenaBlocks; ++i )
+    {
+        pIPC->pArenaBlocks[i].RefCount = 0;
+        pIPC->pArenaBlocks[i].Next = i + 1 < pIPC->ArenaBlocks ? i + 2 : 0;
+    }
+    pIPC->pArena->FreeList = 1;
+}
+
+HRESULT CreateInterprocessStream(
+    LPCWSTR szName,
+	DWORD dwVersion,
+    UINT uRingBufferSize,
+    IPC_STREAM** ppIPC )
+{
+	IPC_STREAM_DESC desc;
+
+    ZeroMemory( &desc, sizeof(desc) );
+    desc.RingBufferSize = uRingBufferSize;
+
+    return CreateInterprocessStreamEx( szName, dwVersion, &desc, ppIPC );
+}
+
+HRESULT CreateInterprocessStreamEx(
+    LPCWSTR szName,
+	DWORD dwVersion,
+    const IPC_STREAM_DESC* pDesc,
+    IPC_STREAM** ppIPC )
+{
+	IPC_STREAM* pIPC;
+	UINT uRingBufferSize;
+	UINT uBufferOffset;
+	UINT uIOGranularity;
+	UINT uLargePageSize = 0;
+	UINT uMaxReaders = 0;
+	UINT uMaxWriters = 0;
+	UINT uLanes = 0;
+	UINT uArenaOffset = 0;
+	UINT uArenaBlockSize = 0;
+	UINT uArenaBlocks = 0;
+    HRESULT hr;
+
+    if ( ppIPC == NULL || pDesc == NULL ) 
+        return E_INVALIDARG;
+    if ( pDesc->RingBufferSize == 0 )
+        return E_INVALIDARG;
+    if ( pDesc->dwFlags & ~( IPC_STREAM_MULTI_PRODUCER | IPC_STREAM_MIRRORED | IPC_STREAM_MESSAGES |
+                             IPC_STREAM_ADAPTIVE_GRANULARITY | IPC_STREAM_LARGE_PAGES | IPC_STREAM_PREFAULT |
+                             IPC_STREAM_BROADCAST | IPC_STREAM_OVERWRITE | IPC_STREAM_SHARDED |
+                             IPC_STREAM_GROWABLE | IPC_STREAM_JOURNAL | IPC_STREAM_PRIORITY |
+                             IPC_STREAM_ARENA ) )
+        return E_INVALIDARG;
+    // Shards are only ever drained a whole message at a time, and have exactly
+    // one producer and one consumer each
+    if ( ( pDesc->dwFlags & IPC_STREAM_SHARDED ) &&
+         ( !( pDesc->dwFlags & IPC_STREAM_MESSAGES ) ||
+           ( pDesc->dwFlags & ( IPC_STREAM_MULTI_PRODUCER | IPC_STREAM_MIRRORED |
+                                IPC_STREAM_BROADCAST | IPC_STREAM_OVERWRITE ) ) ) )
+        return E_INVALIDARG;
+    // Lanes are laid out as shards are, and read a whole message at a time for
+    // the same reason
+    if ( ( pDesc->dwFlags & IPC_STREAM_PRIORITY ) &&
+         ( !( pDesc->dwFlags & IPC_STREAM_MESSAGES ) ||
+           ( pDesc->dwFlags & ( IPC_STREAM_MULTI_PRODUCER | IPC_STREAM_MIRRORED | IPC_STREAM_BROADCAST |
+                                IPC_STREAM_OVERWRITE | IPC_STREAM_SHARDED | IPC_STREAM_GROWABLE |
+                                IPC_STREAM_JOURNAL ) ) ) )
+        return E_INVALIDARG;
+    if ( !( pDesc->dwFlags & IPC_STREAM_PRIORITY ) && pDesc->Lanes != 0 )
+        return E_INVALIDARG;
+    // A block only goes back to the pool once its reference is read, which an
+    // overwritten one may never be, and the arena lives in the first ring's
+    // mapping only. A journal's references would outlive the arena.
+    if ( ( pDesc->dwFlags & IPC_STREAM_ARENA ) &&
+         ( pDesc->dwFlags & ( IPC_STREAM_OVERWRITE | IPC_STREAM_GROWABLE | IPC_STREAM_JOURNAL ) ) )
+        return E_INVALIDARG;
+    if ( !( pDesc->dwFlags & IPC_STREAM_ARENA ) && ( pDesc->ArenaBlockSize != 0 || pDesc->ArenaBlocks != 0 ) )
+        return E_INVALIDARG;
+    // Overwritten data has to be checked after it is copied, so it can't be
+    // handed out in place or written by several producers at once
+    if ( ( pDesc->dwFlags & IPC_STREAM_OVERWRITE ) &&
+         ( pDesc->dwFlags & ( IPC_STREAM_MULTI_PRODUCER | IPC_STREAM_MIRRORED ) ) )
+        return E_INVALIDARG;
+    // A ring is only retired under the write lock, which multi-producer and
+    // sharded writers don't take, and only one read cursor can follow it
+    if ( ( pDesc->dwFlags & IPC_STREAM_GROWABLE ) &&
+         ( pDesc->dwFlags & ( IPC_STREAM_MULTI_PRODUCER | IPC_STREAM_BROADCAST |
+                              IPC_STREAM_OVERWRITE | IPC_STREAM_SHARDED ) ) )
+        return E_INVALIDARG;
+    if ( !( pDesc->dwFlags & IPC_STREAM_GROWABLE ) && ( pDesc->MaxRingBufferSize != 0 || pDesc->GrowMicroseconds != 0 ) )
+        return E_INVALIDARG;
+    // Every journal write lands whole in one segment under the write lock, and
+    // each reader keeps its own position in the files
+    if ( ( pDesc->dwFlags & IPC_STREAM_JOURNAL ) &&
+         ( pDesc->dwFlags & ( IPC_STREAM_MULTI_PRODUCER | IPC_STREAM_MIRRORED | IPC_STREAM_LARGE_PAGES |
+                              IPC_STREAM_BROADCAST | IPC_STREAM_OVERWRITE | IPC_STREAM_SHARDED |
+                              IPC_STREAM_GROWABLE ) ) )
+        return E_INVALIDARG;
+    if ( ( pDesc->dwFlags & IPC_STREAM_JOURNAL ) ?
+         ( pDesc->JournalDirectory == NULL || *pDesc->JournalDirectory == 0 ) :
+         ( pDesc->JournalDirectory != NULL || pDesc->JournalSegments != 0 ) )
+        return E_INVALIDARG;
+    if ( pDesc->MaxReaders > IPC_MAX_READERS || pDesc->MaxWriters > IPC_MAX_WRITERS ||
+         pDesc->Lanes > IPC_MAX_LANES )
+        return E_INVALIDARG;
+    if ( pDesc->WaitStrategy > IPC_WAIT_BLOCK )
+        return E_INVALIDARG;
+    if ( pDesc->NumaPolicy > IPC_NUMA_INTERLEAVE || pDesc->NumaNode > IPC_MAX_NUMA_NODE )
+        return E_INVALIDARG;
+    if ( pDesc->CopyKernel > IPC_COPY_AVX512 )
+        return E_INVALIDARG;
+    if ( szName == NULL || *szName == 0 )
+        return E_INVALIDARG;
+	if ( dwVersion != IPCLIB_VERSION )
+		return E_INVALIDARG;
+
+    uIOGranularity = pDesc->IOGranularity ? pDesc->IOGranularity : IPC_IO_GRANULARITY;
+
+	// Make sure we can do at least two writes to the buffer
+	uRingBufferSize = max( pDesc->RingBufferSize, uIOGranularity * 2 );
+    if ( pDesc->dwFlags & IPC_STREAM_BROADCAST )
+        uMaxReaders = pDesc->MaxReaders ? pDesc->MaxReaders : IPC_DEFAULT_MAX_READERS;
+    if ( pDesc->dwFlags & IPC_STREAM_SHARDED )
+        uMaxWriters = pDesc->MaxWriters ? pDesc->MaxWriters : IPC_DEFAULT_MAX_WRITERS;
+    if ( pDesc->dwFlags & IPC_STREAM_PRIORITY )
+        uLanes = pDesc->Lanes ? pDesc->Lanes : IPC_DEFAULT_LANES;
+    uBufferOffset = IPC_READER_SLOTS_OFFSET + uMaxReaders * sizeof(IPC_READER_SLOT) +
+        ( uMaxWriters + uLanes ) * sizeof(IPC_SHARD);
+    if ( pDesc->dwFlags & IPC_STREAM_ARENA )
+    {
+        UINT64 blockSize = pDesc->ArenaBlockSize ? pDesc->ArenaBlockSize : IPC_DEFAULT_ARENA_BLOCK_SIZE;
+        UINT64 arenaEnd;
+
+        // Blocks start on a line of their own
+        blockSize = ( blockSize + IPC_CACHE_LINE - 1 ) / IPC_CACHE_LINE * IPC_CACHE_LINE;
+        uArenaBlocks = pDesc->ArenaBlocks ? pDesc->ArenaBlocks : IPC_DEFAULT_ARENA_BLOCKS;
+        arenaEnd = uBufferOffset + GetArenaHeaderSize( uArenaBlocks ) + blockSize * uArenaBlocks;
+        if ( arenaEnd > 0xFFFFFFFF )
+            return E_INVALIDARG;
+
+        uArenaOffset = uBufferOffset;
+        uArenaBlockSize = (UINT) blockSize;
+        uBufferOffset = (UINT) arenaEnd;
+    }
+    if ( pDesc->dwFlags & IPC_STREAM_JOURNAL )
+        uBufferOffset = IPC_JOURNAL_PREFIX_OFFSET + IPC_MAX_JOURNAL_PATH * sizeof(WCHAR);
+
+    // The mirror can only be mapped at whole allocation units of the segment
+    if ( pDesc->dwFlags & IPC_STREAM_MIRRORED )
+    {
+        UINT granularity = GetMappingGranularity();
+        uRingBufferSize = ( uRingBufferSize + granularity - 1 ) / granularity * granularity;
+        uBufferOffset = ( uBufferOffset + granularity - 1 ) / granularity * granularity;
+    }
+
+    // Large-page segments come in whole large pages, and so does the mirror.
+    // Rounding up here is harmless if we have to fall back to normal pages.
+    if ( pDesc->dwFlags & IPC_STREAM_LARGE_PAGES )
+        uLargePageSize = GetLargePageSize();
+    if ( uLargePageSize != 0 )
+    {
+        // Shards and lanes get whole pages of their own too
+        if ( pDesc->dwFlags & ( IPC_STREAM_MIRRORED | IPC_STREAM_SHARDED | IPC_STREAM_PRIORITY ) )
+        {
+            uRingBufferSize = ( uRingBufferSize + uLargePageSize - 1 ) / uLargePageSize * uLargePageSize;
+            uBufferOffset = ( uBufferOffset + uLargePageSize - 1 ) / uLargePageSize * uLargePageSize;
+        }
+        else
+        {
+            uRingBufferSize = ( uBufferOffset + uRingBufferSize + uLargePageSize - 1 ) /
+                uLargePageSize * uLargePageSize - uBufferOffset;
+        }
+    }
+
+    if ( (UINT64) uBufferOffset + (UINT64) uRingBufferSize * max( uMaxWriters + uLanes, 1 ) > 0xFFFFFFFF )
+        return E_INVALIDARG;
+    if ( (UINT64) sizeof(IPC_SEGMENT) + uRingBufferSize > 0xFFFFFFFF )
+        return E_INVALIDARG;
+
+    pIPC = (IPC_STREAM*) malloc( sizeof(IPC_STREAM) );
+    if ( pIPC == NULL )
+        return E_OUTOFMEMORY;
+    ZeroMemory( pIPC, sizeof(*pIPC) );
+
+    hr = CreateStreamNames( pIPC, szName, dwVersion );
+    if ( FAILED( hr ) )
+    {
+        CloseInterprocessStream( pIPC );
+        return hr;
+    }
+    pIPC->MaxReaders = uMaxReaders;
+    pIPC->MaxWriters = uMaxWriters;
+    pIPC->Lanes = uLanes;
+
+    // A journal's data lives in its segment files rather than the mapping
+    pIPC->MappedFileSize = uBufferOffset;
+    if ( !( pDesc->dwFlags & IPC_STREAM_JOURNAL ) )
+        pIPC->MappedFileSize += uRingBufferSize * CountSubRings( pIPC );
+    pIPC->BufferOffset = uBufferOffset;
+    pIPC->RingBufferSize = uRingBufferSize;
+    pIPC->dwFlags = pDesc->dwFlags;
+    pIPC->WaitStrategy = pDesc->WaitStrategy;
+    pIPC->SpinMicroseconds = pDesc->SpinMicroseconds ? pDesc->SpinMicroseconds : IPC_SPIN_MICROSECONDS;
+    pIPC->PageSize = uLargePageSize;
+    pIPC->NumaPolicy = pDesc->NumaPolicy;
+    pIPC->NumaNode = pDesc->NumaPolicy == IPC_NUMA_BIND ? pDesc->NumaNode : 0;
+    pIPC->NonTemporalThreshold = pDesc->NonTemporalThreshold ? pDesc->NonTemporalThreshold : IPC_NON_TEMPORAL_THRESHOLD;
+    BindCopyKernel( pIPC, pDesc->CopyKernel );
+    if ( pDesc->dwFlags & IPC_STREAM_GROWABLE )
+    {
+        pIPC->MaxRingBufferSize = pDesc->MaxRingBufferSize;
+        pIPC->GrowMicroseconds = pDesc->GrowMicroseconds ? pDesc->GrowMicroseconds : IPC_GROW_MICROSECONDS;
+        pIPC->StreamName = CopyStreamName( szName );
+        if ( pIPC->StreamName == NULL )
+        {
+            CloseInterprocessStream( pIPC );
+            return E_OUTOFMEMORY;
+        }
+    }
+    if ( pDesc->dwFlags & IPC_STREAM_JOURNAL )
+    {
+        pIPC->JournalSegments = pDesc->JournalSegments;
+        pIPC->JournalPrefix = CreateJournalPrefix( pDesc->JournalDirectory, szName );
+        if ( pIPC->JournalPrefix == NULL || wcslen( pIPC->JournalPrefix ) >= IPC_MAX_JOURNAL_PATH )
+        {
+            hr = pIPC->JournalPrefix == NULL ? E_OUTOFMEMORY : E_INVALIDARG;
+            CloseInterprocessStream( pIPC );
+            return hr;
+        }
+    }
+
+    // Works out what we actually got for the page size and NUMA placement
+    hr = CreateStreamObjects( pIPC );
+    if ( FAILED( hr ) )
+    {
+        CloseInterprocessStream( pIPC );
+        return hr;
+    }
+
+	IPC_TRY
+	{
+		// New segments are zero-filled, so only touch the ring, or the arena's
+		// blocks, if asked to. Writing it places the pages according to the
+		// NUMA policy.
+		ZeroMemory( pIPC->pRing, ( pDesc->dwFlags & IPC_STREAM_PREFAULT ) ? pIPC->MappedFileSize :
+			uArenaOffset != 0 ? uArenaOffset + sizeof(IPC_ARENA) : uBufferOffset );
+		pIPC->pRing->RingBufferSize = uRingBufferSize;
+		pIPC->pRing->dwVersion = dwVersion;
+		pIPC->pRing->HeaderSize = sizeof(IPC_RING);
+		pIPC->pRing->dwFlags = pDesc->dwFlags;
+		pIPC->pRing->BufferOffset = uBufferOffset;
+		pIPC->pRing->IOGranularity = uIOGranularity;
+		pIPC->pRing->WaitStrategy = pIPC->WaitStrategy;
+		pIPC->pRing->SpinMicroseconds = pIPC->SpinMicroseconds;
+		pIPC->pRing->PageSize = pIPC->PageSize;
+		pIPC->pRing->NumaPolicy = pIPC->NumaPolicy;
+		pIPC->pRing->NumaNode = pIPC->NumaNode;
+		pIPC->pRing->MaxReaders = uMaxReaders;
+		pIPC->pRing->MaxWriters = uMaxWriters;
+		pIPC->pRing->MaxRingBufferSize = pIPC->MaxRingBufferSize;
+		pIPC->pRing->GrowMicroseconds = pIPC->GrowMicroseconds;
+		pIPC->pRing->JournalSegments = pIPC->JournalSegments;
+		pIPC->pRing->CopyKernel = pDesc->CopyKernel;
+		pIPC->pRing->NonTemporalThreshold = pIPC->NonTemporalThreshold;
+		pIPC->pRing->Lanes = uLanes;
+		pIPC->pRing->ArenaOffset = uArenaOffset;
+		pIPC->pRing->ArenaBlockSize = uArenaBlockSize;
+		pIPC->pRing->ArenaBlocks = uArenaBlocks;
+		pIPC->pRing->ProcessId = GetCurrentProcessId();
+		if ( SUCCEEDED( BindArena( pIPC ) ) && pIPC->pArena != NULL )
+			InitArena( pIPC );
+		if ( pIPC->JournalPrefix != NULL )
+			memcpy( (BYTE*) pIPC->pRing + IPC_JOURNAL_PREFIX_OFFSET, pIPC->JournalPrefix,
+				( wcslen( pIPC->JournalPrefix ) + 1 ) * sizeof(WCHAR) );
+	}
+	IPC_EXCEPT
+	{
+        CloseInterprocessStream( pIPC );
+		return E_FAIL;
+	}
+
+    pIPC->pBuffer = ( (BYTE*) pIPC->pRing ) + uBufferOffset;
+    pIPC->pReadCursor = &pIPC->pRing->ReadCursor;
+    pIPC->pReadSequence = &pIPC->pRing->ReadSequence;
+    pIPC->pWriteCursor = &pIPC->pRing->WriteCursor;
+    pIPC->IOGranularity = uIOGranularity;
+    pIPC->bIsServer = TRUE;
+
+    if ( pIPC->dwFlags & IPC_STREAM_JOURNAL )
+    {
+        hr = RecoverJournal( pIPC );
+        if ( SUCCEEDED( hr ) )
+            hr = SeekJournal( pIPC, IPC_JOURNAL_END );
+        if ( FAILED( hr ) )
+        {
+            CloseInterprocessStream( pIPC );
+            return hr;
+        }
+    }
+
+    // A broadcast or growable stream's creator is its writer and holds no
+    // reader slot, and a sharded or priority stream's is its reader and holds
+    // no shard
+    if ( pIPC->dwFlags & ( IPC_STREAM_BROADCAST | IPC_STREAM_GROWABLE ) )
+        pIPC->dwAccess = IPC_ACCESS_WRITE;
+    else if ( pIPC->dwFlags & ( IPC_STREAM_SHARDED | IPC_STREAM_PRIORITY ) )
+        pIPC->dwAccess = IPC_ACCESS_READ;
+    else
+        pIPC->dwAccess = IPC_ACCESS_READ | IPC_ACCESS_WRITE;
+
+    if ( pIPC->dwFlags & IPC_STREAM_PREFAULT )
+        PrefaultStreamView( pIPC );
+
+    RegisterStream( pIPC, szName, dwVersion );
+
+    *ppIPC = pIPC;
+    return S_OK;
+}
+
+typedef struct _IPC_SPIN
+{
+    UINT64  Deadline;	// Clock reading at which the budget runs out
+    UINT    Count;		// Polls so far
+} IPC_SPIN;
+
+static void BeginSpin( IPC_SPIN* pSpin )
+{
+    pSpin->Deadline = 0;
+    pSpin->Count = 0;
+}
+
+// Waits a little between polls of a cursor, as the wait strategy dictates.
+// Returns FALSE once the spin budget is spent and the caller should sleep on
+// the stream event instead. The clock is only started on the first miss so
+// that uncontended calls never read it.
+static BOOL SpinWait(
+    DWORD waitStrategy,
+    UINT spinMicroseconds,
+    IPC_SPIN* pSpin )
+{
+    UINT pause;
+
+    if ( waitStrategy == IPC_WAIT_BLOCK )
+        return FALSE;
+
+    if ( spinMicroseconds != IPC_SPIN_FOREVER )
+    {
+        if ( pSpin->Count == 0 )
+        {
+            pSpin->Deadline = QueryClockMicroseconds() + spinMicroseconds;
+        }
+        else if ( ( waitStrategy != IPC_WAIT_SPIN || pSpin->Count % IPC_SPIN_CLOCK_INTERVAL == 0 ) &&
+                  QueryClockMicroseconds() >= pSpin->Deadline )
+        {
+            return FALSE;
+        }
+    }
+
+    switch ( waitStrategy )
+    {
+    case IPC_WAIT_SPIN:
+        YieldProcessor();
+        break;
+
+    case IPC_WAIT_BACKOFF:
+        // Double the pause each time, then keep yielding at the cap
+        if ( pSpin->Count >= IPC_BACKOFF_LIMIT )
+            SwitchToThread();
+        for ( pause = 1u << min( pSpin->Count, IPC_BACKOFF_LIMIT ); pause > 0; --pause )
+            YieldProcessor();
+        break;
+
+    default:
+        SwitchToThread(); // Give up our quantum
+        break;
+    }
+
+    ++pSpin->Count;
+    return TRUE;
+}
+
+static BOOL SpinOnce(
+    IPC_STREAM* pIPC,
+    IPC_SPIN* pSpin )
+{
+    return SpinWait( pIPC->WaitStrategy, pIPC->SpinMicroseconds, pSpin );
+}
+
+// Held while a broadcast block is counted out to the readers and its reference
+// written, which can wait on the slowest of them, so waiters poll for it
+static void AcquireArenaLock( IPC_STREAM* pIPC )
+{
+    IPC_SPIN spin;
+
+    BeginSpin( &spin );
+    while ( AtomicCompareExchange( &pIPC->pArena->ReaderLock, 1, 0 ) != 0 )
+    {
+        if ( !SpinOnce( pIPC, &spin ) )
+            Sleep( IPC_EVENT_POLL_MS );
+    }
+}
+
+static void ReleaseArenaLock( IPC_STREAM* pIPC )
+{
+    MemoryBarrier();
+    pIPC->pArena->ReaderLock = 0;
+}
+
+// Claims a free reader slot, starting the reader at the current write cursor.
+// A writer scanning the table mid-claim sees at worst a stale cursor from the
+// slot's last occupant, which only makes it more cautious.
+static HRESULT RegisterReader( IPC_STREAM* pIPC )
+{
+    IPC_READER_SLOT* pSlots = (IPC_READER_SLOT*) ( (BYTE*) pIPC->pRing + IPC_READER_SLOTS_OFFSET );
+    HRESULT hr = HRESULT_FROM_WIN32( ERROR_TOO_MANY_OPEN_FILES );
+    UINT i;
+
+    // A block being sent is counted out to exactly the readers there are
+    if ( pIPC->pArena != NULL )
+        AcquireArenaLock( pIPC );
+
+    for ( i = 0; i < pIPC->MaxReaders; ++i )
+    {
+        if ( pSlots[i].InUse == 0 && AtomicCompareExchange( &pSlots[i].InUse, 1, 0 ) == 0 )
+        {
+            // The cursor and record count must agree, so keep the writer still
+            if ( pIPC->dwFlags & IPC_STREAM_OVERWRITE )
+                AcquireStreamLock( pIPC->hWriteLock );
+            pSlots[i].ReadCursor = pIPC->pRing->WriteCursor;
+            pSlots[i].ReadSequence = pIPC->pRing->WriteSequence;
+            if ( pIPC->dwFlags & IPC_STREAM_OVERWRITE )
+                ReleaseStreamLock( pIPC->hWriteLock );
+
+            pIPC->pSlot = &pSlots[i];
+            pIPC->pReadCursor = &pSlots[i].ReadCursor;
+            pIPC->pReadSequence = &pSlots[i].ReadSequence;
+
+            // In case a writer saw the stale cursor and went to sleep on it
+            MemoryBarrier();
+            WakeWriters( pIPC );
+            hr = S_OK;
+            break;
+        }
+    }
+
+    if ( pIPC->pArena != NULL )
+        ReleaseArenaLock( pIPC );
+    return hr;
+}
+
+static IPC_SHARD* GetShards( IPC_STREAM* pIPC )
+{
+    return (IPC_SHARD*) ( (BYTE*) pIPC->pRing + IPC_SHARDS_OFFSET );
+}
+
+// Points the handle at one shard's ring and cursors
+static void BindShard(
+    IPC_STREAM* pIPC,
+    UINT shard )
+{
+    IPC_SHARD* pShard = GetShards( pIPC ) + shard;
+
+    pIPC->pBuffer = (BYTE*) pIPC->pRing + pIPC->BufferOffset + shard * pIPC->RingBufferSize;
+    pIPC->pWriteCursor = &pShard->WriteCursor;
+    pIPC->pReadCursor = &pShard->ReadCursor;
+    pIPC->CachedWriteCursor = pShard->WriteCursor;
+    pIPC->CachedReadCursor = pShard->ReadCursor;
+}
+
+// Claims a free shard for a producer. Whatever its last owner left unread is
+// still drained, and we carry on from where it stopped.
+static HRESULT ClaimShard( IPC_STREAM* pIPC )
+{
+    IPC_SHARD* pShards = GetShards( pIPC );
+    UINT i;
+
+    for ( i = 0; i < pIPC->MaxWriters; ++i )
+    {
+        if ( pShards[i].InUse == 0 && AtomicCompareExchange( &pShards[i].InUse, 1, 0 ) == 0 )
+        {
+            pIPC->pShard = &pShards[i];
+            BindShard( pIPC, i );
+            return S_OK;
+        }
+    }
+
+    return HRESULT_FROM_WIN32( ERROR_TOO_MANY_OPEN_FILES );
+}
+
+// Points a priority writer at the lane it is about to write. The lane's
+// cursors are only cached here; the write cursor is read again under its lock.
+static void BindLane(
+    IPC_STREAM* pIPC,
+    UINT lane )
+{
+    pIPC->pLane = GetShards( pIPC ) + lane;
+    BindShard( pIPC, lane );
+}
+
+HRESULT OpenInterprocessStream(
+    LPCWSTR szName,
+	DWORD dwVersion,
+    IPC_STREAM** ppIPC )
+{
+    return OpenInterprocessStreamEx( szName, dwVersion, IPC_ACCESS_READ | IPC_ACCESS_WRITE, ppIPC );
+}
+
+// Opens one ring by name, without following a growable stream on from it
+static HRESULT OpenStream(
+    LPCWSTR szName,
+	DWORD dwVersion,
+	DWORD dwAccess,
+    IPC_STREAM** ppIPC )
+{
+	IPC_STREAM* pIPC = NULL;
+	IPC_REGISTRY_ENTRY* pEntry = NULL;
+	IPC_REGISTRY_ENTRY entry;
+    HRESULT hr;
+
+    if ( ppIPC == NULL ) 
+        return E_INVALIDARG;
+    if ( dwAccess & ~( IPC_ACCESS_READ | IPC_ACCESS_WRITE ) )
+        return E_INVALIDARG;
+    if ( szName == NULL || *szName == 0 )
+        return E_INVALIDARG;
+	if ( dwVersion != IPCLIB_VERSION )
+		return E_INVALIDARG;
+
+    pIPC = (IPC_STREAM*) malloc( sizeof(IPC_STREAM) );
+    if ( pIPC == NULL )
+        return E_OUTOFMEMORY;
+    ZeroMemory( pIPC, sizeof(*pIPC) );
+
+    hr = CreateStreamNames( pIPC, szName, dwVersion );
+    if ( SUCCEEDED( hr ) )
+    {
+        pEntry = LookupStream( szName, dwVersion, &entry );
+        hr = OpenStreamObjects( pIPC, dwVersion, pEntry != NULL ? &entry : NULL );
+    }
+
+    // A stream that's listed but gone, or whose creator isn't running, was left
+    // listed by a creator that died. Lookups and listings only read the
+    // registry, so it's opening the stream that takes it out.
+    if ( pEntry != NULL &&
+         ( hr == HRESULT_FROM_WIN32( ERROR_FILE_NOT_FOUND ) || !ProcessAlive( entry.ProcessId ) ) )
+        CloseRegistryEntry( pEntry, entry.Sequence );
+    if ( FAILED( hr ) )
+    {
+        CloseInterprocessStream( pIPC );
+        return hr;
+    }
+
+    pIPC->pBuffer = ( (BYTE*) pIPC->pRing ) + pIPC->BufferOffset;
+    pIPC->pReadCursor = &pIPC->pRing->ReadCursor;
+    pIPC->pReadSequence = &pIPC->pRing->ReadSequence;
+    pIPC->pWriteCursor = &pIPC->pRing->WriteCursor;
+    pIPC->dwAccess = dwAccess;
+    pIPC->bIsServer = FALSE;
+    pIPC->NonTemporalThreshold = pIPC->pRing->NonTemporalThreshold;
+    BindCopyKernel( pIPC, pIPC->pRing->CopyKernel );
+
+    hr = BindArena( pIPC );
+    if ( FAILED( hr ) )
+    {
+        CloseInterprocessStream( pIPC );
+        return hr;
+    }
+
+    // A sharded handle is bound to either its own shard or to all of them, and
+    // a priority one to the lanes it writes or to all of them
+    if ( pIPC->dwFlags & ( IPC_STREAM_SHARDED | IPC_STREAM_PRIORITY ) )
+    {
+        if ( dwAccess == ( IPC_ACCESS_READ | IPC_ACCESS_WRITE ) )
+            hr = E_INVALIDARG;
+        else if ( ( dwAccess & IPC_ACCESS_WRITE ) && ( pIPC->dwFlags & IPC_STREAM_SHARDED ) )
+            hr = ClaimShard( pIPC );
+        else if ( dwAccess & IPC_ACCESS_WRITE )
+            BindLane( pIPC, 0 );
+        if ( FAILED( hr ) )
+        {
+            CloseInterprocessStream( pIPC );
+            return hr;
+        }
+    }
+
+    if ( ( pIPC->dwFlags & IPC_STREAM_BROADCAST ) && ( dwAccess & IPC_ACCESS_READ ) )
+    {
+        hr = RegisterReader( pIPC );
+        if ( FAILED( hr ) )
+        {
+            CloseInterprocessStream( pIPC );
+            return hr;
+        }
+    }
+
+    if ( pIPC->dwFlags & IPC_STREAM_JOURNAL )
+    {
+        hr = OpenJournal( pIPC );
+        if ( FAILED( hr ) )
+        {
+            CloseInterprocessStream( pIPC );
+            return hr;
+        }
+    }
+
+    if ( pIPC->dwFlags & IPC_STREAM_PREFAULT )
+        PrefaultStreamView( pIPC );
+
+    *ppIPC = pIPC;
+    return S_OK;
+}
+
+// A growable stream's later rings are streams of their own, named after it
+static LPWSTR CreateRingName(
+    LPCWSTR szName,
+    UINT generation )
+{
+    SIZE_T totalLen = wcslen( szName ) + 16; // _Ring + UINT + nullterm
+    WCHAR* newStr = (WCHAR*) malloc( sizeof(WCHAR) * totalLen );
+
+    if ( newStr == NULL )
+        return NULL;
+
+    swprintf_s( newStr, totalLen, L"%ls_Ring%u", szName, generation );
+    return newStr;
+}
+
+static HRESULT OpenRing(
+    IPC_STREAM* pIPC,
+    UINT generation,
+    DWORD dwAccess,
+    IPC_STREAM** ppNext )
+{
+    LPWSTR szRingName = CreateRingName( pIPC->StreamName, generation );
+    HRESULT hr;
+
+    if ( szRingName == NULL )
+        return E_OUTOFMEMORY;
+
+    hr = OpenStream( szRingName, IPCLIB_VERSION, dwAccess, ppNext );
+    free( szRingName );
+    return hr;
+}
+
+static IPC_RING* GetFirstRing( IPC_STREAM* pIPC )
+{
+    return pIPC->pFirst ? pIPC->pFirst->pRing : pIPC->pRing;
+}
+
+// Whether writers have moved on from this ring, leaving its write cursor final
+static BOOL RingRetired( IPC_STREAM* pIPC )
+{
+    if ( pIPC->pRing->Successor == 0 )
+        return FALSE;
+
+    MemoryBarrier();
+    return TRUE;
+}
+
+// Hands one side's counters on to the ring it is moving to, with both rings
+// locked for that side
+static void MoveRingStats(
+    IPC_RING_STATS* pTo,
+    IPC_RING_STATS* pFrom )
+{
+    pTo->Bytes += pFrom->Bytes;
+    pTo->Messages += pFrom->Messages;
+    pTo->Spins += pFrom->Spins;
+    pTo->Waits += pFrom->Waits;
+    pTo->WaitMicroseconds += pFrom->WaitMicroseconds;
+    pTo->LockContention += pFrom->LockContention;
+    pTo->HighWater = max( pTo->HighWater, pFrom->HighWater );
+    ZeroMemory( (void*) pFrom, sizeof(*pFrom) );
+}
+
+// Moves the handle on to the ring pNext has open, and frees pNext. What belongs
+// to the handle rather than the ring stays with it, and the first ring is kept
+// so we can always find the newest one.
+static void AdoptRing(
+    IPC_STREAM* pIPC,
+    IPC_STREAM* pNext,
+    UINT generation )
+{
+    IPC_STREAM old = *pIPC;
+
+    free( pNext->StreamName );
+    *pIPC = *pNext;
+    *pNext = old;
+
+    pIPC->StreamName = old.StreamName;
+    pIPC->pFirst = old.pFirst;
+    pIPC->Generation = generation;
+    pIPC->dwAccess = old.dwAccess;
+    pIPC->pfnWriteWait = old.pfnWriteWait;
+    pIPC->pWriteWaitContext = old.pWriteWaitContext;
+    pIPC->bIsServer = old.bIsServer;
+
+    pNext->StreamName = NULL;
+    pNext->pFirst = NULL;
+    if ( old.Generation == 0 )
+    {
+        pIPC->pFirst = pNext;
+    }
+    else
+    {
+        // Whoever is still reading it mustn't have it cleared under them
+        pNext->bIsServer = FALSE;
+        CloseInterprocessStream( pNext );
+    }
+}
+
+// Moves a handle that doesn't read on to the stream's newest ring
+static HRESULT FollowLatestRing( IPC_STREAM* pIPC )
+{
+    IPC_STREAM* pNext;
+    UINT generation;
+    HRESULT hr;
+
+    while ( RingRetired( pIPC ) )
+    {
+        generation = (UINT) GetFirstRing( pIPC )->LatestRing;
+        hr = OpenRing( pIPC, generation, pIPC->dwAccess, &pNext );
+        if ( FAILED( hr ) )
+            return hr;
+        AdoptRing( pIPC, pNext, generation );
+    }
+
+    return S_OK;
+}
+
+// Moves a reader that has drained a retired ring on to the next one. Called
+// with the old ring's read lock held, and returns with the new one's instead.
+static HRESULT MoveReader( IPC_STREAM* pIPC )
+{
+    UINT generation = (UINT) pIPC->pRing->Successor;
+    IPC_STREAM* pNext;
+    HRESULT hr;
+
+    hr = OpenRing( pIPC, generation, IPC_ACCESS_READ, &pNext );
+    if ( FAILED( hr ) )
+        return hr;
+
+    AcquireStreamLock( pNext->hReadLock );
+    MoveRingStats( &pNext->pRing->ReaderStats, &pIPC->pRing->ReaderStats );
+    ReleaseStreamLock( pIPC->hReadLock );
+
+    AdoptRing( pIPC, pNext, generation );
+    return S_OK;
+}
+
+// Moves a new reader past every ring that has already been drained
+static HRESULT FollowReadRings( IPC_STREAM* pIPC )
+{
+    HRESULT hr = S_OK;
+
+    AcquireStreamLock( pIPC->hReadLock );
+    while ( SUCCEEDED( hr ) && RingRetired( pIPC ) && *pIPC->pReadCursor == *pIPC->pWriteCursor )
+    {
+        hr = MoveReader( pIPC );
+    }
+    ReleaseStreamLock( pIPC->hReadLock );
+
+    return hr;
+}
+
+// Retires the ring we hold the write lock of in favour of a new one, and
+// returns holding the new one's lock instead. The new ring carries on from
+// the old one's cursors, so readers can move across without renumbering.
+static HRESULT GrowRing(
+    IPC_STREAM* pIPC,
+    UINT uRingBufferSize )
+{
+    UINT generation = pIPC->Generation + 1;
+    UINT64 writeCursor = *pIPC->pWriteCursor;
+    IPC_STREAM_DESC desc;
+    IPC_STREAM* pNext;
+    LPWSTR szRingName;
+    HRESULT hr;
+
+    ZeroMemory( &desc, sizeof(desc) );
+    desc.RingBufferSize = uRingBufferSize;
+    desc.dwFlags = pIPC->dwFlags;
+    desc.IOGranularity = pIPC->IOGranularity;
+    desc.WaitStrategy = pIPC->WaitStrategy;
+    desc.SpinMicroseconds = pIPC->SpinMicroseconds;
+    desc.NumaPolicy = pIPC->NumaPolicy;
+    desc.NumaNode = pIPC->NumaNode;
+    desc.MaxRingBufferSize = pIPC->MaxRingBufferSize;
+    desc.GrowMicroseconds = pIPC->GrowMicroseconds;
+    desc.CopyKernel = pIPC->pRing->CopyKernel;
+    desc.NonTemporalThreshold = pIPC->pRing->NonTemporalThreshold;
+
+    szRingName = CreateRingName( pIPC->StreamName, generation );
+    if ( szRingName == NULL )
+        return E_OUTOFMEMORY;
+
+    hr = CreateInterprocessStreamEx( szRingName, IPCLIB_VERSION, &desc, &pNext );
+    free( szRingName );
+    if ( FAILED( hr ) )
+        return hr;
+
+    // The stream's server unlinks it along with the rest, and it's found
+    // through the first ring rather than listed
+    DisownStreamObjects( pNext );
+    UnregisterStream( pNext );
+
+    AcquireStreamLock( pNext->hWriteLock );
+    pNext->pRing->WriteCursor = writeCursor;
+    pNext->pRing->ReserveCursor = writeCursor;
+    pNext->pRing->ReadCursor = writeCursor;
+    MoveRingStats( &pNext->pRing->WriterStats, &pIPC->pRing->WriterStats );
+
+    // Anyone who sees the successor must find it as the newest ring too
+    GetFirstRing( pIPC )->LatestRing = (LONG) generation;
+    MemoryBarrier();
+    pIPC->pRing->Successor = (LONG) generation;
+    MemoryBarrier();
+    WakeReaders( pIPC );
+    ReleaseStreamLock( pIPC->hWriteLock );
+
+    AdoptRing( pIPC, pNext, generation );
+    return S_OK;
+}
+
+// Rings are created by whichever writer grew the stream, so their names go
+// when its server closes
+static void UnlinkGrownRings( IPC_STREAM* pIPC )
+{
+    UINT latest = (UINT) GetFirstRing( pIPC )->LatestRing;
+    UINT generation;
+
+    for ( generation = 1; generation <= latest; ++generation )
+    {
+        LPWSTR szRingName = CreateRingName( pIPC->StreamName, generation );
+        LPWSTR szMappedFileName;
+
+        if ( szRingName == NULL )
+            continue;
+
+        szMappedFileName = CreateGlobalObjectName( szRingName, IPC_MAPPED_FILE, IPCLIB_VERSION );
+        if ( szMappedFileName != NULL )
+        {
+            UnlinkStreamObjects( szMappedFileName );
+            FreeGlobalObjectName( szMappedFileName );
+        }
+        free( szRingName );
+    }
+}
+
+HRESULT OpenInterprocessStreamEx(
+    LPCWSTR szName,
+	DWORD dwVersion,
+	DWORD dwAccess,
+    IPC_STREAM** ppIPC )
+{
+	IPC_STREAM* pIPC = NULL;
+    HRESULT hr;
+
+    hr = OpenStream( szName, dwVersion, dwAccess, &pIPC );
+    if ( FAILED( hr ) )
+        return hr;
+
+    // Readers start on the oldest ring with anything left in it, and everyone
+    // else on the newest
+    if ( pIPC->dwFlags & IPC_STREAM_GROWABLE )
+    {
+        pIPC->StreamName = CopyStreamName( szName );
+        if ( pIPC->StreamName == NULL )
+            hr = E_OUTOFMEMORY;
+        else if ( dwAccess == ( IPC_ACCESS_READ | IPC_ACCESS_WRITE ) )
+            hr = E_INVALIDARG;
+        else if ( dwAccess & IPC_ACCESS_READ )
+            hr = FollowReadRings( pIPC );
+        else
+            hr = FollowLatestRing( pIPC );
+        if ( FAILED( hr ) )
+        {
+            CloseInterprocessStream( pIPC );
+            return hr;
+        }
+    }
+
+    *ppIPC = pIPC;
+    return S_OK;
+}
+
+HRESULT QueryInterprocessStreamInfo(
+    IPC_STREAM* pIPC,
+    IPC_STREAM_INFO* pInfo )
+{
+    if ( pIPC == NULL || pInfo == NULL )
+        return E_INVALIDARG;
+
+    ZeroMemory( pInfo, sizeof(*pInfo) );
+    pInfo->RingBufferSize = pIPC->RingBufferSize;
+    pInfo->dwFlags = pIPC->dwFlags;
+    pInfo->PageSize = pIPC->PageSize;
+    pInfo->NumaPolicy = pIPC->NumaPolicy;
+    pInfo->NumaNode = pIPC->NumaNode;
+    pInfo->MaxReaders = pIPC->MaxReaders;
+    pInfo->MaxWriters = pIPC->MaxWriters;
+    pInfo->Generation = pIPC->Generation;
+    pInfo->CopyKernel = pIPC->CopyKernel;
+    pInfo->NonTemporalThreshold = pIPC->NonTemporalThreshold;
+    pInfo->Lanes = pIPC->Lanes;
+    pInfo->ArenaBlockSize = pIPC->ArenaBlockSize;
+    pInfo->ArenaBlocks = pIPC->ArenaBlocks;
+    return S_OK;
+}
+
+HRESULT QueryInterprocessStreamDropped(
+    IPC_STREAM* pIPC,
+    UINT64* pDroppedBytes,
+    UINT64* pDroppedMessages )
+{
+    if ( pIPC == NULL || pDroppedBytes == NULL || pDroppedMessages == NULL )
+        return E_INVALIDARG;
+
+    *pDroppedBytes = pIPC->DroppedBytes;
+    *pDroppedMessages = pIPC->DroppedMessages;
+    return S_OK;
+}
+
+BOOL QueryInterprocessStreamIsOpen( 
+	LPCWSTR szName,
+	DWORD dwVersion )
+{
+    IPC_REGISTRY_ENTRY entry;
+    IPC_REGISTRY* pRegistry;
+    LPWSTR MappedFileName;
+    BOOL bIsOpen;
+
+    if ( LookupStream( szName, dwVersion, &entry ) != NULL )
+        return TRUE;
+
+    // Not finding a name only counts if everything that was created got listed
+    pRegistry = GetRegistry();
+    if ( pRegistry != NULL && pRegistry->Overflow == 0 )
+        return FALSE;
+
+    MappedFileName = CreateGlobalObjectName( szName, IPC_MAPPED_FILE, dwVersion );
+    bIsOpen = QueryStreamObjectsExist( MappedFileName );
+
+    FreeGlobalObjectName( MappedFileName );
+    return bIsOpen;
+}
+
+HRESULT EnumerateInterprocessStreams(
+    IPC_STREAM_ENTRY* pEntries,
+    UINT maxEntries,
+    UINT* pCount )
+{
+    IPC_REGISTRY* pRegistry;
+    IPC_REGISTRY_ENTRY entry;
+    UINT count = 0;
+    UINT i;
+
+    if ( pCount == NULL || ( pEntries == NULL && maxEntries != 0 ) )
+        return E_INVALIDARG;
+
+    pRegistry = GetRegistry();
+    if ( pRegistry == NULL )
+        return E_FAIL;
+
+    for ( i = 0; i < IPC_REGISTRY_ENTRIES; ++i )
+    {
+        ReadRegistryEntry( &pRegistry->Table[i], &entry );
+        if ( entry.State != IPC_REGISTRY_OPEN )
+            continue;
+
+        if ( count < maxEntries )
+        {
+            memcpy( pEntries[count].Name, entry.Name, sizeof(entry.Name) );
+            pEntries[count].dwVersion = entry.dwVersion;
+            pEntries[count].dwFlags = entry.dwFlags;
+            pEntries[count].RingBufferSize = entry.RingBufferSize;
+            pEntries[count].ProcessId = entry.ProcessId;
+        }
+        ++count;
+    }
+
+    *pCount = count;
+    return count > maxEntries ? HRESULT_FROM_WIN32( ERROR_INSUFFICIENT_BUFFER ) : S_OK;
+}
+
+// A broadcast reader that leaves gives back every block still on its way to
+// it, and takes the arena lock so that no more are counted out to it. The
+// sender holding the lock may be waiting for this reader to make room, so it
+// keeps draining until it gets the lock.
+static void ReleaseUnreadBlocks( IPC_STREAM* pIPC )
+{
+    UINT recordSize = sizeof(IPC_BLOCK_REFERENCE);
+    UINT readable, dataSize;
+    LPCVOID pBlock;
+    IPC_SPIN spin;
+
+    if ( pIPC->dwFlags & IPC_STREAM_MESSAGES )
+        recordSize += sizeof(UINT);
+
+    BeginSpin( &spin );
+    for ( ;; )
+    {
+        while ( SUCCEEDED( QueryInterprocessStreamReady( pIPC, &readable, NULL ) ) && readable >= recordSize &&
+                ReceiveInterprocessBlock( pIPC, &pBlock, &dataSize ) == S_OK )
+            ReleaseInterprocessBlock( pIPC, pBlock );
+
+        if ( AtomicCompareExchange( &pIPC->pArena->ReaderLock, 1, 0 ) == 0 )
+            break;
+        if ( !SpinOnce( pIPC, &spin ) )
+            Sleep( IPC_EVENT_POLL_MS );
+    }
+
+    // Anything sent before we got the lock was counted out to us too
+    while ( SUCCEEDED( QueryInterprocessStreamReady( pIPC, &readable, NULL ) ) && readable >= recordSize &&
+            ReceiveInterprocessBlock( pIPC, &pBlock, &dataSize ) == S_OK )
+        ReleaseInterprocessBlock( pIPC, pBlock );
+}
+
+HRESULT CloseInterprocessStream( IPC_STREAM* pIPC )
+{
+    if ( pIPC == NULL )
+        return E_INVALIDARG;
+
+    // Stop holding the writer back
+    if ( pIPC->pSlot != NULL && pIPC->pArena != NULL )
+    {
+        ReleaseUnreadBlocks( pIPC );
+        pIPC->pSlot->InUse = 0;
+        ReleaseArenaLock( pIPC );
+        WakeWriters( pIPC );
+    }
+    else if ( pIPC->pSlot != NULL )
+    {
+        pIPC->pSlot->InUse = 0;
+        MemoryBarrier();
+        WakeWriters( pIPC );
+    }
+    if ( pIPC->pShard != NULL )
+        pIPC->pShard->InUse = 0;
+
+    // Nobody finds the stream once it starts going away
+    UnregisterStream( pIPC );
+
+    if ( pIPC->bIsServer && pIPC->StreamName != NULL && pIPC->pRing != NULL )
+        UnlinkGrownRings( pIPC );
+
+    if ( pIPC->bIsServer && 
+         pIPC->hWriteLock && 
+         pIPC->hWriteEvent &&
+         pIPC->pRing )
+    {
+        // Wait for clients to release their write lock on the ringbuffer
+        AcquireStreamLock( pIPC->hWriteLock );
+
+        // Clear the mapping
+        ClearStreamRing( pIPC );
+        ReleaseStreamLock( pIPC->hWriteLock );
+
+        // Notify listeners there's data there
+        WakeReaders( pIPC );
+    }
+
+    CloseStreamObjects( pIPC );
+
+    if ( pIPC->pFirst != NULL )
+        CloseInterprocessStream( pIPC->pFirst );
+    free( pIPC->StreamName );
+
+    // A journal's segments stay on disk for the next time it is created
+    UnmapSegment( pIPC, pIPC->pWriteSegment );
+    UnmapSegment( pIPC, pIPC->pReadSegment );
+    free( pIPC->JournalPrefix );
+
+    if ( pIPC->WriteLockName != NULL )
+        FreeGlobalObjectName( pIPC->WriteLockName );
+    if ( pIPC->WriteEventName != NULL )
+        FreeGlobalObjectName( pIPC->WriteEventName );
+    if ( pIPC->ReadLockName != NULL )
+        FreeGlobalObjectName( pIPC->ReadLockName );
+    if ( pIPC->ReadEventName != NULL )
+        FreeGlobalObjectName( pIPC->ReadEventName );
+    if ( pIPC->MappedFileName != NULL )
+        FreeGlobalObjectName( pIPC->MappedFileName );
+
+    free( pIPC );
+    return S_OK;
+}
+
+// Where a cursor falls in the ring. A ring whose size is a power of two, as
+// the typed queues in IPCLib.hpp always ask for, is indexed with a mask
+// rather than a division.
+static BYTE* RingPointer(
+    IPC_STREAM* pIPC,
+    UINT64 cursor )
+{
+    UINT ringBufferSize = pIPC->RingBufferSize;
+
+    if ( ( ringBufferSize & ( ringBufferSize - 1 ) ) == 0 )
+        return pIPC->pBuffer + ( (UINT) cursor & ( ringBufferSize - 1 ) );
+    return pIPC->pBuffer + ( cursor % ringBufferSize );
+}
+
+// Copies into the ring, splitting the copy at the end of the buffer unless the
+// ring is mirrored. Returns where the next copy should go.
+static BYTE* CopyToRing(
+    IPC_STREAM* pIPC,
+    IPC_COPY_ROUTINE pfnCopy,
+    BYTE* pDest,
+    const BYTE* pSource,
+    SIZE_T size )
+{
+    BYTE* pRingEnd = pIPC->pBuffer + pIPC->RingBufferSize;
+
+    // Check for wrap: if we do, split the write
+    if ( pDest + size > pRingEnd && !pIPC->pMirror )
+    {
+        SIZE_T splitPoint = pRingEnd - pDest;
+        SIZE_T remainder = size - splitPoint;
+        pfnCopy( pDest, pSource, splitPoint );
+        pfnCopy( pIPC->pBuffer, pSource + splitPoint, remainder );
+        return pIPC->pBuffer + remainder;
+    }
+
+    pfnCopy( pDest, pSource, size );
+    pDest += size;
+    return pDest >= pRingEnd ? pDest - pIPC->RingBufferSize : pDest;
+}
+
+static const BYTE* CopyFromRing(
+    IPC_STREAM* pIPC,
+    IPC_COPY_ROUTINE pfnCopy,
+    BYTE* pDest,
+    const BYTE* pSrc,
+    SIZE_T size )
+{
+    const BYTE* pRingEnd = pIPC->pBuffer + pIPC->RingBufferSize;
+
+    // If we're about to overrun the buffer, split the read
+    if ( pSrc + size > pRingEnd && !pIPC->pMirror )
+    {
+        SIZE_T splitPoint = pRingEnd - pSrc;
+        SIZE_T remainder = size - splitPoint;
+        pfnCopy( pDest, pSrc, splitPoint );
+        pfnCopy( pDest + splitPoint, pIPC->pBuffer, remainder );
+        return pIPC->pBuffer + remainder;
+    }
+
+    pfnCopy( pDest, pSrc, size );
+    pSrc += size;
+    return pSrc >= pRingEnd ? pSrc - pIPC->RingBufferSize : pSrc;
+}
+
+// How far the writer's data has been consumed: in a broadcast stream, as far as
+// the slowest registered reader, or everything written if there are none. A
+// journal never waits to be read, so everything in it counts as consumed.
+static UINT64 QueryReadCursor( IPC_STREAM* pIPC )
+{
+    IPC_READER_SLOT* pSlots;
+    UINT64 readCursor;
+    UINT i;
+
+    if ( pIPC->dwFlags & IPC_STREAM_JOURNAL )
+        return pIPC->pRing->WriteCursor;
+    if ( !( pIPC->dwFlags & IPC_STREAM_BROADCAST ) )
+        return *pIPC->pReadCursor;
+
+    pSlots = (IPC_READER_SLOT*) ( (BYTE*) pIPC->pRing + IPC_READER_SLOTS_OFFSET );
+    readCursor = pIPC->pRing->WriteCursor;
+    for ( i = 0; i < pIPC->MaxReaders; ++i )
+    {
+        if ( pSlots[i].InUse && pSlots[i].ReadCursor < readCursor )
+            readCursor = pSlots[i].ReadCursor;
+    }
+
+    return readCursor;
+}
+
+HRESULT QueryInterprocessStreamStats(
+    IPC_STREAM* pIPC,
+    IPC_STREAM_STATS* pStats )
+{
+    IPC_RING_STATS* pWriter;
+    IPC_RING_STATS* pReader;
+    IPC_SHARD* pShards;
+    UINT64 fill = 0;
+    UINT i;
+
+    if ( pIPC == NULL || pStats == NULL )
+        return E_INVALIDARG;
+
+    // A reader's counters are wherever it has got to, but anyone else can look
+    // at the newest ring. Writers follow it anyway when they next write.
+    if ( !( pIPC->dwAccess & IPC_ACCESS_READ ) && pIPC->PendingWriteSize == 0 )
+        FollowLatestRing( pIPC );
+
+    pWriter = &pIPC->pRing->WriterStats;
+    pReader = &pIPC->pRing->ReaderStats;
+    ZeroMemory( pStats, sizeof(*pStats) );
+
+	IPC_TRY
+	{
+        pStats->BytesWritten = pWriter->Bytes;
+        pStats->MessagesWritten = pWriter->Messages;
+        pStats->BytesRead = pReader->Bytes;
+        pStats->MessagesRead = pReader->Messages;
+        pStats->WriteSpins = pWriter->Spins;
+        pStats->ReadSpins = pReader->Spins;
+        pStats->WriteWaits = pWriter->Waits;
+        pStats->ReadWaits = pReader->Waits;
+        pStats->WriteWaitMicroseconds = pWriter->WaitMicroseconds;
+        pStats->ReadWaitMicroseconds = pReader->WaitMicroseconds;
+        pStats->WriteLockContention = pWriter->LockContention;
+        pStats->ReadLockContention = pReader->LockContention;
+        pStats->HighWater = (UINT) pReader->HighWater;
+
+        // Nothing is locked, so read each read cursor before the write cursor
+        // it trails. An overwrite stream's reader can still have been lapped.
+        if ( pIPC->dwFlags & ( IPC_STREAM_SHARDED | IPC_STREAM_PRIORITY ) )
+        {
+            pShards = GetShards( pIPC );
+            for ( i = 0; i < CountSubRings( pIPC ); ++i )
+            {
+                UINT64 readCursor = pShards[i].ReadCursor;
+
+                fill += min( pShards[i].WriteCursor - readCursor, pIPC->RingBufferSize );
+            }
+        }
+        else
+        {
+            UINT64 readCursor = QueryReadCursor( pIPC );
+            UINT64 writeCursor = pIPC->pRing->WriteCursor;
+
+            fill = writeCursor > readCursor ? min( writeCursor - readCursor, pIPC->RingBufferSize ) : 0;
+        }
+	}
+	IPC_EXCEPT
+	{
+		return E_FAIL;
+	}
+
+    pStats->RingBufferSize = pIPC->RingBufferSize;
+    pStats->Fill = (UINT) fill;
+    return S_OK;
+}
+
+HRESULT QueryInterprocessStreamReady(
+    IPC_STREAM* pIPC,
+    UINT* pReadable,
+    UINT* pWritable )
+{
+    UINT readable = 0, writable = 0;
+
+    if ( pIPC == NULL )
+        return E_INVALIDARG;
+    if ( pIPC->dwFlags & ( IPC_STREAM_SHARDED | IPC_STREAM_GROWABLE | IPC_STREAM_JOURNAL | IPC_STREAM_PRIORITY ) )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION );
+
+    // Each cursor is read before the one that runs ahead of it, so neither
+    // figure can be more than is really there
+	IPC_TRY
+	{
+        if ( pIPC->dwAccess & IPC_ACCESS_READ )
+        {
+            UINT64 readCursor = *pIPC->pReadCursor;
+            UINT64 writeCursor = *pIPC->pWriteCursor;
+
+            readable = (UINT) min( writeCursor - readCursor, pIPC->RingBufferSize );
+        }
+
+        if ( ( pIPC->dwAccess & IPC_ACCESS_WRITE ) && ( pIPC->dwFlags & IPC_STREAM_OVERWRITE ) )
+        {
+            writable = pIPC->RingBufferSize;
+        }
+        else if ( pIPC->dwAccess & IPC_ACCESS_WRITE )
+        {
+            UINT64 readCursor = QueryReadCursor( pIPC );
+            UINT64 writeCursor = ( pIPC->dwFlags & IPC_STREAM_MULTI_PRODUCER ) ?
+                pIPC->pRing->ReserveCursor : pIPC->pRing->WriteCursor;
+
+            if ( writeCursor - readCursor < pIPC->RingBufferSize )
+                writable = pIPC->RingBufferSize - (UINT) ( writeCursor - readCursor );
+        }
+	}
+	IPC_EXCEPT
+	{
+		return E_FAIL;
+	}
+
+    if ( pReadable != NULL )
+        *pReadable = readable;
+    if ( pWritable != NULL )
+        *pWritable = writable;
+    return S_OK;
+}
+
+// How much of the next write to copy before publishing the write cursor. The
+// adaptive policy hands the reader one large batch while it is keeping up, and
+// drops back to the configured granularity when the ring is nearly empty (the
+// reader is waiting on us) or nearly full (we are about to wait on it).
+static UINT WritePacketSize(
+    IPC_STREAM* pIPC,
+    UINT64 writeCursor,
+    UINT dataSize )
+{
+    UINT ringBufferSize = pIPC->RingBufferSize;
+    UINT used, space;
+
+    if ( !( pIPC->dwFlags & IPC_STREAM_ADAPTIVE_GRANULARITY ) )
+        return min( dataSize, pIPC->IOGranularity );
+
+    // Batches are large enough here to afford a fresh look at the reader
+    pIPC->CachedReadCursor = QueryReadCursor( pIPC );
+    used = (UINT) ( writeCursor - pIPC->CachedReadCursor );
+    space = used < ringBufferSize ? ringBufferSize - used : 0;
+    if ( used < pIPC->IOGranularity || space < ringBufferSize / 4 )
+        return min( dataSize, pIPC->IOGranularity );
+
+    return min( dataSize, max( pIPC->IOGranularity, space / 2 ) );
+}
+
+// How much of the available data to consume before publishing the read cursor.
+// Under the adaptive policy only a nearly full ring, where the writer is likely
+// stalled waiting for space, is handed back in small chunks.
+static UINT ReadPacketSize(
+    IPC_STREAM* pIPC,
+    UINT available )
+{
+    if ( !( pIPC->dwFlags & IPC_STREAM_ADAPTIVE_GRANULARITY ) ||
+         available > pIPC->RingBufferSize / 4 * 3 )
+        return min( available, pIPC->IOGranularity );
+
+    return available;
+}
+
+// Called after publishing a cursor. Sleepers advertise themselves before
+// re-checking the cursor, and we publish before looking for them, so with a
+// full fence on both sides one of us always sees the other.
+static void SignalReaders( IPC_STREAM* pIPC )
+{
+    MemoryBarrier();
+    if ( pIPC->pRing->ReadWaiters != 0 )
+        WakeReaders( pIPC );
+}
+
+static void SignalWriters( IPC_STREAM* pIPC )
+{
+    MemoryBarrier();
+    if ( pIPC->pRing->WriteWaiters != 0 )
+        WakeWriters( pIPC );
+}
+
+// Adds to one side's counter. Several writers can count at once in a multi-
+// producer, sharded or priority stream, and several readers in a broadcast
+// stream or a journal; anyone else is holding their side's lock.
+static void CountStat(
+    IPC_STREAM* pIPC,
+    IPC_RING_STATS* pStats,
+    volatile UINT64* pCounter,
+    UINT64 value )
+{
+    BOOL bShared = ( pStats == &pIPC->pRing->WriterStats ) ?
+        ( pIPC->dwFlags & ( IPC_STREAM_MULTI_PRODUCER | IPC_STREAM_SHARDED | IPC_STREAM_PRIORITY ) ) != 0 :
+        ( pIPC->dwFlags & ( IPC_STREAM_BROADCAST | IPC_STREAM_JOURNAL ) ) != 0;
+
+    if ( value == 0 )
+        return;
+
+    if ( bShared )
+        AtomicFetchAdd64( pCounter, value );
+    else
+        *pCounter += value;
+}
+
+static void CountTransfer(
+    IPC_STREAM* pIPC,
+    IPC_RING_STATS* pStats,
+    UINT dataSize )
+{
+    CountStat( pIPC, pStats, &pStats->Bytes, dataSize );
+    if ( pIPC->dwFlags & IPC_STREAM_MESSAGES )
+        CountStat( pIPC, pStats, &pStats->Messages, 1 );
+}
+
+// Called on waking from a sleep on the stream event that began at sleepStart
+static void CountSleep(
+    IPC_STREAM* pIPC,
+    IPC_RING_STATS* pStats,
+    UINT64 sleepStart )
+{
+    CountStat( pIPC, pStats, &pStats->Waits, 1 );
+    CountStat( pIPC, pStats, &pStats->WaitMicroseconds, QueryClockMicroseconds() - sleepStart );
+}
+
+// Whether the ring has room for everything up to writeCursor. The reader's
+// cursor only moves forward, so our cached copy can only understate the room;
+// the shared one is re-read only when the copy says the ring is full.
+static BOOL WriteSpaceAvailable(
+    IPC_STREAM* pIPC,
+    UINT64 writeCursor )
+{
+    if ( writeCursor - pIPC->CachedReadCursor <= pIPC->RingBufferSize )
+        return TRUE;
+
+    pIPC->CachedReadCursor = QueryReadCursor( pIPC );
+    return writeCursor - pIPC->CachedReadCursor <= pIPC->RingBufferSize;
+}
+
+// Likewise for the reader, which re-reads the writer's cursor only once it has
+// consumed everything it last saw
+static BOOL ReadDataAvailable(
+    IPC_STREAM* pIPC,
+    UINT64 readCursor )
+{
+    UINT64 fill;
+
+    if ( readCursor < pIPC->CachedWriteCursor )
+        return TRUE;
+
+    pIPC->CachedWriteCursor = *pIPC->pWriteCursor;
+
+    // Only sampled when we have to look, which is often enough to catch a
+    // reader falling behind. Racing readers can lose each other's samples.
+    fill = pIPC->CachedWriteCursor - *pIPC->pReadCursor;
+    if ( fill > pIPC->pRing->ReaderStats.HighWater )
+        pIPC->pRing->ReaderStats.HighWater = min( fill, pIPC->RingBufferSize );
+
+    return readCursor < pIPC->CachedWriteCursor;
+}
+
+static void WriteSpinlock( 
+    IPC_STREAM* pIPC,
+    UINT64 writeCursor )
+{
+    IPC_RING_STATS* pStats = &pIPC->pRing->WriterStats;
+    UINT64 blockStart = 0;
+    IPC_SPIN spin;
+
+    if ( WriteSpaceAvailable( pIPC, writeCursor ) )
+        return;
+
+    // Only a ring that can still grow needs the time it holds us up
+    if ( pIPC->MaxRingBufferSize > pIPC->RingBufferSize )
+        blockStart = QueryClockMicroseconds();
+
+    // Spin while in case the data is going to come in very soon
+    BeginSpin( &spin );
+    while ( !WriteSpaceAvailable( pIPC, writeCursor ) && SpinOnce( pIPC, &spin ) )
+    {
+    }
+    CountStat( pIPC, pStats, &pStats->Spins, spin.Count );
+
+    // Switch to a very slow wait 
+    if ( !WriteSpaceAvailable( pIPC, writeCursor ) )
+    {
+        UINT64 sleepStart = QueryClockMicroseconds();
+
+        AtomicIncrement( &pIPC->pRing->WriteWaiters );
+        while ( !WriteSpaceAvailable( pIPC, writeCursor ) )
+        {
+            // Each shard's or lane's writer can be waiting on the one event,
+            // so poll
+            if ( pIPC->dwFlags & ( IPC_STREAM_SHARDED | IPC_STREAM_PRIORITY ) )
+                WaitStreamEventTimeout( pIPC->hReadEvent, IPC_EVENT_POLL_MS );
+            else
+                WaitStreamEvent( pIPC->hReadEvent );
+        }
+        AtomicDecrement( &pIPC->pRing->WriteWaiters );
+        CountSleep( pIPC, pStats, sleepStart );
+    }
+
+    if ( blockStart != 0 )
+        pIPC->BlockedMicroseconds += QueryClockMicroseconds() - blockStart;
+
+#ifdef _DEBUG
+	assert( writeCursor - pIPC->CachedReadCursor <= pIPC->RingBufferSize );
+#endif
+}
+
+// Makes room for everything up to endCursor in an overwrite stream by moving
+// the tail past whatever is about to be overwritten: whole records in a message
+// stream, so readers always resync to a length prefix. The tail is published
+// before any of the old data is touched.
+static void OverwriteSpace(
+    IPC_STREAM* pIPC,
+    UINT64 endCursor )
+{
+    IPC_RING* pRing = pIPC->pRing;
+    UINT64 tailCursor = pRing->TailCursor;
+    UINT64 tailSequence = pRing->TailSequence;
+    UINT messageSize;
+
+    if ( endCursor - tailCursor <= pIPC->RingBufferSize )
+        return;
+
+    if ( pIPC->dwFlags & IPC_STREAM_MESSAGES )
+    {
+        // These are our own records, so nobody else can be changing them
+        while ( endCursor - tailCursor > pIPC->RingBufferSize )
+        {
+            CopyFromRing( pIPC, CopyCached, (BYTE*) &messageSize,
+                RingPointer( pIPC, tailCursor ), sizeof(messageSize) );
+            tailCursor += sizeof(messageSize) + messageSize;
+            ++tailSequence;
+        }
+    }
+    else
+    {
+        tailCursor = endCursor - pIPC->RingBufferSize;
+    }
+
+    ++pRing->Generation;
+    MemoryBarrier();
+    pRing->TailCursor = tailCursor;
+    pRing->TailSequence = tailSequence;
+    MemoryBarrier();
+    ++pRing->Generation;
+}
+
+// The commit cursor is only ever advanced by the producer whose reservation it
+// points into, so once every earlier reservation has been committed we publish
+// whatever we've copied so far. Once all of it is published the producers
+// behind us are free to move the cursor on, so don't look at it again.
+static BOOL PublishReservation(
+    IPC_STREAM* pIPC,
+    UINT64* pCommitted,
+    UINT64 copied )
+{
+    if ( copied == *pCommitted )
+        return TRUE;
+
+    if ( *pIPC->pWriteCursor != *pCommitted )
+        return FALSE;
+
+	MemoryBarrier();
+    *pIPC->pWriteCursor = copied;
+    *pCommitted = copied;
+    SignalReaders( pIPC );
+
+    return TRUE;
+}
+
+static void MultiProducerBackoff( 
+    IPC_STREAM* pIPC,
+    IPC_SPIN* pSpin )
+{
+    IPC_RING_STATS* pStats = &pIPC->pRing->WriterStats;
+    UINT64 sleepStart;
+
+    if ( pIPC->pfnWriteWait != NULL )
+        pIPC->pfnWriteWait( pIPC->pWriteWaitContext );
+
+    if ( SpinOnce( pIPC, pSpin ) )
+        return;
+
+    // Several producers can be parked on the one auto-reset event, and only one
+    // of them is released per signal, so poll rather than wait indefinitely
+    sleepStart = QueryClockMicroseconds();
+    AtomicIncrement( &pIPC->pRing->WriteWaiters );
+    WaitStreamEventTimeout( pIPC->hReadEvent, IPC_EVENT_POLL_MS );
+    AtomicDecrement( &pIPC->pRing->WriteWaiters );
+    CountSleep( pIPC, pStats, sleepStart );
+}
+
+// Counts the polls made by a run of MultiProducerBackoff calls
+static void EndMultiProducerBackoff(
+    IPC_STREAM* pIPC,
+    const IPC_SPIN* pSpin )
+{
+    IPC_RING_STATS* pStats = &pIPC->pRing->WriterStats;
+
+    CountStat( pIPC, pStats, &pStats->Spins, pSpin->Count );
+}
+
+// Walks a list of caller buffers so writes can be gathered into the ring
+// without staging them in one place first
+typedef struct _IPC_GATHER
+{
+    const IPC_BUFFER*	pBuffer;
+    const BYTE*			pSource;
+    UINT				remaining;
+    IPC_COPY_ROUTINE	pfnCopy;		// Chosen for the whole transfer
+} IPC_GATHER;
+
+static void BeginGather(
+    IPC_STREAM* pIPC,
+    IPC_GATHER* pGather,
+    const IPC_BUFFER* pBuffers,
+    UINT dataSize )
+{
+    pGather->pfnCopy = SelectCopy( pIPC, dataSize );
+    pGather->pBuffer = pBuffers;
+    pGather->pSource = (const BYTE*) pBuffers->pData;
+    pGather->remaining = pBuffers->dataSize;
+}
+
+static BYTE* GatherToRing(
+    IPC_STREAM* pIPC,
+    BYTE* pDest,
+    IPC_GATHER* pGather,
+    UINT size )
+{
+    while ( size > 0 )
+    {
+        UINT copySize;
+
+        while ( pGather->remaining == 0 )
+        {
+            ++pGather->pBuffer;
+            pGather->pSource = (const BYTE*) pGather->pBuffer->pData;
+            pGather->remaining = pGather->pBuffer->dataSize;
+        }
+
+        copySize = min( size, pGather->remaining );
+        pDest = CopyToRing( pIPC, pGather->pfnCopy, pDest, pGather->pSource, copySize );
+
+        pGather->pSource += copySize;
+        pGather->remaining -= copySize;
+        size -= copySize;
+    }
+
+    return pDest;
+}
+
+static UINT SumBuffers(
+    const IPC_BUFFER* pBuffers,
+    UINT bufferCount )
+{
+    UINT total = 0;
+    UINT i;
+
+    for ( i = 0; i < bufferCount; ++i )
+        total += pBuffers[i].dataSize;
+
+    return total;
+}
+
+static HRESULT WriteMultiProducer(
+    IPC_STREAM* pIPC,
+    const IPC_BUFFER* pBuffers,
+    UINT dataSize )
+{
+    UINT totalSize = dataSize;
+    IPC_SPIN spin;
+    IPC_GATHER gather;
+
+    BeginSpin( &spin );
+    BeginGather( pIPC, &gather, pBuffers, dataSize );
+
+	IPC_TRY
+	{
+        // Claim our slice of the stream; nobody else will touch it
+        UINT64 writeCursor = AtomicFetchAdd64( &pIPC->pRing->ReserveCursor, dataSize );
+        UINT64 committed = writeCursor;
+        BYTE* pDest = RingPointer( pIPC, writeCursor );
+
+        while ( dataSize > 0 )
+        {
+            UINT packetSize = WritePacketSize( pIPC, writeCursor, dataSize );
+
+            // Wait until the memory becomes available. The reader may be
+            // waiting on what we've already copied, so keep publishing it.
+            while ( !WriteSpaceAvailable( pIPC, writeCursor + packetSize ) )
+            {
+                PublishReservation( pIPC, &committed, writeCursor );
+                MultiProducerBackoff( pIPC, &spin );
+            }
+
+            pDest = GatherToRing( pIPC, pDest, &gather, packetSize );
+
+            writeCursor += packetSize;
+            dataSize -= packetSize;
+
+            PublishReservation( pIPC, &committed, writeCursor );
+        }
+
+        // Wait for the producers ahead of us to commit
+        EndMultiProducerBackoff( pIPC, &spin );
+        BeginSpin( &spin );
+        while ( !PublishReservation( pIPC, &committed, writeCursor ) )
+        {
+            MultiProducerBackoff( pIPC, &spin );
+        }
+        EndMultiProducerBackoff( pIPC, &spin );
+
+        CountTransfer( pIPC, &pIPC->pRing->WriterStats, totalSize );
+	}
+	IPC_EXCEPT
+	{
+		return E_FAIL;
+	}
+
+    return S_OK;
+}
+
+// A lane's lock is its InUse flag rather than a named lock, so that writers
+// on one lane never wait for those on another. It can be held for as long as
+// a message takes to go into a full lane, so waiters poll for it slowly once
+// they have spun.
+static void AcquireLaneLock( IPC_STREAM* pIPC )
+{
+    IPC_RING_STATS* pStats = &pIPC->pRing->WriterStats;
+    IPC_SPIN spin;
+
+    if ( AtomicCompareExchange( &pIPC->pLane->InUse, 1, 0 ) == 0 )
+        return;
+
+    CountStat( pIPC, pStats, &pStats->LockContention, 1 );
+    BeginSpin( &spin );
+    while ( AtomicCompareExchange( &pIPC->pLane->InUse, 1, 0 ) != 0 )
+    {
+        if ( !SpinOnce( pIPC, &spin ) )
+            WaitStreamEventTimeout( pIPC->hReadEvent, IPC_EVENT_POLL_MS );
+    }
+}
+
+// A shard's producer owns its cursor; everyone else shares one. Writers of a
+// growable stream follow it on to its newest ring, and grow that first if it
+// has held them up for long enough; writes never straddle two rings.
+static HRESULT AcquireWriterLock( IPC_STREAM* pIPC )
+{
+    IPC_RING_STATS* pStats;
+    HRESULT hr;
+
+    if ( pIPC->dwFlags & IPC_STREAM_SHARDED )
+        return S_OK;
+    if ( pIPC->dwFlags & IPC_STREAM_PRIORITY )
+    {
+        AcquireLaneLock( pIPC );
+        return S_OK;
+    }
+
+    for ( ;; )
+    {
+        pStats = &pIPC->pRing->WriterStats;
+        if ( !TryAcquireStreamLock( pIPC->hWriteLock ) )
+        {
+            AcquireStreamLock( pIPC->hWriteLock );
+            CountStat( pIPC, pStats, &pStats->LockContention, 1 );
+        }
+
+        if ( !RingRetired( pIPC ) )
+            break;
+
+        ReleaseStreamLock( pIPC->hWriteLock );
+        hr = FollowLatestRing( pIPC );
+        if ( FAILED( hr ) )
+            return hr;
+    }
+
+    // Growing is only ever worth trying; if it fails we carry on as we are
+    if ( pIPC->MaxRingBufferSize > pIPC->RingBufferSize && pIPC->BlockedMicroseconds >= pIPC->GrowMicroseconds )
+    {
+        GrowRing( pIPC, (UINT) min( (UINT64) pIPC->RingBufferSize * 2, pIPC->MaxRingBufferSize ) );
+        pIPC->BlockedMicroseconds = 0;
+    }
+
+    return S_OK;
+}
+
+static void ReleaseWriterLock( IPC_STREAM* pIPC )
+{
+    if ( pIPC->dwFlags & IPC_STREAM_PRIORITY )
+    {
+        MemoryBarrier();
+        pIPC->pLane->InUse = 0;
+    }
+    else if ( !( pIPC->dwFlags & IPC_STREAM_SHARDED ) )
+    {
+        ReleaseStreamLock( pIPC->hWriteLock );
+    }
+}
+
+HRESULT GrowInterprocessStream(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT uRingBufferSize )
+{
+    HRESULT hr;
+
+    if ( pIPC == NULL )
+        return E_INVALIDARG;
+    if ( !( pIPC->dwFlags & IPC_STREAM_GROWABLE ) )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION );
+    if ( pIPC->PendingWriteSize != 0 )
+        return E_UNEXPECTED;
+    if ( !( pIPC->dwAccess & IPC_ACCESS_WRITE ) )
+        return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+
+    hr = AcquireWriterLock( pIPC );
+    if ( FAILED( hr ) )
+        return hr;
+
+	IPC_TRY
+	{
+        // Another writer may have got there first
+        if ( uRingBufferSize <= pIPC->RingBufferSize )
+            hr = S_FALSE;
+        else
+            hr = GrowRing( pIPC, uRingBufferSize );
+	}
+	IPC_EXCEPT
+	{
+        ReleaseWriterLock( pIPC );
+		return E_FAIL;
+	}
+
+    ReleaseWriterLock( pIPC );
+    return hr;
+}
+
+// Starts the journal's next segment where the head one ends. Readers go on to
+// it once they see the old one sealed, and the seal starts the old one's
+// pages on their way to disk.
+static HRESULT StartJournalSegment( IPC_STREAM* pIPC )
+{
+    IPC_SEGMENT* pOld = pIPC->pWriteSegment;
+    IPC_SEGMENT* pNew;
+    UINT64 index = pIPC->WriteSegment + 1;
+    HRESULT hr;
+
+    hr = MapSegment( pIPC, index, TRUE, &pNew );
+    if ( FAILED( hr ) )
+        return hr;
+
+    InitSegment( pNew, pIPC->RingBufferSize, pOld->EndCursor, pOld->EndSequence );
+    pIPC->pRing->HeadSegment = index;
+    MemoryBarrier();
+    pOld->Sealed = 1;
+    FlushSegmentFile( pOld, SegmentMappedSize( pIPC ) );
+
+    UnmapSegment( pIPC, pOld );
+    pIPC->pWriteSegment = pNew;
+    pIPC->WriteSegment = index;
+
+    TrimJournal( pIPC );
+    return S_OK;
+}
+
+// Another writer may have started segments since we last wrote
+static HRESULT MapJournalHead( IPC_STREAM* pIPC )
+{
+    UINT64 head = pIPC->pRing->HeadSegment;
+    IPC_SEGMENT* pSegment;
+    HRESULT hr;
+
+    if ( pIPC->pWriteSegment != NULL && pIPC->WriteSegment == head )
+        return S_OK;
+
+    hr = MapSegment( pIPC, head, TRUE, &pSegment );
+    if ( FAILED( hr ) )
+        return hr;
+
+    UnmapSegment( pIPC, pIPC->pWriteSegment );
+    pIPC->pWriteSegment = pSegment;
+    pIPC->WriteSegment = head;
+    return S_OK;
+}
+
+// Appends a whole write to the head segment, starting a new one if it won't
+// fit. Nothing waits for readers: a full segment just means another file.
+static HRESULT WriteJournal(
+    IPC_STREAM* pIPC,
+    const IPC_BUFFER* pBuffers,
+    UINT bufferCount,
+    UINT dataSize )
+{
+    IPC_COPY_ROUTINE pfnCopy = SelectCopy( pIPC, dataSize );
+    IPC_SEGMENT* pSegment;
+    BYTE* pDest;
+    UINT i;
+    HRESULT hr;
+
+    if ( dataSize > pIPC->RingBufferSize )
+        return E_INVALIDARG;
+
+    hr = AcquireWriterLock( pIPC );
+    if ( FAILED( hr ) )
+        return hr;
+
+	IPC_TRY
+	{
+        hr = MapJournalHead( pIPC );
+        if ( SUCCEEDED( hr ) &&
+             pIPC->pWriteSegment->EndCursor - pIPC->pWriteSegment->BaseCursor + dataSize > pIPC->RingBufferSize )
+            hr = StartJournalSegment( pIPC );
+
+        if ( SUCCEEDED( hr ) )
+        {
+            pSegment = pIPC->pWriteSegment;
+            pDest = SegmentData( pSegment ) + ( pSegment->EndCursor - pSegment->BaseCursor );
+            for ( i = 0; i < bufferCount; ++i )
+            {
+                pfnCopy( pDest, (const BYTE*) pBuffers[i].pData, pBuffers[i].dataSize );
+                pDest += pBuffers[i].dataSize;
+            }
+
+            // Readers take the end cursor as their go-ahead, so it goes last
+            if ( pIPC->dwFlags & IPC_STREAM_MESSAGES )
+            {
+                ++pSegment->EndSequence;
+                ++pIPC->pRing->WriteSequence;
+            }
+            MemoryBarrier();
+            pSegment->EndCursor += dataSize;
+            pIPC->pRing->WriteCursor = pSegment->EndCursor;
+            SignalReaders( pIPC );
+
+            CountTransfer( pIPC, &pIPC->pRing->WriterStats, dataSize );
+        }
+	}
+	IPC_EXCEPT
+	{
+        ReleaseWriterLock( pIPC );
+		return E_FAIL;
+	}
+
+    ReleaseWriterLock( pIPC );
+    return hr;
+}
+
+// Writes the segments back-to-back as one contiguous run of the stream
+static HRESULT WriteBuffers(
+    IPC_STREAM* pIPC,
+    const IPC_BUFFER* pBuffers,
+    UINT bufferCount )
+{
+	UINT dataSize = SumBuffers( pBuffers, bufferCount );
+    UINT totalSize = dataSize;
+    IPC_GATHER gather;
+    HRESULT hr;
+
+    if ( dataSize == 0 )
+    {
+        // Just release the semaphore and quit
+        WakeReaders( pIPC );
+        return S_OK;
+    }
+
+    if ( pIPC->dwFlags & IPC_STREAM_MULTI_PRODUCER )
+        return WriteMultiProducer( pIPC, pBuffers, dataSize );
+    if ( pIPC->dwFlags & IPC_STREAM_JOURNAL )
+        return WriteJournal( pIPC, pBuffers, bufferCount, dataSize );
+
+    BeginGather( pIPC, &gather, pBuffers, dataSize );
+    
+    // Lock the ring, which can move us on to a bigger one
+    hr = AcquireWriterLock( pIPC );
+    if ( FAILED( hr ) )
+        return hr;
+
+    // Extract the current ring properties
+	IPC_TRY
+	{
+		UINT64 writeCursor = *pIPC->pWriteCursor;
+        BYTE* pDest = RingPointer( pIPC, writeCursor );
+
+        while ( dataSize > 0 )
+        {
+            UINT packetSize = WritePacketSize( pIPC, writeCursor, dataSize );
+
+            // Wait until the memory becomes available, or take it
+            if ( pIPC->dwFlags & IPC_STREAM_OVERWRITE )
+                OverwriteSpace( pIPC, writeCursor + packetSize );
+            else
+                WriteSpinlock( pIPC, writeCursor + packetSize );
+
+            pDest = GatherToRing( pIPC, pDest, &gather, packetSize );
+
+            writeCursor += packetSize;
+            dataSize -= packetSize;
+
+            // Update the write position so reads can consume the data
+            *pIPC->pWriteCursor = writeCursor;
+            SignalReaders( pIPC );
+        }
+
+        // Every message goes out in a single write
+        if ( pIPC->dwFlags & IPC_STREAM_OVERWRITE )
+            ++pIPC->pRing->WriteSequence;
+
+        CountTransfer( pIPC, &pIPC->pRing->WriterStats, totalSize );
+	}
+	IPC_EXCEPT
+	{
+        ReleaseWriterLock( pIPC );
+		return E_FAIL;
+	}
+
+    // Release the lock
+    ReleaseWriterLock( pIPC );
+    return S_OK;
+}
+
+HRESULT WriteInterprocessStream(
+    _In_ IPC_STREAM* pIPC,
+    _In_reads_(dataSize) LPCVOID pData,
+    _In_ UINT dataSize )
+{
+    IPC_BUFFER buffer;
+
+    buffer.pData = (LPVOID) pData;
+    buffer.dataSize = dataSize;
+    return WriteInterprocessStreamV( pIPC, &buffer, 1 );
+}
+
+HRESULT WriteInterprocessStreamV(
+    _In_ IPC_STREAM* pIPC,
+    _In_reads_(bufferCount) const IPC_BUFFER* pBuffers,
+    _In_ UINT bufferCount )
+{
+    if ( pBuffers == NULL && bufferCount != 0 )
+        return E_INVALIDARG;
+    if ( pIPC->dwFlags & IPC_STREAM_MESSAGES )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION );
+    if ( !( pIPC->dwAccess & IPC_ACCESS_WRITE ) )
+        return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+
+    return WriteBuffers( pIPC, pBuffers, bufferCount );
+}
+
+HRESULT WriteInterprocessMessage(
+    _In_ IPC_STREAM* pIPC,
+    _In_reads_(dataSize) LPCVOID pData,
+    _In_ UINT dataSize )
+{
+    IPC_BUFFER buffer;
+
+    buffer.pData = (LPVOID) pData;
+    buffer.dataSize = dataSize;
+    return WriteInterprocessMessageV( pIPC, &buffer, 1 );
+}
+
+HRESULT WriteInterprocessMessageV(
+    _In_ IPC_STREAM* pIPC,
+    _In_reads_(bufferCount) const IPC_BUFFER* pBuffers,
+    _In_ UINT bufferCount )
+{
+    return WriteInterprocessMessageEx( pIPC, 0, pBuffers, bufferCount );
+}
+
+HRESULT WriteInterprocessMessageEx(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT lane,
+    _In_reads_(bufferCount) const IPC_BUFFER* pBuffers,
+    _In_ UINT bufferCount )
+{
+    IPC_BUFFER buffers[IPC_MAX_MESSAGE_BUFFERS + 1];
+    UINT messageSize;
+
+    if ( pBuffers == NULL && bufferCount != 0 )
+        return E_INVALIDARG;
+    if ( bufferCount > IPC_MAX_MESSAGE_BUFFERS )
+        return E_INVALIDARG;
+    if ( lane >= max( pIPC->Lanes, 1 ) )
+        return E_INVALIDARG;
+    if ( !( pIPC->dwFlags & IPC_STREAM_MESSAGES ) )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION );
+    if ( !( pIPC->dwAccess & IPC_ACCESS_WRITE ) )
+        return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+
+    if ( pIPC->dwFlags & IPC_STREAM_PRIORITY )
+        BindLane( pIPC, lane );
+
+    // The length prefix goes out in the same write as the payload, so it can
+    // never be separated from it by another producer
+    messageSize = SumBuffers( pBuffers, bufferCount );
+    if ( ( pIPC->dwFlags & IPC_STREAM_OVERWRITE ) &&
+         messageSize > pIPC->RingBufferSize - sizeof(messageSize) )
+        return E_INVALIDARG;
+    buffers[0].pData = &messageSize;
+    buffers[0].dataSize = sizeof(messageSize);
+    memcpy( buffers + 1, pBuffers, bufferCount * sizeof(IPC_BUFFER) );
+    return WriteBuffers( pIPC, buffers, bufferCount + 1 );
+}
+
+static UINT64 ReadSpinlock( 
+    IPC_STREAM* pIPC,
+    UINT64 readCursor )
+{
+    IPC_RING_STATS* pStats = &pIPC->pRing->ReaderStats;
+    IPC_SPIN spin;
+
+    if ( ReadDataAvailable( pIPC, readCursor ) )
+        return pIPC->CachedWriteCursor;
+
+    BeginSpin( &spin );
+    while ( !ReadDataAvailable( pIPC, readCursor ) && !RingRetired( pIPC ) && SpinOnce( pIPC, &spin ) )
+    {
+    }
+    CountStat( pIPC, pStats, &pStats->Spins, spin.Count );
+
+    if ( !ReadDataAvailable( pIPC, readCursor ) && !RingRetired( pIPC ) )
+    {
+        UINT64 sleepStart = QueryClockMicroseconds();
+
+        AtomicIncrement( &pIPC->pRing->ReadWaiters );
+        while ( !ReadDataAvailable( pIPC, readCursor ) && !RingRetired( pIPC ) )
+        {
+            // The event only wakes one of several broadcast readers, so poll
+            if ( pIPC->dwFlags & IPC_STREAM_BROADCAST )
+                WaitStreamEventTimeout( pIPC->hWriteEvent, IPC_EVENT_POLL_MS );
+            else
+                WaitStreamEvent( pIPC->hWriteEvent );
+        }
+        AtomicDecrement( &pIPC->pRing->ReadWaiters );
+        CountSleep( pIPC, pStats, sleepStart );
+    }
+
+    // Nothing more is coming to a retired ring. Once everything in it has
+    // been consumed we wait in the next one instead; until then the caller
+    // has what is left.
+    while ( !ReadDataAvailable( pIPC, readCursor ) && *pIPC->pReadCursor == readCursor )
+    {
+        if ( SUCCEEDED( MoveReader( pIPC ) ) )
+            return ReadSpinlock( pIPC, readCursor );
+        WaitStreamEventTimeout( pIPC->hWriteEvent, IPC_EVENT_POLL_MS );
+    }
+
+#ifdef _DEBUG
+	assert( *pIPC->pReadCursor <= *pIPC->pWriteCursor );
+#endif
+
+    return pIPC->CachedWriteCursor;
+}
+
+// The read-side counterpart of IPC_GATHER
+typedef struct _IPC_SCATTER
+{
+    const IPC_BUFFER*	pBuffer;
+    BYTE*				pDest;
+    UINT				remaining;
+    IPC_COPY_ROUTINE	pfnCopy;
+} IPC_SCATTER;
+
+static const BYTE* ScatterFromRing(
+    IPC_STREAM* pIPC,
+    const BYTE* pSrc,
+    IPC_SCATTER* pScatter,
+    UINT size )
+{
+    while ( size > 0 )
+    {
+        UINT copySize;
+
+        while ( pScatter->remaining == 0 )
+        {
+            ++pScatter->pBuffer;
+            pScatter->pDest = (BYTE*) pScatter->pBuffer->pData;
+            pScatter->remaining = pScatter->pBuffer->dataSize;
+        }
+
+        copySize = min( size, pScatter->remaining );
+        pSrc = CopyFromRing( pIPC, pScatter->pfnCopy, pScatter->pDest, pSrc, copySize );
+
+        pScatter->pDest += copySize;
+        pScatter->remaining -= copySize;
+        size -= copySize;
+    }
+
+    return pSrc;
+}
+
+// Broadcast and journal readers each own their cursor, so only a shared one
+// needs the lock
+static void AcquireReaderLock( IPC_STREAM* pIPC )
+{
+    IPC_RING_STATS* pStats = &pIPC->pRing->ReaderStats;
+
+    if ( pIPC->dwFlags & ( IPC_STREAM_BROADCAST | IPC_STREAM_JOURNAL ) )
+        return;
+
+    if ( !TryAcquireStreamLock( pIPC->hReadLock ) )
+    {
+        AcquireStreamLock( pIPC->hReadLock );
+        CountStat( pIPC, pStats, &pStats->LockContention, 1 );
+    }
+}
+
+static void ReleaseReaderLock( IPC_STREAM* pIPC )
+{
+    if ( !( pIPC->dwFlags & ( IPC_STREAM_BROADCAST | IPC_STREAM_JOURNAL ) ) )
+        ReleaseStreamLock( pIPC->hReadLock );
+}
+
+// Whether the writer has started overwriting anything from readCursor on.
+// Called after copying out of an overwrite stream; the writer moves the tail
+// before it writes, so if we copied anything of its we see the new tail.
+static BOOL ReaderOverrun(
+    IPC_STREAM* pIPC,
+    UINT64 readCursor )
+{
+    MemoryBarrier();
+    return pIPC->pRing->TailCursor > readCursor;
+}
+
+// Moves a lapped reader on to the tail, counting everything it missed since
+// readCursor. Returns the new read cursor.
+static UINT64 ResyncReader(
+    IPC_STREAM* pIPC,
+    UINT64 readCursor )
+{
+    IPC_RING* pRing = pIPC->pRing;
+    UINT64 tailCursor, tailSequence;
+    LONG generation;
+
+    do
+    {
+        generation = pRing->Generation;
+        MemoryBarrier();
+        tailCursor = pRing->TailCursor;
+        tailSequence = pRing->TailSequence;
+        MemoryBarrier();
+    }
+    while ( ( generation & 1 ) || generation != pRing->Generation );
+
+    pIPC->DroppedBytes += tailCursor - readCursor;
+    if ( pIPC->dwFlags & IPC_STREAM_MESSAGES )
+    {
+        pIPC->DroppedMessages += tailSequence - *pIPC->pReadSequence;
+        *pIPC->pReadSequence = tailSequence;
+    }
+
+    *pIPC->pReadCursor = tailCursor;
+    return tailCursor;
+}
+
+static void BeginScatter(
+    IPC_STREAM* pIPC,
+    IPC_SCATTER* pScatter,
+    const IPC_BUFFER* pBuffers,
+    UINT dataSize )
+{
+    pScatter->pfnCopy = SelectCopy( pIPC, dataSize );
+    pScatter->pBuffer = pBuffers;
+    pScatter->pDest = (BYTE*) pBuffers->pData;
+    pScatter->remaining = pBuffers->dataSize;
+}
+
+// Reads from the stream with the read lock already held. Returns FALSE if the
+// reader was lapped and had to skip ahead.
+static BOOL ReadLocked(
+    IPC_STREAM* pIPC,
+    const IPC_BUFFER* pBuffers,
+    UINT dataSize )
+{
+    UINT64 readCursor = *pIPC->pReadCursor;
+    UINT64 readStart = readCursor;
+    UINT remaining = dataSize;
+    const BYTE* pSrc = RingPointer( pIPC, readCursor );
+    IPC_SCATTER scatter;
+    BOOL bIntact = TRUE;
+
+    if ( dataSize == 0 )
+        return TRUE;
+
+    BeginScatter( pIPC, &scatter, pBuffers, dataSize );
+
+    while ( remaining > 0 )
+    {
+        // Wait until the memory becomes available, maybe in a later ring
+        UINT generation = pIPC->Generation;
+        UINT64 writeCursor = ReadSpinlock( pIPC, readCursor );
+
+        // How much memory is available?
+        UINT available = min( remaining, ReadPacketSize( pIPC, (UINT) (writeCursor - readCursor) ) );
+
+        if ( pIPC->Generation != generation )
+            pSrc = RingPointer( pIPC, readCursor );
+        pSrc = ScatterFromRing( pIPC, pSrc, &scatter, available );
+
+        // If we were lapped, throw the whole read away and start again
+        if ( ( pIPC->dwFlags & IPC_STREAM_OVERWRITE ) && ReaderOverrun( pIPC, readCursor ) )
+        {
+            readCursor = readStart = ResyncReader( pIPC, readStart );
+            pSrc = RingPointer( pIPC, readCursor );
+            remaining = dataSize;
+            BeginScatter( pIPC, &scatter, pBuffers, dataSize );
+            bIntact = FALSE;
+            continue;
+        }
+
+        readCursor += available;
+        remaining -= available;
+
+        // Free it up so writes can resume
+        *pIPC->pReadCursor = readCursor;
+        SignalWriters( pIPC );
+    }
+
+    return bIntact;
+}
+
+// ReadInterprocessMessage for an overwrite stream, where a message has to be
+// copied out whole before it can be known to be intact
+static HRESULT ReadOverwrittenMessage(
+    IPC_STREAM* pIPC,
+    LPVOID pData,
+    UINT bufferSize,
+    UINT* pMessageSize )
+{
+    BOOL bIntact = TRUE;
+
+    for ( ;; )
+    {
+        UINT64 readCursor = *pIPC->pReadCursor;
+        UINT64 writeCursor = ReadSpinlock( pIPC, readCursor );
+        UINT messageSize;
+
+        while ( writeCursor - readCursor < sizeof(messageSize) )
+        {
+            writeCursor = ReadSpinlock( pIPC, writeCursor );
+        }
+
+        CopyFromRing( pIPC, CopyCached, (BYTE*) &messageSize,
+            RingPointer( pIPC, readCursor ), sizeof(messageSize) );
+        if ( ReaderOverrun( pIPC, readCursor ) )
+        {
+            ResyncReader( pIPC, readCursor );
+            bIntact = FALSE;
+            continue;
+        }
+
+        *pMessageSize = messageSize;
+        if ( messageSize > bufferSize )
+            return HRESULT_FROM_WIN32( ERROR_INSUFFICIENT_BUFFER );
+
+        while ( writeCursor - readCursor < sizeof(messageSize) + messageSize )
+        {
+            writeCursor = ReadSpinlock( pIPC, writeCursor );
+        }
+
+        CopyFromRing( pIPC, SelectCopy( pIPC, messageSize ), (BYTE*) pData,
+            RingPointer( pIPC, readCursor + sizeof(messageSize) ), messageSize );
+        if ( ReaderOverrun( pIPC, readCursor ) )
+        {
+            ResyncReader( pIPC, readCursor );
+            bIntact = FALSE;
+            continue;
+        }
+
+        *pIPC->pReadCursor = readCursor + sizeof(messageSize) + messageSize;
+        ++*pIPC->pReadSequence;
+        return bIntact ? S_OK : S_FALSE;
+    }
+}
+
+// Moves a reader at the end of a sealed segment on to the next one. If
+// retention has deleted that, it skips to the oldest one left, counting what
+// it missed, and returns S_FALSE.
+static HRESULT MoveJournalReader( IPC_STREAM* pIPC )
+{
+    IPC_SEGMENT* pSegment;
+    UINT64 index = pIPC->ReadSegment + 1;
+    HRESULT hr;
+
+    hr = MapSegment( pIPC, index, FALSE, &pSegment );
+    if ( FAILED( hr ) )
+    {
+        index = pIPC->pRing->TailSegment;
+        if ( index <= pIPC->ReadSegment + 1 )
+            return hr;
+        hr = MapSegment( pIPC, index, FALSE, &pSegment );
+        if ( FAILED( hr ) )
+            return hr;
+    }
+
+    hr = S_OK;
+    if ( pSegment->BaseCursor > pIPC->JournalCursor )
+    {
+        pIPC->DroppedBytes += pSegment->BaseCursor - pIPC->JournalCursor;
+        pIPC->DroppedMessages += pSegment->BaseSequence - pIPC->JournalSequence;
+        hr = S_FALSE;
+    }
+
+    UnmapSegment( pIPC, pIPC->pReadSegment );
+    pIPC->pReadSegment = pSegment;
+    pIPC->ReadSegment = index;
+    pIPC->JournalCursor = pSegment->BaseCursor;
+    pIPC->JournalSequence = pSegment->BaseSequence;
+    return hr;
+}
+
+// How much there is to read in our segment, moving on to the next once we
+// have all of a sealed one. Sets *pbSkipped if that meant skipping anything.
+static UINT PollJournal(
+    IPC_STREAM* pIPC,
+    BOOL* pbSkipped )
+{
+    IPC_SEGMENT* pSegment = pIPC->pReadSegment;
+    UINT64 endCursor = pSegment->EndCursor;
+
+    if ( endCursor == pIPC->JournalCursor && pSegment->Sealed )
+    {
+        // It is sealed only after its last write, so its end is final now
+        MemoryBarrier();
+        endCursor = pSegment->EndCursor;
+        if ( endCursor == pIPC->JournalCursor )
+        {
+            if ( MoveJournalReader( pIPC ) == S_FALSE )
+                *pbSkipped = TRUE;
+            return 0;
+        }
+    }
+
+    MemoryBarrier();
+    return (UINT) ( endCursor - pIPC->JournalCursor );
+}
+
+// ReadSpinlock for a journal reader. Readers don't share a cursor the writers
+// wait on, so they poll the event rather than count on being woken.
+static UINT JournalSpinlock(
+    IPC_STREAM* pIPC,
+    BOOL* pbSkipped )
+{
+    IPC_RING_STATS* pStats = &pIPC->pRing->ReaderStats;
+    IPC_SPIN spin;
+    UINT available;
+
+    available = PollJournal( pIPC, pbSkipped );
+    if ( available > 0 )
+        return available;
+
+    BeginSpin( &spin );
+    while ( ( available = PollJournal( pIPC, pbSkipped ) ) == 0 && SpinOnce( pIPC, &spin ) )
+    {
+    }
+    CountStat( pIPC, pStats, &pStats->Spins, spin.Count );
+
+    if ( available == 0 )
+    {
+        UINT64 sleepStart = QueryClockMicroseconds();
+
+        AtomicIncrement( &pIPC->pRing->ReadWaiters );
+        while ( ( available = PollJournal( pIPC, pbSkipped ) ) == 0 )
+        {
+            WaitStreamEventTimeout( pIPC->hWriteEvent, IPC_EVENT_POLL_MS );
+        }
+        AtomicDecrement( &pIPC->pRing->ReadWaiters );
+        CountSleep( pIPC, pStats, sleepStart );
+    }
+
+    return available;
+}
+
+static const BYTE* GetJournalReadPointer( IPC_STREAM* pIPC )
+{
+    return SegmentData( pIPC->pReadSegment ) + ( pIPC->JournalCursor - pIPC->pReadSegment->BaseCursor );
+}
+
+// Reads from a byte journal. If retention overtakes us part way through, the
+// read starts again from wherever we skipped to.
+static HRESULT ReadJournal(
+    IPC_STREAM* pIPC,
+    const IPC_BUFFER* pBuffers,
+    UINT dataSize )
+{
+    IPC_SCATTER scatter;
+    UINT remaining = dataSize;
+    BOOL bIntact = TRUE;
+
+    BeginScatter( pIPC, &scatter, pBuffers, dataSize );
+    while ( remaining > 0 )
+    {
+        BOOL bSkipped = FALSE;
+        UINT available = JournalSpinlock( pIPC, &bSkipped );
+        const BYTE* pSrc = GetJournalReadPointer( pIPC );
+
+        if ( bSkipped )
+        {
+            bIntact = FALSE;
+            BeginScatter( pIPC, &scatter, pBuffers, dataSize );
+            remaining = dataSize;
+        }
+
+        available = min( available, remaining );
+        remaining -= available;
+        pIPC->JournalCursor += available;
+        while ( available > 0 )
+        {
+            UINT copySize;
+
+            while ( scatter.remaining == 0 )
+            {
+                ++scatter.pBuffer;
+                scatter.pDest = (BYTE*) scatter.pBuffer->pData;
+                scatter.remaining = scatter.pBuffer->dataSize;
+            }
+
+            copySize = min( available, scatter.remaining );
+            scatter.pfnCopy( scatter.pDest, pSrc, copySize );
+            pSrc += copySize;
+            scatter.pDest += copySize;
+            scatter.remaining -= copySize;
+            available -= copySize;
+        }
+    }
+
+    return bIntact ? S_OK : S_FALSE;
+}
+
+// Writers publish each message whole, and never across two segments
+static HRESULT ReadJournalMessage(
+    IPC_STREAM* pIPC,
+    LPVOID pData,
+    UINT bufferSize,
+    UINT* pMessageSize )
+{
+    BOOL bSkipped = FALSE;
+    const BYTE* pSrc;
+    UINT messageSize;
+
+    JournalSpinlock( pIPC, &bSkipped );
+    pSrc = GetJournalReadPointer( pIPC );
+
+    memcpy( &messageSize, pSrc, sizeof(messageSize) );
+    *pMessageSize = messageSize;
+    if ( messageSize > bufferSize )
+        return HRESULT_FROM_WIN32( ERROR_INSUFFICIENT_BUFFER );
+
+    if ( messageSize > 0 )
+        SelectCopy( pIPC, messageSize )( (BYTE*) pData, pSrc + sizeof(messageSize), messageSize );
+    pIPC->JournalCursor += sizeof(messageSize) + messageSize;
+    ++pIPC->JournalSequence;
+    return bSkipped ? S_FALSE : S_OK;
+}
+
+HRESULT ReadInterprocessStream(
+    _In_ IPC_STREAM* pIPC,
+    _Out_writes_(*pDataSize) LPVOID pData,
+    _Out_ UINT dataSize )
+{
+    IPC_BUFFER buffer;
+
+    buffer.pData = pData;
+    buffer.dataSize = dataSize;
+    return ReadInterprocessStreamV( pIPC, &buffer, 1 );
+}
+
+HRESULT ReadInterprocessStreamV(
+    _In_ IPC_STREAM* pIPC,
+    _In_reads_(bufferCount) const IPC_BUFFER* pBuffers,
+    _In_ UINT bufferCount )
+{
+    HRESULT hr = S_OK;
+
+    if ( pBuffers == NULL && bufferCount != 0 )
+        return E_INVALIDARG;
+    if ( pIPC->dwFlags & IPC_STREAM_MESSAGES )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION );
+    if ( !( pIPC->dwAccess & IPC_ACCESS_READ ) )
+        return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+
+    // Secure the read lock
+    AcquireReaderLock( pIPC );
+
+	IPC_TRY
+	{
+        UINT dataSize = SumBuffers( pBuffers, bufferCount );
+
+        if ( pIPC->dwFlags & IPC_STREAM_JOURNAL )
+            hr = ReadJournal( pIPC, pBuffers, dataSize );
+        else if ( !ReadLocked( pIPC, pBuffers, dataSize ) )
+            hr = S_FALSE;
+        CountTransfer( pIPC, &pIPC->pRing->ReaderStats, dataSize );
+	}
+	IPC_EXCEPT
+	{
+        ReleaseReaderLock( pIPC );
+		return E_FAIL;
+	}
+
+    ReleaseReaderLock( pIPC );
+    return hr;
+}
+
+// Binds a sharded reader to the next shard with anything in it, taking them in
+// turn so that a busy producer can't starve the rest. A priority reader always
+// takes the highest lane with anything in it instead.
+static BOOL FindShard( IPC_STREAM* pIPC )
+{
+    IPC_SHARD* pShards = GetShards( pIPC );
+    UINT count = CountSubRings( pIPC );
+    UINT i, shard;
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( pIPC->dwFlags & IPC_STREAM_PRIORITY )
+            shard = count - 1 - i;
+        else
+            shard = ( pIPC->NextShard + i ) % count;
+        if ( pShards[shard].WriteCursor != pShards[shard].ReadCursor )
+        {
+            BindShard( pIPC, shard );
+            pIPC->NextShard = shard + 1;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+// ReadSpinlock across every shard at once
+static void SelectShard( IPC_STREAM* pIPC )
+{
+    IPC_RING_STATS* pStats = &pIPC->pRing->ReaderStats;
+    IPC_SPIN spin;
+
+    if ( FindShard( pIPC ) )
+        return;
+
+    BeginSpin( &spin );
+    while ( !FindShard( pIPC ) && SpinOnce( pIPC, &spin ) )
+    {
+    }
+    CountStat( pIPC, pStats, &pStats->Spins, spin.Count );
+
+    if ( !FindShard( pIPC ) )
+    {
+        UINT64 sleepStart = QueryClockMicroseconds();
+
+        AtomicIncrement( &pIPC->pRing->ReadWaiters );
+        while ( !FindShard( pIPC ) )
+        {
+            WaitStreamEvent( pIPC->hWriteEvent );
+        }
+        AtomicDecrement( &pIPC->pRing->ReadWaiters );
+        CountSleep( pIPC, pStats, sleepStart );
+    }
+}
+
+// Reads a message with the read lock already held
+static HRESULT ReadMessageLocked(
+    IPC_STREAM* pIPC,
+    LPVOID pData,
+    UINT bufferSize,
+    UINT* pMessageSize )
+{
+    UINT64 readCursor = *pIPC->pReadCursor;
+    UINT64 writeCursor = ReadSpinlock( pIPC, readCursor );
+    UINT messageSize;
+
+    // Peek at the length prefix; writers always publish it with the payload
+    while ( writeCursor - readCursor < sizeof(messageSize) )
+    {
+        writeCursor = ReadSpinlock( pIPC, writeCursor );
+    }
+
+    CopyFromRing( pIPC, CopyCached, (BYTE*) &messageSize,
+        RingPointer( pIPC, readCursor ), sizeof(messageSize) );
+    *pMessageSize = messageSize;
+
+    // Leave the message where it is so the caller can retry
+    if ( messageSize > bufferSize )
+        return HRESULT_FROM_WIN32( ERROR_INSUFFICIENT_BUFFER );
+
+    *pIPC->pReadCursor = readCursor + sizeof(messageSize);
+    if ( messageSize > 0 )
+    {
+        IPC_BUFFER buffer;
+
+        buffer.pData = pData;
+        buffer.dataSize = messageSize;
+        ReadLocked( pIPC, &buffer, messageSize );
+    }
+    else
+    {
+        SignalWriters( pIPC );
+    }
+
+    return S_OK;
+}
+
+HRESULT ReadInterprocessMessage(
+    _In_ IPC_STREAM* pIPC,
+    _Out_writes_opt_(bufferSize) LPVOID pData,
+    _In_ UINT bufferSize,
+    _Out_ UINT* pMessageSize )
+{
+    HRESULT hr;
+
+    if ( pMessageSize == NULL || ( pData == NULL && bufferSize != 0 ) )
+        return E_INVALIDARG;
+    if ( !( pIPC->dwFlags & IPC_STREAM_MESSAGES ) )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION );
+    if ( !( pIPC->dwAccess & IPC_ACCESS_READ ) )
+        return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+
+    AcquireReaderLock( pIPC );
+
+	IPC_TRY
+	{
+        if ( pIPC->dwFlags & ( IPC_STREAM_SHARDED | IPC_STREAM_PRIORITY ) )
+            SelectShard( pIPC );
+
+        if ( pIPC->dwFlags & IPC_STREAM_OVERWRITE )
+            hr = ReadOverwrittenMessage( pIPC, pData, bufferSize, pMessageSize );
+        else if ( pIPC->dwFlags & IPC_STREAM_JOURNAL )
+            hr = ReadJournalMessage( pIPC, pData, bufferSize, pMessageSize );
+        else
+            hr = ReadMessageLocked( pIPC, pData, bufferSize, pMessageSize );
+
+        if ( SUCCEEDED( hr ) )
+            CountTransfer( pIPC, &pIPC->pRing->ReaderStats, sizeof(UINT) + *pMessageSize );
+	}
+	IPC_EXCEPT
+	{
+        ReleaseReaderLock( pIPC );
+		return E_FAIL;
+	}
+
+    ReleaseReaderLock( pIPC );
+    return hr;
+}
+
+HRESULT SeekInterprocessStream(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT64 position )
+{
+    HRESULT hr;
+
+    if ( pIPC == NULL )
+        return E_INVALIDARG;
+    if ( !( pIPC->dwFlags & IPC_STREAM_JOURNAL ) )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION );
+    if ( !( pIPC->dwAccess & IPC_ACCESS_READ ) )
+        return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+
+	IPC_TRY
+	{
+        hr = SeekJournal( pIPC, position );
+	}
+	IPC_EXCEPT
+	{
+		return E_FAIL;
+	}
+
+    return hr;
+}
+
+HRESULT QueryInterprocessStreamPosition(
+    _In_ IPC_STREAM* pIPC,
+    _Out_ UINT64* pPosition )
+{
+    if ( pIPC == NULL || pPosition == NULL )
+        return E_INVALIDARG;
+    if ( !( pIPC->dwFlags & IPC_STREAM_JOURNAL ) )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION );
+
+    *pPosition = ( pIPC->dwAccess & IPC_ACCESS_READ ) ? pIPC->JournalCursor : pIPC->pRing->WriteCursor;
+    return S_OK;
+}
+
+HRESULT DeleteInterprocessJournal(
+    _In_z_ LPCWSTR szDirectory,
+    _In_z_ LPCWSTR szName )
+{
+    LPWSTR szPrefix;
+    UINT64 first, last, index;
+
+    if ( szDirectory == NULL || *szDirectory == 0 || szName == NULL || *szName == 0 )
+        return E_INVALIDARG;
+
+    szPrefix = CreateJournalPrefix( szDirectory, szName );
+    if ( szPrefix == NULL )
+        return E_OUTOFMEMORY;
+
+    if ( !FindSegmentFiles( szPrefix, &first, &last ) )
+    {
+        free( szPrefix );
+        return S_FALSE;
+    }
+
+    for ( index = first; index <= last; ++index )
+        DeleteSegment( szPrefix, index );
+
+    free( szPrefix );
+    return S_OK;
+}
+
+HRESULT AcquireWriteRegion(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT regionSize,
+    _Out_ LPVOID* ppRegion )
+{
+    UINT64 writeCursor;
+
+    if ( pIPC == NULL || ppRegion == NULL )
+        return E_INVALIDARG;
+    if ( regionSize == 0 || regionSize > pIPC->RingBufferSize )
+        return E_INVALIDARG;
+    if ( !pIPC->pMirror )
+        return HRESULT_FROM_WIN32( ERROR_NOT_SUPPORTED );
+    if ( pIPC->dwFlags & IPC_STREAM_MESSAGES )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION );
+    if ( pIPC->PendingWriteSize != 0 )
+        return E_UNEXPECTED;
+    if ( !( pIPC->dwAccess & IPC_ACCESS_WRITE ) )
+        return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+
+    if ( !( pIPC->dwFlags & IPC_STREAM_MULTI_PRODUCER ) )
+    {
+        HRESULT hr = AcquireWriterLock( pIPC );
+
+        if ( FAILED( hr ) )
+            return hr;
+    }
+
+	IPC_TRY
+	{
+        if ( pIPC->dwFlags & IPC_STREAM_MULTI_PRODUCER )
+        {
+            IPC_SPIN spin;
+
+            BeginSpin( &spin );
+            writeCursor = AtomicFetchAdd64( &pIPC->pRing->ReserveCursor, regionSize );
+            while ( !WriteSpaceAvailable( pIPC, writeCursor + regionSize ) )
+            {
+                MultiProducerBackoff( pIPC, &spin );
+            }
+            EndMultiProducerBackoff( pIPC, &spin );
+        }
+        else
+        {
+            writeCursor = *pIPC->pWriteCursor;
+            WriteSpinlock( pIPC, writeCursor + regionSize );
+        }
+	}
+	IPC_EXCEPT
+	{
+        if ( !( pIPC->dwFlags & IPC_STREAM_MULTI_PRODUCER ) )
+            ReleaseStreamLock( pIPC->hWriteLock );
+		return E_FAIL;
+	}
+
+    pIPC->PendingWriteCursor = writeCursor;
+    pIPC->PendingWriteSize = regionSize;
+
+    *ppRegion = RingPointer( pIPC, writeCursor );
+    return S_OK;
+}
+
+HRESULT CommitWrite(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT dataSize )
+{
+    UINT64 writeCursor;
+
+    if ( pIPC == NULL )
+        return E_INVALIDARG;
+    if ( pIPC->PendingWriteSize == 0 )
+        return E_UNEXPECTED;
+    if ( dataSize > pIPC->PendingWriteSize )
+        return E_INVALIDARG;
+
+    // Other producers have already reserved the space after ours
+    if ( ( pIPC->dwFlags & IPC_STREAM_MULTI_PRODUCER ) && dataSize != pIPC->PendingWriteSize )
+        return E_INVALIDARG;
+
+    writeCursor = pIPC->PendingWriteCursor;
+    pIPC->PendingWriteSize = 0;
+
+	IPC_TRY
+	{
+        if ( pIPC->dwFlags & IPC_STREAM_MULTI_PRODUCER )
+        {
+            UINT64 committed = writeCursor;
+            IPC_SPIN spin;
+
+            BeginSpin( &spin );
+            while ( !PublishReservation( pIPC, &committed, writeCursor + dataSize ) )
+            {
+                MultiProducerBackoff( pIPC, &spin );
+            }
+            EndMultiProducerBackoff( pIPC, &spin );
+            CountTransfer( pIPC, &pIPC->pRing->WriterStats, dataSize );
+            return S_OK;
+        }
+
+        *pIPC->pWriteCursor = writeCursor + dataSize;
+        SignalReaders( pIPC );
+        CountTransfer( pIPC, &pIPC->pRing->WriterStats, dataSize );
+	}
+	IPC_EXCEPT
+	{
+        ReleaseStreamLock( pIPC->hWriteLock );
+		return E_FAIL;
+	}
+
+    ReleaseStreamLock( pIPC->hWriteLock );
+    return S_OK;
+}
+
+HRESULT AcquireReadRegion(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT minSize,
+    _Out_ LPCVOID* ppRegion,
+    _Out_ UINT* pRegionSize )
+{
+    UINT64 readCursor;
+    UINT64 writeCursor;
+
+    if ( pIPC == NULL || ppRegion == NULL || pRegionSize == NULL )
+        return E_INVALIDARG;
+    if ( minSize > pIPC->RingBufferSize )
+        return E_INVALIDARG;
+    if ( !pIPC->pMirror )
+        return HRESULT_FROM_WIN32( ERROR_NOT_SUPPORTED );
+    if ( pIPC->dwFlags & IPC_STREAM_MESSAGES )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION );
+    if ( pIPC->PendingReadSize != 0 )
+        return E_UNEXPECTED;
+    if ( !( pIPC->dwAccess & IPC_ACCESS_READ ) )
+        return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+
+    minSize = max( minSize, 1 );
+
+    AcquireReaderLock( pIPC );
+
+	IPC_TRY
+	{
+        readCursor = *pIPC->pReadCursor;
+        writeCursor = ReadSpinlock( pIPC, readCursor );
+        while ( writeCursor - readCursor < minSize && !RingRetired( pIPC ) )
+        {
+            writeCursor = ReadSpinlock( pIPC, writeCursor );
+        }
+	}
+	IPC_EXCEPT
+	{
+        ReleaseReaderLock( pIPC );
+		return E_FAIL;
+	}
+
+    pIPC->PendingReadSize = (UINT) ( writeCursor - readCursor );
+
+    *ppRegion = RingPointer( pIPC, readCursor );
+    *pRegionSize = pIPC->PendingReadSize;
+    return S_OK;
+}
+
+HRESULT ReleaseRead(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT dataSize )
+{
+    if ( pIPC == NULL )
+        return E_INVALIDARG;
+    if ( pIPC->PendingReadSize == 0 )
+        return E_UNEXPECTED;
+    if ( dataSize > pIPC->PendingReadSize )
+        return E_INVALIDARG;
+
+    pIPC->PendingReadSize = 0;
+
+	IPC_TRY
+	{
+        if ( dataSize > 0 )
+        {
+            *pIPC->pReadCursor += dataSize;
+            SignalWriters( pIPC );
+            CountTransfer( pIPC, &pIPC->pRing->ReaderStats, dataSize );
+        }
+	}
+	IPC_EXCEPT
+	{
+        ReleaseReaderLock( pIPC );
+		return E_FAIL;
+	}
+
+    ReleaseReaderLock( pIPC );
+    return S_OK;
+}
+
+// Finds the block a pointer from AllocateInterprocessBlock or
+// ReceiveInterprocessBlock refers to
+static HRESULT FindArenaBlock(
+    IPC_STREAM* pIPC,
+    LPCVOID pBlock,
+    UINT* pIndex )
+{
+    SIZE_T offset;
+
+    if ( pIPC->pArena == NULL )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION );
+    if ( (const BYTE*) pBlock < pIPC->pArenaData )
+        return E_INVALIDARG;
+
+    offset = (const BYTE*) pBlock - pIPC->pArenaData;
+    if ( offset % pIPC->ArenaBlockSize != 0 || offset / pIPC->ArenaBlockSize >= pIPC->ArenaBlocks )
+        return E_INVALIDARG;
+
+    *pIndex = (UINT) ( offset / pIPC->ArenaBlockSize );
+    return S_OK;
+}
+
+static BOOL PopArenaBlock(
+    IPC_STREAM* pIPC,
+    UINT* pIndex )
+{
+    UINT64 head, next;
+    UINT index;
+
+    do
+    {
+        head = pIPC->pArena->FreeList;
+        if ( (UINT) head == 0 )
+            return FALSE;
+
+        index = (UINT) head - 1;
+        next = ( ( head >> 32 ) + 1 ) << 32 | pIPC->pArenaBlocks[index].Next;
+    }
+    while ( AtomicCompareExchange64( &pIPC->pArena->FreeList, next, head ) != head );
+
+    *pIndex = index;
+    return TRUE;
+}
+
+static void PushArenaBlock(
+    IPC_STREAM* pIPC,
+    UINT index )
+{
+    UINT64 head, next;
+
+    do
+    {
+        head = pIPC->pArena->FreeList;
+        pIPC->pArenaBlocks[index].Next = (UINT) head;
+        next = ( ( head >> 32 ) + 1 ) << 32 | ( index + 1 );
+    }
+    while ( AtomicCompareExchange64( &pIPC->pArena->FreeList, next, head ) != head );
+}
+
+// A reference goes through the stream as any other write would, so it keeps
+// its place among them
+static HRESULT WriteBlockReference(
+    IPC_STREAM* pIPC,
+    const IPC_BLOCK_REFERENCE* pReference )
+{
+    if ( pIPC->dwFlags & IPC_STREAM_MESSAGES )
+        return WriteInterprocessMessage( pIPC, pReference, sizeof(*pReference) );
+    return WriteInterprocessStream( pIPC, pReference, sizeof(*pReference) );
+}
+
+// Readers give blocks back without waking anyone, so an empty pool is polled
+HRESULT AllocateInterprocessBlock(
+    IPC_STREAM* pIPC,
+    UINT dataSize,
+    LPVOID* ppBlock )
+{
+    IPC_SPIN spin;
+    UINT index;
+
+    if ( pIPC == NULL || ppBlock == NULL )
+        return E_INVALIDARG;
+    if ( pIPC->pArena == NULL )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION );
+    if ( !( pIPC->dwAccess & IPC_ACCESS_WRITE ) )
+        return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+    if ( dataSize > pIPC->ArenaBlockSize )
+        return E_INVALIDARG;
+
+	IPC_TRY
+	{
+        BeginSpin( &spin );
+        while ( !PopArenaBlock( pIPC, &index ) )
+        {
+            if ( !SpinOnce( pIPC, &spin ) )
+                Sleep( IPC_EVENT_POLL_MS );
+        }
+
+        // The block is its writer's until it is sent
+        pIPC->pArenaBlocks[index].RefCount = 1;
+	}
+	IPC_EXCEPT
+	{
+		return E_FAIL;
+	}
+
+    *ppBlock = pIPC->pArenaData + (SIZE_T) index * pIPC->ArenaBlockSize;
+    return S_OK;
+}
+
+HRESULT SendInterprocessBlock(
+    IPC_STREAM* pIPC,
+    LPVOID pBlock,
+    UINT dataSize )
+{
+    IPC_READER_SLOT* pSlots;
+    IPC_BLOCK_REFERENCE reference;
+    LONG readers = 0;
+    HRESULT hr;
+    UINT i;
+
+    if ( pIPC == NULL )
+        return E_INVALIDARG;
+    hr = FindArenaBlock( pIPC, pBlock, &reference.Block );
+    if ( FAILED( hr ) )
+        return hr;
+    if ( dataSize > pIPC->ArenaBlockSize )
+        return E_INVALIDARG;
+    reference.DataSize = dataSize;
+
+    if ( !( pIPC->dwFlags & IPC_STREAM_BROADCAST ) )
+        return WriteBlockReference( pIPC, &reference );
+
+    // Every reader there is now sees the reference, and nobody can join or
+    // leave until it has been written
+    AcquireArenaLock( pIPC );
+    pSlots = (IPC_READER_SLOT*) ( (BYTE*) pIPC->pRing + IPC_READER_SLOTS_OFFSET );
+    for ( i = 0; i < pIPC->MaxReaders; ++i )
+    {
+        if ( pSlots[i].InUse )
+            ++readers;
+    }
+
+    if ( readers == 0 )
+    {
+        ReleaseArenaLock( pIPC );
+        return ReleaseInterprocessBlock( pIPC, pBlock );
+    }
+
+    pIPC->pArenaBlocks[reference.Block].RefCount = readers;
+    hr = WriteBlockReference( pIPC, &reference );
+    if ( FAILED( hr ) )
+        pIPC->pArenaBlocks[reference.Block].RefCount = 1;
+    ReleaseArenaLock( pIPC );
+    return hr;
+}
+
+HRESULT ReceiveInterprocessBlock(
+    IPC_STREAM* pIPC,
+    LPCVOID* ppBlock,
+    UINT* pDataSize )
+{
+    IPC_BLOCK_REFERENCE reference;
+    UINT messageSize = sizeof(reference);
+    HRESULT hr;
+
+    if ( pIPC == NULL || ppBlock == NULL || pDataSize == NULL )
+        return E_INVALIDARG;
+    if ( pIPC->pArena == NULL )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION );
+
+    if ( pIPC->dwFlags & IPC_STREAM_MESSAGES )
+        hr = ReadInterprocessMessage( pIPC, &reference, sizeof(reference), &messageSize );
+    else
+        hr = ReadInterprocessStream( pIPC, &reference, sizeof(reference) );
+    if ( FAILED( hr ) )
+        return hr;
+
+    if ( messageSize != sizeof(reference) || reference.Block >= pIPC->ArenaBlocks ||
+         reference.DataSize > pIPC->ArenaBlockSize )
+        return HRESULT_FROM_WIN32( ERROR_INVALID_DATA );
+
+    *ppBlock = pIPC->pArenaData + (SIZE_T) reference.Block * pIPC->ArenaBlockSize;
+    *pDataSize = reference.DataSize;
+    return S_OK;
+}
+
+HRESULT ReleaseInterprocessBlock(
+    IPC_STREAM* pIPC,
+    LPCVOID pBlock )
+{
+    LONG refCount;
+    HRESULT hr;
+    UINT index;
+
+    if ( pIPC == NULL )
+        return E_INVALIDARG;
+    hr = FindArenaBlock( pIPC, pBlock, &index );
+    if ( FAILED( hr ) )
+        return hr;
+
+	IPC_TRY
+	{
+        refCount = AtomicDecrement( &pIPC->pArenaBlocks[index].RefCount );
+        if ( refCount < 0 )
+        {
+            AtomicIncrement( &pIPC->pArenaBlocks[index].RefCount );
+            return E_UNEXPECTED;
+        }
+        if ( refCount == 0 )
+            PushArenaBlock( pIPC, index );
+	}
+	IPC_EXCEPT
+	{
+		return E_FAIL;
+	}
+
+    return S_OK;
+}
+
+typedef struct _IPC_SELECTOR_ENTRY
+{
+    IPC_STREAM*	pIPC;
+    LPVOID		pContext;
+	DWORD		dwEvents;
+} IPC_SELECTOR_ENTRY;
+
+struct _IPC_SELECTOR
+{
+    IPC_SELECTOR_ENTRY*	pEntries;
+    IPC_EVENT*		phEvents;		// The event each entry's peer signals, two for one added both ways
+    LONG*			pEventValues;	// What each event was before the streams were last polled
+    UINT			Count;
+    UINT			EventCount;
+    UINT			Capacity;
+    UINT			Next;			// Where the next wait starts looking
+	DWORD			WaitStrategy;
+    UINT			SpinMicroseconds;
+    IPC_LOCK		hLock;			// Held by whichever thread is waiting on the streams
+    volatile LONG	Lock;
+    IPC_EVENT		hRearm;			// Tells the watcher a wait has run since it signalled
+    volatile LONG	Rearm;
+    IPC_SELECT_HANDLE	hHandle;
+    IPC_THREAD		hThread;
+    BOOL			bWatching;
+    volatile LONG	bStop;
+};
+
+// Readers sleep on the write event and writers on the read event, and that or
+// whatever stands in for it for selectors is what a selector sleeps on
+static void BindSelectorEvents( IPC_SELECTOR* pSelector )
+{
+    IPC_SELECTOR_ENTRY* pEntry;
+    UINT i;
+
+    pSelector->EventCount = 0;
+    for ( i = 0; i < pSelector->Count; ++i )
+    {
+        pEntry = &pSelector->pEntries[i];
+        if ( pEntry->dwEvents & IPC_SELECT_READ )
+            pSelector->phEvents[pSelector->EventCount++] =
+                GetSelectorEvent( pEntry->pIPC->hWriteEvent, &pEntry->pIPC->pRing->ReadSelectSequence );
+        if ( pEntry->dwEvents & IPC_SELECT_WRITE )
+            pSelector->phEvents[pSelector->EventCount++] =
+                GetSelectorEvent( pEntry->pIPC->hReadEvent, &pEntry->pIPC->pRing->WriteSelectSequence );
+    }
+}
+
+// Stores the streams that are ready, starting after the last one returned so
+// that none is starved when more are ready than fit
+static UINT CollectReadyStreams(
+    IPC_SELECTOR* pSelector,
+    IPC_SELECT_RESULT* pResults,
+    UINT maxResults )
+{
+    IPC_SELECTOR_ENTRY* pEntry;
+    IPC_SELECT_RESULT result;
+    UINT count = 0, start = pSelector->Next, i, index;
+
+    for ( i = 0; i < pSelector->Count && count < maxResults; ++i )
+    {
+        index = ( start + i ) % pSelector->Count;
+        pEntry = &pSelector->pEntries[index];
+        if ( FAILED( QueryInterprocessStreamReady( pEntry->pIPC, &result.Readable, &result.Writable ) ) )
+            continue;
+
+        result.dwReady = 0;
+        if ( ( pEntry->dwEvents & IPC_SELECT_READ ) && result.Readable > 0 )
+            result.dwReady |= IPC_SELECT_READ;
+        if ( ( pEntry->dwEvents & IPC_SELECT_WRITE ) && result.Writable > 0 )
+            result.dwReady |= IPC_SELECT_WRITE;
+        if ( result.dwReady == 0 )
+            continue;
+
+        result.pIPC = pEntry->pIPC;
+        result.pContext = pEntry->pContext;
+        pResults[count++] = result;
+        pSelector->Next = ( index + 1 ) % pSelector->Count;
+    }
+
+    return count;
+}
+
+// Counts the selector among the sleepers on every stream, so that their peers
+// signal it as they would a blocked reader or writer
+static void AdvertiseSelector(
+    IPC_SELECTOR* pSelector,
+    BOOL bSleeping )
+{
+    IPC_SELECTOR_ENTRY* pEntry;
+    IPC_RING* pRing;
+    UINT i;
+
+    for ( i = 0; i < pSelector->Count; ++i )
+    {
+        pEntry = &pSelector->pEntries[i];
+        pRing = pEntry->pIPC->pRing;
+        if ( ( pEntry->dwEvents & IPC_SELECT_READ ) && bSleeping )
+        {
+            AtomicIncrement( &pRing->ReadSelectors );
+            AtomicIncrement( &pRing->ReadWaiters );
+        }
+        else if ( pEntry->dwEvents & IPC_SELECT_READ )
+        {
+            AtomicDecrement( &pRing->ReadWaiters );
+            AtomicDecrement( &pRing->ReadSelectors );
+        }
+        if ( ( pEntry->dwEvents & IPC_SELECT_WRITE ) && bSleeping )
+        {
+            AtomicIncrement( &pRing->WriteSelectors );
+            AtomicIncrement( &pRing->WriteWaiters );
+        }
+        else if ( pEntry->dwEvents & IPC_SELECT_WRITE )
+        {
+            AtomicDecrement( &pRing->WriteWaiters );
+            AtomicDecrement( &pRing->WriteSelectors );
+        }
+    }
+}
+
+// Polls every stream in turn, spinning between rounds rather than on each
+// stream, then sleeps on all of their events until one is ready or the time
+// runs out. The caller holds the selector lock.
+static UINT SelectStreams(
+    IPC_SELECTOR* pSelector,
+    DWORD dwMilliseconds,
+    BOOL bSpin,
+    IPC_SELECT_RESULT* pResults,
+    UINT maxResults )
+{
+    UINT64 deadline, now;
+    IPC_SPIN spin;
+    UINT count;
+
+    count = CollectReadyStreams( pSelector, pResults, maxResults );
+    if ( count > 0 || dwMilliseconds == 0 )
+        return count;
+
+    deadline = QueryClockMicroseconds() + (UINT64) dwMilliseconds * 1000;
+    BeginSpin( &spin );
+    while ( bSpin && SpinWait( pSelector->WaitStrategy, pSelector->SpinMicroseconds, &spin ) )
+    {
+        count = CollectReadyStreams( pSelector, pResults, maxResults );
+        if ( count > 0 )
+            return count;
+        if ( dwMilliseconds != INFINITE && QueryClockMicroseconds() >= deadline )
+            return 0;
+    }
+
+    for ( ;; )
+    {
+        now = QueryClockMicroseconds();
+        if ( dwMilliseconds != INFINITE && now >= deadline )
+            return 0;
+
+        AdvertiseSelector( pSelector, TRUE );
+        ObserveStreamEvents( pSelector->phEvents, pSelector->pEventValues, pSelector->EventCount );
+        count = CollectReadyStreams( pSelector, pResults, maxResults );
+        if ( count == 0 )
+        {
+            WaitStreamEvents( pSelector->phEvents, pSelector->pEventValues, pSelector->EventCount,
+                dwMilliseconds == INFINITE ? INFINITE : (DWORD) ( ( deadline - now + 999 ) / 1000 ) );
+        }
+        AdvertiseSelector( pSelector, FALSE );
+
+        if ( count == 0 )
+            count = CollectReadyStreams( pSelector, pResults, maxResults );
+        if ( count > 0 )
+            return count;
+    }
+}
+
+// Waits on the streams in short turns, so the selector's own thread can have
+// the lock in between, and signals the handle once one is ready. It then waits
+// for a wait on the selector to have run before looking again, so that a
+// stream that stays ready doesn't keep it spinning.
+static void WatchSelector( IPC_SELECTOR* pSelector )
+{
+    IPC_SELECT_RESULT result;
+    BOOL bSpin = TRUE;
+    UINT count;
+
+    while ( !pSelector->bStop )
+    {
+        AcquireStreamLock( pSelector->hLock );
+        count = SelectStreams( pSelector, IPC_SELECTOR_POLL_MS, bSpin, &result, 1 );
+        ReleaseStreamLock( pSelector->hLock );
+        bSpin = FALSE;
+
+        if ( count > 0 )
+        {
+            SignalSelectorHandle( pSelector->hHandle );
+            WaitStreamEvent( pSelector->hRearm );
+            bSpin = TRUE;
+        }
+    }
+}
+
+HRESULT CreateInterprocessSelector(
+    DWORD waitStrategy,
+    UINT spinMicroseconds,
+    IPC_SELECTOR** ppSelector )
+{
+    IPC_SELECTOR* pSelector;
+
+    if ( ppSelector == NULL || waitStrategy > IPC_WAIT_BLOCK )
+        return E_INVALIDARG;
+
+    *ppSelector = NULL;
+    pSelector = (IPC_SELECTOR*) calloc( 1, sizeof(IPC_SELECTOR) );
+    if ( pSelector == NULL )
+        return E_OUTOFMEMORY;
+
+    pSelector->WaitStrategy = waitStrategy;
+    pSelector->SpinMicroseconds = spinMicroseconds ? spinMicroseconds : IPC_SPIN_MICROSECONDS;
+    pSelector->hLock = CreateLocalLock( &pSelector->Lock );
+    pSelector->hRearm = CreateLocalEvent( &pSelector->Rearm );
+    if ( pSelector->hLock == NULL || pSelector->hRearm == NULL )
+    {
+        CloseInterprocessSelector( pSelector );
+        return E_OUTOFMEMORY;
+    }
+
+    *ppSelector = pSelector;
+    return S_OK;
+}
+
+HRESULT CloseInterprocessSelector( IPC_SELECTOR* pSelector )
+{
+    if ( pSelector == NULL )
+        return E_INVALIDARG;
+
+    if ( pSelector->bWatching )
+    {
+        pSelector->bStop = TRUE;
+        SignalStreamEvent( pSelector->hRearm );
+        JoinSelectorThread( pSelector->hThread );
+        CloseSelectorHandle( pSelector->hHandle );
+    }
+
+    if ( pSelector->hLock != NULL )
+        CloseLocalObject( pSelector->hLock );
+    if ( pSelector->hRearm != NULL )
+        CloseLocalObject( pSelector->hRearm );
+    free( pSelector->pEntries );
+    free( pSelector->phEvents );
+    free( pSelector->pEventValues );
+    free( pSelector );
+    return S_OK;
+}
+
+HRESULT AddInterprocessSelectorStream(
+    IPC_SELECTOR* pSelector,
+    IPC_STREAM* pIPC,
+    DWORD dwEvents,
+    LPVOID pContext )
+{
+    IPC_SELECTOR_ENTRY* pEntries;
+    IPC_EVENT* phEvents;
+    LONG* pEventValues;
+    UINT capacity, i;
+    HRESULT hr;
+
+    if ( pSelector == NULL || pIPC == NULL || dwEvents == 0 ||
+         ( dwEvents & ~( IPC_SELECT_READ | IPC_SELECT_WRITE ) ) )
+        return E_INVALIDARG;
+
+    hr = QueryInterprocessStreamReady( pIPC, NULL, NULL );
+    if ( FAILED( hr ) )
+        return hr;
+    if ( ( ( dwEvents & IPC_SELECT_READ ) && !( pIPC->dwAccess & IPC_ACCESS_READ ) ) ||
+         ( ( dwEvents & IPC_SELECT_WRITE ) && !( pIPC->dwAccess & IPC_ACCESS_WRITE ) ) )
+        return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+
+    AcquireStreamLock( pSelector->hLock );
+
+    for ( i = 0; i < pSelector->Count; ++i )
+    {
+        if ( pSelector->pEntries[i].pIPC == pIPC )
+        {
+            ReleaseStreamLock( pSelector->hLock );
+            return HRESULT_FROM_WIN32( ERROR_ALREADY_EXISTS );
+        }
+    }
+
+    if ( pSelector->Count == pSelector->Capacity )
+    {
+        capacity = max( pSelector->Capacity * 2, 8 );
+        pEntries = (IPC_SELECTOR_ENTRY*) realloc( pSelector->pEntries, capacity * sizeof(IPC_SELECTOR_ENTRY) );
+        if ( pEntries != NULL )
+            pSelector->pEntries = pEntries;
+        phEvents = (IPC_EVENT*) realloc( pSelector->phEvents, capacity * 2 * sizeof(IPC_EVENT) );
+        if ( phEvents != NULL )
+            pSelector->phEvents = phEvents;
+        pEventValues = (LONG*) realloc( pSelector->pEventValues, capacity * 2 * sizeof(LONG) );
+        if ( pEventValues != NULL )
+            pSelector->pEventValues = pEventValues;
+        if ( pEntries == NULL || phEvents == NULL || pEventValues == NULL )
+        {
+            ReleaseStreamLock( pSelector->hLock );
+            return E_OUTOFMEMORY;
+        }
+        pSelector->Capacity = capacity;
+    }
+
+    pSelector->pEntries[pSelector->Count].pIPC = pIPC;
+    pSelector->pEntries[pSelector->Count].pContext = pContext;
+    pSelector->pEntries[pSelector->Count].dwEvents = dwEvents;
+    ++pSelector->Count;
+    BindSelectorEvents( pSelector );
+
+    ReleaseStreamLock( pSelector->hLock );
+    return S_OK;
+}
+
+HRESULT RemoveInterprocessSelectorStream(
+    IPC_SELECTOR* pSelector,
+    IPC_STREAM* pIPC )
+{
+    UINT i;
+
+    if ( pSelector == NULL || pIPC == NULL )
+        return E_INVALIDARG;
+
+    AcquireStreamLock( pSelector->hLock );
+
+    for ( i = 0; i < pSelector->Count; ++i )
+    {
+        if ( pSelector->pEntries[i].pIPC == pIPC )
+            break;
+    }
+    if ( i == pSelector->Count )
+    {
+        ReleaseStreamLock( pSelector->hLock );
+        return E_INVALIDARG;
+    }
+
+    memmove( pSelector->pEntries + i, pSelector->pEntries + i + 1,
+             ( pSelector->Count - i - 1 ) * sizeof(IPC_SELECTOR_ENTRY) );
+    --pSelector->Count;
+    if ( pSelector->Next >= pSelector->Count )
+        pSelector->Next = 0;
+    BindSelectorEvents( pSelector );
+
+    ReleaseStreamLock( pSelector->hLock );
+    return S_OK;
+}
+
+HRESULT WaitInterprocessSelector(
+    IPC_SELECTOR* pSelector,
+    DWORD dwMilliseconds,
+    IPC_SELECT_RESULT* pResults,
+    UINT maxResults,
+    UINT* pCount )
+{
+    UINT count;
+
+    if ( pSelector == NULL || pResults == NULL || maxResults == 0 || pCount == NULL )
+        return E_INVALIDARG;
+
+    *pCount = 0;
+
+    // Anything still ready is found again below, and signalled again after
+    if ( pSelector->bWatching )
+        ResetSelectorHandle( pSelector->hHandle );
+
+    AcquireStreamLock( pSelector->hLock );
+	IPC_TRY
+	{
+        count = SelectStreams( pSelector, dwMilliseconds, TRUE, pResults, maxResults );
+	}
+	IPC_EXCEPT
+	{
+        ReleaseStreamLock( pSelector->hLock );
+		return E_FAIL;
+	}
+    ReleaseStreamLock( pSelector->hLock );
+
+    if ( pSelector->bWatching )
+        SignalStreamEvent( pSelector->hRearm );
+
+    *pCount = count;
+    return count > 0 ? S_OK : S_FALSE;
+}
+
+HRESULT QueryInterprocessSelectorHandle(
+    IPC_SELECTOR* pSelector,
+    IPC_SELECT_HANDLE* phHandle )
+{
+    HRESULT hr;
+
+    if ( pSelector == NULL || phHandle == NULL )
+        return E_INVALIDARG;
+
+    if ( !pSelector->bWatching )
+    {
+        hr = CreateSelectorHandle( &pSelector->hHandle );
+        if ( FAILED( hr ) )
+            return hr;
+
+        hr = StartSelectorThread( pSelector, &pSelector->hThread );
+        if ( FAILED( hr ) )
+        {
+            CloseSelectorHandle( pSelector->hHandle );
+            return hr;
+        }
+        pSelector->bWatching = TRUE;
+    }
+
+    *phHandle = pSelector->hHandle;
+    return S_OK;
+}
+
+// Every request and response is framed with one of these in the byte stream
+// that carries it
+typedef struct _IPC_CHANNEL_HEADER
+{
+    UINT64  CallId;
+    UINT    DataSize;
+    UINT    Reserved;
+} IPC_CHANNEL_HEADER;
+
+// A client thread in AwaitInterprocessResponse
+typedef struct _IPC_CHANNEL_WAITER
+{
+    UINT64          CallId;
+    BYTE*           pData;
+    UINT            BufferSize;
+    UINT            ResponseSize;
+    HRESULT         hr;
+    BOOL            bInUse;
+    BOOL            bDone;
+    IPC_EVENT       hEvent;
+    volatile LONG   Event;
+} IPC_CHANNEL_WAITER;
+
+// A response that came in before anyone waited for it, or that didn't fit
+// the buffer of the thread that did. The data follows it.
+typedef struct _IPC_CHANNEL_RESPONSE
+{
+    struct _IPC_CHANNEL_RESPONSE*	pNext;
+    UINT64          CallId;
+    UINT            DataSize;
+} IPC_CHANNEL_RESPONSE;
+
+// Requests go through a multi-producer stream so that client threads never
+// queue on a lock to send. Responses go through a broadcast stream with one
+// reader slot, which the client claims, so a second client can't steal them
+// and the server never blocks on a client that has gone away.
+struct _IPC_CHANNEL
+{
+    IPC_STREAM*     pRequests;
+    IPC_STREAM*     pResponses;
+    BOOL            bIsServer;
+    volatile UINT64 NextCallId;
+    IPC_LOCK        hLock;          // Guards everything below
+    volatile LONG   Lock;
+    BOOL            bReading;       // A client thread is reading responses for all of them
+    IPC_CHANNEL_RESPONSE*	pPending;
+    IPC_CHANNEL_HEADER	Request;    // Header of a request too big for the last buffer
+    BOOL            bRequestPending;
+    IPC_CHANNEL_WAITER	Waiters[IPC_CHANNEL_MAX_WAITERS];
+};
+
+// The streams behind a channel are named after it
+static LPWSTR CreateChannelStreamName(
+    LPCWSTR szName,
+    LPCWSTR szSuffix )
+{
+    SIZE_T totalLen = wcslen( szName ) + wcslen( szSuffix ) + 1;
+    WCHAR* newStr = (WCHAR*) malloc( sizeof(WCHAR) * totalLen );
+
+    if ( newStr != NULL )
+        swprintf_s( newStr, totalLen, L"%ls%ls", szName, szSuffix );
+
+    return newStr;
+}
+
+// Sends the header and payload as one contiguous run of the stream, so that
+// frames from different threads can't interleave
+static HRESULT WriteChannelFrame(
+    IPC_STREAM* pIPC,
+    UINT64 callId,
+    LPCVOID pData,
+    UINT dataSize )
+{
+    IPC_CHANNEL_HEADER header;
+    IPC_BUFFER buffers[2];
+
+    header.CallId = callId;
+    header.DataSize = dataSize;
+    header.Reserved = 0;
+
+    buffers[0].pData = &header;
+    buffers[0].dataSize = sizeof(header);
+    buffers[1].pData = (LPVOID) pData;
+    buffers[1].dataSize = dataSize;
+    return WriteInterprocessStreamV( pIPC, buffers, dataSize > 0 ? 2 : 1 );
+}
+
+static IPC_CHANNEL_WAITER* FindChannelWaiter(
+    IPC_CHANNEL* pChannel,
+    UINT64 callId )
+{
+    UINT i;
+
+    for ( i = 0; i < IPC_CHANNEL_MAX_WAITERS; ++i )
+    {
+        if ( pChannel->Waiters[i].bInUse && !pChannel->Waiters[i].bDone &&
+             pChannel->Waiters[i].CallId == callId )
+            return &pChannel->Waiters[i];
+    }
+
+    return NULL;
+}
+
+// Hands a waiter its result, waking it unless it's the thread doing this
+static void CompleteChannelWaiter(
+    IPC_CHANNEL_WAITER* pWaiter,
+    IPC_CHANNEL_WAITER* pSelf,
+    HRESULT hr,
+    UINT responseSize )
+{
+    pWaiter->hr = hr;
+    pWaiter->ResponseSize = responseSize;
+    pWaiter->bDone = TRUE;
+    if ( pWaiter != pSelf )
+        SignalStreamEvent( pWaiter->hEvent );
+}
+
+// Completes a waiter from the queued responses if its response is there
+static void TakeChannelResponse(
+    IPC_CHANNEL* pChannel,
+    IPC_CHANNEL_WAITER* pWaiter,
+    IPC_CHANNEL_WAITER* pSelf )
+{
+    IPC_CHANNEL_RESPONSE** ppResponse;
+    IPC_CHANNEL_RESPONSE* pResponse;
+
+    for ( ppResponse = &pChannel->pPending; *ppResponse != NULL; ppResponse = &(*ppResponse)->pNext )
+    {
+        pResponse = *ppResponse;
+        if ( pResponse->CallId != pWaiter->CallId )
+            continue;
+
+        // Too big, so leave it for a retry with a larger buffer
+        if ( pResponse->DataSize > pWaiter->BufferSize )
+        {
+            CompleteChannelWaiter( pWaiter, pSelf, HRESULT_FROM_WIN32( ERROR_INSUFFICIENT_BUFFER ), pResponse->DataSize );
+            return;
+        }
+
+        memcpy( pWaiter->pData, pResponse + 1, pResponse->DataSize );
+        *ppResponse = pResponse->pNext;
+        CompleteChannelWaiter( pWaiter, pSelf, S_OK, pResponse->DataSize );
+        free( pResponse );
+        return;
+    }
+}
+
+static HRESULT DiscardFromStream(
+    IPC_STREAM* pIPC,
+    UINT dataSize )
+{
+    BYTE discard[IPC_CHANNEL_DISCARD_SIZE];
+    HRESULT hr = S_OK;
+
+    while ( dataSize > 0 && SUCCEEDED( hr ) )
+    {
+        UINT readSize = min( dataSize, sizeof(discard) );
+
+        hr = ReadInterprocessStream( pIPC, discard, readSize );
+        dataSize -= readSize;
+    }
+
+    return hr;
+}
+
+// Reads the next response for whichever thread is waiting on it, or queues it
+// if none is yet. Called without the lock by the one thread reading on behalf
+// of the rest; returns with the lock held.
+static HRESULT ReadChannelResponse(
+    IPC_CHANNEL* pChannel,
+    IPC_CHANNEL_WAITER* pSelf )
+{
+    IPC_CHANNEL_HEADER header;
+    IPC_CHANNEL_WAITER* pWaiter;
+    IPC_CHANNEL_RESPONSE* pResponse;
+    HRESULT hr;
+
+    hr = ReadInterprocessStream( pChannel->pResponses, &header, sizeof(header) );
+    AcquireStreamLock( pChannel->hLock );
+    if ( FAILED( hr ) )
+        return hr;
+
+    // A waiter can't leave until it's been completed, so its buffer is ours
+    // to read into without the lock
+    pWaiter = FindChannelWaiter( pChannel, header.CallId );
+    if ( pWaiter != NULL && header.DataSize <= pWaiter->BufferSize )
+    {
+        ReleaseStreamLock( pChannel->hLock );
+        hr = ReadInterprocessStream( pChannel->pResponses, pWaiter->pData, header.DataSize );
+        AcquireStreamLock( pChannel->hLock );
+        CompleteChannelWaiter( pWaiter, pSelf, hr, header.DataSize );
+        return hr;
+    }
+    ReleaseStreamLock( pChannel->hLock );
+
+    pResponse = (IPC_CHANNEL_RESPONSE*) malloc( sizeof(IPC_CHANNEL_RESPONSE) + header.DataSize );
+    if ( pResponse == NULL )
+    {
+        hr = DiscardFromStream( pChannel->pResponses, header.DataSize );
+        AcquireStreamLock( pChannel->hLock );
+        pWaiter = FindChannelWaiter( pChannel, header.CallId );
+        if ( pWaiter != NULL )
+            CompleteChannelWaiter( pWaiter, pSelf, E_OUTOFMEMORY, header.DataSize );
+        return hr;
+    }
+
+    hr = ReadInterprocessStream( pChannel->pResponses, pResponse + 1, header.DataSize );
+    AcquireStreamLock( pChannel->hLock );
+    if ( FAILED( hr ) )
+    {
+        free( pResponse );
+        return hr;
+    }
+
+    pResponse->CallId = header.CallId;
+    pResponse->DataSize = header.DataSize;
+    pResponse->pNext = pChannel->pPending;
+    pChannel->pPending = pResponse;
+
+    // Its waiter may have turned up while we were reading
+    pWaiter = FindChannelWaiter( pChannel, header.CallId );
+    if ( pWaiter != NULL )
+        TakeChannelResponse( pChannel, pWaiter, pSelf );
+
+    return S_OK;
+}
+
+// Called by a thread that has stopped reading responses for the others, with
+// the lock held, to wake one that still needs somebody to
+static void PassChannelReading( IPC_CHANNEL* pChannel )
+{
+    UINT i;
+
+    for ( i = 0; i < IPC_CHANNEL_MAX_WAITERS; ++i )
+    {
+        if ( pChannel->Waiters[i].bInUse && !pChannel->Waiters[i].bDone )
+        {
+            SignalStreamEvent( pChannel->Waiters[i].hEvent );
+            return;
+        }
+    }
+}
+
+// Runs while a client thread waits for room to send a request. If nobody is
+// waiting on a response then nobody is reading them either, and the server
+// may be stuck writing one, so take in whatever it has managed to send.
+static void PumpChannelResponses( void* pContext )
+{
+    IPC_CHANNEL* pChannel = (IPC_CHANNEL*) pContext;
+    IPC_STREAM* pIPC = pChannel->pResponses;
+
+    if ( *pIPC->pWriteCursor - *pIPC->pReadCursor < sizeof(IPC_CHANNEL_HEADER) )
+        return;
+
+    // Look again once nobody else can be reading. The caller may be holding
+    // back other requests, so it mustn't block on a response that isn't there.
+    AcquireStreamLock( pChannel->hLock );
+    if ( !pChannel->bReading &&
+         *pIPC->pWriteCursor - *pIPC->pReadCursor >= sizeof(IPC_CHANNEL_HEADER) )
+    {
+        pChannel->bReading = TRUE;
+        ReleaseStreamLock( pChannel->hLock );
+        ReadChannelResponse( pChannel, NULL );
+        pChannel->bReading = FALSE;
+        PassChannelReading( pChannel );
+    }
+    ReleaseStreamLock( pChannel->hLock );
+}
+
+static HRESULT AllocateChannel(
+    BOOL bIsServer,
+    IPC_CHANNEL** ppChannel )
+{
+    IPC_CHANNEL* pChannel = (IPC_CHANNEL*) malloc( sizeof(IPC_CHANNEL) );
+    UINT i;
+
+    if ( pChannel == NULL )
+        return E_OUTOFMEMORY;
+    ZeroMemory( pChannel, sizeof(*pChannel) );
+
+    pChannel->bIsServer = bIsServer;
+    pChannel->hLock = CreateLocalLock( &pChannel->Lock );
+    if ( pChannel->hLock == NULL )
+    {
+        free( pChannel );
+        return E_OUTOFMEMORY;
+    }
+
+    // Only the client has threads waiting on responses
+    for ( i = 0; !bIsServer && i < IPC_CHANNEL_MAX_WAITERS; ++i )
+    {
+        pChannel->Waiters[i].hEvent = CreateLocalEvent( &pChannel->Waiters[i].Event );
+        if ( pChannel->Waiters[i].hEvent == NULL )
+        {
+            CloseInterprocessChannel( pChannel );
+            return E_OUTOFMEMORY;
+        }
+    }
+
+    *ppChannel = pChannel;
+    return S_OK;
+}
+
+HRESULT CreateInterprocessChannel(
+    LPCWSTR szName,
+	DWORD dwVersion,
+    const IPC_STREAM_DESC* pDesc,
+    IPC_CHANNEL** ppChannel )
+{
+    IPC_CHANNEL* pChannel = NULL;
+    IPC_STREAM_DESC desc;
+    LPWSTR szRequests, szResponses;
+    HRESULT hr;
+
+    if ( ppChannel == NULL || pDesc == NULL )
+        return E_INVALIDARG;
+    if ( szName == NULL || *szName == 0 )
+        return E_INVALIDARG;
+    if ( pDesc->dwFlags & ~( IPC_STREAM_MIRRORED | IPC_STREAM_ADAPTIVE_GRANULARITY |
+                             IPC_STREAM_LARGE_PAGES | IPC_STREAM_PREFAULT ) )
+        return E_INVALIDARG;
+
+    hr = AllocateChannel( TRUE, &pChannel );
+    if ( FAILED( hr ) )
+        return hr;
+
+    szRequests = CreateChannelStreamName( szName, L"_Requests" );
+    szResponses = CreateChannelStreamName( szName, L"_Responses" );
+    if ( szRequests == NULL || szResponses == NULL )
+    {
+        hr = E_OUTOFMEMORY;
+    }
+    else
+    {
+        desc = *pDesc;
+        desc.dwFlags |= IPC_STREAM_MULTI_PRODUCER;
+        hr = CreateInterprocessStreamEx( szRequests, dwVersion, &desc, &pChannel->pRequests );
+    }
+
+    if ( SUCCEEDED( hr ) )
+    {
+        desc = *pDesc;
+        desc.dwFlags |= IPC_STREAM_BROADCAST;
+        desc.MaxReaders = 1;
+        hr = CreateInterprocessStreamEx( szResponses, dwVersion, &desc, &pChannel->pResponses );
+    }
+
+    free( szRequests );
+    free( szResponses );
+
+    if ( FAILED( hr ) )
+    {
+        CloseInterprocessChannel( pChannel );
+        return hr;
+    }
+
+    *ppChannel = pChannel;
+    return S_OK;
+}
+
+HRESULT OpenInterprocessChannel(
+    LPCWSTR szName,
+	DWORD dwVersion,
+    IPC_CHANNEL** ppChannel )
+{
+    IPC_CHANNEL* pChannel = NULL;
+    LPWSTR szRequests, szResponses;
+    HRESULT hr;
+
+    if ( ppChannel == NULL )
+        return E_INVALIDARG;
+    if ( szName == NULL || *szName == 0 )
+        return E_INVALIDARG;
+
+    hr = AllocateChannel( FALSE, &pChannel );
+    if ( FAILED( hr ) )
+        return hr;
+
+    // Register for responses before anything can be sent that needs one
+    szRequests = CreateChannelStreamName( szName, L"_Requests" );
+    szResponses = CreateChannelStreamName( szName, L"_Responses" );
+    if ( szRequests == NULL || szResponses == NULL )
+        hr = E_OUTOFMEMORY;
+    else
+        hr = OpenInterprocessStreamEx( szResponses, dwVersion, IPC_ACCESS_READ, &pChannel->pResponses );
+
+    if ( SUCCEEDED( hr ) )
+        hr = OpenInterprocessStreamEx( szRequests, dwVersion, IPC_ACCESS_WRITE, &pChannel->pRequests );
+    if ( SUCCEEDED( hr ) )
+    {
+        pChannel->pRequests->pfnWriteWait = PumpChannelResponses;
+        pChannel->pRequests->pWriteWaitContext = pChannel;
+    }
+
+    free( szRequests );
+    free( szResponses );
+
+    if ( FAILED( hr ) )
+    {
+        CloseInterprocessChannel( pChannel );
+        return hr;
+    }
+
+    *ppChannel = pChannel;
+    return S_OK;
+}
+
+HRESULT CloseInterprocessChannel( IPC_CHANNEL* pChannel )
+{
+    IPC_CHANNEL_RESPONSE* pResponse;
+    UINT i;
+
+    if ( pChannel == NULL )
+        return E_INVALIDARG;
+
+    if ( pChannel->pRequests != NULL )
+        CloseInterprocessStream( pChannel->pRequests );
+    if ( pChannel->pResponses != NULL )
+        CloseInterprocessStream( pChannel->pResponses );
+
+    while ( pChannel->pPending != NULL )
+    {
+        pResponse = pChannel->pPending;
+        pChannel->pPending = pResponse->pNext;
+        free( pResponse );
+    }
+
+    for ( i = 0; i < IPC_CHANNEL_MAX_WAITERS; ++i )
+    {
+        if ( pChannel->Waiters[i].hEvent != NULL )
+            CloseLocalObject( pChannel->Waiters[i].hEvent );
+    }
+    CloseLocalObject( pChannel->hLock );
+
+    free( pChannel );
+    return S_OK;
+}
+
+HRESULT SendInterprocessRequest(
+    IPC_CHANNEL* pChannel,
+    LPCVOID pData,
+    UINT dataSize,
+    UINT64* pCallId )
+{
+    UINT64 callId;
+    HRESULT hr;
+
+    if ( pChannel == NULL || pCallId == NULL || ( pData == NULL && dataSize != 0 ) )
+        return E_INVALIDARG;
+    if ( pChannel->bIsServer )
+        return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+
+    callId = AtomicFetchAdd64( &pChannel->NextCallId, 1 ) + 1;
+    hr = WriteChannelFrame( pChannel->pRequests, callId, pData, dataSize );
+    if ( SUCCEEDED( hr ) )
+        *pCallId = callId;
+
+    return hr;
+}
+
+HRESULT AwaitInterprocessResponse(
+    IPC_CHANNEL* pChannel,
+    UINT64 callId,
+    LPVOID pData,
+    UINT bufferSize,
+    UINT* pResponseSize )
+{
+    IPC_CHANNEL_WAITER* pWaiter = NULL;
+    HRESULT hr;
+    UINT i;
+
+    if ( pChannel == NULL || pResponseSize == NULL || ( pData == NULL && bufferSize != 0 ) )
+        return E_INVALIDARG;
+    if ( pChannel->bIsServer )
+        return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+
+    AcquireStreamLock( pChannel->hLock );
+
+    for ( i = 0; i < IPC_CHANNEL_MAX_WAITERS && pWaiter == NULL; ++i )
+    {
+        if ( !pChannel->Waiters[i].bInUse )
+            pWaiter = &pChannel->Waiters[i];
+    }
+    if ( pWaiter == NULL )
+    {
+        ReleaseStreamLock( pChannel->hLock );
+        return HRESULT_FROM_WIN32( ERROR_TOO_MANY_OPEN_FILES );
+    }
+
+    pWaiter->CallId = callId;
+    pWaiter->pData = (BYTE*) pData;
+    pWaiter->BufferSize = bufferSize;
+    pWaiter->bInUse = TRUE;
+    pWaiter->bDone = FALSE;
+    TakeChannelResponse( pChannel, pWaiter, pWaiter );
+
+    // One thread at a time reads responses and hands them out. The rest sleep
+    // until theirs arrives or the reader leaves and it's their turn.
+    while ( !pWaiter->bDone )
+    {
+        if ( pChannel->bReading )
+        {
+            ReleaseStreamLock( pChannel->hLock );
+            WaitStreamEvent( pWaiter->hEvent );
+            AcquireStreamLock( pChannel->hLock );
+            continue;
+        }
+
+        pChannel->bReading = TRUE;
+        ReleaseStreamLock( pChannel->hLock );
+        hr = ReadChannelResponse( pChannel, pWaiter );
+        pChannel->bReading = FALSE;
+
+        if ( FAILED( hr ) && !pWaiter->bDone )
+            CompleteChannelWaiter( pWaiter, pWaiter, hr, 0 );
+    }
+
+    if ( !pChannel->bReading )
+        PassChannelReading( pChannel );
+
+    hr = pWaiter->hr;
+    *pResponseSize = pWaiter->ResponseSize;
+    pWaiter->bInUse = FALSE;
+
+    ReleaseStreamLock( pChannel->hLock );
+    return hr;
+}
+
+HRESULT ReceiveInterprocessRequest(
+    IPC_CHANNEL* pChannel,
+    UINT64* pCallId,
+    LPVOID pData,
+    UINT bufferSize,
+    UINT* pRequestSize )
+{
+    HRESULT hr = S_OK;
+
+    if ( pChannel == NULL || pCallId == NULL || pRequestSize == NULL || ( pData == NULL && bufferSize != 0 ) )
+        return E_INVALIDARG;
+    if ( !pChannel->bIsServer )
+        return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+
+    // Server threads take requests whole and in turn
+    AcquireStreamLock( pChannel->hLock );
+
+    if ( !pChannel->bRequestPending )
+    {
+        hr = ReadInterprocessStream( pChannel->pRequests, &pChannel->Request, sizeof(pChannel->Request) );
+        pChannel->bRequestPending = SUCCEEDED( hr );
+    }
+
+    if ( SUCCEEDED( hr ) )
+    {
+        *pCallId = pChannel->Request.CallId;
+        *pRequestSize = pChannel->Request.DataSize;
+
+        if ( pChannel->Request.DataSize > bufferSize )
+        {
+            hr = HRESULT_FROM_WIN32( ERROR_INSUFFICIENT_BUFFER );
+        }
+        else
+        {
+            hr = ReadInterprocessStream( pChannel->pRequests, pData, pChannel->Request.DataSize );
+            pChannel->bRequestPending = FALSE;
+        }
+    }
+
+    ReleaseStreamLock( pChannel->hLock );
+    return hr;
+}
+
+HRESULT SendInterprocessResponse(
+    IPC_CHANNEL* pChannel,
+    UINT64 callId,
+    LPCVOID pData,
+    UINT dataSize )
+{
+    if ( pChannel == NULL || ( pData == NULL && dataSize != 0 ) )
+        return E_INVALIDARG;
+    if ( !pChannel->bIsServer )
+        return HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED );
+
+    return WriteChannelFrame( pChannel->pResponses, callId, pData, dataSize );
+}
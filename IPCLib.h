@@ -20,13 +20,155 @@
 #ifndef __IPCLIB_H__
 #define __IPCLIB_H__
 
+#ifndef _WIN32
+#	include "IPCLibPosix.h"
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define IPCLIB_VERSION MAKELONG(1, 0)
+#define IPCLIB_VERSION MAKELONG(2, 0)
 
 typedef struct _IPC_STREAM IPC_STREAM;
+typedef struct _IPC_CHANNEL IPC_CHANNEL;
+typedef struct _IPC_SELECTOR IPC_SELECTOR;
+
+// Stream creation flags, fixed for the lifetime of the stream
+#define IPC_STREAM_MULTI_PRODUCER	0x00000001	// Writers reserve space lock-free and copy concurrently
+#define IPC_STREAM_MIRRORED			0x00000002	// Ring is mapped twice back-to-back; enables the region calls
+#define IPC_STREAM_MESSAGES			0x00000004	// Stream carries length-prefixed messages rather than bytes
+#define IPC_STREAM_ADAPTIVE_GRANULARITY	0x00000008	// Publish cursors in large batches while the peer keeps up
+#define IPC_STREAM_LARGE_PAGES		0x00000010	// Back the ring with large pages, falling back to normal ones
+#define IPC_STREAM_PREFAULT			0x00000020	// Fault the whole ring in when the stream is created or opened
+#define IPC_STREAM_BROADCAST		0x00000040	// Every reader sees every byte; the writer waits for the slowest
+#define IPC_STREAM_OVERWRITE		0x00000080	// Writers never wait; they overwrite what slow readers haven't read
+#define IPC_STREAM_SHARDED			0x00000100	// Each writer gets a ring of its own; readers drain them in turn
+#define IPC_STREAM_GROWABLE			0x00000200	// Writers can move the stream on to a larger ring while it is open
+#define IPC_STREAM_JOURNAL			0x00000400	// Data goes to segment files on disk and outlives the stream
+#define IPC_STREAM_PRIORITY			0x00000800	// Messages go on one of several lanes; readers drain the highest first
+#define IPC_STREAM_ARENA			0x00001000	// Payloads go in shared blocks, and only references to them go in the ring
+
+// What an opened handle may do. A broadcast reader is registered on open and
+// sees only what is written after that. A sharded stream is opened to read or
+// to write, and each writer claims a shard that only it uses. A growable
+// stream is opened to read or to write, and its creator writes; readers can
+// still be draining an older ring after writers have moved on. A priority
+// stream is opened to read or to write, and a writer can write any lane.
+// Every reader of a journal has its own position, starting at the live end,
+// and the creator both reads and writes it. A handle opened with no rights
+// at all can only be queried.
+#define IPC_ACCESS_NONE		0x00000000
+#define IPC_ACCESS_READ		0x00000001
+#define IPC_ACCESS_WRITE	0x00000002
+
+// How a blocked reader or writer polls before sleeping on the stream event
+#define IPC_WAIT_YIELD		0	// Give up the quantum between polls
+#define IPC_WAIT_SPIN		1	// Busy-poll with a CPU pause between polls
+#define IPC_WAIT_BACKOFF	2	// Pause for exponentially longer between polls
+#define IPC_WAIT_BLOCK		3	// Sleep on the event straight away
+
+#define IPC_SPIN_FOREVER	0xFFFFFFFF	// Spin budget that never falls back to sleeping
+
+// Where the ring's memory is placed on NUMA systems
+#define IPC_NUMA_DEFAULT	0	// Wherever it is first touched
+#define IPC_NUMA_BIND		1	// On NumaNode (preferred rather than required on Windows)
+#define IPC_NUMA_INTERLEAVE	2	// Spread across every node; POSIX only
+
+// How transfers of NonTemporalThreshold bytes or more are copied. Those use
+// streaming stores that bypass the cache, so a large frame doesn't evict the
+// copier's working set; smaller ones always use memcpy. A kernel the CPU
+// can't run falls back to the widest one it can.
+#define IPC_COPY_AUTO		0	// The widest the CPU supports
+#define IPC_COPY_MEMCPY		1	// Never bypass the cache
+#define IPC_COPY_SSE2		2
+#define IPC_COPY_AVX2		3
+#define IPC_COPY_AVX512		4
+
+// One run of caller memory in a vectored read or write
+typedef struct _IPC_BUFFER
+{
+    LPVOID	pData;
+	UINT	dataSize;
+} IPC_BUFFER;
+
+typedef struct _IPC_STREAM_DESC
+{
+    UINT	RingBufferSize;
+	DWORD	dwFlags;
+	UINT	IOGranularity;	// Bytes copied between cursor updates; 0 selects the default
+	DWORD	WaitStrategy;		// One of IPC_WAIT_*
+	UINT	SpinMicroseconds;	// Time to poll before sleeping; 0 selects the default
+	DWORD	NumaPolicy;			// One of IPC_NUMA_*
+	DWORD	NumaNode;			// Node for IPC_NUMA_BIND
+	UINT	MaxReaders;			// Reader slots in a broadcast stream; 0 selects the default
+	UINT	MaxWriters;			// Shards in a sharded stream; 0 selects the default
+	UINT	MaxRingBufferSize;	// Growable streams grow by themselves up to this; 0 never does
+	UINT	GrowMicroseconds;	// Time writers spend blocked on a ring before it grows; 0 selects the default
+	LPCWSTR	JournalDirectory;	// Where a journal keeps its segment files
+	UINT	JournalSegments;	// Segments a journal retains, deleting the oldest; 0 keeps them all
+	DWORD	CopyKernel;			// One of IPC_COPY_*
+	UINT	NonTemporalThreshold;	// Smallest transfer to bypass the cache; 0 selects the default
+	UINT	Lanes;				// Lanes in a priority stream, each with a ring of its own; 0 selects the default
+	UINT	ArenaBlockSize;		// Largest payload an arena block holds; 0 selects the default
+	UINT	ArenaBlocks;		// Blocks in the arena; 0 selects the default
+} IPC_STREAM_DESC;
+
+// Position of the newest byte in a journal, for SeekInterprocessStream
+#define IPC_JOURNAL_END		((UINT64) -1)
+
+// What a stream actually got, which can fall short of what was asked for
+typedef struct _IPC_STREAM_INFO
+{
+    UINT	RingBufferSize;		// After rounding up
+	DWORD	dwFlags;
+	UINT	PageSize;			// Size of the pages backing the ring
+	DWORD	NumaPolicy;
+	DWORD	NumaNode;
+	UINT	MaxReaders;			// Zero unless the stream is a broadcast one
+	UINT	MaxWriters;			// Zero unless the stream is a sharded one
+	UINT	Generation;			// Times the stream had grown before the ring this handle is on
+	DWORD	CopyKernel;			// The kernel this handle copies with
+	UINT	NonTemporalThreshold;
+	UINT	Lanes;				// Zero unless the stream is a priority one
+	UINT	ArenaBlockSize;		// Both zero unless the stream has an arena
+	UINT	ArenaBlocks;
+} IPC_STREAM_INFO;
+
+// Counters kept in the stream's shared memory, totalled over every handle
+// that has written or read it. Message streams count their length prefixes
+// as bytes too.
+typedef struct _IPC_STREAM_STATS
+{
+    UINT64	BytesWritten;
+	UINT64	MessagesWritten;
+	UINT64	BytesRead;
+	UINT64	MessagesRead;
+	UINT64	WriteSpins;				// Polls of a full ring
+	UINT64	ReadSpins;				// Polls of an empty ring
+	UINT64	WriteWaits;				// Times a writer slept on the stream event
+	UINT64	ReadWaits;
+	UINT64	WriteWaitMicroseconds;	// Time writers spent asleep
+	UINT64	ReadWaitMicroseconds;
+	UINT64	WriteLockContention;	// Lock acquisitions that found the lock held
+	UINT64	ReadLockContention;
+	UINT	RingBufferSize;
+	UINT	Fill;					// Bytes waiting to be read, summed over shards
+	UINT	HighWater;				// The most a reader has found waiting at once
+} IPC_STREAM_STATS;
+
+// Longest name, terminator included, that a stream can be listed under
+#define IPC_MAX_STREAM_NAME	64
+
+// What the stream registry knows of a stream, without opening it
+typedef struct _IPC_STREAM_ENTRY
+{
+    WCHAR	Name[IPC_MAX_STREAM_NAME];
+	DWORD	dwVersion;
+	DWORD	dwFlags;
+	UINT	RingBufferSize;
+	DWORD	ProcessId;			// The creator's
+} IPC_STREAM_ENTRY;
 
 HRESULT CreateInterprocessStream(
     _In_z_ LPCWSTR szName,
@@ -34,15 +176,79 @@ HRESULT CreateInterprocessStream(
     _In_ UINT uRingBufferSize,
     _Out_ IPC_STREAM** ppIPC );
 
+HRESULT CreateInterprocessStreamEx(
+    _In_z_ LPCWSTR szName,
+	_In_ DWORD dwVersion,
+    _In_ const IPC_STREAM_DESC* pDesc,
+    _Out_ IPC_STREAM** ppIPC );
+
 HRESULT OpenInterprocessStream(
     _In_z_ LPCWSTR szName,
 	_In_ DWORD dwVersion,
     _Out_ IPC_STREAM** ppIPC );
 
+// Opens with the given IPC_ACCESS_* rights. Fails with ERROR_TOO_MANY_OPEN_FILES
+// if a broadcast stream has no reader slot left, or a sharded one no shard.
+HRESULT OpenInterprocessStreamEx(
+    _In_z_ LPCWSTR szName,
+	_In_ DWORD dwVersion,
+	_In_ DWORD dwAccess,
+    _Out_ IPC_STREAM** ppIPC );
+
+HRESULT QueryInterprocessStreamInfo(
+    _In_ IPC_STREAM* pIPC,
+    _Out_ IPC_STREAM_INFO* pInfo );
+
+// What this handle has lost to the writer lapping it in an overwrite stream.
+// Reads that had to skip ahead return S_FALSE; a byte stream resyncs to the
+// oldest byte still intact, a message stream to the oldest whole message.
+HRESULT QueryInterprocessStreamDropped(
+    _In_ IPC_STREAM* pIPC,
+    _Out_ UINT64* pDroppedBytes,
+    _Out_ UINT64* pDroppedMessages );
+
+// Safe to call from any handle, including one opened with IPC_ACCESS_NONE
+// to watch a stream without taking part in it. Such a handle follows a
+// growable stream on to its newest ring, whose reader counters only include
+// what was read from the older ones once the readers have caught up.
+HRESULT QueryInterprocessStreamStats(
+    _In_ IPC_STREAM* pIPC,
+    _Out_ IPC_STREAM_STATS* pStats );
+
+// How many bytes this handle could read, and write, right now without waiting:
+// what has been published and not yet read, and the room left in the ring. A
+// handle without the right to do one or the other has nothing for it. Writers
+// of an overwrite stream always have the whole ring. Meant for polling many
+// streams from one thread, so it takes no locks; another reader or writer of
+// the same stream can still get there first. Sharded, growable, journal and
+// priority streams have no single pair of cursors to report, and fail with
+// ERROR_INVALID_FUNCTION.
+HRESULT QueryInterprocessStreamReady(
+    _In_ IPC_STREAM* pIPC,
+    _Out_opt_ UINT* pReadable,
+    _Out_opt_ UINT* pWritable );
+
+// Every stream is listed, from when its creation succeeds until its creator
+// closes it, in a registry all processes share, and is looked up there without
+// touching the stream itself. Streams whose names are too long to list, or
+// that don't fit in the registry, are looked for by opening them instead. A
+// stream whose creator exited without closing it stays listed until it is next
+// opened, or its name is created again. Processes that set IPCLIB_REGISTRY in
+// their environment share the registry it names instead, and see only each
+// other's streams in it.
 BOOL QueryInterprocessStreamIsOpen(
 	_In_z_ LPCWSTR szName,
 	_In_ DWORD dwVersion );
 
+// Lists the streams in the registry, in no particular order. *pCount is the
+// number listed; if that's more than maxEntries, the first maxEntries are
+// returned along with ERROR_INSUFFICIENT_BUFFER. A grown stream is listed
+// under its own name only, not under those of its later rings.
+HRESULT EnumerateInterprocessStreams(
+    _Out_writes_opt_(maxEntries) IPC_STREAM_ENTRY* pEntries,
+    _In_ UINT maxEntries,
+    _Out_ UINT* pCount );
+
 HRESULT WriteInterprocessStream(
     _In_ IPC_STREAM* pIPC,
     _In_reads_(dataSize) LPCVOID pData,
@@ -53,9 +259,268 @@ HRESULT ReadInterprocessStream(
     _Out_writes_(*pDataSize) LPVOID pData,
     _Out_ UINT dataSize );
 
+// Vectored forms: the buffers are copied as one contiguous run of the stream
+// under a single lock acquisition
+HRESULT WriteInterprocessStreamV(
+    _In_ IPC_STREAM* pIPC,
+    _In_reads_(bufferCount) const IPC_BUFFER* pBuffers,
+    _In_ UINT bufferCount );
+
+HRESULT ReadInterprocessStreamV(
+    _In_ IPC_STREAM* pIPC,
+    _In_reads_(bufferCount) const IPC_BUFFER* pBuffers,
+    _In_ UINT bufferCount );
+
 HRESULT CloseInterprocessStream(
     _In_ IPC_STREAM* pIPC );
 
+// Moves an IPC_STREAM_GROWABLE stream on to a new ring of at least the given
+// size, from a handle that writes it. Writers carry on in the new ring at once,
+// and readers follow once they have drained the old one, so nothing is lost or
+// reordered. Returns S_FALSE if the ring is already that large. Writers also
+// grow the ring by themselves, doubling it up to MaxRingBufferSize, once they
+// have been held up on it for GrowMicroseconds.
+//
+// On Windows each ring only lasts while some handle has it open, so writers
+// shouldn't close until their readers have caught up with them.
+HRESULT GrowInterprocessStream(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT uRingBufferSize );
+
+// An IPC_STREAM_JOURNAL stream keeps its data in files named after the stream
+// in JournalDirectory, each holding RingBufferSize bytes of it, so no single
+// write can be larger than that. Writers never wait; once a segment is full
+// they start another. Creating the stream again carries on from the end of
+// whatever is there, and the files stay behind when the stream is closed.
+//
+// Moves a journal reader to a position, in bytes from the start of the
+// journal, or to IPC_JOURNAL_END. A position before the oldest retained
+// segment moves to the start of that one. In a message journal it must fall
+// at the start of a message, or the call fails with E_INVALIDARG. A reader
+// that retention overtakes skips to the oldest segment left, counts what it
+// missed as dropped and has its read return S_FALSE.
+HRESULT SeekInterprocessStream(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT64 position );
+
+// A journal reader's position, or where the next write will go for a handle
+// that doesn't read
+HRESULT QueryInterprocessStreamPosition(
+    _In_ IPC_STREAM* pIPC,
+    _Out_ UINT64* pPosition );
+
+// Deletes the segment files of a journal that is not open. Returns S_FALSE if
+// there were none.
+HRESULT DeleteInterprocessJournal(
+    _In_z_ LPCWSTR szDirectory,
+    _In_z_ LPCWSTR szName );
+
+// Whole-message access to an IPC_STREAM_MESSAGES stream. If the next message
+// is larger than bufferSize, ReadInterprocessMessage leaves it in the stream,
+// stores its size in *pMessageSize and fails with ERROR_INSUFFICIENT_BUFFER.
+HRESULT WriteInterprocessMessage(
+    _In_ IPC_STREAM* pIPC,
+    _In_reads_(dataSize) LPCVOID pData,
+    _In_ UINT dataSize );
+
+// Sends the buffers, at most 16 of them, as the payload of one message
+HRESULT WriteInterprocessMessageV(
+    _In_ IPC_STREAM* pIPC,
+    _In_reads_(bufferCount) const IPC_BUFFER* pBuffers,
+    _In_ UINT bufferCount );
+
+// Sends a message on one lane of an IPC_STREAM_PRIORITY stream, from 0 up to
+// one less than its Lanes; the other calls send on lane 0. A reader always
+// takes its next message from the highest lane that has one, though it
+// finishes any message it has started on first. Each lane has a lock of its
+// own, so a writer held up on a full lane holds up nobody on the others. A
+// handle writes one lane at a time, so threads that write at once need a
+// handle each. Other streams only have lane 0.
+HRESULT WriteInterprocessMessageEx(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT lane,
+    _In_reads_(bufferCount) const IPC_BUFFER* pBuffers,
+    _In_ UINT bufferCount );
+
+HRESULT ReadInterprocessMessage(
+    _In_ IPC_STREAM* pIPC,
+    _Out_writes_opt_(bufferSize) LPVOID pData,
+    _In_ UINT bufferSize,
+    _Out_ UINT* pMessageSize );
+
+// Zero-copy access to a mirrored stream. A region is always contiguous and at
+// most the size of the ring. Each acquire must be paired with a commit/release
+// from the same IPC_STREAM before it acquires again; in a multi-producer stream
+// the whole acquired region must be committed. A read region never spans two
+// rings of a grown stream, so it can come up short of minSize where one ends.
+HRESULT AcquireWriteRegion(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT regionSize,
+    _Out_ LPVOID* ppRegion );
+
+HRESULT CommitWrite(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT dataSize );
+
+HRESULT AcquireReadRegion(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT minSize,
+    _Out_ LPCVOID* ppRegion,
+    _Out_ UINT* pRegionSize );
+
+HRESULT ReleaseRead(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT dataSize );
+
+// A stream with an arena has a pool of fixed-size blocks in its shared memory
+// alongside the ring, and carries nothing but references to them. A writer
+// allocates a block, fills it in place and sends it; each reader receives a
+// pointer to the same memory, and releases it when done. A block goes back to
+// the pool once everyone it was sent to has released it: in a broadcast
+// stream, every reader registered when it was sent. A broadcast reader that
+// closes releases whatever was still waiting for it. Allocating waits while
+// the pool is empty. A block that was allocated but not sent is released by
+// its writer. Overwrite, growable and journal streams can't have an arena.
+HRESULT AllocateInterprocessBlock(
+    _In_ IPC_STREAM* pIPC,
+    _In_ UINT dataSize,
+    _Out_ LPVOID* ppBlock );
+
+// Fails, leaving the block with the caller, only if the write does
+HRESULT SendInterprocessBlock(
+    _In_ IPC_STREAM* pIPC,
+    _In_ LPVOID pBlock,
+    _In_ UINT dataSize );
+
+HRESULT ReceiveInterprocessBlock(
+    _In_ IPC_STREAM* pIPC,
+    _Out_ LPCVOID* ppBlock,
+    _Out_ UINT* pDataSize );
+
+HRESULT ReleaseInterprocessBlock(
+    _In_ IPC_STREAM* pIPC,
+    _In_ LPCVOID pBlock );
+
+// Waits on many streams at once. Each stream is added for reading, writing
+// or both, and a wait returns the ones with data to read or room to write.
+// The selector spins once for all of them, by its own wait strategy, and then
+// sleeps on all of their events together. Only the streams that
+// QueryInterprocessStreamReady can report on can be added, and each must be
+// removed before it is closed. A selector is used from one thread at a time.
+#define IPC_SELECT_READ		0x00000001
+#define IPC_SELECT_WRITE	0x00000002
+
+#ifdef _WIN32
+typedef HANDLE IPC_SELECT_HANDLE;
+#else
+typedef int IPC_SELECT_HANDLE;
+#endif
+
+typedef struct _IPC_SELECT_RESULT
+{
+    IPC_STREAM*	pIPC;
+    LPVOID		pContext;	// As given when the stream was added
+	DWORD		dwReady;	// IPC_SELECT_READ and/or IPC_SELECT_WRITE
+	UINT		Readable;	// As QueryInterprocessStreamReady reported them
+	UINT		Writable;
+} IPC_SELECT_RESULT;
+
+// spinMicroseconds of 0 selects the default, as it does for a stream
+HRESULT CreateInterprocessSelector(
+    _In_ DWORD waitStrategy,
+    _In_ UINT spinMicroseconds,
+    _Out_ IPC_SELECTOR** ppSelector );
+
+HRESULT CloseInterprocessSelector(
+    _In_ IPC_SELECTOR* pSelector );
+
+// Fails with ERROR_ACCESS_DENIED if the handle can't do what it is waited
+// for, and with ERROR_ALREADY_EXISTS if it has already been added
+HRESULT AddInterprocessSelectorStream(
+    _In_ IPC_SELECTOR* pSelector,
+    _In_ IPC_STREAM* pIPC,
+    _In_ DWORD dwEvents,
+    _In_opt_ LPVOID pContext );
+
+HRESULT RemoveInterprocessSelectorStream(
+    _In_ IPC_SELECTOR* pSelector,
+    _In_ IPC_STREAM* pIPC );
+
+// Waits up to dwMilliseconds, which may be 0 or INFINITE, for any of the
+// streams to be ready, and stores up to maxResults of those that are. When
+// more are ready than fit, the next wait starts looking where this one
+// stopped. Returns S_FALSE, with *pCount of zero, if the time ran out.
+HRESULT WaitInterprocessSelector(
+    _In_ IPC_SELECTOR* pSelector,
+    _In_ DWORD dwMilliseconds,
+    _Out_writes_(maxResults) IPC_SELECT_RESULT* pResults,
+    _In_ UINT maxResults,
+    _Out_ UINT* pCount );
+
+// A handle to add to an epoll set or a WaitForMultipleObjects call: an
+// eventfd, or a manual-reset event on Windows. It is signalled while any of
+// the streams is ready, until the next wait, which should then be made with
+// a timeout of 0. The first call starts a thread that does the waiting
+// instead; a write to a stream can't signal the handle by itself. The handle
+// belongs to the selector and is closed with it.
+HRESULT QueryInterprocessSelectorHandle(
+    _In_ IPC_SELECTOR* pSelector,
+    _Out_ IPC_SELECT_HANDLE* phHandle );
+
+// A request/response channel between one server, which creates it, and one
+// client process, which opens it. Any number of client threads can have calls
+// outstanding at once; each waits for its own response by the call ID it was
+// given. The description's flags may include IPC_STREAM_MIRRORED,
+// IPC_STREAM_ADAPTIVE_GRANULARITY, IPC_STREAM_LARGE_PAGES and
+// IPC_STREAM_PREFAULT, and apply to the rings in both directions.
+HRESULT CreateInterprocessChannel(
+    _In_z_ LPCWSTR szName,
+	_In_ DWORD dwVersion,
+    _In_ const IPC_STREAM_DESC* pDesc,
+    _Out_ IPC_CHANNEL** ppChannel );
+
+// Fails with ERROR_TOO_MANY_OPEN_FILES if another client has it open
+HRESULT OpenInterprocessChannel(
+    _In_z_ LPCWSTR szName,
+	_In_ DWORD dwVersion,
+    _Out_ IPC_CHANNEL** ppChannel );
+
+// As with streams, closing the server's end clears the rings, so any response
+// the client hasn't taken yet is lost
+HRESULT CloseInterprocessChannel(
+    _In_ IPC_CHANNEL* pChannel );
+
+// Client side. A response too large for the buffer stays queued for the call,
+// its size is stored in *pResponseSize, and the wait fails with
+// ERROR_INSUFFICIENT_BUFFER. At most 64 threads can wait at once.
+HRESULT SendInterprocessRequest(
+    _In_ IPC_CHANNEL* pChannel,
+    _In_reads_(dataSize) LPCVOID pData,
+    _In_ UINT dataSize,
+    _Out_ UINT64* pCallId );
+
+HRESULT AwaitInterprocessResponse(
+    _In_ IPC_CHANNEL* pChannel,
+    _In_ UINT64 callId,
+    _Out_writes_opt_(bufferSize) LPVOID pData,
+    _In_ UINT bufferSize,
+    _Out_ UINT* pResponseSize );
+
+// Server side. A request too large for the buffer is left in the channel,
+// to be received again with a larger one.
+HRESULT ReceiveInterprocessRequest(
+    _In_ IPC_CHANNEL* pChannel,
+    _Out_ UINT64* pCallId,
+    _Out_writes_opt_(bufferSize) LPVOID pData,
+    _In_ UINT bufferSize,
+    _Out_ UINT* pRequestSize );
+
+HRESULT SendInterprocessResponse(
+    _In_ IPC_CHANNEL* pChannel,
+    _In_ UINT64 callId,
+    _In_reads_(dataSize) LPCVOID pData,
+    _In_ UINT dataSize );
+
 
 #ifdef __cplusplus
 }
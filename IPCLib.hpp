@@ -0,0 +1,509 @@
+/*
+	Copyright (C) 2015 Peter J. B. Lewis
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+    and associated documentation files (the "Software"), to deal in the Software without restriction,
+    including without limitation the rights to use, copy, modify, merge, publish, distribute,
+    sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+    BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Typed C++ wrappers over IPCLib streams. Needs C++11; the coroutine streams
+// further down need C++20.
+
+#ifndef __IPCLIB_HPP__
+#define __IPCLIB_HPP__
+
+#include <type_traits>
+
+#if __cplusplus >= 202002L || ( defined(_MSVC_LANG) && _MSVC_LANG >= 202002L )
+#	define IPC_COROUTINES
+#	include <chrono>
+#	include <coroutine>
+#	include <cstddef>
+#	include <exception>
+#	include <mutex>
+#	include <span>
+#	include <thread>
+#	include <vector>
+#endif
+
+#include "IPCLib.h"
+
+namespace ipc
+{
+
+// A queue of Capacity values of T, in a stream of the given name that any
+// other queue of the same type can open. Each value takes a slot of exactly
+// sizeof(T) bytes with no length prefix. A batch is published a few whole
+// slots at a time, and a single value as soon as it is copied in. A queue
+// with more than one producer reserves its slots lock-free; one with a single
+// producer takes the cheaper write lock instead. The ring is exactly Capacity
+// slots, so when sizeof(T) is a power of two too it is indexed by mask.
+template <typename T, UINT Capacity, UINT Producers = 1>
+class queue
+{
+    static_assert( std::is_trivially_copyable<T>::value, "Queued values are copied as bytes" );
+    static_assert( Capacity >= 2 && ( Capacity & ( Capacity - 1 ) ) == 0, "Capacity must be a power of two" );
+    static_assert( (unsigned long long) Capacity * sizeof(T) <= 0x80000000ULL, "The ring must fit in a UINT" );
+    static_assert( Producers >= 1, "A queue needs a producer" );
+
+public:
+    static constexpr UINT capacity = Capacity;
+    static constexpr UINT slot_size = (UINT) sizeof(T);
+    static constexpr UINT ring_size = Capacity * (UINT) sizeof(T);
+    static constexpr DWORD flags = Producers > 1 ? IPC_STREAM_MULTI_PRODUCER : 0;
+
+    // Whole slots, about as many as the library's default granularity holds,
+    // but never more than half the ring
+    static constexpr UINT publish_slots =
+        256 / sizeof(T) == 0 ? 1 : 256 / sizeof(T) > Capacity / 2 ? Capacity / 2 : (UINT) ( 256 / sizeof(T) );
+
+    queue() : m_pIPC( nullptr )
+    {
+    }
+
+    queue( queue&& other ) : m_pIPC( other.m_pIPC )
+    {
+        other.m_pIPC = nullptr;
+    }
+
+    queue& operator=( queue&& other )
+    {
+        if ( this != &other )
+        {
+            close();
+            m_pIPC = other.m_pIPC;
+            other.m_pIPC = nullptr;
+        }
+        return *this;
+    }
+
+    queue( const queue& ) = delete;
+    queue& operator=( const queue& ) = delete;
+
+    ~queue()
+    {
+        close();
+    }
+
+    // Creates the stream, which both reads and writes
+    HRESULT create( LPCWSTR szName )
+    {
+        IPC_STREAM_DESC desc = {};
+
+        close();
+        desc.RingBufferSize = ring_size;
+        desc.IOGranularity = publish_slots * slot_size;
+        desc.dwFlags = flags;
+        return CreateInterprocessStreamEx( szName, IPCLIB_VERSION, &desc, &m_pIPC );
+    }
+
+    // Opens a stream created by a queue of the same type. Fails with
+    // E_INVALIDARG if its geometry says it was some other type.
+    HRESULT open(
+        LPCWSTR szName,
+        DWORD dwAccess = IPC_ACCESS_READ | IPC_ACCESS_WRITE )
+    {
+        IPC_STREAM_INFO info;
+        HRESULT hr;
+
+        close();
+        hr = OpenInterprocessStreamEx( szName, IPCLIB_VERSION, dwAccess, &m_pIPC );
+        if ( FAILED( hr ) )
+            return hr;
+
+        QueryInterprocessStreamInfo( m_pIPC, &info );
+        if ( info.RingBufferSize != ring_size || info.dwFlags != flags )
+        {
+            close();
+            return E_INVALIDARG;
+        }
+
+        return S_OK;
+    }
+
+    void close()
+    {
+        if ( m_pIPC != nullptr )
+        {
+            CloseInterprocessStream( m_pIPC );
+            m_pIPC = nullptr;
+        }
+    }
+
+    // Waits for room as the stream's wait strategy dictates
+    HRESULT push( const T& value )
+    {
+        return WriteInterprocessStream( m_pIPC, &value, slot_size );
+    }
+
+    // Several values go in as one write, which several producers never interleave
+    HRESULT push(
+        const T* pValues,
+        UINT count )
+    {
+        return WriteInterprocessStream( m_pIPC, pValues, count * slot_size );
+    }
+
+    HRESULT pop( T& value )
+    {
+        return ReadInterprocessStream( m_pIPC, &value, slot_size );
+    }
+
+    HRESULT pop(
+        T* pValues,
+        UINT count )
+    {
+        return ReadInterprocessStream( m_pIPC, pValues, count * slot_size );
+    }
+
+    bool is_open() const
+    {
+        return m_pIPC != nullptr;
+    }
+
+    // For the calls that take the stream itself, such as the stats
+    IPC_STREAM* native_handle() const
+    {
+        return m_pIPC;
+    }
+
+private:
+    IPC_STREAM* m_pIPC;
+};
+
+#ifdef IPC_COROUTINES
+
+class reactor;
+
+namespace detail
+{
+
+// One read or write waiting for its stream. It's ready once what is left of
+// it is there to be done, or a whole ring's worth of it, which is the most
+// that can ever be waiting. Running it moves only what is there, and whatever
+// is left waits again, so a transfer larger than the ring never blocks on a
+// peer that the same reactor resumes. One on a stream that can't be waited
+// for is made as a single call straight away.
+struct transfer
+{
+    IPC_STREAM*             pIPC;
+    std::byte*              pData;
+    UINT                    size;
+    UINT                    maxWait;
+    bool                    bWrite;
+    HRESULT                 hr;
+    std::coroutine_handle<> waiter;
+
+    UINT needed() const
+    {
+        return size < maxWait ? size : maxWait;
+    }
+
+    bool ready() const
+    {
+        UINT readable, writable;
+
+        if ( needed() == 0 || FAILED( QueryInterprocessStreamReady( pIPC, &readable, &writable ) ) )
+            return true;
+        return ( bWrite ? writable : readable ) >= needed();
+    }
+
+    // Returns whether the transfer is finished, successfully or not
+    bool run()
+    {
+        UINT readable, writable, count = size;
+
+        if ( needed() != 0 && SUCCEEDED( QueryInterprocessStreamReady( pIPC, &readable, &writable ) ) )
+        {
+            // Another reader, or writer, may have taken what this was woken for
+            count = bWrite ? writable : readable;
+            if ( count == 0 )
+                return false;
+            if ( count > size )
+                count = size;
+        }
+
+        hr = bWrite ? WriteInterprocessStream( pIPC, pData, count ) : ReadInterprocessStream( pIPC, pData, count );
+        if ( FAILED( hr ) )
+            return true;
+
+        pData += count;
+        size -= count;
+        return size == 0;
+    }
+};
+
+}
+
+// Resumes the coroutines waiting on streams as the streams become ready, on
+// whichever thread runs it. The streams' own events can't be waited on
+// together, so it polls them, backing off to short sleeps while none is ready.
+class reactor
+{
+public:
+    reactor() = default;
+    reactor( const reactor& ) = delete;
+    reactor& operator=( const reactor& ) = delete;
+
+    // Resumes everything whose stream is ready; returns how many
+    size_t poll()
+    {
+        std::vector<detail::transfer*> ready;
+
+        {
+            std::lock_guard<std::mutex> lock( m_lock );
+            for ( size_t i = 0; i < m_pending.size(); )
+            {
+                if ( m_pending[i]->ready() )
+                {
+                    ready.push_back( m_pending[i] );
+                    m_pending[i] = m_pending.back();
+                    m_pending.pop_back();
+                }
+                else
+                {
+                    ++i;
+                }
+            }
+        }
+
+        // Resuming can start more transfers, which go on the list too, and
+        // so does whatever is left of one that could only be done in part
+        for ( detail::transfer* pTransfer : ready )
+        {
+            if ( pTransfer->run() )
+                pTransfer->waiter.resume();
+            else
+                add( pTransfer );
+        }
+        return ready.size();
+    }
+
+    // Polls until nothing is left waiting
+    void run()
+    {
+        unsigned idle = 0;
+
+        while ( pending() )
+        {
+            if ( poll() != 0 )
+                idle = 0;
+            else if ( ++idle < IDLE_YIELDS )
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+        }
+    }
+
+    bool pending()
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        return !m_pending.empty();
+    }
+
+private:
+    friend class stream;
+
+    static const unsigned IDLE_YIELDS = 64;
+
+    void add( detail::transfer* pTransfer )
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        m_pending.push_back( pTransfer );
+    }
+
+    std::mutex m_lock;
+    std::vector<detail::transfer*> m_pending;
+};
+
+// A byte stream whose reads and writes suspend the awaiting coroutine rather
+// than its thread, which the reactor resumes once the stream is ready. A
+// transfer that's ready straight away never suspends at all. Only streams that
+// QueryInterprocessStreamReady can report on are waited for; on any other the
+// call is made straight away, and a message stream's fails as it would from C.
+// With more than one reader, or writer, on a stream, one can take what another
+// was woken for, and that one then waits again.
+class stream
+{
+public:
+    class awaitable
+    {
+    public:
+        // As much as can be done straight away is, and only the rest waits
+        bool await_ready()
+        {
+            return m_transfer.pIPC == nullptr || ( m_transfer.ready() && m_transfer.run() );
+        }
+
+        void await_suspend( std::coroutine_handle<> waiter )
+        {
+            m_transfer.waiter = waiter;
+            m_pReactor->add( &m_transfer );
+        }
+
+        // Finished by the reactor if we had to wait
+        HRESULT await_resume()
+        {
+            if ( m_transfer.pIPC == nullptr )
+                return E_INVALIDARG;
+            return m_transfer.hr;
+        }
+
+    private:
+        friend class stream;
+
+        awaitable(
+            reactor* pReactor,
+            IPC_STREAM* pIPC,
+            void* pData,
+            size_t size,
+            UINT maxWait,
+            bool bWrite ) : m_pReactor( pReactor )
+        {
+            m_transfer.pIPC = size <= 0xFFFFFFFF ? pIPC : nullptr;
+            m_transfer.pData = (std::byte*) pData;
+            m_transfer.size = (UINT) size;
+            m_transfer.maxWait = maxWait;
+            m_transfer.bWrite = bWrite;
+            m_transfer.hr = E_FAIL;
+        }
+
+        reactor* m_pReactor;
+        detail::transfer m_transfer;
+    };
+
+    stream() : m_pIPC( nullptr ), m_pReactor( nullptr ), m_maxWait( 0 )
+    {
+    }
+
+    stream( stream&& other ) : m_pIPC( other.m_pIPC ), m_pReactor( other.m_pReactor ), m_maxWait( other.m_maxWait )
+    {
+        other.m_pIPC = nullptr;
+    }
+
+    stream& operator=( stream&& other )
+    {
+        if ( this != &other )
+        {
+            close();
+            m_pIPC = other.m_pIPC;
+            m_pReactor = other.m_pReactor;
+            m_maxWait = other.m_maxWait;
+            other.m_pIPC = nullptr;
+        }
+        return *this;
+    }
+
+    stream( const stream& ) = delete;
+    stream& operator=( const stream& ) = delete;
+
+    ~stream()
+    {
+        close();
+    }
+
+    HRESULT create(
+        reactor& executor,
+        LPCWSTR szName,
+        const IPC_STREAM_DESC& desc )
+    {
+        close();
+        return Attach( executor, CreateInterprocessStreamEx( szName, IPCLIB_VERSION, &desc, &m_pIPC ) );
+    }
+
+    HRESULT open(
+        reactor& executor,
+        LPCWSTR szName,
+        DWORD dwAccess = IPC_ACCESS_READ | IPC_ACCESS_WRITE )
+    {
+        close();
+        return Attach( executor, OpenInterprocessStreamEx( szName, IPCLIB_VERSION, dwAccess, &m_pIPC ) );
+    }
+
+    void close()
+    {
+        if ( m_pIPC != nullptr )
+        {
+            CloseInterprocessStream( m_pIPC );
+            m_pIPC = nullptr;
+        }
+    }
+
+    // The buffer has to outlive the co_await
+    awaitable read( std::span<std::byte> buffer )
+    {
+        return awaitable( m_pReactor, m_pIPC, buffer.data(), buffer.size(), m_maxWait, false );
+    }
+
+    awaitable write( std::span<const std::byte> buffer )
+    {
+        return awaitable( m_pReactor, m_pIPC, (void*) buffer.data(), buffer.size(), m_maxWait, true );
+    }
+
+    bool is_open() const
+    {
+        return m_pIPC != nullptr;
+    }
+
+    IPC_STREAM* native_handle() const
+    {
+        return m_pIPC;
+    }
+
+private:
+    HRESULT Attach(
+        reactor& executor,
+        HRESULT hr )
+    {
+        IPC_STREAM_INFO info;
+
+        if ( FAILED( hr ) )
+        {
+            m_pIPC = nullptr;
+            return hr;
+        }
+
+        // The most a transfer waits for is a whole ring
+        QueryInterprocessStreamInfo( m_pIPC, &info );
+        m_pReactor = &executor;
+        m_maxWait = info.RingBufferSize;
+        if ( ( info.dwFlags & IPC_STREAM_MESSAGES ) || FAILED( QueryInterprocessStreamReady( m_pIPC, nullptr, nullptr ) ) )
+            m_maxWait = 0;
+        return hr;
+    }
+
+    IPC_STREAM* m_pIPC;
+    reactor* m_pReactor;
+    UINT m_maxWait;
+};
+
+// A coroutine type for callers without one of their own. It starts straight
+// away, runs on whichever thread resumes it, and frees itself when it ends.
+struct task
+{
+    struct promise_type
+    {
+        task get_return_object() { return task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,99 @@
+/*
+	Copyright (C) 2015 Peter J. B. Lewis
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+    and associated documentation files (the "Software"), to deal in the Software without restriction,
+    including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+    sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies or 
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+    BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// The subset of the Win32 types, error codes and SAL annotations that IPCLib.h
+// relies on, for building against the POSIX backend.
+
+#ifndef __IPCLIBPOSIX_H__
+#define __IPCLIBPOSIX_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+typedef int32_t			HRESULT;
+typedef int				BOOL;
+typedef unsigned char	BYTE;
+typedef uint16_t		WORD;
+typedef uint32_t		DWORD;
+typedef int32_t			LONG;
+typedef unsigned int	UINT;
+typedef uint64_t		UINT64;
+typedef int64_t			LONG64;
+typedef size_t			SIZE_T;
+typedef uintptr_t		DWORD_PTR;
+typedef wchar_t			WCHAR;
+typedef WCHAR*			LPWSTR;
+typedef const WCHAR*	LPCWSTR;
+typedef void*			LPVOID;
+typedef const void*		LPCVOID;
+
+#ifndef TRUE
+#	define TRUE 1
+#endif
+#ifndef FALSE
+#	define FALSE 0
+#endif
+
+#ifndef INFINITE
+#	define INFINITE 0xFFFFFFFF
+#endif
+
+#define MAKELONG(a, b)			((LONG)(((WORD)(a)) | ((DWORD)((WORD)(b))) << 16))
+
+#define S_OK					((HRESULT)0L)
+#define S_FALSE					((HRESULT)1L)
+#define E_UNEXPECTED			((HRESULT)0x8000FFFFL)
+#define E_NOTIMPL				((HRESULT)0x80004001L)
+#define E_FAIL					((HRESULT)0x80004005L)
+#define E_OUTOFMEMORY			((HRESULT)0x8007000EL)
+#define E_INVALIDARG			((HRESULT)0x80070057L)
+
+#define SUCCEEDED(hr)			(((HRESULT)(hr)) >= 0)
+#define FAILED(hr)				(((HRESULT)(hr)) < 0)
+
+#define FACILITY_WIN32			7
+#define HRESULT_FROM_WIN32(x)	((HRESULT)(x) <= 0 ? ((HRESULT)(x)) : \
+	((HRESULT) (((x) & 0x0000FFFF) | (FACILITY_WIN32 << 16) | 0x80000000)))
+
+// Win32 error codes the POSIX backend reports through HRESULT_FROM_WIN32
+#define ERROR_INVALID_FUNCTION		1L
+#define ERROR_FILE_NOT_FOUND		2L
+#define ERROR_TOO_MANY_OPEN_FILES	4L
+#define ERROR_ACCESS_DENIED			5L
+#define ERROR_NOT_ENOUGH_MEMORY		8L
+#define ERROR_INVALID_DATA			13L
+#define ERROR_NOT_SUPPORTED			50L
+#define ERROR_INVALID_PARAMETER		87L
+#define ERROR_INSUFFICIENT_BUFFER	122L
+#define ERROR_ALREADY_EXISTS		183L
+#define ERROR_MORE_DATA				234L
+
+// SAL annotations are only meaningful to the Microsoft toolchain
+#define _In_
+#define _In_z_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _In_reads_(x)
+#define _Out_writes_(x)
+#define _Out_writes_opt_(x)
+
+#endif
@@ -0,0 +1,188 @@
+/*
+	Copyright (C) 2015 Peter J. B. Lewis
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+    and associated documentation files (the "Software"), to deal in the Software without restriction,
+    including without limitation the rights to use, copy, modify, merge, publish, distribute,
+    sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+    BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Attaches to a running stream by name, without reading or writing it, and
+// prints what its writers and readers have been doing once per interval.
+// A writer that spends its time blocked with the ring full has a slow reader;
+// one with a low fill and a blocked reader has nothing to send. With -list,
+// prints every stream the registry knows of instead.
+
+#ifdef _WIN32
+#	include <Windows.h>
+#else
+#	include "TestPosix.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "IPCLib.h"
+
+#define INSPECT_INTERVAL_MS 1000
+#define INSPECT_MAX_NAME 256
+
+static void PrintTotals( const IPC_STREAM_STATS* pStats )
+{
+	printf( "written %llu bytes, %llu messages; read %llu bytes, %llu messages\n",
+		(unsigned long long) pStats->BytesWritten, (unsigned long long) pStats->MessagesWritten,
+		(unsigned long long) pStats->BytesRead, (unsigned long long) pStats->MessagesRead );
+	printf( "writers: %llu spins, %llu waits (%llu us), %llu contended locks\n",
+		(unsigned long long) pStats->WriteSpins, (unsigned long long) pStats->WriteWaits,
+		(unsigned long long) pStats->WriteWaitMicroseconds, (unsigned long long) pStats->WriteLockContention );
+	printf( "readers: %llu spins, %llu waits (%llu us), %llu contended locks\n",
+		(unsigned long long) pStats->ReadSpins, (unsigned long long) pStats->ReadWaits,
+		(unsigned long long) pStats->ReadWaitMicroseconds, (unsigned long long) pStats->ReadLockContention );
+	printf( "fill %u of %u bytes, high water %u\n\n", pStats->Fill, pStats->RingBufferSize, pStats->HighWater );
+}
+
+static void PrintHeader( void )
+{
+	printf( "%10s %10s %10s %10s %5s %5s %10s %10s %7s %7s %7s %7s\n",
+		"write MB/s", "write m/s", "read MB/s", "read m/s", "fill%", "high%",
+		"wspin/s", "rspin/s", "wblock%", "rblock%", "wlock/s", "rlock/s" );
+}
+
+// Rates over the interval between two samples. Time blocked is a share of the
+// interval, so it passes 100% when several threads on a side are all blocked.
+static void PrintRates(
+	const IPC_STREAM_STATS* pLast,
+	const IPC_STREAM_STATS* pNow,
+	double seconds )
+{
+	double ring = (double) max( pNow->RingBufferSize, 1 );
+
+	printf( "%10.1f %10.0f %10.1f %10.0f %5.0f %5.0f %10.0f %10.0f %7.1f %7.1f %7.0f %7.0f\n",
+		( pNow->BytesWritten - pLast->BytesWritten ) / seconds / ( 1024.0 * 1024.0 ),
+		( pNow->MessagesWritten - pLast->MessagesWritten ) / seconds,
+		( pNow->BytesRead - pLast->BytesRead ) / seconds / ( 1024.0 * 1024.0 ),
+		( pNow->MessagesRead - pLast->MessagesRead ) / seconds,
+		pNow->Fill * 100.0 / ring,
+		pNow->HighWater * 100.0 / ring,
+		( pNow->WriteSpins - pLast->WriteSpins ) / seconds,
+		( pNow->ReadSpins - pLast->ReadSpins ) / seconds,
+		( pNow->WriteWaitMicroseconds - pLast->WriteWaitMicroseconds ) / ( seconds * 10000.0 ),
+		( pNow->ReadWaitMicroseconds - pLast->ReadWaitMicroseconds ) / ( seconds * 10000.0 ),
+		( pNow->WriteLockContention - pLast->WriteLockContention ) / seconds,
+		( pNow->ReadLockContention - pLast->ReadLockContention ) / seconds );
+	fflush( stdout );
+}
+
+static int ListStreams( void )
+{
+	IPC_STREAM_ENTRY* pEntries;
+	UINT count = 0, i;
+	HRESULT hr;
+
+	// Streams can come and go between counting them and listing them
+	do
+	{
+		pEntries = (IPC_STREAM_ENTRY*) malloc( ( count + 16 ) * sizeof(IPC_STREAM_ENTRY) );
+		if ( pEntries == NULL )
+			return 1;
+		hr = EnumerateInterprocessStreams( pEntries, count + 16, &count );
+		if ( hr == HRESULT_FROM_WIN32( ERROR_INSUFFICIENT_BUFFER ) )
+			free( pEntries );
+	}
+	while ( hr == HRESULT_FROM_WIN32( ERROR_INSUFFICIENT_BUFFER ) );
+
+	if ( FAILED( hr ) )
+	{
+		fprintf( stderr, "Can't read the stream registry (0x%08X)\n", (unsigned int) hr );
+		free( pEntries );
+		return 1;
+	}
+
+	for ( i = 0; i < count; ++i )
+	{
+		printf( "%ls: %u byte ring, flags 0x%X, version 0x%08X, created by process %u\n", pEntries[i].Name,
+			pEntries[i].RingBufferSize, (unsigned int) pEntries[i].dwFlags, (unsigned int) pEntries[i].dwVersion,
+			(unsigned int) pEntries[i].ProcessId );
+	}
+
+	free( pEntries );
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	WCHAR szName[INSPECT_MAX_NAME];
+	IPC_STREAM* pIPC = NULL;
+	IPC_STREAM_INFO info;
+	IPC_STREAM_STATS last, now;
+	LARGE_INTEGER frequency, lastTick, nowTick;
+	DWORD dwInterval = INSPECT_INTERVAL_MS;
+	UINT count = 0;
+	UINT sample;
+	HRESULT hr;
+	int i;
+
+	// Usage: Inspect name [-interval milliseconds] [-count samples] | Inspect -list
+	if ( argc == 2 && strcmp( argv[1], "-list" ) == 0 )
+		return ListStreams();
+	if ( argc < 2 || mbstowcs( szName, argv[1], _countof(szName) ) >= _countof(szName) )
+	{
+		fprintf( stderr, "Usage: Inspect name [-interval milliseconds] [-count samples] | Inspect -list\n" );
+		return 1;
+	}
+
+	for ( i = 2; i + 1 < argc; i += 2 )
+	{
+		if ( strcmp( argv[i], "-interval" ) == 0 )
+			dwInterval = (DWORD) max( atoi( argv[i + 1] ), 1 );
+		else if ( strcmp( argv[i], "-count" ) == 0 )
+			count = (UINT) atoi( argv[i + 1] );
+	}
+
+	hr = OpenInterprocessStreamEx( szName, IPCLIB_VERSION, IPC_ACCESS_NONE, &pIPC );
+	if ( FAILED( hr ) )
+	{
+		fprintf( stderr, "Can't open stream %s (0x%08X)\n", argv[1], (unsigned int) hr );
+		return 1;
+	}
+
+	QueryInterprocessStreamInfo( pIPC, &info );
+	printf( "%s: %u byte ring, flags 0x%X, %u byte pages\n", argv[1], info.RingBufferSize,
+		(unsigned int) info.dwFlags, info.PageSize );
+
+	QueryPerformanceFrequency( &frequency );
+	QueryInterprocessStreamStats( pIPC, &last );
+	QueryPerformanceCounter( &lastTick );
+	PrintTotals( &last );
+	PrintHeader();
+
+	// Runs until the stream goes away, or for count samples
+	for ( sample = 0; count == 0 || sample < count; ++sample )
+	{
+		Sleep( dwInterval );
+		if ( !QueryInterprocessStreamIsOpen( szName, IPCLIB_VERSION ) )
+			break;
+
+		QueryInterprocessStreamStats( pIPC, &now );
+		QueryPerformanceCounter( &nowTick );
+		if ( now.RingBufferSize != last.RingBufferSize )
+			printf( "ring grown to %u bytes\n", now.RingBufferSize );
+		PrintRates( &last, &now, (double) ( nowTick.QuadPart - lastTick.QuadPart ) / frequency.QuadPart );
+
+		last = now;
+		lastTick = nowTick;
+	}
+
+	CloseInterprocessStream( pIPC );
+	return 0;
+}
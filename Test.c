@@ -17,8 +17,17 @@
     OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
-#include <Windows.h>
+#ifdef _WIN32
+#	include <Windows.h>
+#else
+#	include "TestPosix.h"
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/prctl.h>
+#	include <sys/wait.h>
+#endif
 #include <stdio.h>
+#include <string.h>
 
 #ifdef _DEBUG
 #	include <assert.h>
@@ -27,10 +36,58 @@
 #include "IPCLib.h"
 
 #define NUM_TESTS 1048576
+#define NUM_PRODUCERS 4
+#define NUM_BROADCAST_CONSUMERS 2
 #define MAX_STRING_LEN 1024
 #define RINGBUFFER_SIZE 512
+#define MIRRORED_RINGBUFFER_SIZE 16384
+#define JOURNAL_SEGMENT_SIZE 65536
+#define JOURNAL_RETAINED_SEGMENTS 2
+#define PRIORITY_LANES 3
+#define NUM_SELECT_STREAMS 8
+#define NUM_SELECT_BLOCKED_READS 20
+#define ARENA_BLOCK_SIZE 8192
+#define ARENA_BLOCKS 8
+#define NUM_REGISTRY_STREAMS 1024
+
+#define TEST_APP_NAME L"TESTIPC_%u"
+#define TEST_JOURNAL_DIRECTORY L"."
+#define TEST_SELECT_NAME L"%ls_SELECT_%d"
+#define TEST_REGISTRY_PREFIX L"%ls_REGISTRY_"
+#define TEST_CRASH_NAME L"%ls_CRASH"
+#define TEST_REGISTRY_SEGMENT "/TESTIPC_%u_REGISTRY"
+#define TEST_REGISTRY_VARIABLE "IPCLIB_REGISTRY"
+
+static DWORD g_dwNumTests = NUM_TESTS;
+static BOOL g_bZeroCopy = FALSE;
+static BOOL g_bMessages = FALSE;
+static BOOL g_bVectored = FALSE;
+static BOOL g_bOverwrite = FALSE;
+static BOOL g_bChannel = FALSE;
+static BOOL g_bJournal = FALSE;
+static BOOL g_bPriority = FALSE;
+static BOOL g_bSelect = FALSE;
+static BOOL g_bArena = FALSE;
+static BOOL g_bRegistry = FALSE;
+static BOOL g_bCrash = FALSE;
+
+// Every name has the process ID in it, so that runs side by side never share
+// a stream
+static WCHAR g_szAppName[32];
+static WCHAR g_szRegistryPrefix[48];
+static WCHAR g_szCrashName[48];
+static char g_szCrashRegistry[48];
+
+// Broadcast readers are registered before anything is written, so that each
+// of them sees the whole stream
+static IPC_STREAM* g_pReaders[NUM_BROADCAST_CONSUMERS];
 
-#define TEST_APP_NAME L"TESTIPC"
+// Both ends of the channel test, shared by all the threads on each side
+static IPC_CHANNEL* g_pServer;
+static IPC_CHANNEL* g_pClient;
+
+// One writer on each of the streams the selector test waits on
+static IPC_STREAM* g_pSelectWriters[NUM_SELECT_STREAMS];
 
 static const WCHAR TESTCHARS[] = L"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
 
@@ -55,21 +112,36 @@ int ProducerThread( DWORD_PTR index )
 
 	SetThreadAffinityMask( GetCurrentThread(), (DWORD_PTR) ( 1UL << index ) );
 
-	assert( QueryInterprocessStreamIsOpen( TEST_APP_NAME, IPCLIB_VERSION ) );
+	assert( QueryInterprocessStreamIsOpen( g_szAppName, IPCLIB_VERSION ) );
 
-    OpenInterprocessStream( TEST_APP_NAME, IPCLIB_VERSION, &pIPC );
+    OpenInterprocessStreamEx( g_szAppName, IPCLIB_VERSION, IPC_ACCESS_WRITE, &pIPC );
     
-    for (i = 0; i < NUM_TESTS; ++i)
+    for (i = 0; i < g_dwNumTests; ++i)
     {
 		UINT len = rand() % MAX_STRING_LEN;
-        offset = swprintf_s( pPayload, MAX_STRING_LEN, L" [%d, %d, %d] ", index, i, len );
+		WCHAR prefix[64];
+		offset = swprintf_s( prefix, _countof(prefix), L" [%d, %d, %d] ", index, i, len );
+
+		// Zero-copy streams have the packet encoded straight into the ring
+		if ( g_bZeroCopy )
+		{
+			AcquireWriteRegion( pIPC, sizeof(PRODUCER_PACKET) + ( offset + len ) * sizeof(WCHAR), (LPVOID*) &pPacket );
+			pPayload = (WCHAR*)( pPacket + 1 );
+		}
+		else if ( g_bArena )
+		{
+			// Arena streams have it built in a shared block, and send a reference
+			AllocateInterprocessBlock( pIPC, sizeof(PRODUCER_PACKET) + ( offset + len ) * sizeof(WCHAR), (LPVOID*) &pPacket );
+			pPayload = (WCHAR*)( pPacket + 1 );
+		}
+
+		memcpy( pPayload, prefix, offset * sizeof(WCHAR) );
 		for (j = offset; j < offset+len; ++j) 
 		{
 			pPayload[j] = TESTCHARS[rand() % (_countof(TESTCHARS)-1)];
 			assert(isprint(pPayload[j]));
 		}
 
-		pPayload[j] = 0;
 		pPacket->dwLength = j;
 
 		pPacket->dwCheckSum = 0;
@@ -78,10 +150,39 @@ int ProducerThread( DWORD_PTR index )
 			pPacket->dwCheckSum += pPayload[j];
 		}
 
-        WriteInterprocessStream( pIPC, pPacket, sizeof(PRODUCER_PACKET) + pPacket->dwLength * sizeof(WCHAR) );
-
-		swprintf_s( debug, _countof(debug), L"Thread %d producing %d characters (checksum %X): %s\n", index, pPacket->dwLength, pPacket->dwCheckSum, pPayload );
+		swprintf_s( debug, _countof(debug), L"Thread %d producing %d characters (checksum %X): %.*ls\n", index, pPacket->dwLength, pPacket->dwCheckSum, pPacket->dwLength, pPayload );
 		OutputDebugStringW( debug );
+
+		if ( g_bZeroCopy )
+			CommitWrite( pIPC, sizeof(PRODUCER_PACKET) + pPacket->dwLength * sizeof(WCHAR) );
+		else if ( g_bArena )
+			SendInterprocessBlock( pIPC, pPacket, sizeof(PRODUCER_PACKET) + pPacket->dwLength * sizeof(WCHAR) );
+		else if ( g_bPriority )
+		{
+			// Producers share lanes, and move between them
+			IPC_BUFFER buffer;
+			buffer.pData = pPacket;
+			buffer.dataSize = sizeof(PRODUCER_PACKET) + pPacket->dwLength * sizeof(WCHAR);
+
+			WriteInterprocessMessageEx( pIPC, ( index + i ) % PRIORITY_LANES, &buffer, 1 );
+		}
+		else if ( g_bVectored )
+		{
+			IPC_BUFFER buffers[2];
+			buffers[0].pData = pPacket;
+			buffers[0].dataSize = sizeof(PRODUCER_PACKET);
+			buffers[1].pData = pPayload;
+			buffers[1].dataSize = pPacket->dwLength * sizeof(WCHAR);
+
+			if ( g_bMessages )
+				WriteInterprocessMessageV( pIPC, buffers, _countof(buffers) );
+			else
+				WriteInterprocessStreamV( pIPC, buffers, _countof(buffers) );
+		}
+		else if ( g_bMessages )
+			WriteInterprocessMessage( pIPC, pPacket, sizeof(PRODUCER_PACKET) + pPacket->dwLength * sizeof(WCHAR) );
+		else
+			WriteInterprocessStream( pIPC, pPacket, sizeof(PRODUCER_PACKET) + pPacket->dwLength * sizeof(WCHAR) );
     }
 
     CloseInterprocessStream(pIPC);
@@ -90,7 +191,7 @@ int ProducerThread( DWORD_PTR index )
 
 HANDLE StartProducerThread(UINT index)
 {
-    return CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE) ProducerThread, (LPVOID) index, 0, NULL );
+    return CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE) ProducerThread, (LPVOID) (DWORD_PTR) index, 0, NULL );
 }
 
 int ConsumerThread( DWORD_PTR index )
@@ -99,20 +200,97 @@ int ConsumerThread( DWORD_PTR index )
 	UINT i, j, len, checksum;
 	WCHAR debug[256 + MAX_STRING_LEN];
     WCHAR t[256 + MAX_STRING_LEN];
+    WCHAR m[sizeof(PRODUCER_PACKET) + 256 + MAX_STRING_LEN];
+	UINT64 droppedBytes, droppedMessages, lastDropped = 0;
 
 	SetThreadAffinityMask( GetCurrentThread(), (DWORD_PTR) ( 1UL << index ) );
 
-	assert( QueryInterprocessStreamIsOpen( TEST_APP_NAME, IPCLIB_VERSION ) );
+	assert( QueryInterprocessStreamIsOpen( g_szAppName, IPCLIB_VERSION ) );
+
+    if ( index >= NUM_PRODUCERS && g_pReaders[index - NUM_PRODUCERS] != NULL )
+        pIPC = g_pReaders[index - NUM_PRODUCERS];
+    else
+        OpenInterprocessStreamEx( g_szAppName, IPCLIB_VERSION, IPC_ACCESS_READ, &pIPC );
 
-    OpenInterprocessStream( TEST_APP_NAME, IPCLIB_VERSION, &pIPC );
+    // A journal reader starts at the live end, and the producers are already
+    // under way, so replay everything from the start
+    if ( g_bJournal )
+        assert( SeekInterprocessStream( pIPC, 0 ) == S_OK );
     
-    for (i = 0; i < NUM_TESTS; ++i)
+    // Every producer's messages funnel into the one consumer
+    for (i = 0; i < g_dwNumTests * NUM_PRODUCERS; ++i)
     {
-        ReadInterprocessStream( pIPC, &len, sizeof(len) );
-		assert( len <= _countof(t) );
+		if ( g_bZeroCopy )
+		{
+			const PRODUCER_PACKET* pPacket;
+			UINT available;
+
+			// Peek at the header, then take the whole packet once it's arrived
+			AcquireReadRegion( pIPC, sizeof(PRODUCER_PACKET), (LPCVOID*) &pPacket, &available );
+			len = pPacket->dwLength;
+			ReleaseRead( pIPC, 0 );
+			assert( len <= _countof(t) );
+
+			AcquireReadRegion( pIPC, sizeof(PRODUCER_PACKET) + len * sizeof(WCHAR), (LPCVOID*) &pPacket, &available );
+			checksum = pPacket->dwCheckSum;
+			memcpy( t, pPacket + 1, len * sizeof(WCHAR) );
+			ReleaseRead( pIPC, sizeof(PRODUCER_PACKET) + len * sizeof(WCHAR) );
+		}
+		else if ( g_bArena )
+		{
+			const PRODUCER_PACKET* pPacket;
+			UINT dataSize;
+
+			ReceiveInterprocessBlock( pIPC, (LPCVOID*) &pPacket, &dataSize );
+			len = pPacket->dwLength;
+			assert( dataSize == sizeof(PRODUCER_PACKET) + len * sizeof(WCHAR) );
+			assert( len <= _countof(t) );
+
+			checksum = pPacket->dwCheckSum;
+			memcpy( t, pPacket + 1, len * sizeof(WCHAR) );
+			assert( ReleaseInterprocessBlock( pIPC, pPacket ) == S_OK );
+		}
+		else if ( g_bMessages )
+		{
+			const PRODUCER_PACKET* pPacket = (const PRODUCER_PACKET*) m;
+			UINT messageSize;
+
+			// Now and then check that an undersized read reports the size needed
+			if ( i % 64 == 0 )
+			{
+				HRESULT hr = ReadInterprocessMessage( pIPC, NULL, 0, &messageSize );
+				assert( hr == HRESULT_FROM_WIN32( ERROR_INSUFFICIENT_BUFFER ) );
+			}
+
+			ReadInterprocessMessage( pIPC, m, sizeof(m), &messageSize );
+			len = pPacket->dwLength;
+			assert( messageSize == sizeof(PRODUCER_PACKET) + len * sizeof(WCHAR) );
+			assert( len <= _countof(t) );
+
+			checksum = pPacket->dwCheckSum;
+			memcpy( t, pPacket + 1, len * sizeof(WCHAR) );
+		}
+		else if ( g_bVectored )
+		{
+			IPC_BUFFER buffers[2];
+			buffers[0].pData = &len;
+			buffers[0].dataSize = sizeof(len);
+			buffers[1].pData = &checksum;
+			buffers[1].dataSize = sizeof(checksum);
 
-        ReadInterprocessStream( pIPC, &checksum, sizeof(checksum) );
-        ReadInterprocessStream( pIPC, t, len * sizeof(WCHAR) );
+			ReadInterprocessStreamV( pIPC, buffers, _countof(buffers) );
+			assert( len <= _countof(t) );
+
+			ReadInterprocessStream( pIPC, t, len * sizeof(WCHAR) );
+		}
+		else
+		{
+			ReadInterprocessStream( pIPC, &len, sizeof(len) );
+			assert( len <= _countof(t) );
+
+			ReadInterprocessStream( pIPC, &checksum, sizeof(checksum) );
+			ReadInterprocessStream( pIPC, t, len * sizeof(WCHAR) );
+		}
 
  		for (j = 0; j < len; ++j) 
 		{
@@ -121,14 +299,25 @@ int ConsumerThread( DWORD_PTR index )
 		}
 
         t[len] = 0;
-		swprintf_s( debug, _countof(debug), L"Consuming %d characters (checksum %X): %s\n", len, checksum, t );
+		swprintf_s( debug, _countof(debug), L"Consuming %d characters (checksum %X): %ls\n", len, checksum, t );
 		OutputDebugStringW( debug );
 
 		assert(checksum == 0);
 
         wprintf( t );
+
+		// Messages the producers lapped us on still count towards the total
+		if ( g_bOverwrite )
+		{
+			QueryInterprocessStreamDropped( pIPC, &droppedBytes, &droppedMessages );
+			i += (UINT) ( droppedMessages - lastDropped );
+			lastDropped = droppedMessages;
+		}
     }
 
+	// Every message was either read or reported lost, and none twice
+	assert( i == g_dwNumTests * NUM_PRODUCERS );
+
     CloseInterprocessStream(pIPC);
 	
 	return 0;
@@ -136,33 +325,905 @@ int ConsumerThread( DWORD_PTR index )
 
 HANDLE StartConsumerThread(UINT index)
 {
-    return CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE) ConsumerThread, (LPVOID) index, 0, NULL );
+    return CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE) ConsumerThread, (LPVOID) (DWORD_PTR) index, 0, NULL );
+}
+
+// Answers every request with its characters reversed. Some requests are first
+// received into a buffer that's too small, and have to be taken again.
+int ChannelServerThread( DWORD_PTR index )
+{
+	WCHAR request[MAX_STRING_LEN], response[MAX_STRING_LEN];
+	UINT64 callId, retryId;
+	UINT requestSize, retrySize, len;
+	DWORD i, j;
+	HRESULT hr;
+
+	for ( i = 0; i < g_dwNumTests * NUM_PRODUCERS * 2; ++i )
+	{
+		if ( i % 7 == 0 )
+		{
+			hr = ReceiveInterprocessRequest( g_pServer, &retryId, NULL, 0, &retrySize );
+			if ( hr == S_OK )
+			{
+				assert( retrySize == 0 );
+				SendInterprocessResponse( g_pServer, retryId, NULL, 0 );
+				continue;
+			}
+			assert( hr == HRESULT_FROM_WIN32( ERROR_INSUFFICIENT_BUFFER ) );
+		}
+
+		hr = ReceiveInterprocessRequest( g_pServer, &callId, request, sizeof(request), &requestSize );
+		assert( hr == S_OK );
+		assert( i % 7 != 0 || ( callId == retryId && requestSize == retrySize ) );
+
+		len = requestSize / sizeof(WCHAR);
+		for ( j = 0; j < len; ++j )
+			response[j] = request[len - 1 - j];
+		SendInterprocessResponse( g_pServer, callId, response, requestSize );
+	}
+
+	return 0;
+}
+
+static UINT MakeRequest( WCHAR* pRequest )
+{
+	UINT len = rand() % MAX_STRING_LEN;
+	UINT j;
+
+	for ( j = 0; j < len; ++j )
+		pRequest[j] = TESTCHARS[rand() % (_countof(TESTCHARS)-1)];
+
+	return len;
+}
+
+// Checks one response, sometimes asking for it with too small a buffer first
+static void AwaitReversed(
+	UINT64 callId,
+	const WCHAR* pRequest,
+	UINT len,
+	BOOL bRetry )
+{
+	WCHAR response[MAX_STRING_LEN];
+	UINT responseSize, j;
+	HRESULT hr;
+
+	if ( bRetry && len > 0 )
+	{
+		hr = AwaitInterprocessResponse( g_pClient, callId, response, sizeof(WCHAR), &responseSize );
+		assert( len == 1 ? hr == S_OK : hr == HRESULT_FROM_WIN32( ERROR_INSUFFICIENT_BUFFER ) );
+		assert( responseSize == len * sizeof(WCHAR) );
+		if ( hr == S_OK )
+			return;
+	}
+
+	hr = AwaitInterprocessResponse( g_pClient, callId, response, sizeof(response), &responseSize );
+	assert( hr == S_OK );
+	assert( responseSize == len * sizeof(WCHAR) );
+	for ( j = 0; j < len; ++j )
+		assert( response[j] == pRequest[len - 1 - j] );
+}
+
+// Keeps two calls in flight and collects them in the opposite order, so that
+// responses regularly arrive for a thread other than the one reading them
+int ChannelClientThread( DWORD_PTR index )
+{
+	WCHAR first[MAX_STRING_LEN], second[MAX_STRING_LEN];
+	UINT64 firstId, secondId;
+	UINT firstLen, secondLen;
+	DWORD i;
+
+	for ( i = 0; i < g_dwNumTests; ++i )
+	{
+		firstLen = MakeRequest( first );
+		secondLen = MakeRequest( second );
+		assert( SendInterprocessRequest( g_pClient, first, firstLen * sizeof(WCHAR), &firstId ) == S_OK );
+		assert( SendInterprocessRequest( g_pClient, second, secondLen * sizeof(WCHAR), &secondId ) == S_OK );
+		assert( firstId != secondId );
+
+		AwaitReversed( secondId, second, secondLen, i % 5 == 0 );
+		AwaitReversed( firstId, first, firstLen, FALSE );
+	}
+
+	return 0;
+}
+
+static void RunChannelTest( const IPC_STREAM_DESC* pDesc )
+{
+	HANDLE hThreads[NUM_PRODUCERS + 1];
+	IPC_CHANNEL* pSecond = NULL;
+	UINT64 callId;
+	UINT size;
+	int i;
+
+	assert( CreateInterprocessChannel( g_szAppName, IPCLIB_VERSION, pDesc, &g_pServer ) == S_OK );
+	assert( OpenInterprocessChannel( g_szAppName, IPCLIB_VERSION, &g_pClient ) == S_OK );
+
+	// One client at a time, and each end only does its own half
+	assert( OpenInterprocessChannel( g_szAppName, IPCLIB_VERSION, &pSecond ) ==
+			HRESULT_FROM_WIN32( ERROR_TOO_MANY_OPEN_FILES ) );
+	assert( SendInterprocessRequest( g_pServer, NULL, 0, &callId ) == HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED ) );
+	assert( ReceiveInterprocessRequest( g_pClient, &callId, NULL, 0, &size ) == HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED ) );
+
+	hThreads[0] = CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE) ChannelServerThread, NULL, 0, NULL );
+	for ( i = 0; i < NUM_PRODUCERS; ++i )
+		hThreads[i + 1] = CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE) ChannelClientThread, (LPVOID) (DWORD_PTR) i, 0, NULL );
+
+	WaitForMultipleObjects( _countof(hThreads), hThreads, TRUE, INFINITE );
+
+	CloseInterprocessChannel( g_pClient );
+	CloseInterprocessChannel( g_pServer );
+}
+
+int SelectProducerThread( DWORD_PTR index )
+{
+	DWORD i;
+
+	for ( i = 0; i < g_dwNumTests; ++i )
+		assert( WriteInterprocessStream( g_pSelectWriters[index], &i, sizeof(i) ) == S_OK );
+
+	return 0;
+}
+
+int SelectBlockedReaderThread( IPC_STREAM* pReader )
+{
+	DWORD dwData;
+
+	assert( ReadInterprocessStream( pReader, &dwData, sizeof(dwData) ) == S_OK );
+	return 0;
+}
+
+static BOOL WaitSelectHandle(
+	IPC_SELECT_HANDLE hHandle,
+	DWORD dwMilliseconds )
+{
+#ifdef _WIN32
+	return WaitForSingleObject( hHandle, dwMilliseconds ) == WAIT_OBJECT_0;
+#else
+	struct pollfd pfd;
+
+	pfd.fd = hHandle;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll( &pfd, 1, (int) dwMilliseconds ) == 1;
+#endif
+}
+
+// Reads a counter from each of several streams, on one thread, in whatever
+// order the selector finds them ready. It returns fewer than there are
+// streams at a time, so every stream has to get its turn.
+static void RunSelectorTest( const IPC_STREAM_DESC* pDesc )
+{
+	HANDLE hThreads[NUM_SELECT_STREAMS];
+	IPC_STREAM* pReaders[NUM_SELECT_STREAMS];
+	IPC_SELECTOR* pSelector = NULL;
+	IPC_SELECT_RESULT results[NUM_SELECT_STREAMS / 2];
+	IPC_SELECT_HANDLE hHandle;
+	IPC_STREAM_INFO info;
+	DWORD next[NUM_SELECT_STREAMS], values[RINGBUFFER_SIZE / sizeof(DWORD)];
+	WCHAR szName[64];
+	UINT count, finished = 0, index, n, i, j;
+
+	assert( CreateInterprocessSelector( pDesc->WaitStrategy, pDesc->SpinMicroseconds, &pSelector ) == S_OK );
+	for ( i = 0; i < NUM_SELECT_STREAMS; ++i )
+	{
+		swprintf_s( szName, _countof(szName), TEST_SELECT_NAME, g_szAppName, i );
+		assert( CreateInterprocessStreamEx( szName, IPCLIB_VERSION, pDesc, &pReaders[i] ) == S_OK );
+		assert( OpenInterprocessStreamEx( szName, IPCLIB_VERSION, IPC_ACCESS_WRITE, &g_pSelectWriters[i] ) == S_OK );
+		assert( AddInterprocessSelectorStream( pSelector, pReaders[i], IPC_SELECT_READ, (LPVOID) (DWORD_PTR) i ) == S_OK );
+		next[i] = 0;
+	}
+
+	assert( AddInterprocessSelectorStream( pSelector, pReaders[0], IPC_SELECT_READ, NULL ) ==
+			HRESULT_FROM_WIN32( ERROR_ALREADY_EXISTS ) );
+	assert( AddInterprocessSelectorStream( pSelector, g_pSelectWriters[0], IPC_SELECT_READ, NULL ) ==
+			HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED ) );
+
+	// Nothing has been written, but every writer has the whole ring free
+	assert( WaitInterprocessSelector( pSelector, 0, results, _countof(results), &count ) == S_FALSE );
+	assert( WaitInterprocessSelector( pSelector, 5, results, _countof(results), &count ) == S_FALSE );
+	assert( count == 0 );
+	assert( AddInterprocessSelectorStream( pSelector, g_pSelectWriters[0], IPC_SELECT_WRITE, NULL ) == S_OK );
+	assert( WaitInterprocessSelector( pSelector, INFINITE, results, _countof(results), &count ) == S_OK );
+	QueryInterprocessStreamInfo( g_pSelectWriters[0], &info );
+	assert( count == 1 && results[0].pIPC == g_pSelectWriters[0] );
+	assert( results[0].dwReady == IPC_SELECT_WRITE && results[0].Writable == info.RingBufferSize );
+	assert( RemoveInterprocessSelectorStream( pSelector, g_pSelectWriters[0] ) == S_OK );
+	assert( RemoveInterprocessSelectorStream( pSelector, g_pSelectWriters[0] ) == E_INVALIDARG );
+
+	for ( i = 0; i < NUM_SELECT_STREAMS; ++i )
+		hThreads[i] = CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE) SelectProducerThread, (LPVOID) (DWORD_PTR) i, 0, NULL );
+
+	while ( finished < NUM_SELECT_STREAMS )
+	{
+		assert( WaitInterprocessSelector( pSelector, INFINITE, results, _countof(results), &count ) == S_OK );
+		assert( count > 0 && count <= _countof(results) );
+
+		for ( i = 0; i < count; ++i )
+		{
+			index = (UINT) (DWORD_PTR) results[i].pContext;
+			assert( results[i].pIPC == pReaders[index] && results[i].dwReady == IPC_SELECT_READ );
+
+			n = min( results[i].Readable, sizeof(values) ) / sizeof(DWORD);
+			if ( n == 0 )
+				continue;
+			assert( ReadInterprocessStream( pReaders[index], values, n * sizeof(DWORD) ) == S_OK );
+			for ( j = 0; j < n; ++j )
+				assert( values[j] == next[index]++ );
+
+			if ( next[index] == g_dwNumTests )
+			{
+				assert( RemoveInterprocessSelectorStream( pSelector, pReaders[index] ) == S_OK );
+				++finished;
+			}
+		}
+	}
+
+	WaitForMultipleObjects( _countof(hThreads), hThreads, TRUE, INFINITE );
+
+	// The pollable handle is signalled while a stream is ready, and stays
+	// clear after a wait that found nothing
+	assert( AddInterprocessSelectorStream( pSelector, pReaders[3], IPC_SELECT_READ, (LPVOID) (DWORD_PTR) 3 ) == S_OK );
+	assert( QueryInterprocessSelectorHandle( pSelector, &hHandle ) == S_OK );
+	assert( !WaitSelectHandle( hHandle, 0 ) );
+	assert( WriteInterprocessStream( g_pSelectWriters[3], &finished, sizeof(finished) ) == S_OK );
+	assert( WaitSelectHandle( hHandle, 5000 ) );
+	assert( WaitInterprocessSelector( pSelector, 0, results, _countof(results), &count ) == S_OK );
+	assert( count == 1 && results[0].pContext == (LPVOID) (DWORD_PTR) 3 && results[0].Readable == sizeof(finished) );
+	assert( ReadInterprocessStream( pReaders[3], values, sizeof(finished) ) == S_OK );
+	assert( WaitInterprocessSelector( pSelector, 0, results, _countof(results), &count ) == S_FALSE );
+	assert( !WaitSelectHandle( hHandle, 20 ) );
+
+	// A reader blocked on a stream the selector's thread also sleeps on still
+	// gets woken, whichever of them the signal lands on
+	for ( i = 0; i < NUM_SELECT_BLOCKED_READS; ++i )
+	{
+		hThreads[0] = CreateThread( NULL, 0, (LPTHREAD_START_ROUTINE) SelectBlockedReaderThread, pReaders[3], 0, NULL );
+		Sleep( 5 );
+		assert( WriteInterprocessStream( g_pSelectWriters[3], &i, sizeof(i) ) == S_OK );
+		WaitForMultipleObjects( 1, hThreads, TRUE, INFINITE );
+		WaitInterprocessSelector( pSelector, 0, results, _countof(results), &count );
+	}
+
+	assert( CloseInterprocessSelector( pSelector ) == S_OK );
+	for ( i = 0; i < NUM_SELECT_STREAMS; ++i )
+	{
+		CloseInterprocessStream( g_pSelectWriters[i] );
+		CloseInterprocessStream( pReaders[i] );
+	}
+}
+
+// Lists every stream in the registry. Other processes create streams all the
+// while, so the buffer grows until they all fit.
+static IPC_STREAM_ENTRY* ListStreams( UINT* pCount )
+{
+	IPC_STREAM_ENTRY* pEntries = NULL;
+	UINT count = 0;
+	HRESULT hr;
+
+	do
+	{
+		free( pEntries );
+		pEntries = (IPC_STREAM_ENTRY*) malloc( ( count + 16 ) * sizeof(IPC_STREAM_ENTRY) );
+		assert( pEntries != NULL );
+		hr = EnumerateInterprocessStreams( pEntries, count + 16, &count );
+	}
+	while ( hr == HRESULT_FROM_WIN32( ERROR_INSUFFICIENT_BUFFER ) );
+
+	assert( hr == S_OK );
+	*pCount = count;
+	return pEntries;
+}
+
+// Which of the test's streams are listed, checking each is listed as created
+static UINT CountListedStreams(
+	const IPC_STREAM_INFO* pInfo,
+	BOOL* pListed )
+{
+	IPC_STREAM_ENTRY* pEntries;
+	UINT count, listed = 0, index, i;
+
+	pEntries = ListStreams( &count );
+
+	ZeroMemory( pListed, NUM_REGISTRY_STREAMS * sizeof(BOOL) );
+	for ( i = 0; i < count; ++i )
+	{
+		if ( wcsncmp( pEntries[i].Name, g_szRegistryPrefix, wcslen( g_szRegistryPrefix ) ) != 0 )
+			continue;
+
+		index = (UINT) wcstoul( pEntries[i].Name + wcslen( g_szRegistryPrefix ), NULL, 10 );
+		assert( index < NUM_REGISTRY_STREAMS && !pListed[index] );
+		assert( pEntries[i].dwVersion == IPCLIB_VERSION );
+		assert( pEntries[i].dwFlags == pInfo->dwFlags );
+		assert( pEntries[i].RingBufferSize == pInfo->RingBufferSize );
+		assert( pEntries[i].ProcessId == GetCurrentProcessId() );
+		pListed[index] = TRUE;
+		++listed;
+	}
+
+	free( pEntries );
+	return listed;
+}
+
+// Creates a great many streams, finds each of them listed, and opens each by
+// its listing. Closing one takes it out, and a name too long to list is still
+// found the slow way.
+static void RunRegistryTest( const IPC_STREAM_DESC* pDesc )
+{
+	IPC_STREAM* pStreams[NUM_REGISTRY_STREAMS];
+	BOOL bListed[NUM_REGISTRY_STREAMS];
+	IPC_STREAM* pIPC = NULL;
+	IPC_STREAM_ENTRY entry;
+	IPC_STREAM_INFO info;
+	WCHAR szName[IPC_MAX_STREAM_NAME * 2];
+	DWORD dwData;
+	UINT count, i;
+
+	for ( i = 0; i < NUM_REGISTRY_STREAMS; ++i )
+	{
+		swprintf_s( szName, _countof(szName), L"%ls%u", g_szRegistryPrefix, i );
+		assert( !QueryInterprocessStreamIsOpen( szName, IPCLIB_VERSION ) );
+		assert( CreateInterprocessStreamEx( szName, IPCLIB_VERSION, pDesc, &pStreams[i] ) == S_OK );
+		assert( QueryInterprocessStreamIsOpen( szName, IPCLIB_VERSION ) );
+	}
+
+	QueryInterprocessStreamInfo( pStreams[0], &info );
+	assert( CountListedStreams( &info, bListed ) == NUM_REGISTRY_STREAMS );
+	assert( EnumerateInterprocessStreams( &entry, 1, &count ) == HRESULT_FROM_WIN32( ERROR_INSUFFICIENT_BUFFER ) );
+	assert( count >= NUM_REGISTRY_STREAMS );
+
+	for ( i = 0; i < NUM_REGISTRY_STREAMS; ++i )
+	{
+		swprintf_s( szName, _countof(szName), L"%ls%u", g_szRegistryPrefix, i );
+		assert( OpenInterprocessStreamEx( szName, IPCLIB_VERSION, IPC_ACCESS_WRITE, &pIPC ) == S_OK );
+		dwData = i;
+		assert( WriteInterprocessStream( pIPC, &dwData, sizeof(dwData) ) == S_OK );
+		assert( ReadInterprocessStream( pStreams[i], &dwData, sizeof(dwData) ) == S_OK );
+		assert( dwData == i );
+		CloseInterprocessStream( pIPC );
+	}
+
+	// Closed streams drop out, and their names can be created again
+	for ( i = 0; i < NUM_REGISTRY_STREAMS; i += 2 )
+		CloseInterprocessStream( pStreams[i] );
+	assert( CountListedStreams( &info, bListed ) == NUM_REGISTRY_STREAMS / 2 );
+	for ( i = 0; i < NUM_REGISTRY_STREAMS; ++i )
+	{
+		swprintf_s( szName, _countof(szName), L"%ls%u", g_szRegistryPrefix, i );
+		assert( bListed[i] == ( i % 2 != 0 ) );
+		assert( QueryInterprocessStreamIsOpen( szName, IPCLIB_VERSION ) == bListed[i] );
+		if ( i % 2 == 0 )
+			assert( CreateInterprocessStreamEx( szName, IPCLIB_VERSION, pDesc, &pStreams[i] ) == S_OK );
+	}
+	assert( CountListedStreams( &info, bListed ) == NUM_REGISTRY_STREAMS );
+
+	for ( i = 0; i < NUM_REGISTRY_STREAMS; ++i )
+		CloseInterprocessStream( pStreams[i] );
+	assert( CountListedStreams( &info, bListed ) == 0 );
+
+	swprintf_s( szName, _countof(szName), L"%ls", g_szAppName );
+	for ( i = (UINT) wcslen( szName ); i < _countof(szName) - 1; ++i )
+		szName[i] = L'L';
+	szName[i] = 0;
+	assert( CreateInterprocessStreamEx( szName, IPCLIB_VERSION, pDesc, &pStreams[0] ) == S_OK );
+	assert( QueryInterprocessStreamIsOpen( szName, IPCLIB_VERSION ) );
+	assert( OpenInterprocessStreamEx( szName, IPCLIB_VERSION, IPC_ACCESS_WRITE, &pIPC ) == S_OK );
+	CloseInterprocessStream( pIPC );
+	CloseInterprocessStream( pStreams[0] );
+	assert( !QueryInterprocessStreamIsOpen( szName, IPCLIB_VERSION ) );
+}
+
+// Whose stream of the given name is listed, if anyone's
+static DWORD QueryListedCreator( LPCWSTR szName )
+{
+	IPC_STREAM_ENTRY* pEntries;
+	DWORD dwProcessId = 0;
+	UINT count, i;
+
+	pEntries = ListStreams( &count );
+	for ( i = 0; i < count; ++i )
+	{
+		if ( wcscmp( pEntries[i].Name, szName ) == 0 )
+			dwProcessId = pEntries[i].ProcessId;
+	}
+
+	free( pEntries );
+	return dwProcessId;
+}
+
+// A creator killed while it holds its write lock leaves neither the lock nor
+// the stream's name stuck, and its stream is taken out of the registry when
+// next opened. Nor does a process killed holding the registry's lock, which is
+// the registry's first word, keep others from creating streams; that is tried
+// on a registry of the test's own, so nobody else waits for the takeover.
+// Win32 objects die with their creator, and a mutex it abandons goes to the
+// next waiter, so there this is only done on POSIX.
+static void RunCrashTest( const IPC_STREAM_DESC* pDesc )
+{
+#ifndef _WIN32
+	IPC_STREAM* pReader = NULL;
+	IPC_STREAM* pWriter = NULL;
+	IPC_STREAM* pIPC = NULL;
+	IPC_STREAM_INFO info;
+	volatile LONG* pRegistryLock;
+	BYTE data[64];
+	UINT readable;
+	pid_t parent = getpid();
+	pid_t child;
+	int status, fd;
+
+	memset( data, 0x5A, sizeof(data) );
+	child = fork();
+	if ( child == 0 )
+	{
+		// Fills the ring, then waits for room with the lock held. It goes if
+		// the test does, whether or not it gets as far as killing it.
+		prctl( PR_SET_PDEATHSIG, SIGKILL );
+		if ( getppid() != parent )
+			_exit( 1 );
+		assert( CreateInterprocessStreamEx( g_szCrashName, IPCLIB_VERSION, pDesc, &pIPC ) == S_OK );
+		for ( ;; )
+			WriteInterprocessStream( pIPC, data, sizeof(data) );
+	}
+
+	while ( OpenInterprocessStreamEx( g_szCrashName, IPCLIB_VERSION, IPC_ACCESS_READ, &pReader ) != S_OK )
+		Sleep( 1 );
+	QueryInterprocessStreamInfo( pReader, &info );
+	do
+	{
+		Sleep( 1 );
+		assert( SUCCEEDED( QueryInterprocessStreamReady( pReader, &readable, NULL ) ) );
+	}
+	while ( readable + sizeof(data) <= info.RingBufferSize );
+	Sleep( 20 );
+	assert( QueryInterprocessStreamIsOpen( g_szCrashName, IPCLIB_VERSION ) );
+	assert( QueryListedCreator( g_szCrashName ) == (DWORD) child );
+
+	kill( child, SIGKILL );
+	waitpid( child, &status, 0 );
+
+	// The next writer takes the lock over once it sees its owner is gone, and
+	// opening the stream takes its listing out
+	while ( readable > 0 )
+	{
+		assert( ReadInterprocessStream( pReader, data, sizeof(data) ) == S_OK );
+		readable -= sizeof(data);
+	}
+	assert( OpenInterprocessStreamEx( g_szCrashName, IPCLIB_VERSION, IPC_ACCESS_WRITE, &pWriter ) == S_OK );
+	assert( !QueryInterprocessStreamIsOpen( g_szCrashName, IPCLIB_VERSION ) );
+	assert( QueryListedCreator( g_szCrashName ) == 0 );
+	assert( WriteInterprocessStream( pWriter, data, sizeof(data) ) == S_OK );
+	assert( ReadInterprocessStream( pReader, data, sizeof(data) ) == S_OK );
+
+	// The segment its creator left behind doesn't keep the name taken
+	assert( CreateInterprocessStreamEx( g_szCrashName, IPCLIB_VERSION, pDesc, &pIPC ) == S_OK );
+	CloseInterprocessStream( pIPC );
+	CloseInterprocessStream( pWriter );
+	CloseInterprocessStream( pReader );
+
+	child = fork();
+	if ( child == 0 )
+		_exit( 0 );
+	waitpid( child, &status, 0 );
+
+	fd = shm_open( g_szCrashRegistry, O_RDWR, 0 );
+	assert( fd >= 0 );
+	pRegistryLock = (volatile LONG*) mmap( NULL, sizeof(LONG), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	assert( pRegistryLock != MAP_FAILED );
+	while ( __sync_val_compare_and_swap( pRegistryLock, 0, (LONG) child ) != 0 )
+		Sleep( 1 );
+
+	assert( CreateInterprocessStreamEx( g_szCrashName, IPCLIB_VERSION, pDesc, &pIPC ) == S_OK );
+	assert( *pRegistryLock != (LONG) child );
+	CloseInterprocessStream( pIPC );
+	munmap( (void*) pRegistryLock, sizeof(LONG) );
+	shm_unlink( g_szCrashRegistry );
+#else
+	UNREFERENCED_PARAMETER( pDesc );
+#endif
 }
 
 int main(int argc, char** argv)
 {
     IPC_STREAM* pIPC = NULL;
+	IPC_STREAM_DESC desc;
+	int i;
+
+	ZeroMemory( &desc, sizeof(desc) );
+	desc.RingBufferSize = RINGBUFFER_SIZE;
+
+	swprintf_s( g_szAppName, _countof(g_szAppName), TEST_APP_NAME, (UINT) GetCurrentProcessId() );
+	swprintf_s( g_szRegistryPrefix, _countof(g_szRegistryPrefix), TEST_REGISTRY_PREFIX, g_szAppName );
+	swprintf_s( g_szCrashName, _countof(g_szCrashName), TEST_CRASH_NAME, g_szAppName );
+#ifndef _WIN32
+	snprintf( g_szCrashRegistry, sizeof(g_szCrashRegistry), TEST_REGISTRY_SEGMENT, (UINT) GetCurrentProcessId() );
+#endif
+
+	// Usage: Test [iterations] [-mpsc] [-mirror | -messages] [-vectored] [-adaptive]
+	//                  [-spin | -backoff | -block] [-largepages] [-prefault] [-numa | -interleave]
+	//                  [-broadcast] [-overwrite] [-sharded] [-channel] [-grow] [-journal]
+	//                  [-streaming [-sse2 | -avx2]] [-priority] [-select] [-arena] [-registry] [-crash]
+	for ( i = 1; i < argc; ++i )
+	{
+		if ( strcmp( argv[i], "-mpsc" ) == 0 )
+			desc.dwFlags |= IPC_STREAM_MULTI_PRODUCER;
+		else if ( strcmp( argv[i], "-broadcast" ) == 0 )
+		{
+			desc.dwFlags |= IPC_STREAM_BROADCAST;
+			desc.MaxReaders = NUM_BROADCAST_CONSUMERS;
+		}
+		else if ( strcmp( argv[i], "-vectored" ) == 0 )
+			g_bVectored = TRUE;
+		else if ( strcmp( argv[i], "-adaptive" ) == 0 )
+			desc.dwFlags |= IPC_STREAM_ADAPTIVE_GRANULARITY;
+		else if ( strcmp( argv[i], "-spin" ) == 0 )
+			desc.WaitStrategy = IPC_WAIT_SPIN;
+		else if ( strcmp( argv[i], "-backoff" ) == 0 )
+			desc.WaitStrategy = IPC_WAIT_BACKOFF;
+		else if ( strcmp( argv[i], "-block" ) == 0 )
+			desc.WaitStrategy = IPC_WAIT_BLOCK;
+		else if ( strcmp( argv[i], "-largepages" ) == 0 )
+			desc.dwFlags |= IPC_STREAM_LARGE_PAGES;
+		else if ( strcmp( argv[i], "-prefault" ) == 0 )
+			desc.dwFlags |= IPC_STREAM_PREFAULT;
+		else if ( strcmp( argv[i], "-numa" ) == 0 )
+			desc.NumaPolicy = IPC_NUMA_BIND;
+		else if ( strcmp( argv[i], "-interleave" ) == 0 )
+			desc.NumaPolicy = IPC_NUMA_INTERLEAVE;
+		else if ( strcmp( argv[i], "-overwrite" ) == 0 )
+		{
+			// Only whole messages can be resynced to, and each has to fit
+			desc.dwFlags |= IPC_STREAM_OVERWRITE | IPC_STREAM_MESSAGES;
+			desc.RingBufferSize = MIRRORED_RINGBUFFER_SIZE;
+			g_bMessages = TRUE;
+			g_bOverwrite = TRUE;
+		}
+		else if ( strcmp( argv[i], "-sharded" ) == 0 )
+		{
+			desc.dwFlags |= IPC_STREAM_SHARDED | IPC_STREAM_MESSAGES;
+			desc.MaxWriters = NUM_PRODUCERS;
+			g_bMessages = TRUE;
+		}
+		else if ( strcmp( argv[i], "-priority" ) == 0 )
+		{
+			desc.dwFlags |= IPC_STREAM_PRIORITY | IPC_STREAM_MESSAGES;
+			desc.Lanes = PRIORITY_LANES;
+			g_bMessages = TRUE;
+			g_bPriority = TRUE;
+		}
+		else if ( strcmp( argv[i], "-channel" ) == 0 )
+			g_bChannel = TRUE;
+		else if ( strcmp( argv[i], "-select" ) == 0 )
+			g_bSelect = TRUE;
+		else if ( strcmp( argv[i], "-registry" ) == 0 )
+			g_bRegistry = TRUE;
+		else if ( strcmp( argv[i], "-crash" ) == 0 )
+			g_bCrash = TRUE;
+		else if ( strcmp( argv[i], "-arena" ) == 0 )
+		{
+			// Few enough blocks that the producers wait for the consumers
+			desc.dwFlags |= IPC_STREAM_ARENA;
+			desc.ArenaBlockSize = ARENA_BLOCK_SIZE;
+			desc.ArenaBlocks = ARENA_BLOCKS;
+			g_bArena = TRUE;
+		}
+		else if ( strcmp( argv[i], "-grow" ) == 0 )
+		{
+			desc.dwFlags |= IPC_STREAM_GROWABLE;
+			desc.GrowMicroseconds = 1000;
+		}
+		else if ( strcmp( argv[i], "-streaming" ) == 0 )
+			desc.NonTemporalThreshold = 1; // Bypass the cache for every copy
+		else if ( strcmp( argv[i], "-sse2" ) == 0 )
+			desc.CopyKernel = IPC_COPY_SSE2;
+		else if ( strcmp( argv[i], "-avx2" ) == 0 )
+			desc.CopyKernel = IPC_COPY_AVX2;
+		else if ( strcmp( argv[i], "-journal" ) == 0 )
+		{
+			desc.dwFlags |= IPC_STREAM_JOURNAL;
+			desc.RingBufferSize = JOURNAL_SEGMENT_SIZE;
+			desc.JournalDirectory = TEST_JOURNAL_DIRECTORY;
+			g_bJournal = TRUE;
+		}
+		else if ( strcmp( argv[i], "-messages" ) == 0 )
+		{
+			desc.dwFlags |= IPC_STREAM_MESSAGES;
+			g_bMessages = TRUE;
+		}
+		else if ( strcmp( argv[i], "-mirror" ) == 0 )
+		{
+			// Whole packets have to fit in the ring to be written in place
+			desc.dwFlags |= IPC_STREAM_MIRRORED;
+			desc.RingBufferSize = MIRRORED_RINGBUFFER_SIZE;
+			g_bZeroCopy = TRUE;
+		}
+		else
+			g_dwNumTests = (DWORD) atoi( argv[i] );
+	}
+
+	// Let the writers double the ring a few times over
+	if ( desc.dwFlags & IPC_STREAM_GROWABLE )
+		desc.MaxRingBufferSize = desc.RingBufferSize * 16;
+
+#ifndef _WIN32
+	// Before anything maps the shared registry, which this process then keeps
+	if ( g_bCrash )
+		setenv( TEST_REGISTRY_VARIABLE, g_szCrashRegistry, 1 );
+#endif
+
+	assert( !QueryInterprocessStreamIsOpen( g_szAppName, IPCLIB_VERSION ) );
 
-	assert( !QueryInterprocessStreamIsOpen( TEST_APP_NAME, IPCLIB_VERSION ) );
+	if ( g_bChannel )
+	{
+		RunChannelTest( &desc );
+		return 0;
+	}
+
+	if ( g_bSelect )
+	{
+		RunSelectorTest( &desc );
+		return 0;
+	}
+
+	if ( g_bRegistry )
+	{
+		RunRegistryTest( &desc );
+		return 0;
+	}
+
+	if ( g_bCrash )
+	{
+		RunCrashTest( &desc );
+		return 0;
+	}
+
+	// Start from an empty journal, whatever an earlier run left behind
+	if ( g_bJournal )
+		DeleteInterprocessJournal( TEST_JOURNAL_DIRECTORY, g_szAppName );
+
+    CreateInterprocessStreamEx( g_szAppName, IPCLIB_VERSION, &desc, &pIPC );
+
+	assert( QueryInterprocessStreamIsOpen( g_szAppName, IPCLIB_VERSION ) );
+
+	// Large pages and NUMA placement are best-effort, but must be reported
+	{
+		IPC_STREAM_INFO info;
+		QueryInterprocessStreamInfo( pIPC, &info );
+		assert( info.RingBufferSize >= desc.RingBufferSize );
+		assert( info.PageSize != 0 );
+		assert( info.NumaPolicy == desc.NumaPolicy || info.NumaPolicy == IPC_NUMA_DEFAULT );
+		assert( info.CopyKernel != IPC_COPY_AUTO );
+		assert( desc.CopyKernel == IPC_COPY_AUTO || info.CopyKernel <= desc.CopyKernel );
+	}
+
+	// The creator of a sharded or priority stream only reads
+	if ( desc.dwFlags & ( IPC_STREAM_SHARDED | IPC_STREAM_PRIORITY ) )
+	{
+		DWORD dwData = 0;
+		assert( WriteInterprocessMessage( pIPC, &dwData, sizeof(dwData) ) == HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED ) );
+	}
+
+	// Whatever is waiting on a higher lane is read first, and the rest in the
+	// order it was written
+	if ( g_bPriority )
+	{
+		IPC_STREAM* pWriter = NULL;
+		IPC_STREAM_INFO info;
+		IPC_BUFFER buffer;
+		DWORD dwData;
+		UINT messageSize, lane;
+
+		QueryInterprocessStreamInfo( pIPC, &info );
+		assert( info.Lanes == PRIORITY_LANES );
+		assert( OpenInterprocessStreamEx( g_szAppName, IPCLIB_VERSION, IPC_ACCESS_WRITE, &pWriter ) == S_OK );
+		buffer.pData = &dwData;
+		buffer.dataSize = sizeof(dwData);
+		assert( WriteInterprocessMessageEx( pWriter, PRIORITY_LANES, &buffer, 1 ) == E_INVALIDARG );
+
+		for ( lane = 0; lane < PRIORITY_LANES; ++lane )
+		{
+			dwData = lane;
+			assert( WriteInterprocessMessageEx( pWriter, lane, &buffer, 1 ) == S_OK );
+		}
+		dwData = PRIORITY_LANES;
+		assert( WriteInterprocessMessage( pWriter, &dwData, sizeof(dwData) ) == S_OK );
+
+		for ( lane = PRIORITY_LANES; lane-- > 0; )
+		{
+			assert( ReadInterprocessMessage( pIPC, &dwData, sizeof(dwData), &messageSize ) == S_OK );
+			assert( dwData == lane );
+		}
+		assert( ReadInterprocessMessage( pIPC, &dwData, sizeof(dwData), &messageSize ) == S_OK );
+		assert( dwData == PRIORITY_LANES );
+		CloseInterprocessStream( pWriter );
+	}
+
+	// Blocks are handed out whole and taken back once, and a reference comes
+	// out of the stream pointing at the same bytes that went in
+	if ( g_bArena )
+	{
+		IPC_STREAM* pWriter = NULL;
+		IPC_STREAM_INFO info;
+		LPVOID pBlock, pFirst;
+		LPCVOID pReceived;
+		UINT dataSize;
+
+		QueryInterprocessStreamInfo( pIPC, &info );
+		assert( info.ArenaBlockSize == ARENA_BLOCK_SIZE );
+		assert( info.ArenaBlocks == ARENA_BLOCKS );
+		assert( OpenInterprocessStreamEx( g_szAppName, IPCLIB_VERSION, IPC_ACCESS_WRITE, &pWriter ) == S_OK );
+		assert( AllocateInterprocessBlock( pWriter, ARENA_BLOCK_SIZE + 1, &pBlock ) == E_INVALIDARG );
+		assert( AllocateInterprocessBlock( pWriter, ARENA_BLOCK_SIZE, &pFirst ) == S_OK );
+		assert( ReleaseInterprocessBlock( pWriter, (BYTE*) pFirst + 1 ) == E_INVALIDARG );
+		assert( ReleaseInterprocessBlock( pWriter, pFirst ) == S_OK );
+		assert( ReleaseInterprocessBlock( pWriter, pFirst ) == E_UNEXPECTED );
+
+		// The pool hands back whatever it was given last
+		assert( AllocateInterprocessBlock( pWriter, sizeof(DWORD), &pBlock ) == S_OK );
+		assert( pBlock == pFirst );
+		*(DWORD*) pBlock = 0xA5A5A5A5;
+		assert( SendInterprocessBlock( pWriter, pBlock, sizeof(DWORD) ) == S_OK );
+		if ( !( desc.dwFlags & IPC_STREAM_BROADCAST ) )
+		{
+			assert( ReceiveInterprocessBlock( pIPC, &pReceived, &dataSize ) == S_OK );
+			assert( dataSize == sizeof(DWORD) && *(const DWORD*) pReceived == 0xA5A5A5A5 );
+			assert( ReleaseInterprocessBlock( pIPC, pReceived ) == S_OK );
+		}
+		CloseInterprocessStream( pWriter );
+	}
+	else
+	{
+		LPVOID pBlock;
+		assert( AllocateInterprocessBlock( pIPC, 0, &pBlock ) == HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION ) );
+	}
+
+	// The creator of a growable stream only writes, and can grow it by hand
+	// before its writers do
+	if ( desc.dwFlags & IPC_STREAM_GROWABLE )
+	{
+		IPC_STREAM* pExtra = NULL;
+		IPC_STREAM_INFO first;
+		IPC_STREAM_INFO info;
+
+		assert( OpenInterprocessStreamEx( g_szAppName, IPCLIB_VERSION, IPC_ACCESS_READ | IPC_ACCESS_WRITE, &pExtra ) == E_INVALIDARG );
+		QueryInterprocessStreamInfo( pIPC, &first );
+		assert( GrowInterprocessStream( pIPC, desc.RingBufferSize ) == S_FALSE );
+		assert( GrowInterprocessStream( pIPC, desc.RingBufferSize * 2 ) == S_OK );
+		QueryInterprocessStreamInfo( pIPC, &info );
+		assert( info.Generation == 1 );
+		assert( info.RingBufferSize >= desc.RingBufferSize * 2 );
+
+		// The new ring copies the way the first one did
+		assert( info.CopyKernel == first.CopyKernel );
+		assert( info.NonTemporalThreshold == first.NonTemporalThreshold );
+	}
 
-    CreateInterprocessStream( TEST_APP_NAME, IPCLIB_VERSION, RINGBUFFER_SIZE, &pIPC );
+	if ( desc.dwFlags & IPC_STREAM_BROADCAST )
+	{
+		IPC_STREAM* pExtra = NULL;
+		DWORD dwData;
+		UINT messageSize;
+		HRESULT hr;
 
-	assert( QueryInterprocessStreamIsOpen( TEST_APP_NAME, IPCLIB_VERSION ) );
+		// The creator only writes, and every reader slot gets taken
+		if ( g_bMessages )
+			hr = ReadInterprocessMessage( pIPC, &dwData, sizeof(dwData), &messageSize );
+		else
+			hr = ReadInterprocessStream( pIPC, &dwData, sizeof(dwData) );
+		assert( hr == HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED ) );
+		for ( i = 0; i < NUM_BROADCAST_CONSUMERS; ++i )
+			OpenInterprocessStreamEx( g_szAppName, IPCLIB_VERSION, IPC_ACCESS_READ, &g_pReaders[i] );
+		assert( OpenInterprocessStreamEx( g_szAppName, IPCLIB_VERSION, IPC_ACCESS_READ, &pExtra ) ==
+				HRESULT_FROM_WIN32( ERROR_TOO_MANY_OPEN_FILES ) );
+	}
 
 	{
-		HANDLE hThreads[] = { 
-			StartProducerThread( 0 ),
-			StartProducerThread( 1 ),
-			StartProducerThread( 2 ),
-			StartProducerThread( 3 ),
+		HANDLE hThreads[NUM_PRODUCERS + NUM_BROADCAST_CONSUMERS];
+		int numThreads = 0;
 
-			StartConsumerThread( 4 )
-		};
+		for ( i = 0; i < NUM_PRODUCERS; ++i )
+			hThreads[numThreads++] = StartProducerThread( i );
+		hThreads[numThreads++] = StartConsumerThread( NUM_PRODUCERS );
+		for ( i = 1; i < NUM_BROADCAST_CONSUMERS && g_pReaders[i] != NULL; ++i )
+			hThreads[numThreads++] = StartConsumerThread( NUM_PRODUCERS + i );
 
-		WaitForMultipleObjects( _countof(hThreads), hThreads, TRUE, INFINITE );
+		WaitForMultipleObjects( numThreads, hThreads, TRUE, INFINITE );
+	}
+
+	// Every byte written was counted, and read by every reader unless it was
+	// overwritten first. An onlooker can see all of it without taking part.
+	{
+		IPC_STREAM* pInspector = NULL;
+		IPC_STREAM_STATS stats;
+		UINT64 readers = ( desc.dwFlags & IPC_STREAM_BROADCAST ) ? NUM_BROADCAST_CONSUMERS : 1;
+		DWORD dwData = 0;
+
+		assert( SUCCEEDED( OpenInterprocessStreamEx( g_szAppName, IPCLIB_VERSION, IPC_ACCESS_NONE, &pInspector ) ) );
+		assert( WriteInterprocessStream( pInspector, &dwData, sizeof(dwData) ) != S_OK );
+		assert( SUCCEEDED( QueryInterprocessStreamStats( pInspector, &stats ) ) );
+		assert( stats.BytesWritten > 0 );
+		assert( stats.HighWater <= stats.RingBufferSize );
+		if ( g_bOverwrite )
+		{
+			assert( stats.BytesRead <= stats.BytesWritten * readers );
+		}
+		else
+		{
+			assert( stats.BytesRead == stats.BytesWritten * readers );
+			assert( stats.MessagesRead == stats.MessagesWritten * readers );
+			assert( stats.Fill == 0 );
+		}
+		assert( g_bMessages == ( stats.MessagesWritten != 0 ) );
+		if ( desc.dwFlags & IPC_STREAM_GROWABLE )
+			assert( stats.RingBufferSize >= desc.RingBufferSize * 2 );
+		if ( g_bJournal )
+		{
+			UINT64 position;
+			assert( QueryInterprocessStreamPosition( pInspector, &position ) == S_OK );
+			assert( position == stats.BytesWritten );
+		}
+		CloseInterprocessStream( pInspector );
+	}
+
+	// Every block came back to the pool, including those sent to a reader that
+	// closed without receiving them
+	if ( g_bArena )
+	{
+		IPC_STREAM* pWriter = NULL;
+		IPC_STREAM* pReader = NULL;
+		LPVOID pBlocks[ARENA_BLOCKS];
+
+		assert( OpenInterprocessStreamEx( g_szAppName, IPCLIB_VERSION, IPC_ACCESS_WRITE, &pWriter ) == S_OK );
+		if ( desc.dwFlags & IPC_STREAM_BROADCAST )
+		{
+			assert( OpenInterprocessStreamEx( g_szAppName, IPCLIB_VERSION, IPC_ACCESS_READ, &pReader ) == S_OK );
+			for ( i = 0; i < ARENA_BLOCKS / 2; ++i )
+			{
+				assert( AllocateInterprocessBlock( pWriter, 0, &pBlocks[i] ) == S_OK );
+				assert( SendInterprocessBlock( pWriter, pBlocks[i], 0 ) == S_OK );
+			}
+			CloseInterprocessStream( pReader );
+		}
+
+		for ( i = 0; i < ARENA_BLOCKS; ++i )
+			assert( AllocateInterprocessBlock( pWriter, 0, &pBlocks[i] ) == S_OK );
+		for ( i = 0; i < ARENA_BLOCKS; ++i )
+			assert( ReleaseInterprocessBlock( pWriter, pBlocks[i] ) == S_OK );
+		CloseInterprocessStream( pWriter );
 	}
 
     CloseInterprocessStream(pIPC);
+
+	// The journal outlives the stream. Created again, it carries on from where
+	// it ended, less the segments it no longer retains.
+	if ( g_bJournal )
+	{
+		IPC_STREAM* pReader = NULL;
+		IPC_STREAM* pInspector = NULL;
+		UINT64 end, position;
+
+		desc.JournalSegments = JOURNAL_RETAINED_SEGMENTS;
+		assert( CreateInterprocessStreamEx( g_szAppName, IPCLIB_VERSION, &desc, &pIPC ) == S_OK );
+		assert( QueryInterprocessStreamPosition( pIPC, &end ) == S_OK );
+		assert( end > JOURNAL_SEGMENT_SIZE * JOURNAL_RETAINED_SEGMENTS );
+
+		assert( OpenInterprocessStreamEx( g_szAppName, IPCLIB_VERSION, IPC_ACCESS_NONE, &pInspector ) == S_OK );
+		assert( QueryInterprocessStreamPosition( pInspector, &position ) == S_OK );
+		assert( position == end );
+		assert( SeekInterprocessStream( pInspector, 0 ) == HRESULT_FROM_WIN32( ERROR_ACCESS_DENIED ) );
+
+		assert( OpenInterprocessStreamEx( g_szAppName, IPCLIB_VERSION, IPC_ACCESS_READ, &pReader ) == S_OK );
+		assert( QueryInterprocessStreamPosition( pReader, &position ) == S_OK );
+		assert( position == end );
+		assert( SeekInterprocessStream( pReader, 0 ) == S_OK );
+		assert( QueryInterprocessStreamPosition( pReader, &position ) == S_OK );
+		assert( position > 0 && position < end );
+
+		CloseInterprocessStream( pReader );
+		CloseInterprocessStream( pInspector );
+		CloseInterprocessStream( pIPC );
+		assert( DeleteInterprocessJournal( TEST_JOURNAL_DIRECTORY, g_szAppName ) == S_OK );
+	}
 	
 	return 0;
 }
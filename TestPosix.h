@@ -0,0 +1,176 @@
+/*
+	Copyright (C) 2015 Peter J. B. Lewis
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+    and associated documentation files (the "Software"), to deal in the Software without restriction,
+    including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+    sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies or 
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+    BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Just enough of the Win32 threading, timing and debugging surface for Test.c,
+// Benchmark.c and Inspect.c to run against the POSIX backend.
+
+#ifndef __TESTPOSIX_H__
+#define __TESTPOSIX_H__
+
+#ifndef _GNU_SOURCE
+#	define _GNU_SOURCE
+#endif
+
+#include <ctype.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "IPCLibPosix.h"
+
+typedef void* HANDLE;
+typedef DWORD (*LPTHREAD_START_ROUTINE)( LPVOID );
+
+#define INFINITE			0xFFFFFFFF
+#define _countof( a )		( sizeof(a) / sizeof((a)[0]) )
+#define swprintf_s			swprintf
+#define ZeroMemory( p, n )	memset( (p), 0, (n) )
+#define DebugBreak()		raise( SIGTRAP )
+#define OutputDebugStringW( s )
+
+#ifndef min
+#	define min( a, b )		( ( (a) < (b) ) ? (a) : (b) )
+#endif
+#ifndef max
+#	define max( a, b )		( ( (a) > (b) ) ? (a) : (b) )
+#endif
+
+typedef struct _POSIX_THREAD
+{
+	pthread_t				hThread;
+	LPTHREAD_START_ROUTINE	pfnStart;
+	LPVOID					pParam;
+} POSIX_THREAD;
+
+static __inline void* PosixThreadEntry( void* pArg )
+{
+	POSIX_THREAD* pThread = (POSIX_THREAD*) pArg;
+	pThread->pfnStart( pThread->pParam );
+	return NULL;
+}
+
+static __inline HANDLE CreateThread(
+	void* pSecurity,
+	SIZE_T stackSize,
+	LPTHREAD_START_ROUTINE pfnStart,
+	LPVOID pParam,
+	DWORD dwFlags,
+	DWORD* pThreadId )
+{
+	POSIX_THREAD* pThread = (POSIX_THREAD*) malloc( sizeof(POSIX_THREAD) );
+
+	(void) pSecurity; (void) stackSize; (void) dwFlags; (void) pThreadId;
+
+	if ( pThread == NULL )
+		return NULL;
+
+	pThread->pfnStart = pfnStart;
+	pThread->pParam = pParam;
+	if ( pthread_create( &pThread->hThread, NULL, PosixThreadEntry, pThread ) != 0 )
+	{
+		free( pThread );
+		return NULL;
+	}
+
+	return pThread;
+}
+
+// Only the wait-all, wait-forever form is supported
+static __inline DWORD WaitForMultipleObjects(
+	DWORD nCount,
+	const HANDLE* pHandles,
+	BOOL bWaitAll,
+	DWORD dwMilliseconds )
+{
+	DWORD i;
+
+	(void) bWaitAll; (void) dwMilliseconds;
+
+	for ( i = 0; i < nCount; ++i )
+	{
+		POSIX_THREAD* pThread = (POSIX_THREAD*) pHandles[i];
+		if ( pThread == NULL )
+			continue;
+
+		pthread_join( pThread->hThread, NULL );
+		free( pThread );
+	}
+
+	return 0;
+}
+
+typedef union _LARGE_INTEGER
+{
+	LONG64 QuadPart;
+} LARGE_INTEGER;
+
+// The performance counter ticks in nanoseconds
+static __inline BOOL QueryPerformanceFrequency( LARGE_INTEGER* pFrequency )
+{
+	pFrequency->QuadPart = 1000000000;
+	return TRUE;
+}
+
+static __inline BOOL QueryPerformanceCounter( LARGE_INTEGER* pCount )
+{
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	pCount->QuadPart = (LONG64) now.tv_sec * 1000000000 + now.tv_nsec;
+	return TRUE;
+}
+
+static __inline void Sleep( DWORD dwMilliseconds )
+{
+	struct timespec delay;
+
+	delay.tv_sec = dwMilliseconds / 1000;
+	delay.tv_nsec = ( dwMilliseconds % 1000 ) * 1000000L;
+	nanosleep( &delay, NULL );
+}
+
+#define GetCurrentThread()	pthread_self()
+#define GetCurrentProcessId()	( (DWORD) getpid() )
+
+static __inline DWORD_PTR SetThreadAffinityMask(
+	pthread_t hThread,
+	DWORD_PTR mask )
+{
+	cpu_set_t cpus;
+	int i;
+
+	CPU_ZERO( &cpus );
+	for ( i = 0; i < (int) ( sizeof(mask) * 8 ); ++i )
+	{
+		if ( mask & ( (DWORD_PTR) 1 << i ) )
+			CPU_SET( i, &cpus );
+	}
+
+	// Like the Win32 call, asking for a CPU that isn't there just fails
+	return pthread_setaffinity_np( hThread, sizeof(cpus), &cpus ) == 0 ? mask : 0;
+}
+
+#endif
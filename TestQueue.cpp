@@ -0,0 +1,155 @@
+/*
+	Copyright (C) 2015 Peter J. B. Lewis
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+    and associated documentation files (the "Software"), to deal in the Software without restriction,
+    including without limitation the rights to use, copy, modify, merge, publish, distribute,
+    sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+    BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Runs the typed queues in IPCLib.hpp: one producer sending batches of values
+// whose size is a power of two, then several sending values that aren't.
+
+// The standard headers go first, before the min and max macros
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#	include <Windows.h>
+#else
+#	include "TestPosix.h"
+#endif
+#include <stdlib.h>
+
+#ifdef _DEBUG
+#	include <assert.h>
+#endif
+
+#include "IPCLib.hpp"
+
+#define NUM_TESTS 1048576
+#define NUM_PRODUCERS 4
+#define MAX_BATCH 7
+
+#define TEST_QUEUE_NAME L"TESTIPC_QUEUE"
+
+#ifndef assert
+#	define assert(x) { if (!(x)) DebugBreak(); }
+#endif
+
+// Twelve bytes, so its ring is indexed by division
+struct SAMPLE
+{
+	DWORD dwProducer;
+	DWORD dwSequence;
+	DWORD dwCheckSum;
+};
+
+typedef ipc::queue<UINT64, 64> VALUE_QUEUE;
+typedef ipc::queue<SAMPLE, 256, NUM_PRODUCERS> SAMPLE_QUEUE;
+
+static DWORD g_dwNumTests = NUM_TESTS;
+
+static void ValueProducer()
+{
+	VALUE_QUEUE queue;
+	UINT64 values[MAX_BATCH];
+	UINT64 next = 0;
+	UINT count, i;
+
+	assert( queue.open( TEST_QUEUE_NAME, IPC_ACCESS_WRITE ) == S_OK );
+	while ( next < g_dwNumTests )
+	{
+		count = (UINT) min( (UINT64) ( rand() % MAX_BATCH + 1 ), g_dwNumTests - next );
+		for ( i = 0; i < count; ++i )
+			values[i] = next++;
+		assert( queue.push( values, count ) == S_OK );
+	}
+}
+
+static void SampleProducer( DWORD dwProducer )
+{
+	SAMPLE_QUEUE queue;
+	SAMPLE sample;
+	DWORD i;
+
+	assert( queue.open( TEST_QUEUE_NAME, IPC_ACCESS_WRITE ) == S_OK );
+	for ( i = 0; i < g_dwNumTests; ++i )
+	{
+		sample.dwProducer = dwProducer;
+		sample.dwSequence = i;
+		sample.dwCheckSum = ~( dwProducer ^ i );
+		assert( queue.push( sample ) == S_OK );
+	}
+}
+
+int main(int argc, char** argv)
+{
+	// Usage: TestQueue [iterations]
+	if ( argc > 1 )
+		g_dwNumTests = (DWORD) atoi( argv[1] );
+
+	// Values come out one at a time in the order they went in, however they
+	// were batched
+	{
+		VALUE_QUEUE queue;
+		ipc::queue<UINT64, 128> wrongCapacity;
+		ipc::queue<UINT64, 64, 2> wrongProducers;
+		UINT64 value, expected;
+
+		assert( queue.create( TEST_QUEUE_NAME ) == S_OK );
+		assert( wrongCapacity.open( TEST_QUEUE_NAME ) == E_INVALIDARG );
+		assert( wrongProducers.open( TEST_QUEUE_NAME ) == E_INVALIDARG );
+		assert( !wrongCapacity.is_open() );
+
+		std::thread producer( ValueProducer );
+		for ( expected = 0; expected < g_dwNumTests; ++expected )
+		{
+			assert( queue.pop( value ) == S_OK );
+			assert( value == expected );
+		}
+		producer.join();
+	}
+
+	// Each producer's samples arrive in order, among everyone else's
+	{
+		SAMPLE_QUEUE queue;
+		std::vector<std::thread> producers;
+		DWORD next[NUM_PRODUCERS] = {};
+		SAMPLE samples[MAX_BATCH];
+		UINT64 remaining = (UINT64) g_dwNumTests * NUM_PRODUCERS;
+		UINT count, i;
+
+		assert( queue.create( TEST_QUEUE_NAME ) == S_OK );
+		for ( i = 0; i < NUM_PRODUCERS; ++i )
+			producers.push_back( std::thread( SampleProducer, (DWORD) i ) );
+
+		while ( remaining > 0 )
+		{
+			count = (UINT) min( (UINT64) ( rand() % MAX_BATCH + 1 ), remaining );
+			assert( queue.pop( samples, count ) == S_OK );
+			for ( i = 0; i < count; ++i )
+			{
+				assert( samples[i].dwProducer < NUM_PRODUCERS );
+				assert( samples[i].dwSequence == next[samples[i].dwProducer]++ );
+				assert( samples[i].dwCheckSum == ~( samples[i].dwProducer ^ samples[i].dwSequence ) );
+			}
+			remaining -= count;
+		}
+
+		for ( i = 0; i < NUM_PRODUCERS; ++i )
+			producers[i].join();
+	}
+
+	return 0;
+}
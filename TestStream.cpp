@@ -0,0 +1,183 @@
+/*
+	Copyright (C) 2015 Peter J. B. Lewis
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+    and associated documentation files (the "Software"), to deal in the Software without restriction,
+    including without limitation the rights to use, copy, modify, merge, publish, distribute,
+    sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies or
+    substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+    BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Runs many coroutine streams on one thread: every stream has a coroutine
+// writing packets into it and another reading them back, and a single reactor
+// resumes whichever of them can go next.
+
+// The standard headers go first, before the min and max macros
+#include <vector>
+
+#include "IPCLib.hpp"
+
+#ifdef _WIN32
+#	include <Windows.h>
+#else
+#	include "TestPosix.h"
+#endif
+#include <stdlib.h>
+
+#ifdef _DEBUG
+#	include <assert.h>
+#endif
+
+#define NUM_TESTS 4096
+#define NUM_STREAMS 64
+#define RINGBUFFER_SIZE 4096
+#define MAX_PACKET 1500
+#define LARGE_TRANSFER ( RINGBUFFER_SIZE * 3 + 100 )
+
+#define TEST_STREAM_NAME L"TESTIPC_STREAM_%d"
+
+#ifndef assert
+#	define assert(x) { if (!(x)) DebugBreak(); }
+#endif
+
+static DWORD g_dwNumTests = NUM_TESTS;
+static DWORD g_dwFinished = 0;
+
+static BYTE PacketByte(
+	UINT packet,
+	UINT offset )
+{
+	return (BYTE) ( packet * 31 + offset );
+}
+
+// Each packet is its length followed by that many bytes of a known pattern
+static ipc::task Producer( ipc::stream& stream )
+{
+	BYTE packet[MAX_PACKET];
+	UINT i, j, len;
+
+	for ( i = 0; i < g_dwNumTests; ++i )
+	{
+		len = rand() % MAX_PACKET;
+		for ( j = 0; j < len; ++j )
+			packet[j] = PacketByte( i, j );
+
+		assert( co_await stream.write( std::as_bytes( std::span<UINT>( &len, 1 ) ) ) == S_OK );
+		assert( co_await stream.write( std::as_bytes( std::span<BYTE>( packet, len ) ) ) == S_OK );
+	}
+}
+
+static ipc::task Consumer( ipc::stream& stream )
+{
+	BYTE packet[MAX_PACKET];
+	UINT i, j, len;
+
+	for ( i = 0; i < g_dwNumTests; ++i )
+	{
+		assert( co_await stream.read( std::as_writable_bytes( std::span<UINT>( &len, 1 ) ) ) == S_OK );
+		assert( len < MAX_PACKET );
+		assert( co_await stream.read( std::as_writable_bytes( std::span<BYTE>( packet, len ) ) ) == S_OK );
+		for ( j = 0; j < len; ++j )
+			assert( packet[j] == PacketByte( i, j ) );
+	}
+
+	++g_dwFinished;
+}
+
+// A transfer larger than the ring, whose other end the same reactor runs
+static ipc::task LargeProducer( ipc::stream& stream )
+{
+	static BYTE data[LARGE_TRANSFER];
+	UINT j;
+
+	for ( j = 0; j < LARGE_TRANSFER; ++j )
+		data[j] = PacketByte( LARGE_TRANSFER, j );
+
+	assert( co_await stream.write( std::as_bytes( std::span<BYTE>( data, LARGE_TRANSFER ) ) ) == S_OK );
+	++g_dwFinished;
+}
+
+static ipc::task LargeConsumer( ipc::stream& stream )
+{
+	static BYTE data[LARGE_TRANSFER];
+	UINT j;
+
+	assert( co_await stream.read( std::as_writable_bytes( std::span<BYTE>( data, LARGE_TRANSFER ) ) ) == S_OK );
+	for ( j = 0; j < LARGE_TRANSFER; ++j )
+		assert( data[j] == PacketByte( LARGE_TRANSFER, j ) );
+	++g_dwFinished;
+}
+
+int main(int argc, char** argv)
+{
+	ipc::reactor reactor;
+	std::vector<ipc::stream> readers( NUM_STREAMS ), writers( NUM_STREAMS );
+	IPC_STREAM_DESC desc;
+	WCHAR szName[64];
+	int i;
+
+	// Usage: TestStream [iterations]
+	if ( argc > 1 )
+		g_dwNumTests = (DWORD) atoi( argv[1] );
+
+	ZeroMemory( &desc, sizeof(desc) );
+	desc.RingBufferSize = RINGBUFFER_SIZE;
+
+	for ( i = 0; i < NUM_STREAMS; ++i )
+	{
+		swprintf_s( szName, _countof(szName), TEST_STREAM_NAME, i );
+		assert( readers[i].create( reactor, szName, desc ) == S_OK );
+		assert( writers[i].open( reactor, szName, IPC_ACCESS_WRITE ) == S_OK );
+	}
+
+	// Handles move without closing anything
+	{
+		ipc::stream moved( std::move( writers[0] ) );
+		assert( !writers[0].is_open() );
+		writers[0] = std::move( moved );
+		assert( writers[0].is_open() && !moved.is_open() );
+	}
+
+	for ( i = 0; i < NUM_STREAMS; ++i )
+	{
+		Consumer( readers[i] );
+		Producer( writers[i] );
+	}
+
+	reactor.run();
+	assert( g_dwFinished == NUM_STREAMS );
+
+	// Each end moves what it can and waits for the rest, so neither blocks
+	// the thread the other needs
+	LargeConsumer( readers[0] );
+	LargeProducer( writers[0] );
+	reactor.run();
+	assert( g_dwFinished == NUM_STREAMS + 2 );
+
+	// A message stream can't be awaited, and says so rather than blocking
+	{
+		ipc::stream messages;
+		DWORD dwData = 0;
+
+		desc.dwFlags = IPC_STREAM_MESSAGES;
+		assert( messages.create( reactor, L"TESTIPC_STREAM_MESSAGES", desc ) == S_OK );
+		[]( ipc::stream& stream, DWORD& dwData ) -> ipc::task
+		{
+			assert( co_await stream.read( std::as_writable_bytes( std::span<DWORD>( &dwData, 1 ) ) ) ==
+					HRESULT_FROM_WIN32( ERROR_INVALID_FUNCTION ) );
+			++g_dwFinished;
+		}( messages, dwData );
+		assert( g_dwFinished == NUM_STREAMS + 3 );
+	}
+
+	return 0;
+}